@@ -0,0 +1,257 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "MathHelpers.h"
+#include "SystemCommonTypes.h"
+
+//Bounding sphere hierarchy over world space node bounds for frustum culling
+//Built once per item count and refit bottom up when transforms change
+
+//Leaves are as wide as the widest sphere kernel the compiler allows
+#if defined(__AVX__)
+#include <immintrin.h>
+#define CULL_LANES 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CULL_LANES 4
+#define CULL_SSE
+#else
+#define CULL_LANES 4
+#endif
+
+//Sphere around a local bounding sphere after a world transform, never smaller than the unscaled radius sphereInFrustum tests
+static std::pair<float_3, float> worldSphere(std::pair<float_3, float> localSphere, mat44<float> toWorld) {
+	float maxScale = 1;
+	for (int col = 0; col < 3; col++) {
+		float_3 axis = float_3(toWorld.data[col][0], toWorld.data[col][1], toWorld.data[col][2]);
+		maxScale = std::max(maxScale, axis.norm());
+	}
+	return std::make_pair(float_3(toWorld * localSphere.first), localSphere.second * maxScale);
+}
+
+//Smallest sphere holding both spheres
+static std::pair<float_3, float> mergeSpheres(std::pair<float_3, float> a, std::pair<float_3, float> b) {
+	float_3 offset = b.first - a.first;
+	float dist = offset.norm();
+	if (dist + b.second <= a.second) return a;
+	if (dist + a.second <= b.second) return b;
+	float radius = (dist + a.second + b.second) * 0.5f;
+	return std::make_pair(a.first + offset * ((radius - a.second) / dist), radius);
+}
+
+enum CullResult { CULL_OUTSIDE, CULL_INTERSECT, CULL_INSIDE };
+
+//Six inward facing world space planes of the frustum sphereInFrustum reprojects onto
+struct CullPlanes {
+	float normalX[6];
+	float normalY[6];
+	float normalZ[6];
+	float offsets[6];
+	bool valid = true;
+	CullPlanes(frustumInfo info, mat44<float> toCameraSpace) {
+		//Camera space planes, with z flipped the same way sphereInFrustum flips points
+		float_3 normals[6] = {
+			float_3(0, 0, 1), float_3(0, 0, -1),
+			float_3(-info.farZ, 0, info.farRight).normalize(), float_3(info.farZ, 0, -info.farLeft).normalize(),
+			float_3(0, -info.farZ, info.farTop).normalize(), float_3(0, info.farZ, -info.farBottom).normalize() };
+		float cameraOffsets[6] = { -info.nearZ, info.farZ, 0, 0, 0, 0 };
+		//Pull each plane back through the rigid camera transform
+		for (int plane = 0; plane < 6; plane++) {
+			float_3 flipped = float_3(normals[plane].x, normals[plane].y, -normals[plane].z);
+			float_3 world;
+			world.x = toCameraSpace.data[0][0] * flipped.x + toCameraSpace.data[0][1] * flipped.y + toCameraSpace.data[0][2] * flipped.z;
+			world.y = toCameraSpace.data[1][0] * flipped.x + toCameraSpace.data[1][1] * flipped.y + toCameraSpace.data[1][2] * flipped.z;
+			world.z = toCameraSpace.data[2][0] * flipped.x + toCameraSpace.data[2][1] * flipped.y + toCameraSpace.data[2][2] * flipped.z;
+			float offset = cameraOffsets[plane] + flipped.x * toCameraSpace.data[3][0] +
+				flipped.y * toCameraSpace.data[3][1] + flipped.z * toCameraSpace.data[3][2];
+			float length = world.norm();
+			//Nan check (case when camera is unintialized)
+			if (!(length > 0) || offset != offset) valid = false;
+			normalX[plane] = world.x / length;
+			normalY[plane] = world.y / length;
+			normalZ[plane] = world.z / length;
+			offsets[plane] = offset / length;
+		}
+	}
+	CullResult classify(float_3 center, float radius) {
+		if (!valid) return CULL_OUTSIDE;
+		CullResult result = CULL_INSIDE;
+		for (int plane = 0; plane < 6; plane++) {
+			float dist = normalX[plane] * center.x + normalY[plane] * center.y + normalZ[plane] * center.z + offsets[plane];
+			if (dist < -radius) return CULL_OUTSIDE;
+			if (dist < radius) result = CULL_INTERSECT;
+		}
+		return result;
+	}
+	//Classifies CULL_LANES spheres stored as SoA, setting bit i of the masks for lane i
+	void classifyLanes(const float* x, const float* y, const float* z, const float* radius, int& outsideMask, int& insideMask) {
+		if (!valid) {
+			outsideMask = (1 << CULL_LANES) - 1;
+			insideMask = 0;
+			return;
+		}
+#if defined(__AVX__)
+		__m256 cx = _mm256_loadu_ps(x), cy = _mm256_loadu_ps(y), cz = _mm256_loadu_ps(z), r = _mm256_loadu_ps(radius);
+		__m256 negR = _mm256_sub_ps(_mm256_setzero_ps(), r);
+		__m256 outside = _mm256_setzero_ps(), straddle = _mm256_setzero_ps();
+		for (int plane = 0; plane < 6; plane++) {
+			__m256 dist = _mm256_add_ps(_mm256_add_ps(
+				_mm256_mul_ps(cx, _mm256_set1_ps(normalX[plane])), _mm256_mul_ps(cy, _mm256_set1_ps(normalY[plane]))),
+				_mm256_add_ps(_mm256_mul_ps(cz, _mm256_set1_ps(normalZ[plane])), _mm256_set1_ps(offsets[plane])));
+			outside = _mm256_or_ps(outside, _mm256_cmp_ps(dist, negR, _CMP_LT_OQ));
+			straddle = _mm256_or_ps(straddle, _mm256_cmp_ps(dist, r, _CMP_LT_OQ));
+		}
+		outsideMask = _mm256_movemask_ps(outside);
+		insideMask = ~_mm256_movemask_ps(straddle) & 0xFF;
+#elif defined(CULL_SSE)
+		__m128 cx = _mm_loadu_ps(x), cy = _mm_loadu_ps(y), cz = _mm_loadu_ps(z), r = _mm_loadu_ps(radius);
+		__m128 negR = _mm_sub_ps(_mm_setzero_ps(), r);
+		__m128 outside = _mm_setzero_ps(), straddle = _mm_setzero_ps();
+		for (int plane = 0; plane < 6; plane++) {
+			__m128 dist = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(cx, _mm_set1_ps(normalX[plane])), _mm_mul_ps(cy, _mm_set1_ps(normalY[plane]))),
+				_mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(normalZ[plane])), _mm_set1_ps(offsets[plane])));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(dist, negR));
+			straddle = _mm_or_ps(straddle, _mm_cmplt_ps(dist, r));
+		}
+		outsideMask = _mm_movemask_ps(outside);
+		insideMask = ~_mm_movemask_ps(straddle) & 0xF;
+#else
+		outsideMask = 0;
+		insideMask = 0;
+		for (int lane = 0; lane < CULL_LANES; lane++) {
+			CullResult result = classify(float_3(x[lane], y[lane], z[lane]), radius[lane]);
+			if (result == CULL_OUTSIDE) outsideMask |= 1 << lane;
+			if (result == CULL_INSIDE) insideMask |= 1 << lane;
+		}
+#endif
+	}
+};
+
+class CullBVH {
+public:
+	struct Node {
+		float_3 center;
+		float radius = 0;
+		int left = -1;
+		int right = -1;
+		int first = 0;
+		int count = 0;
+	};
+	//World space sphere for each item, set by the caller before build or refit
+	std::vector<std::pair<float_3, float>> spheres;
+	std::vector<Node> nodes;
+	//Item indices, each node covers order[first, first + count)
+	std::vector<int> order;
+	//Spheres in order as SoA for the lane kernel, padded by CULL_LANES
+	std::vector<float> centerX;
+	std::vector<float> centerY;
+	std::vector<float> centerZ;
+	std::vector<float> radii;
+	int tested = 0;
+
+	void build() {
+		nodes.clear();
+		order.resize(spheres.size());
+		for (int item = 0; item < (int)order.size(); item++) order[item] = item;
+		if (order.empty()) return;
+		nodes.reserve(2 * order.size());
+		buildNode(0, (int)order.size());
+		refit();
+	}
+
+	//Children always follow their parent, so a reverse walk sees them first
+	void refit() {
+		centerX.resize(order.size() + CULL_LANES);
+		centerY.resize(order.size() + CULL_LANES);
+		centerZ.resize(order.size() + CULL_LANES);
+		radii.resize(order.size() + CULL_LANES);
+		for (size_t item = 0; item < order.size(); item++) {
+			centerX[item] = spheres[order[item]].first.x;
+			centerY[item] = spheres[order[item]].first.y;
+			centerZ[item] = spheres[order[item]].first.z;
+			radii[item] = spheres[order[item]].second;
+		}
+		for (int node = (int)nodes.size() - 1; node >= 0; node--) {
+			Node& current = nodes[node];
+			if (current.left == -1) {
+				std::pair<float_3, float> bound = spheres[order[current.first]];
+				for (int leaf = current.first + 1; leaf < current.first + current.count; leaf++) {
+					bound = mergeSpheres(bound, spheres[order[leaf]]);
+				}
+				current.center = bound.first; current.radius = bound.second;
+			}
+			else {
+				std::pair<float_3, float> bound = mergeSpheres(
+					std::make_pair(nodes[current.left].center, nodes[current.left].radius),
+					std::make_pair(nodes[current.right].center, nodes[current.right].radius));
+				current.center = bound.first; current.radius = bound.second;
+			}
+		}
+	}
+
+	//Appends visible items, accepting whole subtrees inside the frustum and running exactTest only on items that straddle a plane
+	template<typename ExactTest>
+	void cull(frustumInfo info, mat44<float> toCameraSpace, ExactTest exactTest, std::vector<int>& visible) {
+		tested = 0;
+		if (nodes.empty()) return;
+		CullPlanes planes(info, toCameraSpace);
+		std::vector<int> stack = { 0 };
+		while (!stack.empty()) {
+			const Node& node = nodes[stack.back()];
+			stack.pop_back();
+			tested++;
+			CullResult result = planes.classify(node.center, node.radius);
+			if (result == CULL_OUTSIDE) continue;
+			if (result == CULL_INSIDE) {
+				visible.insert(visible.end(), order.begin() + node.first, order.begin() + node.first + node.count);
+			}
+			else if (node.left == -1) {
+				int outsideMask, insideMask;
+				planes.classifyLanes(&centerX[node.first], &centerY[node.first], &centerZ[node.first], &radii[node.first],
+					outsideMask, insideMask);
+				tested += node.count;
+				for (int lane = 0; lane < node.count; lane++) {
+					if (outsideMask & (1 << lane)) continue;
+					if ((insideMask & (1 << lane)) || exactTest(order[node.first + lane])) visible.push_back(order[node.first + lane]);
+				}
+			}
+			else {
+				stack.push_back(node.right);
+				stack.push_back(node.left);
+			}
+		}
+	}
+
+private:
+	static const int LEAF_SIZE = CULL_LANES;
+
+	//Median split on the widest axis of the item centers
+	int buildNode(int first, int count) {
+		int index = (int)nodes.size();
+		nodes.push_back(Node());
+		nodes[index].first = first;
+		nodes[index].count = count;
+		if (count <= LEAF_SIZE) return index;
+
+		float_3 minCenter = spheres[order[first]].first;
+		float_3 maxCenter = minCenter;
+		for (int item = first + 1; item < first + count; item++) {
+			float_3 center = spheres[order[item]].first;
+			minCenter = float_3(std::min(minCenter.x, center.x), std::min(minCenter.y, center.y), std::min(minCenter.z, center.z));
+			maxCenter = float_3(std::max(maxCenter.x, center.x), std::max(maxCenter.y, center.y), std::max(maxCenter.z, center.z));
+		}
+		float_3 extent = maxCenter - minCenter;
+		int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+		int half = count / 2;
+		std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+			[&](int a, int b) { return spheres[a].first[axis] < spheres[b].first[axis]; });
+
+		int left = buildNode(first, half);
+		int right = buildNode(first + half, count - half);
+		nodes[index].left = left;
+		nodes[index].right = right;
+		return index;
+	}
+};
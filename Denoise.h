@@ -0,0 +1,79 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+//Edge-avoiding a-trous wavelet filter on RGBA float images, matching Shaders/denoise.comp
+//normalDepth holds the primary hit normal in rgb and its distance in a, negative on a miss
+
+struct DenoisePhis {
+	float color = 1.f;
+	float normal = 128.f;
+	float depth = 1.f;
+	float albedo = 0.1f;
+};
+
+static void atrousPass(const std::vector<float>& inColor, std::vector<float>& outColor,
+	const std::vector<float>& normalDepth, const std::vector<float>& albedo,
+	int width, int height, int stepSize, DenoisePhis phis) {
+	static const float kernel[3] = { 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+	outColor.resize(inColor.size());
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			size_t pixel = 4 * ((size_t)y * width + x);
+			const float* color = &inColor[pixel];
+			const float* nd = &normalDepth[pixel];
+			if (stepSize == 0 || nd[3] < 0) {
+				std::copy(color, color + 4, &outColor[pixel]);
+				continue;
+			}
+			const float* alb = &albedo[pixel];
+
+			float sum[3] = { 0, 0, 0 };
+			float weightSum = 0;
+			for (int ty = -2; ty <= 2; ty++) {
+				for (int tx = -2; tx <= 2; tx++) {
+					int px = std::clamp(x + tx * stepSize, 0, width - 1);
+					int py = std::clamp(y + ty * stepSize, 0, height - 1);
+					size_t tap = 4 * ((size_t)py * width + px);
+					const float* tapColor = &inColor[tap];
+					const float* tapNd = &normalDepth[tap];
+					const float* tapAlb = &albedo[tap];
+					if (tapNd[3] < 0) continue;
+
+					float colorDist = 0, normalDot = 0, albedoDist = 0;
+					for (int c = 0; c < 3; c++) {
+						colorDist += (color[c] - tapColor[c]) * (color[c] - tapColor[c]);
+						normalDot += nd[c] * tapNd[c];
+						albedoDist += (alb[c] - tapAlb[c]) * (alb[c] - tapAlb[c]);
+					}
+					float colorWeight = std::exp(-colorDist / phis.color);
+					float normalWeight = std::pow(std::max(normalDot, 0.f), phis.normal);
+					float depthWeight = std::exp(-std::abs(nd[3] - tapNd[3]) / (phis.depth * (float)stepSize));
+					float albedoWeight = std::exp(-albedoDist / phis.albedo);
+
+					float weight = kernel[std::abs(tx)] * kernel[std::abs(ty)] * colorWeight * normalWeight * depthWeight * albedoWeight;
+					for (int c = 0; c < 3; c++) sum[c] += tapColor[c] * weight;
+					weightSum += weight;
+				}
+			}
+			for (int c = 0; c < 3; c++) outColor[pixel + c] = sum[c] / std::max(weightSum, 1e-6f);
+			outColor[pixel + 3] = color[3];
+		}
+	}
+}
+
+//Runs the same schedule as RTSystem::denoise, doubling the step and halving colorPhi each iteration
+static std::vector<float> atrousDenoise(const std::vector<float>& color,
+	const std::vector<float>& normalDepth, const std::vector<float>& albedo,
+	int width, int height, int iterations, DenoisePhis phis = DenoisePhis()) {
+	std::vector<float> ping = color;
+	std::vector<float> pong;
+	for (int iteration = 0; iteration < iterations; iteration++) {
+		DenoisePhis passPhis = phis;
+		passPhis.color = phis.color / (float)(1 << iteration);
+		atrousPass(ping, pong, normalDepth, albedo, width, height, 1 << iteration, passPhis);
+		std::swap(ping, pong);
+	}
+	return ping;
+}
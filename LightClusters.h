@@ -0,0 +1,150 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include "MathHelpers.h"
+#include "SystemCommonTypes.h"
+
+//Froxel grid over the view frustum for clustered forward shading
+//Tiles split the screen evenly, slices split depth exponentially so near clusters stay small
+//https://www.aortiz.me/2018/12/21/CG.html
+
+static const int CLUSTER_TILES_X = 16;
+static const int CLUSTER_TILES_Y = 9;
+static const int CLUSTER_SLICES = 24;
+static const int CLUSTER_COUNT = CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES;
+
+//Everything the fragment shader needs to find its cluster, laid out for std140
+struct ClusterInfo {
+	mat44<float> view; //World to camera space, the camera looks down -z
+	float leftSlope;
+	float bottomSlope;
+	float tilesPerSlopeX;
+	float tilesPerSlopeY;
+	float nearZ;
+	float slicesPerLog; //CLUSTER_SLICES / log(far / near)
+	int globalCount; //Unbounded lights at the head of the index list, shared by every cluster
+	int pad;
+	//Not touched by build, the deferred pass reconstructs world positions from depth with these
+	mat44<float> inverseCamera; //Clip to world
+	float inverseViewport[2];
+	float pad2[2];
+};
+
+class LightClusters {
+public:
+	//Offset and count into indices for each cluster, x fastest then y then slice
+	std::vector<uint32_t> ranges;
+	//Unbounded lights first, then every cluster's lights back to back
+	std::vector<uint32_t> indices;
+	ClusterInfo info;
+
+	//Lights are world spheres, a negative radius reaches everywhere (suns and lights without a limit)
+	void build(frustumInfo frustum, mat44<float> toCameraSpace, const std::vector<std::pair<float_3, float>>& lights) {
+		info.view = toCameraSpace;
+		info.leftSlope = frustum.farLeft / frustum.farZ;
+		info.bottomSlope = frustum.farBottom / frustum.farZ;
+		info.tilesPerSlopeX = CLUSTER_TILES_X / ((frustum.farRight - frustum.farLeft) / frustum.farZ);
+		info.tilesPerSlopeY = CLUSTER_TILES_Y / ((frustum.farTop - frustum.farBottom) / frustum.farZ);
+		info.nearZ = frustum.nearZ;
+		info.slicesPerLog = CLUSTER_SLICES / std::log(frustum.farZ / frustum.nearZ);
+		info.pad = 0;
+
+		ranges.assign(2 * CLUSTER_COUNT, 0);
+		indices.clear();
+		boxes.clear();
+		for (uint32_t light = 0; light < lights.size(); light++) {
+			if (lights[light].second < 0) indices.push_back(light);
+			else addBoxes(light, toCameraSpace * lights[light].first, lights[light].second, frustum);
+		}
+		info.globalCount = (int)indices.size();
+
+		//Count, prefix sum, then fill
+		for (const Box& box : boxes) {
+			for (int y = box.y0; y <= box.y1; y++) {
+				for (int x = box.x0; x <= box.x1; x++) ranges[2 * cluster(x, y, box.slice) + 1]++;
+			}
+		}
+		uint32_t offset = (uint32_t)indices.size();
+		for (int c = 0; c < CLUSTER_COUNT; c++) {
+			ranges[2 * c] = offset;
+			offset += ranges[2 * c + 1];
+			ranges[2 * c + 1] = 0;
+		}
+		indices.resize(offset);
+		for (const Box& box : boxes) {
+			for (int y = box.y0; y <= box.y1; y++) {
+				for (int x = box.x0; x <= box.x1; x++) {
+					int c = cluster(x, y, box.slice);
+					indices[ranges[2 * c] + ranges[2 * c + 1]++] = box.light;
+				}
+			}
+		}
+	}
+
+	//Lights a fragment in the average cluster loops over
+	float averageLights() {
+		return info.globalCount + (float)(indices.size() - info.globalCount) / CLUSTER_COUNT;
+	}
+
+private:
+	//Tiles one light covers in one slice
+	struct Box {
+		uint32_t light;
+		int slice;
+		int x0, x1, y0, y1;
+	};
+	std::vector<Box> boxes;
+
+	static int cluster(int x, int y, int slice) {
+		return (slice * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x;
+	}
+
+	int sliceOf(float z) {
+		int slice = (int)std::floor(std::log(z / info.nearZ) * info.slicesPerLog);
+		return std::clamp(slice, 0, CLUSTER_SLICES - 1);
+	}
+
+	//Clamped to one past either edge before the cast so far off lights cannot overflow
+	static int tileOf(float slope, float tilesPerSlope, int tiles) {
+		return (int)std::floor(std::clamp(slope * tilesPerSlope, -1.f, (float)tiles));
+	}
+
+	float sliceStart(int slice) {
+		return info.nearZ * std::exp(slice / info.slicesPerLog);
+	}
+
+	//Bounds the sphere's box in each slice it crosses, x / z is monotonic in z so the slab corners bound the tiles
+	void addBoxes(uint32_t light, float_3 center, float radius, frustumInfo frustum) {
+		//Nan check (case when camera is unintialized)
+		if (center.x != center.x || center.y != center.y || center.z != center.z) return;
+		center.z *= -1;
+		float zMin = std::max(center.z - radius, frustum.nearZ);
+		float zMax = std::min(center.z + radius, frustum.farZ);
+		if (zMin > zMax) return;
+		int firstSlice = sliceOf(zMin);
+		int lastSlice = sliceOf(zMax);
+		for (int slice = firstSlice; slice <= lastSlice; slice++) {
+			float z0 = std::max(zMin, sliceStart(slice));
+			float z1 = std::min(zMax, sliceStart(slice + 1));
+			float minX = center.x - radius, maxX = center.x + radius;
+			float minY = center.y - radius, maxY = center.y + radius;
+			float slopeMinX = minX / (minX < 0 ? z0 : z1);
+			float slopeMaxX = maxX / (maxX < 0 ? z1 : z0);
+			float slopeMinY = minY / (minY < 0 ? z0 : z1);
+			float slopeMaxY = maxY / (maxY < 0 ? z1 : z0);
+			Box box;
+			box.light = light;
+			box.slice = slice;
+			box.x0 = tileOf(slopeMinX - info.leftSlope, info.tilesPerSlopeX, CLUSTER_TILES_X);
+			box.x1 = tileOf(slopeMaxX - info.leftSlope, info.tilesPerSlopeX, CLUSTER_TILES_X);
+			box.y0 = tileOf(slopeMinY - info.bottomSlope, info.tilesPerSlopeY, CLUSTER_TILES_Y);
+			box.y1 = tileOf(slopeMaxY - info.bottomSlope, info.tilesPerSlopeY, CLUSTER_TILES_Y);
+			if (box.x1 < 0 || box.y1 < 0 || box.x0 >= CLUSTER_TILES_X || box.y0 >= CLUSTER_TILES_Y) continue;
+			box.x0 = std::max(box.x0, 0); box.x1 = std::min(box.x1, CLUSTER_TILES_X - 1);
+			box.y0 = std::max(box.y0, 0); box.y1 = std::min(box.y1, CLUSTER_TILES_Y - 1);
+			boxes.push_back(box);
+		}
+	}
+};
@@ -38,7 +38,7 @@ if (maek.OS === 'linux') {
 		`-L${VULKAN_SDK}/lib`,
 		'-lX11',
 		`-lvulkan`,
-		
+		'-pthread',
 	];   
 } else if (maek.OS === 'windows') {
 	VULKAN_SDK = process.env.VULKAN_SDK || `${process.env.USERPROFILE}/VulkanSDK/1.3.275.0`;
@@ -91,6 +91,9 @@ const SceneGraph_obj = maek.CPP('SceneGraph.cpp');
 const VulkanSystem_obj = maek.CPP('VulkanSystem.cpp');
 const WindowManager_obj = maek.CPP('WindowManager_lin.cpp');
 const Cube_obj = maek.CPP('cube/cube.cpp');
+const Texcomp_obj = maek.CPP('texcomp/texcomp.cpp');
+const Mathbench_obj = maek.CPP('mathbench/mathbench.cpp');
+const Cullbench_obj = maek.CPP('cullbench/cullbench.cpp');
 
 const VW_objs = [
 	maek.CPP('VW.cpp'),
@@ -109,6 +112,9 @@ if (maek.OS === 'linux') {
 //returns exeFile: exeFileBase + a platform-dependant suffix (e.g., '.exe' on windows)
 const program_exe = maek.LINK([...VW_objs, Main_obj, MainMode_obj, Mode_obj, ProgramMode_obj, SceneGraph_obj, VulkanSystem_obj, WindowManager_obj], 'dist/program');
 const cube_exe= maek.LINK([Cube_obj], 'dist/cube');
+const texcomp_exe = maek.LINK([Texcomp_obj], 'dist/texcomp');
+const mathbench_exe = maek.LINK([Mathbench_obj], 'dist/mathbench');
+const cullbench_exe = maek.LINK([Cullbench_obj], 'dist/cullbench');
 
 
 
@@ -60,10 +60,15 @@ int main(int argc, char* argv[])
 	int headlessArg = 0;
 	int shaderArg = 0;
 	int poolArg = 0;
+	int recordThreadsArg = 0;
 	bool instancing = false;
 	bool verbose = false;
 	bool culling = false;
 	bool animate = true;
+	bool compactVertices = false;
+	bool deferred = false;
+	bool depthPrepass = false;
+	bool reuseCommands = true;
 	bool listPhysicalDevices = false;
 	if (argc < 2) throw std::runtime_error("Please specify a scene (.s72 file) to load the program using --scene ____.");
 	for (int arg = 0; arg < argc; arg++) {
@@ -94,6 +99,9 @@ int main(int argc, char* argv[])
 			else if (std::string(argv[arg]).compare("--pool-size") == 0) {
 				poolArg = arg + 1;
 			}
+			else if (std::string(argv[arg]).compare("--record-threads") == 0) {
+				recordThreadsArg = arg + 1;
+			}
 		}
 		else if (std::string(argv[arg]).compare("--list-physical-devices") == 0) {
 			listPhysicalDevices = true;
@@ -101,9 +109,21 @@ int main(int argc, char* argv[])
 		else if (std::string(argv[arg]).compare("--instancing") == 0) {
 			instancing = true;
 		}
+		else if (std::string(argv[arg]).compare("--compact-vertices") == 0) {
+			compactVertices = true;
+		}
 		else if (std::string(argv[arg]).compare("--culling") == 0) {
 			culling = true;
 		}
+		else if (std::string(argv[arg]).compare("--deferred") == 0) {
+			deferred = true;
+		}
+		else if (std::string(argv[arg]).compare("--depth-prepass") == 0) {
+			depthPrepass = true;
+		}
+		else if (std::string(argv[arg]).compare("--no-command-reuse") == 0) {
+			reuseCommands = false;
+		}
 		else if (std::string(argv[arg]).compare("--verbose") == 0) {
 			verbose = true;
 		}
@@ -139,6 +159,10 @@ int main(int argc, char* argv[])
 	if (cameraArg != 0) {
 		cameraName = std::string(argv[cameraArg]);
 	}
+	//Record threads: Optional
+	if (recordThreadsArg != 0) {
+		graphMode.recordThreads = atoi(argv[recordThreadsArg]);
+	}
 	//Physical device name: Required
 	std::string physicalDeviceName = "";
 	if (physicalDeviceArg == 0) {
@@ -177,6 +201,14 @@ int main(int argc, char* argv[])
 	}
 	//Instancing: optional
 	graphMode.useInstancing = instancing;
+	//Compact vertices: optional
+	graphMode.compactVertices = compactVertices;
+	//Deferred shading: optional
+	graphMode.deferred = deferred;
+	//Depth prepass: optional
+	graphMode.depthPrepass = depthPrepass;
+	//Command buffer reuse: on unless disabled for benchmarking
+	graphMode.reuseCommands = reuseCommands;
 	//Verbose: optional
 	graphMode.verbose = verbose;
 	//Culling: optional
@@ -56,11 +56,21 @@ int main(int argc, char* argv[])
 	int poolArg = 0;
 	int samplesArg = 0;
 	int bouncesArg = 0;
+	int tlasRebuildArg = 0;
+	int targetSamplesArg = 0;
+	int denoiseArg = 0;
+	int recordThreadsArg = 0;
 	bool instancing = false;
 	bool verbose = false;
 	bool culling = false;
 	bool animate = true;
 	bool RT = false;
+	bool accumulate = false;
+	bool denoiseCheck = false;
+	bool compactVertices = false;
+	bool deferred = false;
+	bool depthPrepass = false;
+	bool reuseCommands = true;
 	int reflect = 0;
 	bool listPhysicalDevices = false;
 	if (argc < 2) throw std::runtime_error("Please specify a scene (.s72 file) to load the program using --scene ____.");
@@ -98,6 +108,18 @@ int main(int argc, char* argv[])
 			else if (std::string(argv[arg]).compare("--bounces") == 0) {
 				bouncesArg = arg + 1;
 			}
+			else if (std::string(argv[arg]).compare("--tlas-rebuild") == 0) {
+				tlasRebuildArg = arg + 1;
+			}
+			else if (std::string(argv[arg]).compare("--target-samples") == 0) {
+				targetSamplesArg = arg + 1;
+			}
+			else if (std::string(argv[arg]).compare("--denoise") == 0) {
+				denoiseArg = arg + 1;
+			}
+			else if (std::string(argv[arg]).compare("--record-threads") == 0) {
+				recordThreadsArg = arg + 1;
+			}
 		}
 		else if (std::string(argv[arg]).compare("--list-physical-devices") == 0) {
 			listPhysicalDevices = true;
@@ -112,9 +134,27 @@ int main(int argc, char* argv[])
 			RT = true;
 			reflect = 1;
 		}
+		else if (std::string(argv[arg]).compare("--accumulate") == 0) {
+			accumulate = true;
+		}
+		else if (std::string(argv[arg]).compare("--denoise-check") == 0) {
+			denoiseCheck = true;
+		}
+		else if (std::string(argv[arg]).compare("--compact-vertices") == 0) {
+			compactVertices = true;
+		}
 		else if (std::string(argv[arg]).compare("--culling") == 0) {
 			culling = true;
 		}
+		else if (std::string(argv[arg]).compare("--deferred") == 0) {
+			deferred = true;
+		}
+		else if (std::string(argv[arg]).compare("--depth-prepass") == 0) {
+			depthPrepass = true;
+		}
+		else if (std::string(argv[arg]).compare("--no-command-reuse") == 0) {
+			reuseCommands = false;
+		}
 		else if (std::string(argv[arg]).compare("--verbose") == 0) {
 			verbose = true;
 		}
@@ -162,6 +202,26 @@ int main(int argc, char* argv[])
 	if (bouncesArg != 0) {
 		numBounces = atoi(argv[bouncesArg]);
 	}
+	//TLAS refits before rebuild: Optional
+	if (tlasRebuildArg != 0) {
+		graphMode.tlasRebuildInterval = atoi(argv[tlasRebuildArg]);
+	}
+	//Accumulation: Optional, a target sample count implies accumulation
+	if (targetSamplesArg != 0) {
+		graphMode.targetSamples = atoi(argv[targetSamplesArg]);
+		accumulate = true;
+	}
+	graphMode.accumulate = accumulate;
+	//Denoise iterations: Optional
+	if (denoiseArg != 0) {
+		graphMode.denoiseIterations = atoi(argv[denoiseArg]);
+	}
+	//Denoise check against the CPU reference: Optional
+	graphMode.denoiseCheck = denoiseCheck;
+	//Record threads: Optional
+	if (recordThreadsArg != 0) {
+		graphMode.recordThreads = atoi(argv[recordThreadsArg]);
+	}
 	//Physical device name: Required
 	std::string physicalDeviceName = "";
 	if (physicalDeviceArg == 0) {
@@ -200,6 +260,14 @@ int main(int argc, char* argv[])
 	}
 	//Instancing: optional
 	graphMode.useInstancing = instancing;
+	//Compact vertices: optional
+	graphMode.compactVertices = compactVertices;
+	//Deferred shading: optional
+	graphMode.deferred = deferred;
+	//Depth prepass: optional
+	graphMode.depthPrepass = depthPrepass;
+	//Command buffer reuse: on unless disabled for benchmarking
+	graphMode.reuseCommands = reuseCommands;
 	//Verbose: optional
 	graphMode.verbose = verbose;
 	//Culling: optional
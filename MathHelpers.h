@@ -6,7 +6,11 @@
 #include "iostream"
 #include "exception"
 #include "vulkan/vulkan.h"
-#include "glm/mat4x4.hpp" //Unable to invert perspective otherwise
+#include <type_traits>
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define MATH_SSE
+#endif
 
 #define uint64_2 vec2<uint64_t>
 #define uint64_3 vec3<uint64_t>
@@ -961,24 +965,57 @@ template<typename T> struct mat43 {
 	}
 };
 
+//Column major 4x4 products, out must not alias a, b or v
+template<typename T> static inline void mat44Multiply(const T(&a)[4][4], const T(&b)[4][4], T(&out)[4][4]) noexcept {
+	for (int col = 0; col < 4; col++) {
+		for (int row = 0; row < 4; row++) {
+			out[col][row] = a[0][row] * b[col][0] + a[1][row] * b[col][1] + a[2][row] * b[col][2] + a[3][row] * b[col][3];
+		}
+	}
+}
+template<typename T> static inline void mat44Transform(const T(&a)[4][4], const T* v, T* out) noexcept {
+	for (int row = 0; row < 4; row++) {
+		out[row] = a[0][row] * v[0] + a[1][row] * v[1] + a[2][row] * v[2] + a[3][row] * v[3];
+	}
+}
+#ifdef MATH_SSE
+//Each output column is the matrix columns scaled by one broadcast component
+template<> inline void mat44Multiply<float>(const float(&a)[4][4], const float(&b)[4][4], float(&out)[4][4]) noexcept {
+	__m128 a0 = _mm_load_ps(a[0]), a1 = _mm_load_ps(a[1]), a2 = _mm_load_ps(a[2]), a3 = _mm_load_ps(a[3]);
+	for (int col = 0; col < 4; col++) {
+		__m128 prod = _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(a0, _mm_set1_ps(b[col][0])), _mm_mul_ps(a1, _mm_set1_ps(b[col][1]))),
+			_mm_add_ps(_mm_mul_ps(a2, _mm_set1_ps(b[col][2])), _mm_mul_ps(a3, _mm_set1_ps(b[col][3]))));
+		_mm_store_ps(out[col], prod);
+	}
+}
+template<> inline void mat44Transform<float>(const float(&a)[4][4], const float* v, float* out) noexcept {
+	__m128 prod = _mm_add_ps(
+		_mm_add_ps(_mm_mul_ps(_mm_load_ps(a[0]), _mm_set1_ps(v[0])), _mm_mul_ps(_mm_load_ps(a[1]), _mm_set1_ps(v[1]))),
+		_mm_add_ps(_mm_mul_ps(_mm_load_ps(a[2]), _mm_set1_ps(v[2])), _mm_mul_ps(_mm_load_ps(a[3]), _mm_set1_ps(v[3]))));
+	_mm_storeu_ps(out, prod);
+}
+#endif
+
 template<typename T> struct mat44 {
-	T data[4][4] = { {0,0,0,0}, {0,0,0,0},{0,0,0,0},{0,0,0,0} };
-	mat44<T>() {
+	//Columns are 16 byte aligned so float matrices load straight into SSE registers
+	alignas(16) T data[4][4] = { {0,0,0,0}, {0,0,0,0},{0,0,0,0},{0,0,0,0} };
+	constexpr mat44<T>() noexcept {
 	}
-	mat44<T>(T x) {
+	constexpr mat44<T>(T x) noexcept {
 		for (int i = 0; i < 4; i++) {
 			data[i][i] = x;
 		}
 	}
-	mat44<T>(
+	constexpr mat44<T>(
 		T x00, T x01, T x02, T x03,
 		T x10, T x11, T x12, T x13,
 		T x20, T x21, T x22, T x23,
 		T x30, T x31, T x32, T x33
-	) {
+	) noexcept {
 		data[0][0] = x00; data[0][1] = x01; data[0][2] = x02; data[0][3] = x03;
 		data[1][0] = x10; data[1][1] = x11; data[1][2] = x12; data[1][3] = x13;
-		data[2][0] = x10; data[2][1] = x21; data[2][2] = x22; data[2][3] = x23;
+		data[2][0] = x20; data[2][1] = x21; data[2][2] = x22; data[2][3] = x23;
 		data[3][0] = x30; data[3][1] = x31; data[3][2] = x32; data[3][3] = x33;
 	}
 	mat44<T>(vec4<T> x0, vec4<T> x1, vec4<T> x2, vec4<T> x3) {
@@ -992,7 +1029,7 @@ template<typename T> struct mat44 {
 	static mat44<T> identity() {
 		return mat44<T>(1);
 	}
-	mat44<T> transpose() {
+	constexpr mat44<T> transpose() const noexcept {
 		return mat44<T>(
 			data[0][0], data[1][0], data[2][0], data[3][0],
 			data[0][1], data[1][1], data[2][1], data[3][1],
@@ -1015,7 +1052,7 @@ template<typename T> struct mat44 {
 			m[0][2]*submatrixCol(m, 2, 0).determinate() -
 			m[0][3]*submatrixCol(m, 3, 0).determinate();
 	}
-	vec4<T> operator[](int i) {
+	vec4<T> operator[](int i) const noexcept {
 		vec4<T> ret;
 		ret.x = data[i][0];
 		ret.y = data[i][1];
@@ -1052,27 +1089,24 @@ template<typename T> struct mat44 {
 		T x32 = b[3][0] * data[0][2] + b[3][1] * data[1][2] + b[3][2] * data[2][2] + b[3][3] * data[3][2];
 		return mat43<T>(x00, x01, x02, x10, x11, x12, x20, x21, x22, x30, x31, x32);
 	}
-	vec4<T> operator*(vec4<T> v) {
-		vec4<T> prod;
-		prod.x = data[0][0] * v.x + data[1][0] * v.y + data[2][0] * v.z + data[3][0] * v.w;
-		prod.y = data[0][1] * v.x + data[1][1] * v.y + data[2][1] * v.z + data[3][1] * v.w;
-		prod.z = data[0][2] * v.x + data[1][2] * v.y + data[2][2] * v.z + data[3][2] * v.w;
-		prod.w = data[0][3] * v.x + data[1][3] * v.y + data[2][3] * v.z + data[3][3] * v.w;
-		return prod;
+	vec4<T> operator*(const vec4<T>& v) const noexcept {
+		T in[4] = { v.x, v.y, v.z, v.w };
+		T out[4];
+		mat44Transform(data, in, out);
+		return vec4<T>(out[0], out[1], out[2], out[3]);
 	}
-	mat44<T> operator*(mat44<T> b) {
-		mat44<T> prod = mat44<T>();
-		for (int row = 0; row < 4; row++) {
-			for (int col = 0; col < 4; col++) {
-				prod.data[col][row] =
-					data[0][row] * b[col][0] +
-					data[1][row] * b[col][1] +
-					data[2][row] * b[col][2] +
-					data[3][row] * b[col][3];
-			}
-		}
+	mat44<T> operator*(const mat44<T>& b) const noexcept {
+		mat44<T> prod;
+		mat44Multiply(data, b.data, prod.data);
 		return prod;
 	}
+	//In place composition, this = this * b
+	mat44<T>& operator*=(const mat44<T>& b) noexcept {
+		mat44<T> prod;
+		mat44Multiply(data, b.data, prod.data);
+		*this = prod;
+		return *this;
+	}
 
 	mat44<T> operator *(T x) {
 		mat44<T> result;
@@ -1128,27 +1162,36 @@ template<typename T> struct mat44 {
 	}
 
 
+	//Closed form inverse of perspective, which only has five non zero entries
 	static mat44<T> invPerspective(T fovy, T aspect, T nearP, T farP) {
-		T n = nearP; T f = farP;
-		T t = tan(fovy / 2.0) * n;
-		T b = -t;
-		T r = t * aspect;
-		T l = -r;
+		mat44<T> persp = perspective(fovy, aspect, nearP, farP);
+		mat44<T> inv;
+		inv.data[0][0] = 1 / persp.data[0][0];
+		inv.data[1][1] = 1 / persp.data[1][1];
+		inv.data[3][2] = -1;
+		inv.data[2][3] = 1 / persp.data[3][2];
+		inv.data[3][3] = persp.data[2][2] / persp.data[3][2];
+		return inv;
+	}
 
-		glm::mat4x4 persp(
-			2 * n / (r - l), 0, 0, 0,
-			0, 2 * n / (t - b), 0, 0,
-			0, 0, -(f + n) / (f - n), -1,
-			0, 0, -f * n / (f - n), 0
-		);
-		persp = glm::inverse(persp);
-		mat44<float> retMat;
-		for (int i = 0; i < 4; i++) {
-			for (int j = 0; j < 4; j++) {
-				retMat.data[i][j] = persp[i][j];
-			}
+	//Inverse of a matrix whose last row is 0 0 0 1, the rows of the 3x3 inverse are cross products of its columns
+	static mat44<T> affineInverse(const mat44<T>& m) noexcept {
+		const T(&c)[4][4] = m.data;
+		T r0[3] = { c[1][1] * c[2][2] - c[1][2] * c[2][1], c[1][2] * c[2][0] - c[1][0] * c[2][2], c[1][0] * c[2][1] - c[1][1] * c[2][0] };
+		T r1[3] = { c[2][1] * c[0][2] - c[2][2] * c[0][1], c[2][2] * c[0][0] - c[2][0] * c[0][2], c[2][0] * c[0][1] - c[2][1] * c[0][0] };
+		T r2[3] = { c[0][1] * c[1][2] - c[0][2] * c[1][1], c[0][2] * c[1][0] - c[0][0] * c[1][2], c[0][0] * c[1][1] - c[0][1] * c[1][0] };
+		T invDet = 1 / (c[0][0] * r0[0] + c[0][1] * r0[1] + c[0][2] * r0[2]);
+		mat44<T> inv;
+		for (int col = 0; col < 3; col++) {
+			inv.data[col][0] = r0[col] * invDet;
+			inv.data[col][1] = r1[col] * invDet;
+			inv.data[col][2] = r2[col] * invDet;
+		}
+		for (int row = 0; row < 3; row++) {
+			inv.data[3][row] = -(inv.data[0][row] * c[3][0] + inv.data[1][row] * c[3][1] + inv.data[2][row] * c[3][2]);
 		}
-		return retMat;
+		inv.data[3][3] = 1;
+		return inv;
 	}
 
 	//ROW MAJOR
@@ -1333,60 +1376,31 @@ public:
 		return retQuat;
 	}
 	//https://en.wikipedia.org/wiki/Quaternions_and_spatial_rotation#Quaternion-derived_rotation_matrix
-	static mat44<T> rotate(mat44<T> m, quaternion<T>q) {
-		vec3<T> axis = q.axis();
-		T a = q.angle();
-		T s = 1;
-		//Create rotation matrix rot of q such that given a point p,
-		//rot*p = qpq^-1
-		//column major version
+	//Create rotation matrix rot of q such that given a point p,
+	//rot*p = qpq^-1
+	//column major version
+	mat44<T> toMatrix() const noexcept {
+		const vec3<T>& axis = _axis;
+		T a = _angle;
 		mat44<T> rot(1);
-		rot.data[0][0] = 1 - 2 * s * (axis.y * axis.y + axis.z * axis.z);
-		rot.data[1][0] = 2 * s * (axis.x * axis.y - axis.z * a);
-		rot.data[2][0] = 2 * s * (axis.x * axis.z + axis.y * a);
-
-		rot.data[0][1] = 2 * s * (axis.x * axis.y + axis.z * a);
-		rot.data[1][1] = 1 - 2 * s * (axis.x * axis.x + axis.z * axis.z);
-		rot.data[2][1] = 2 * s * (axis.y * axis.z - axis.x * a);
+		rot.data[0][0] = 1 - 2 * (axis.y * axis.y + axis.z * axis.z);
+		rot.data[1][0] = 2 * (axis.x * axis.y - axis.z * a);
+		rot.data[2][0] = 2 * (axis.x * axis.z + axis.y * a);
 
-		rot.data[0][2] = 2 * s * (axis.x * axis.z - axis.y * a);
-		rot.data[1][2] = 2 * s * (axis.y * axis.z + axis.x * a);
-		rot.data[2][2] = 1 - 2 * s * (axis.x * axis.x + axis.y * axis.y);
-
-		vec4<T> m0 = m[0];
-		vec4<T> m1 = m[1];
-		vec4<T> m2 = m[2];
-		vec4<T> m3 = m[3];
-
-		vec4<T> v0 = rot * m0;
-		vec4<T> v1 = rot * m1;
-		vec4<T> v2 = rot * m2;
-		vec4<T> v3 = rot * m3;
-		return mat44<T>(v0, v1, v2, v3);
+		rot.data[0][1] = 2 * (axis.x * axis.y + axis.z * a);
+		rot.data[1][1] = 1 - 2 * (axis.x * axis.x + axis.z * axis.z);
+		rot.data[2][1] = 2 * (axis.y * axis.z - axis.x * a);
 
+		rot.data[0][2] = 2 * (axis.x * axis.z - axis.y * a);
+		rot.data[1][2] = 2 * (axis.y * axis.z + axis.x * a);
+		rot.data[2][2] = 1 - 2 * (axis.x * axis.x + axis.y * axis.y);
+		return rot;
 	}
-	static vec4<T> rotate(vec4<T> v, quaternion<T>q) {
-		vec3<T> axis = q.axis();
-		T a = q.angle();
-		T s = 1;
-		//Create rotation matrix rot of q such that given a point p,
-		//rot*p = qpq^-1
-		//column major version
-		mat44<T> rot(1);
-		rot.data[0][0] = 1 - 2 * s * (axis.y * axis.y + axis.z * axis.z);
-		rot.data[1][0] = 2 * s * (axis.x * axis.y - axis.z * a);
-		rot.data[2][0] = 2 * s * (axis.x * axis.z + axis.y * a);
-
-		rot.data[0][1] = 2 * s * (axis.x * axis.y + axis.z * a);
-		rot.data[1][1] = 1 - 2 * s * (axis.x * axis.x + axis.z * axis.z);
-		rot.data[2][1] = 2 * s * (axis.y * axis.z - axis.x * a);
-
-		rot.data[0][2] = 2 * s * (axis.x * axis.z - axis.y * a);
-		rot.data[1][2] = 2 * s * (axis.y * axis.z + axis.x * a);
-		rot.data[2][2] = 1 - 2 * s * (axis.x * axis.x + axis.y * axis.y);
-
-		return rot * v;
-
+	static mat44<T> rotate(const mat44<T>& m, const quaternion<T>& q) noexcept {
+		return q.toMatrix() * m;
+	}
+	static vec4<T> rotate(const vec4<T>& v, const quaternion<T>& q) noexcept {
+		return q.toMatrix() * v;
 	}
 	static mat44<T> rotate(mat44<T> m, T a, vec3<T> v) {
 		return rotate(m, angleAxis(a, v));
@@ -0,0 +1,140 @@
+#pragma once
+#include <vector>
+#include <array>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+//Load time index generation and vertex cache ordering for triangle lists
+
+//Merges vertices whose keys are bitwise identical and returns the triangle list indices into the merged vertices
+template<typename V, size_t N>
+static std::vector<uint32_t> weldVertices(std::vector<V>& vertices, std::array<float, N>(*key)(const V&)) {
+	struct KeyHash {
+		size_t operator()(const std::array<float, N>& k) const {
+			//FNV-1a over the raw bits, so -0 and 0 or differing NaNs stay apart
+			uint64_t hash = 14695981039346656037ull;
+			const unsigned char* bytes = (const unsigned char*)k.data();
+			for (size_t b = 0; b < sizeof(float) * N; b++) {
+				hash = (hash ^ bytes[b]) * 1099511628211ull;
+			}
+			return (size_t)hash;
+		}
+	};
+	struct KeyEqual {
+		bool operator()(const std::array<float, N>& a, const std::array<float, N>& b) const {
+			return memcmp(a.data(), b.data(), sizeof(float) * N) == 0;
+		}
+	};
+	std::unordered_map<std::array<float, N>, uint32_t, KeyHash, KeyEqual> unique;
+	unique.reserve(vertices.size());
+	std::vector<V> welded;
+	std::vector<uint32_t> indices(vertices.size());
+	for (size_t vert = 0; vert < vertices.size(); vert++) {
+		auto inserted = unique.emplace(key(vertices[vert]), (uint32_t)welded.size());
+		if (inserted.second) welded.push_back(vertices[vert]);
+		indices[vert] = inserted.first->second;
+	}
+	vertices = welded;
+	return indices;
+}
+
+//Average cache misses per triangle through a FIFO post-transform cache, 3 for a list with no reuse
+static float vertexCacheACMR(const std::vector<uint32_t>& indices, int cacheSize = 16) {
+	if (indices.size() < 3) return 0;
+	std::vector<uint32_t> cache;
+	size_t misses = 0;
+	for (uint32_t index : indices) {
+		if (std::find(cache.begin(), cache.end(), index) != cache.end()) continue;
+		misses++;
+		cache.push_back(index);
+		if ((int)cache.size() > cacheSize) cache.erase(cache.begin());
+	}
+	return (float)misses / (float)(indices.size() / 3);
+}
+
+//Tipsify triangle ordering for a post-transform cache of cacheSize vertices
+//https://gfx.cs.princeton.edu/pubs/Sander_2007_%3ETR/tipsy.pdf
+static std::vector<uint32_t> tipsifyIndices(const std::vector<uint32_t>& indices, uint32_t vertexCount, int cacheSize = 16) {
+	size_t triangleCount = indices.size() / 3;
+	if (triangleCount == 0) return indices;
+
+	//Triangles using each vertex, packed by vertex
+	std::vector<uint32_t> live(vertexCount, 0);
+	for (size_t i = 0; i < triangleCount * 3; i++) live[indices[i]]++;
+	std::vector<uint32_t> adjacencyStart(vertexCount + 1, 0);
+	for (uint32_t vert = 0; vert < vertexCount; vert++) adjacencyStart[vert + 1] = adjacencyStart[vert] + live[vert];
+	std::vector<uint32_t> adjacency(adjacencyStart[vertexCount]);
+	std::vector<uint32_t> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+	for (size_t tri = 0; tri < triangleCount; tri++) {
+		for (int corner = 0; corner < 3; corner++) adjacency[fill[indices[3 * tri + corner]]++] = (uint32_t)tri;
+	}
+
+	std::vector<int> cacheTime(vertexCount, 0);
+	std::vector<bool> emitted(triangleCount, false);
+	std::vector<uint32_t> deadEnd;
+	std::vector<uint32_t> candidates;
+	std::vector<uint32_t> output;
+	output.reserve(triangleCount * 3);
+	int timestamp = cacheSize + 1;
+	uint32_t cursor = 1;
+	int fanning = 0;
+	while (fanning >= 0) {
+		candidates.clear();
+		for (uint32_t a = adjacencyStart[fanning]; a < adjacencyStart[fanning + 1]; a++) {
+			uint32_t tri = adjacency[a];
+			if (emitted[tri]) continue;
+			for (int corner = 0; corner < 3; corner++) {
+				uint32_t vert = indices[3 * tri + corner];
+				output.push_back(vert);
+				deadEnd.push_back(vert);
+				candidates.push_back(vert);
+				live[vert]--;
+				if (timestamp - cacheTime[vert] > cacheSize) cacheTime[vert] = timestamp++;
+			}
+			emitted[tri] = true;
+		}
+
+		//Prefer a candidate still in cache that will not fall out before its triangles are done
+		int best = -1;
+		int bestPriority = -1;
+		for (uint32_t vert : candidates) {
+			if (live[vert] == 0) continue;
+			int priority = 0;
+			if (timestamp - cacheTime[vert] + 2 * (int)live[vert] <= cacheSize) priority = timestamp - cacheTime[vert];
+			if (priority > bestPriority) {
+				bestPriority = priority;
+				best = (int)vert;
+			}
+		}
+		//Otherwise back out through recently used vertices, then scan forward
+		while (best == -1 && !deadEnd.empty()) {
+			uint32_t vert = deadEnd.back();
+			deadEnd.pop_back();
+			if (live[vert] > 0) best = (int)vert;
+		}
+		while (best == -1 && cursor < vertexCount) {
+			if (live[cursor] > 0) best = (int)cursor;
+			cursor++;
+		}
+		fanning = best;
+	}
+	return output;
+}
+
+//Renumbers vertices in the order the indices first use them, so vertex fetch walks memory forward
+template<typename V>
+static void reorderVerticesByFirstUse(std::vector<V>& vertices, std::vector<uint32_t>& indices) {
+	std::vector<uint32_t> remap(vertices.size(), UINT32_MAX);
+	std::vector<V> reordered;
+	reordered.reserve(vertices.size());
+	for (uint32_t& index : indices) {
+		if (remap[index] == UINT32_MAX) {
+			remap[index] = (uint32_t)reordered.size();
+			reordered.push_back(vertices[index]);
+		}
+		index = remap[index];
+	}
+	vertices = reordered;
+}
@@ -189,8 +189,51 @@ void Mode::mainLoop(SceneGraph* graph, bool rt) {
 				end - start).count();
 			framecount++;
 			if (verbose && framecount == 1000) {
+				if (vulkanSystem.debugCullCount > 0) {
+					float culls = (float)vulkanSystem.debugCullCount;
+					std::cout << "MEASURE frustum cull (avg of " << vulkanSystem.debugCullCount << " frames): " <<
+						vulkanSystem.debugCullTime / culls << "ms, tested " << vulkanSystem.debugCullTested / culls <<
+						" of " << vulkanSystem.debugCullTotal / culls << ", visible " << vulkanSystem.debugCullVisible / culls << std::endl;
+				}
+				vulkanSystem.debugCullTime = 0;
+				vulkanSystem.debugCullCount = 0;
+				vulkanSystem.debugCullTested = 0;
+				vulkanSystem.debugCullVisible = 0;
+				vulkanSystem.debugCullTotal = 0;
+				if (vulkanSystem.debugRecordCount > 0) {
+					std::cout << "MEASURE command recording (avg of " << vulkanSystem.debugRecordCount << " frames): " <<
+						vulkanSystem.debugRecordTime / (float)vulkanSystem.debugRecordCount << "ms on " <<
+						vulkanSystem.recordThreads << " threads" << std::endl;
+				}
+				vulkanSystem.debugRecordTime = 0;
+				vulkanSystem.debugRecordCount = 0;
+				if (vulkanSystem.debugClusterCount > 0) {
+					float builds = (float)vulkanSystem.debugClusterCount;
+					std::cout << "MEASURE light clusters (avg of " << vulkanSystem.debugClusterCount << " frames): " <<
+						vulkanSystem.debugClusterTime / builds << "ms, " << vulkanSystem.debugClusterLights / builds <<
+						" lights per cluster" << std::endl;
+				}
+				vulkanSystem.debugClusterTime = 0;
+				vulkanSystem.debugClusterLights = 0;
+				vulkanSystem.debugClusterCount = 0;
+				if (vulkanSystem.debugFragmentCount > 0) {
+					std::cout << "MEASURE fragment invocations (avg of " << vulkanSystem.debugFragmentCount << " frames): " <<
+						vulkanSystem.debugFragmentInvocations / vulkanSystem.debugFragmentCount << " per frame, depth prepass " <<
+						(vulkanSystem.depthPrepass ? "on" : "off") << std::endl;
+				}
+				vulkanSystem.debugFragmentInvocations = 0;
+				vulkanSystem.debugFragmentCount = 0;
+				if (vulkanSystem.debugUploadCount > 0) {
+					std::cout << "MEASURE scene uploads (avg of " << vulkanSystem.debugUploadCount << " frames): " <<
+						vulkanSystem.debugUploadBytes / vulkanSystem.debugUploadCount << " bytes per frame" << std::endl;
+				}
+				vulkanSystem.debugUploadBytes = 0;
+				vulkanSystem.debugUploadCount = 0;
+				std::cout << "MEASURE command reuse (of 1000 frames): " << vulkanSystem.debugReusedFrames <<
+					" re-submitted unchanged" << std::endl;
+				vulkanSystem.debugReusedFrames = 0;
 				std::cout << "MEASURE frametime (avg of 1000 frames): " << (float)
-					mscount / 1000.f << "ms" << std::endl;
+					mscount / 1000.f << "ms " << (vulkanSystem.deferred ? "deferred" : "forward") << std::endl;
 				mscount = 0;
 				framecount = 0;
 			}
@@ -254,19 +297,47 @@ void Mode::mainLoop(SceneGraph* graph, bool rt) {
 			std::chrono::high_resolution_clock::time_point start =
 				std::chrono::high_resolution_clock::now();
 			rtSystem.drawFrame();
+			if (animate) rtSystem.runDrivers(1 / 60.f, graph, true);
 			std::chrono::high_resolution_clock::time_point end =
 				std::chrono::high_resolution_clock::now();
 			mscount += std::chrono::duration_cast<std::chrono::milliseconds>(
 				end - start).count();
 			framecount++;
 			if (verbose && framecount == 1000) {
-				std::cout << "MEASURE raytime (avg of 1000 frames): " <<
-					(float)rtSystem.debugRayTime / 1000.f << "ms" << std::endl;
+				std::cout << "MEASURE cpu frametime (avg of 1000 frames): " <<
+					rtSystem.debugCpuTime / 1000.f << "ms" << std::endl;
+				if (rtSystem.debugGpuCount > 0) {
+					std::cout << "MEASURE gpu busy time (avg of " << rtSystem.debugGpuCount << " frames): " <<
+						rtSystem.debugGpuTime / (float)rtSystem.debugGpuCount << "ms" << std::endl;
+				}
+				if (rtSystem.debugRefitCount > 0) {
+					std::cout << "MEASURE tlas refit (avg of " << rtSystem.debugRefitCount << " refits): " <<
+						rtSystem.debugRefitTime / (float)rtSystem.debugRefitCount << "ms" << std::endl;
+				}
+				if (rtSystem.debugRebuildCount > 0) {
+					std::cout << "MEASURE tlas rebuild (avg of " << rtSystem.debugRebuildCount << " rebuilds): " <<
+						rtSystem.debugRebuildTime / (float)rtSystem.debugRebuildCount << "ms" << std::endl;
+				}
+				if (rtSystem.debugDenoiseCount > 0) {
+					for (int pass = 0; pass < rtSystem.debugDenoiseTimes.size(); pass++) {
+						if (rtSystem.debugDenoiseTimes[pass] == 0) continue;
+						std::cout << "MEASURE denoise pass " << pass << " (avg of " << rtSystem.debugDenoiseCount << " frames): " <<
+							rtSystem.debugDenoiseTimes[pass] / (float)rtSystem.debugDenoiseCount << "ms" << std::endl;
+						rtSystem.debugDenoiseTimes[pass] = 0;
+					}
+				}
+				rtSystem.debugDenoiseCount = 0;
+				rtSystem.debugRefitTime = 0;
+				rtSystem.debugRebuildTime = 0;
+				rtSystem.debugRefitCount = 0;
+				rtSystem.debugRebuildCount = 0;
 				std::cout << "MEASURE frametime (avg of 1000 frames): " << (float)
 					mscount / 1000.f << "ms" << std::endl;
 				mscount = 0;
 				framecount = 0;
-				rtSystem.debugRayTime = 0;
+				rtSystem.debugCpuTime = 0;
+				rtSystem.debugGpuTime = 0;
+				rtSystem.debugGpuCount = 0;
 			}
 		}
 	}
@@ -309,7 +380,7 @@ int Mode::modeMain() {
 	SceneGraph graph = parser.parseJson(sceneName, verbose);
 	
 	graph.drawType = useRT ? DRAW_MESH : ( useInstancing ? DRAW_INSTANCED : DRAW_STANDARD);
-	Texture lut = Texture::parseTexture("Textures/LUT.png", false);
+	Texture lut = Texture::parseTexture("Textures/LUT.png", false, Texture::SEM_PAIR);
 
 	DrawList drawList = graph.navigateSceneGraph(verbose, poolSize);
 	if (drawList.cubeMaps.size() == 0) {
@@ -335,6 +406,11 @@ int Mode::modeMain() {
 		rtSystem.numBounces = numBounces;
 		rtSystem.doReflect = doReflect;
 		rtSystem.verbose = verbose;
+		rtSystem.tlasRebuildInterval = tlasRebuildInterval;
+		rtSystem.accumulate = accumulate;
+		rtSystem.targetSamples = targetSamples;
+		rtSystem.denoiseIterations = denoiseIterations;
+		rtSystem.denoiseCheck = denoiseCheck;
 
 		std::chrono::high_resolution_clock::time_point initFirst = std::chrono::high_resolution_clock::now();
 		rtSystem.initVulkan(drawList, cameraName);
@@ -362,6 +438,11 @@ int Mode::modeMain() {
 		vulkanSystem.mainWindow = mainWindow;
 		vulkanSystem.deviceName = deviceName;
 		vulkanSystem.useCulling = culling;
+		vulkanSystem.compactVertices = compactVertices;
+		vulkanSystem.recordThreads = recordThreads < 1 ? 1 : recordThreads;
+		vulkanSystem.deferred = deferred;
+		vulkanSystem.depthPrepass = depthPrepass;
+		vulkanSystem.reuseCommands = reuseCommands;
 		vulkanSystem.poolSize = poolSize;
 		vulkanSystem.platform = platform;
 		vulkanSystem.defaultShadowTex = defaultShadow;
@@ -372,6 +453,21 @@ int Mode::modeMain() {
 		if (verbose) std::cout << "MEASURE init vulkan: " << (float)
 			std::chrono::duration_cast<std::chrono::milliseconds>(
 				initLast - initFirst).count() << "ms" << std::endl;
+		if (verbose) std::cout << "MEASURE vertex memory: " <<
+			(drawList.vertexPool.size() + drawList.instancedVertexPool.size()) *
+			(sizeof(VertexPosition) + (compactVertices ? sizeof(VertexCompact) : sizeof(VertexAttributes))) << " bytes" << std::endl;
+		if (verbose) std::cout << "MEASURE texture memory: " << vulkanSystem.debugTextureBytes << " bytes, " <<
+			vulkanSystem.debugTextureBytesRGBA << " bytes as RGBA8, " << vulkanSystem.debugCompressedTextureCount << " of " <<
+			vulkanSystem.debugTextureCount << " textures block compressed" << std::endl;
+		if (verbose) std::cout << "MEASURE texture load: " << vulkanSystem.debugTextureDecodeTime << "ms decoding, " <<
+			vulkanSystem.debugTextureUploadTime << "ms uploading" << std::endl;
+		if (verbose) {
+			//Lights each fragment loops over as the scene's lights are added, a brute force loop grows with the light count
+			for (std::array<float, 3> row : vulkanSystem.measureLightScaling(8)) {
+				std::cout << "MEASURE light scaling: " << (int)row[0] << " lights, " << row[1] << " per cluster, " <<
+					row[2] << "ms to bin " << std::string(std::min(60, (int)std::ceil(row[1])), '#') << std::endl;
+			}
+		}
 		lastFrame = std::chrono::high_resolution_clock::now();
 		movementMode = MovementMode::MOVE_USER;
 		vulkanSystem.movementMode = movementMode;
@@ -39,6 +39,16 @@ public:
 	int numSamples = 1;
 	int numBounces = 1;
 	int doReflect = 0;
+	int tlasRebuildInterval = 60;
+	bool accumulate = false;
+	int targetSamples = 0;
+	int denoiseIterations = 0;
+	bool denoiseCheck = false;
+	bool compactVertices = false;
+	int recordThreads = 1;
+	bool deferred = false;
+	bool depthPrepass = false;
+	bool reuseCommands = true;
 	std::string sceneName;
 	std::string cameraName;
 	std::string deviceName;
@@ -2,6 +2,7 @@
 #include "SceneGraph.h"
 #include "FileHelp.h"
 #include "Events.h"
+#include "MeshOptimize.h"
 
 
 std::string parseName(std::string nameString) {
@@ -12,6 +13,13 @@ std::string parseName(std::string nameString) {
 	return nameString.substr(startBlock, nameString.size() - startBlock - endBlock);
 }
 
+//Every attribute of a vertex, so welding only merges vertices that are identical
+static std::array<float, 15> sceneVertexKey(const SceneVertex& v) {
+	return { v.pos.x, v.pos.y, v.pos.z, v.normal.x, v.normal.y, v.normal.z,
+		v.tangent.x, v.tangent.y, v.tangent.z, v.tangent.w,
+		v.texcoord.x, v.texcoord.y, v.color.x, v.color.y, v.color.z };
+}
+
 enum PartialMaterialType { PART_VEC, PART_FLO, PART_TEX };
 struct PartialMaterialData {
 
@@ -47,7 +55,8 @@ private:
 	std::vector<SceneVertex> parseAttributes(std::vector<std::string> attributeStrings);
 	std::vector<float_4> parseAttribute4(std::string attributeString, bool bit_32, int stride);
 	std::vector<float_2> parseAttribute2(std::string attributeString, int stride);
-	std::map<std::string, int> nameToTexture;
+	//The same file read as color and as a scalar map uploads in different formats, so both are kept
+	std::map<std::pair<std::string, Texture::Semantic>, int> nameToTexture;
 	int nameToTextureId(std::string name, Texture tex, std::vector<Texture>* textures);
 	std::map<std::string, int> nameToCube;
 	int nameToCubeId(std::string name, Texture tex, std::vector<Texture>* textures);
@@ -55,7 +64,7 @@ private:
 		std::string albedoString,
 		std::string roughnessString,
 		std::string specularString);
-	PartialMaterialData parseMaterialData(std::string objectStringtextures, bool parseAsCube = false);
+	PartialMaterialData parseMaterialData(std::string objectStringtextures, bool parseAsCube = false, Texture::Semantic semantic = Texture::SEM_COLOR);
 
 	//Specific object type parsing functions
 	Camera parseCamera(std::vector<std::string> jsonObject);
@@ -65,7 +74,7 @@ private:
 	MaterialInt parseMaterial(std::vector<std::string> jsonObject);
 };
 
-PartialMaterialData Parser::parseMaterialData(std::string objectString, bool parseAsCube) {
+PartialMaterialData Parser::parseMaterialData(std::string objectString, bool parseAsCube, Texture::Semantic semantic) {
 	PartialMaterialData parsedData;
 	if (objectString.at(0) == '[') {
 		parsedData.type = PART_VEC;
@@ -79,7 +88,7 @@ PartialMaterialData Parser::parseMaterialData(std::string objectString, bool par
 	else if (objectString.size() > 3 && objectString.at(3) == 's') {
 		parsedData.type = PART_TEX;
 		std::string texName = objectString.substr(9, objectString.size() - 10);
-		Texture parsedTex = Texture::parseTexture(texName, parseAsCube);
+		Texture parsedTex = Texture::parseTexture(texName, parseAsCube, semantic);
 		std::pair<Texture, std::string> texData = std::make_pair(parsedTex, texName);
 		parsedData.texture = texData;
 	}
@@ -99,8 +108,8 @@ PBRInt Parser::parsePBR(
 	pbr.useValueRoughness = true;
 	pbr.useValueSpecular = true;
 	PartialMaterialData albedoData = parseMaterialData(albedoString);
-	PartialMaterialData roughnessData = parseMaterialData(roughnessString);
-	PartialMaterialData specularData = parseMaterialData(specularString);
+	PartialMaterialData roughnessData = parseMaterialData(roughnessString, false, Texture::SEM_SCALAR);
+	PartialMaterialData specularData = parseMaterialData(specularString, false, Texture::SEM_SCALAR);
 	if (albedoData.type == PART_TEX) {
 		pbr.useValueAlbedo = false;
 		pbr.albedo.texture = albedoData.texture;
@@ -141,11 +150,11 @@ MaterialInt Parser::parseMaterial(std::vector<std::string> jsonObject) {
 		}
 		else if (objLen > 21 && !compString.compare("no")) {
 			std::string texName = objectString.substr(21, objLen - 23);
-			parsedMaterial.normalMap = std::make_pair(Texture::parseTexture(texName,false), texName);
+			parsedMaterial.normalMap = std::make_pair(Texture::parseTexture(texName,false,Texture::SEM_NORMAL), texName);
 		}
 		else if (objLen > 27 && !compString.compare("di")) {
 			std::string texName = objectString.substr((27, objLen - 30));
-			parsedMaterial.displacementMap = std::make_pair(Texture::parseTexture(texName,false), texName);
+			parsedMaterial.displacementMap = std::make_pair(Texture::parseTexture(texName,false,Texture::SEM_SCALAR), texName);
 		}
 		else if (objLen > 3 && !compString.compare("pb")) {
 			parsedMaterial.type = MAT_PBR;
@@ -629,10 +638,11 @@ std::vector<float_2> Parser::parseAttribute2(std::string attributeString, int st
 
 
 int Parser::nameToTextureId(std::string name, Texture tex, std::vector<Texture>* textures) {
-	std::map<std::string, int>::iterator mapCheck = nameToTexture.find(name);
+	std::pair<std::string, Texture::Semantic> key = std::make_pair(name, tex.semantic);
+	std::map<std::pair<std::string, Texture::Semantic>, int>::iterator mapCheck = nameToTexture.find(key);
 	if (mapCheck == nameToTexture.end()) {
 		int texIndex = textures->size();
-		nameToTexture[name] = texIndex;
+		nameToTexture[key] = texIndex;
 		textures->push_back(tex);
 		return texIndex;
 	}
@@ -784,6 +794,17 @@ SceneGraph Parser::parseJson(std::string fileName, bool verbose) {
 				attributeStrings.push_back(jsonObject[attributeInd]);
 			}
 			std::vector<SceneVertex> vertices = parseAttributes(attributeStrings);
+			//Weld triangle lists into indexed meshes and order them for the post-transform cache
+			if (!mesh.indicies.has_value() && vertices.size() >= 3 && vertices.size() % 3 == 0) {
+				size_t listVertices = vertices.size();
+				std::vector<uint32_t> indices = weldVertices(vertices, sceneVertexKey);
+				float weldedACMR = vertexCacheACMR(indices);
+				indices = tipsifyIndices(indices, (uint32_t)vertices.size());
+				reorderVerticesByFirstUse(vertices, indices);
+				if (verbose) std::cout << "MEASURE weld " << mesh.name << ": vertices " << listVertices << " -> " << vertices.size()
+					<< ", ACMR 3 -> " << weldedACMR << " -> " << vertexCacheACMR(indices) << std::endl;
+				mesh.indicies = indices;
+			}
 			//Parse material
 			if (attributeInd < jsonObject.size()) {
 				mesh.material = atoi(jsonObject[attributeInd].substr(11, jsonObject[attributeInd].size() - 11).c_str());
@@ -901,8 +922,21 @@ SceneGraph Parser::parseJson(std::string fileName, bool verbose) {
 			parsedGraph.materials.push_back(material);
 		}
 		else if (!typeString.compare("ENVIRONMENT")) {
-			std::string fileName = findSegment(jsonObject[2], "\"src\":\"", "\"");
-			parsedGraph.environmentMap = Texture::parseTexture(fileName, true);
+			//Radiance cubemap and irradiance spherical harmonics are both optional
+			for (size_t line = 2; line < jsonObject.size(); line++) {
+				std::string lineString = jsonObject[line];
+				if (!lineString.substr(0, 10).compare("\"radiance\"")) {
+					std::string fileName = findSegment(lineString, "\"src\":\"", "\"");
+					parsedGraph.environmentMap = Texture::parseTexture(fileName, true);
+				}
+				else if (!lineString.substr(0, 14).compare("\"irradianceSH\"")) {
+					std::string arrayString = findSegment(lineString, "[", "]");
+					parsedGraph.environmentSH = parseArrayStringF("[" + arrayString + "]");
+					if (parsedGraph.environmentSH.size() != 27) {
+						throw std::runtime_error("ERROR: irradianceSH needs 9 rgb coefficients in json file " + fileName + ".");
+					}
+				}
+			}
 		}
 	}
 	//Reformat reference ids
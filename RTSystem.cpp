@@ -23,7 +23,7 @@
 #include "stb_image.h"
 #include "SystemCommon.h"
 #include "SystemCommonTypes.h"
-#include <glm/mat4x4.hpp> //TODO: TEMP
+#include "Denoise.h"
 //https://vulkan-tutorial.com
 //https://nvpro-samples.github.io/vk_raytracing_tutorial_KHR/#raytracingsetup
 
@@ -79,11 +79,11 @@ void RTSystem::initVulkan(DrawList drawList, std::string cameraName) {
 	createCommands();
 	createVertexBuffer();
 	createIndexBuffers();
-	createTransformBuffers();
 	createAccelereationStructures();
 	createDescriptorSetLayout();
 	createRenderPasses();
 	createGraphicsPipelines();
+	createDenoisePipeline();
 	createShaderBindingTable();
 	createFramebuffers();
 	createTextureImages();
@@ -110,9 +110,14 @@ void RTSystem::initVulkan(DrawList drawList, std::string cameraName) {
 				throw std::runtime_error("ERROR: Unable to create a semaphore or fence in RTSystem.");
 			}
 		}
-		for (int i = 0; i < imageCount; i++) {
-			transitionImageLayout(rtImages[i], VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 1, 1);
+		//Frames start and end with their image ready for the composite
+		for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+			transitionImageLayout(rtImages[i], VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 1, 1);
 		}
+		transitionImageLayout(accumImage, VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 1, 1);
+		transitionImageLayout(normalDepthImage, VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 1, 1);
+		transitionImageLayout(albedoImage, VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 1, 1);
+		transitionImageLayout(denoiseImage, VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 1, 1);
 	}
 
 }
@@ -136,6 +141,27 @@ void RTSystem::listPhysicalDevices() {
 }
 
 
+void RTSystem::runDrivers(float frameTime, SceneGraph* sceneGraphP, bool loop) {
+	frameTime *= playbackSpeed; //1 when not in headless mode
+	frameTime *= (playingAnimation ? (forwardAnimation ? 1 : -1) : 0);
+	bool renavigate = false;
+	for (size_t ind = 0; ind < nodeDrivers.size(); ind++) {
+		Driver* driver = nodeDrivers.data() + ind;
+		renavigate = updateTransform(driver, frameTime, sceneGraphP, loop) || renavigate;
+	}
+	for (size_t ind = 0; ind < cameraDrivers.size(); ind++) {
+		Driver* driver = cameraDrivers.data() + ind;
+		renavigate = updateTransform(driver, frameTime, sceneGraphP, loop) || renavigate;
+	}
+	if (renavigate) {
+		DrawList drawList = sceneGraphP->navigateSceneGraph(false, poolSize);
+		transformPoolsMesh = drawList.meshTransformPools;
+		cameras = drawList.cameras;
+		tlasDirty = true;
+		accumulationReset = true;
+	}
+}
+
 void RTSystem::setDriverRuntime(float time) {
 	for (size_t ind = 0; ind < cameraDrivers.size(); ind++) {
 		cameraDrivers[ind].currentRuntime = time;
@@ -151,6 +177,14 @@ void RTSystem::cleanup() {
 #endif // DEBUG
 
 	//TODO: Cleanup acc structures here!
+	for (int frame = 0; frame < tlasInstanceBuffers.size(); frame++) {
+		vkDestroyBuffer(device, tlasInstanceBuffers[frame], nullptr);
+		vkFreeMemory(device, tlasInstanceMemorys[frame], nullptr);
+	}
+	vkDestroyBuffer(device, tlasScratchBuffer, nullptr);
+	vkFreeMemory(device, tlasScratchMemory, nullptr);
+	vkDestroyQueryPool(device, timestampQueryPool, nullptr);
+	vkDestroyQueryPool(device, denoiseQueryPool, nullptr);
 
 	cleanupSwapChain();
 	for (VkImageView texImageView : textureImageViews) {
@@ -179,18 +213,33 @@ void RTSystem::cleanup() {
 	vkDestroyImageView(device, LUTImageView, nullptr);
 	vkDestroyImage(device, LUTImage, nullptr);
 	vkFreeMemory(device, LUTImageMemory, nullptr);
+	vkDestroyImageView(device, accumImageView, nullptr);
+	vkDestroyImage(device, accumImage, nullptr);
+	vkFreeMemory(device, accumImageMemory, nullptr);
+	vkDestroyImageView(device, normalDepthImageView, nullptr);
+	vkDestroyImage(device, normalDepthImage, nullptr);
+	vkFreeMemory(device, normalDepthImageMemory, nullptr);
+	vkDestroyImageView(device, albedoImageView, nullptr);
+	vkDestroyImage(device, albedoImage, nullptr);
+	vkFreeMemory(device, albedoImageMemory, nullptr);
+	vkDestroyImageView(device, denoiseImageView, nullptr);
+	vkDestroyImage(device, denoiseImage, nullptr);
+	vkFreeMemory(device, denoiseImageMemory, nullptr);
 	for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
 		vkDestroyBuffer(device, uniformBuffersCamera[frame], nullptr);
 		vkFreeMemory(device, uniformBuffersMemoryCamera[frame], nullptr);
 	}
 	vkDestroyDescriptorPool(device, descriptorPoolHDR, nullptr);
-	for (int i = 0; i < 2; i++) {
+	vkDestroyDescriptorPool(device, descriptorPoolDenoise, nullptr);
+	for (int i = 0; i < 3; i++) {
 		vkDestroyDescriptorSetLayout(device, descriptorSetLayouts[i], nullptr);
 	}
 	vkDestroyBuffer(device, vertexBuffer, nullptr);
 	vkFreeMemory(device, vertexBufferMemory, nullptr);
 	vkDestroyPipelineLayout(device, pipelineLayoutRT, nullptr);
 	vkDestroyPipelineLayout(device, pipelineLayoutFinal, nullptr);
+	vkDestroyPipelineLayout(device, pipelineLayoutDenoise, nullptr);
+	if (denoiseIterations > 0) vkDestroyPipeline(device, computePipelineDenoise, nullptr);
 	vkDestroyRenderPass(device, renderPass, nullptr);
 	for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
 	{
@@ -461,6 +510,7 @@ void RTSystem::pickPhysicalDevice() {
 	VkPhysicalDeviceProperties2 prop2{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2 };
 	prop2.pNext = &rtProperties;
 	vkGetPhysicalDeviceProperties2(physicalDevice, &prop2);
+	timestampPeriod = prop2.properties.limits.timestampPeriod;
 }
 
 void RTSystem::createLogicalDevice() {
@@ -500,6 +550,11 @@ void RTSystem::createLogicalDevice() {
 	vkGetPhysicalDeviceFeatures2(physicalDevice, &phyDeviceFeatures);
 	deviceFeatures.bufferDeviceAddress = VK_TRUE;
 	phyDeviceFeatures.features.samplerAnisotropy = VK_TRUE;
+	//BC formats from .ktx2 textures, without it they fall back to their png
+	VkPhysicalDeviceFeatures supportedFeatures;
+	vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+	phyDeviceFeatures.features.textureCompressionBC = supportedFeatures.textureCompressionBC;
+	compressedTextures = supportedFeatures.textureCompressionBC;
 	accFeatures.accelerationStructure = VK_TRUE;
 	pipelineFeatures.rayTracingPipeline = VK_TRUE;
 	createInfo.pNext = &phyDeviceFeatures;
@@ -618,14 +673,16 @@ void RTSystem::createStorageImages() {
 	VkExtent2D extent;
 	extent.width = mainWindow->resolution.first;
 	extent.height = mainWindow->resolution.second;
-	rtImages.resize(swapChainImages.size());
-	rtImageMemorys.resize(swapChainImages.size());
-	rtSamplers.resize(swapChainImages.size());
+	//One per frame in flight, so a frame can trace while the last one composites
+	rtImages.resize(MAX_FRAMES_IN_FLIGHT);
+	rtImageMemorys.resize(MAX_FRAMES_IN_FLIGHT);
+	rtSamplers.resize(MAX_FRAMES_IN_FLIGHT);
+	rtImageViews.resize(MAX_FRAMES_IN_FLIGHT);
 
-	for (size_t image = 0; image < swapChainImages.size(); image++) {
+	for (size_t image = 0; image < MAX_FRAMES_IN_FLIGHT; image++) {
 		createImage(extent.width, extent.height, VK_FORMAT_R32G32B32A32_SFLOAT,
 			VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_STORAGE_BIT
-			| VK_IMAGE_USAGE_SAMPLED_BIT, 0,
+			| VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, 0,
 			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, rtImages[image],
 			rtImageMemorys[image]);
 
@@ -652,7 +709,28 @@ void RTSystem::createStorageImages() {
 		if (vkCreateSampler(device, &samplerInfo, nullptr, &rtSamplers[image]) != VK_SUCCESS) {
 			throw std::runtime_error("ERROR: Unable to create a sampler in VulkanSystem.");
 		}
-	}
+		rtImageViews[image] = createImageView(rtImages[image], VK_FORMAT_R32G32B32A32_SFLOAT);
+	}
+
+	//Persistent across frames so samples can be accumulated
+	createImage(extent.width, extent.height, VK_FORMAT_R32G32B32A32_SFLOAT,
+		VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_STORAGE_BIT, 0,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, accumImage, accumImageMemory);
+	accumImageView = createImageView(accumImage, VK_FORMAT_R32G32B32A32_SFLOAT);
+
+	//Primary hit features and the ping-pong target for the denoiser
+	createImage(extent.width, extent.height, VK_FORMAT_R32G32B32A32_SFLOAT,
+		VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, 0,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, normalDepthImage, normalDepthImageMemory);
+	normalDepthImageView = createImageView(normalDepthImage, VK_FORMAT_R32G32B32A32_SFLOAT);
+	createImage(extent.width, extent.height, VK_FORMAT_R32G32B32A32_SFLOAT,
+		VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, 0,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, albedoImage, albedoImageMemory);
+	albedoImageView = createImageView(albedoImage, VK_FORMAT_R32G32B32A32_SFLOAT);
+	createImage(extent.width, extent.height, VK_FORMAT_R32G32B32A32_SFLOAT,
+		VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_STORAGE_BIT, 0,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, denoiseImage, denoiseImageMemory);
+	denoiseImageView = createImageView(denoiseImage, VK_FORMAT_R32G32B32A32_SFLOAT);
 }
 
 
@@ -663,12 +741,6 @@ void RTSystem::createImageViews() {
 		swapChainImageViews[imageIndex] = createImageView(
 			swapChainImages[imageIndex], swapChainImageFormat);
 	}
-	rtImageViews.resize(rtImages.size());
-	for (size_t imageIndex = 0; imageIndex < rtImages.size();
-		imageIndex++) {
-		rtImageViews[imageIndex] = createImageView(
-			rtImages[imageIndex], VK_FORMAT_R32G32B32A32_SFLOAT);
-	}
 }
 
 void RTSystem::AS::create(VkAccelerationStructureCreateInfoKHR createInfo, VkDevice device) {
@@ -780,7 +852,6 @@ void RTSystem::createBLAccelereationStructures(uint32_t flags) {
 		//Produce geometry
 		VkDeviceAddress vertexAddress = getBufferAddress(device, vertexBuffer);
 		VkDeviceAddress indexAddress = getBufferAddress(device, meshIndexBuffers[mesh]);
-		VkDeviceAddress transformAddress = getBufferAddress(device, meshTransformBuffers[mesh]);
 		meshIndexBufferAddresses.push_back(indexAddress);
 		uint32_t maxTriCount = indexPoolsMesh[mesh].size()/3;
 
@@ -793,7 +864,6 @@ void RTSystem::createBLAccelereationStructures(uint32_t flags) {
 		triangles.vertexStride = sizeof(Vertex);
 		triangles.indexType = VK_INDEX_TYPE_UINT32;
 		triangles.indexData.deviceAddress = indexAddress;
-		triangles.transformData.deviceAddress = transformAddress;
 		triangles.maxVertex = meshMinMax[mesh].second;
 
 		geometries[mesh] = VkAccelerationStructureGeometryKHR{
@@ -896,10 +966,11 @@ void RTSystem::createBLAccelereationStructures(uint32_t flags) {
 }
 
 void RTSystem::createTLAccelereationStructures(VkBuildAccelerationStructureFlagsKHR flags) {
-	//Produce instances
+	//Produce instances, the mesh transform lives in the instance so it can be animated
+	tlasFlags = flags;
 	tlasInstances.resize(blas.size());
 	for (int inst = 0; inst < tlasInstances.size(); inst++) {
-		tlasInstances[inst].transform = identityVKTransform();
+		tlasInstances[inst].transform = transformPoolsMesh[inst].toVulkan();
 		tlasInstances[inst].instanceCustomIndex = inst;
 
 		VkAccelerationStructureDeviceAddressInfoKHR addressInfo{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR };
@@ -912,48 +983,28 @@ void RTSystem::createTLAccelereationStructures(VkBuildAccelerationStructureFlags
 		tlasInstances[inst].instanceShaderBindingTableRecordOffset = 0;
 	}
 
-	//Create instance buffer
-	VkBuffer accBuffer;
-	VkDeviceMemory accMemory;
-	VkBuffer scratchBuffer;
-	VkDeviceMemory scratchMemory;
+	//Create instance buffers, one per frame in flight so the CPU can write the next frame's transforms
 	size_t accSize = sizeof(VkAccelerationStructureInstanceKHR) * tlasInstances.size();
-	createBuffer(accSize, VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
-		| VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
-		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT,
-		accBuffer,accMemory, true);
-
-	void* data;
-	vkMapMemory(device, accMemory, 0, accSize, 0, &data);
-	memcpy(data, tlasInstances.data(), accSize);
-	vkUnmapMemory(device, accMemory);
-
-	VkBufferDeviceAddressInfo bufferInfo{ VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO };
-	bufferInfo.pNext = nullptr;
-	bufferInfo.buffer = accBuffer;
-	VkDeviceAddress accBufferAdr = vkGetBufferDeviceAddress(device, &bufferInfo);
-	VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-	VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
-	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-	barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
-	vkCmdPipelineBarrier(commandBuffer,
-		VK_PIPELINE_STAGE_TRANSFER_BIT,
-		VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
-		0, 1, &barrier, 0, nullptr, 0, nullptr);
+	tlasInstanceBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+	tlasInstanceMemorys.resize(MAX_FRAMES_IN_FLIGHT);
+	tlasInstanceMapped.resize(MAX_FRAMES_IN_FLIGHT);
+	for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+		createBuffer(accSize, VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+			| VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			tlasInstanceBuffers[frame], tlasInstanceMemorys[frame], true);
+		vkMapMemory(device, tlasInstanceMemorys[frame], 0, accSize, 0, &tlasInstanceMapped[frame]);
+		memcpy(tlasInstanceMapped[frame], tlasInstances.data(), accSize);
+	}
 
-	//Preparing geometry
-	VkAccelerationStructureGeometryInstancesDataKHR instancesData
-	{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR };
-	instancesData.data.deviceAddress = accBufferAdr;
+	//Sizes
 	VkAccelerationStructureGeometryKHR geometry
 	{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR };
 	geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
-	geometry.geometry.instances = instancesData;
-
-	//Sizes
+	geometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
 	uint32_t instanceCount = tlasInstances.size();
 	VkAccelerationStructureBuildGeometryInfoKHR buildInfo{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR };
-	buildInfo.flags = flags;
+	buildInfo.flags = tlasFlags;
 	buildInfo.geometryCount = 1;
 	buildInfo.pGeometries = &geometry;
 	buildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
@@ -975,34 +1026,136 @@ void RTSystem::createTLAccelereationStructures(VkBuildAccelerationStructureFlags
 		tlas.buf, tlas.mem, true);
 	tlas.create(createInfo, device);
 
-	//Allocate scratch buffer
-	createBuffer(sizeInfo.buildScratchSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
-		| VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+	//Allocate scratch buffer, kept for refits and rebuilds
+	createBuffer(std::max(sizeInfo.buildScratchSize, sizeInfo.updateScratchSize), 
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
 		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
-		VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT, scratchBuffer, scratchMemory, 
+		VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT, tlasScratchBuffer, tlasScratchMemory, 
 		true);
-	VkBufferDeviceAddressInfo scratchInfo{
-		VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO
-	};
-	scratchInfo.pNext = nullptr;
-	scratchInfo.buffer = scratchBuffer;
-	VkDeviceAddress scratchAddress = vkGetBufferDeviceAddress(device, &scratchInfo);
-	
+	tlasScratchAddress = getBufferAddress(device, tlasScratchBuffer);
+
+	//Timestamps for frame, refit and rebuild cost
+	VkQueryPoolCreateInfo queryInfo{ VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+	queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	queryInfo.queryCount = 4 * MAX_FRAMES_IN_FLIGHT;
+	if (vkCreateQueryPool(device, &queryInfo, nullptr, &timestampQueryPool) != VK_SUCCESS) {
+		throw std::runtime_error("ERROR: Unable to create a query pool in RTSystem.");
+	}
+	frameQueryState = std::vector<bool>(MAX_FRAMES_IN_FLIGHT, false);
+	tlasQueryState = std::vector<int>(MAX_FRAMES_IN_FLIGHT, 0);
+
 	//Build tlas
-	buildInfo.srcAccelerationStructure = VK_NULL_HANDLE;
+	VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+	recordTLAccelereationStructureBuild(commandBuffer, false);
+	endSingleTimeCommands(commandBuffer);
+	tlasRefitsSinceBuild = 0;
+}
+
+void RTSystem::recordTLAccelereationStructureBuild(VkCommandBuffer commandBuffer, bool update) {
+	//Previous builds share the scratch buffer and previous traces read the tlas
+	VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR
+		| VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+	barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR
+		| VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+	vkCmdPipelineBarrier(commandBuffer,
+		VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR
+		| VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+		VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+		0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	//Preparing geometry
+	VkAccelerationStructureGeometryInstancesDataKHR instancesData
+	{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR };
+	instancesData.data.deviceAddress = getBufferAddress(device, tlasInstanceBuffers[currentFrame]);
+	VkAccelerationStructureGeometryKHR geometry
+	{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR };
+	geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+	geometry.geometry.instances = instancesData;
+
+	//Refit in place or build from scratch
+	VkAccelerationStructureBuildGeometryInfoKHR buildInfo{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR };
+	buildInfo.flags = tlasFlags;
+	buildInfo.geometryCount = 1;
+	buildInfo.pGeometries = &geometry;
+	buildInfo.mode = update ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR : VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+	buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+	buildInfo.srcAccelerationStructure = update ? tlas.acc : VK_NULL_HANDLE;
 	buildInfo.dstAccelerationStructure = tlas.acc;
-	buildInfo.scratchData.deviceAddress = scratchAddress;
+	buildInfo.scratchData.deviceAddress = tlasScratchAddress;
 	VkAccelerationStructureBuildRangeInfoKHR offsetInfo;
-	offsetInfo.primitiveCount = instanceCount;
+	offsetInfo.primitiveCount = tlasInstances.size();
 	offsetInfo.firstVertex = 0;
 	offsetInfo.primitiveOffset = 0;
 	offsetInfo.transformOffset = 0;
 	VkAccelerationStructureBuildRangeInfoKHR* offsetInfoP = &offsetInfo;
 	vkCmdBuildAccelerationStructuresKHR(commandBuffer, 1, &buildInfo, &offsetInfoP);
 
-	endSingleTimeCommands(commandBuffer);
-	//TODO: destroy scratch buffer
-	//TODO: destory acc buffer
+	//Make the tlas visible to the trace
+	barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+	barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+	vkCmdPipelineBarrier(commandBuffer,
+		VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+		VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+		0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void RTSystem::updateTLAccelereationStructure(VkCommandBuffer commandBuffer) {
+	if (!tlasDirty) return;
+	tlasDirty = false;
+
+	//Copy the new transforms into this frame's instance buffer
+	for (int inst = 0; inst < tlasInstances.size(); inst++) {
+		tlasInstances[inst].transform = transformPoolsMesh[inst].toVulkan();
+	}
+	memcpy(tlasInstanceMapped[currentFrame], tlasInstances.data(),
+		sizeof(VkAccelerationStructureInstanceKHR) * tlasInstances.size());
+
+	//Refits degrade the tree as instances move, so rebuild every so often
+	bool update = tlasRefitsSinceBuild < tlasRebuildInterval;
+	tlasRefitsSinceBuild = update ? tlasRefitsSinceBuild + 1 : 0;
+
+	vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampQueryPool, 4 * currentFrame + 2);
+	recordTLAccelereationStructureBuild(commandBuffer, update);
+	vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, timestampQueryPool, 4 * currentFrame + 3);
+	tlasQueryState[currentFrame] = update ? 1 : 2;
+}
+
+void RTSystem::readTimestamps(uint32_t frame) {
+	//Only called once the frame's fence has signaled
+	uint64_t timestamps[2];
+	if (frameQueryState.size() > 0 && frameQueryState[frame] && 
+		vkGetQueryPoolResults(device, timestampQueryPool, 4 * frame, 2, sizeof(timestamps), timestamps,
+		sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+		debugGpuTime += (float)(timestamps[1] - timestamps[0]) * timestampPeriod / 1000000.f;
+		debugGpuCount++;
+	}
+	if (tlasQueryState.size() > 0 && tlasQueryState[frame] != 0 &&
+		vkGetQueryPoolResults(device, timestampQueryPool, 4 * frame + 2, 2, sizeof(timestamps), timestamps,
+		sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+		float ms = (float)(timestamps[1] - timestamps[0]) * timestampPeriod / 1000000.f;
+		if (tlasQueryState[frame] == 1) {
+			debugRefitTime += ms;
+			debugRefitCount++;
+		}
+		else {
+			debugRebuildTime += ms;
+			debugRebuildCount++;
+		}
+	}
+	uint64_t denoiseTimestamps[MAX_DENOISE_ITERATIONS + 2];
+	if (denoiseQueryState.size() > 0 && denoiseQueryState[frame] != 0 &&
+		vkGetQueryPoolResults(device, denoiseQueryPool, (MAX_DENOISE_ITERATIONS + 2) * frame,
+		denoiseQueryState[frame] + 1, sizeof(denoiseTimestamps), denoiseTimestamps,
+		sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+		for (int pass = 0; pass < denoiseQueryState[frame]; pass++) {
+			debugDenoiseTimes[pass] += (float)(denoiseTimestamps[pass + 1] - denoiseTimestamps[pass]) * timestampPeriod / 1000000.f;
+		}
+		debugDenoiseCount++;
+	}
+	if (frameQueryState.size() > 0) frameQueryState[frame] = false;
+	if (tlasQueryState.size() > 0) tlasQueryState[frame] = 0;
+	if (denoiseQueryState.size() > 0) denoiseQueryState[frame] = 0;
 }
 
 void RTSystem::createAccelereationStructures() {
@@ -1143,7 +1296,7 @@ void RTSystem::createRenderPasses() {
 
 void RTSystem::createDescriptorSetLayout() {
 
-	descriptorSetLayouts.resize(2);
+	descriptorSetLayouts.resize(3);
 
 	VkDescriptorSetLayoutBinding tlasBinding{};
 	tlasBinding.binding = 0;
@@ -1213,13 +1366,27 @@ void RTSystem::createDescriptorSetLayout() {
 	lightBinding.stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
 
 
+	VkDescriptorSetLayoutBinding accumImageBinding{};
+	accumImageBinding.binding = 10;
+	accumImageBinding.descriptorCount = 1;
+	accumImageBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+	accumImageBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
+	accumImageBinding.pImmutableSamplers = nullptr;
+
+	VkDescriptorSetLayoutBinding normalDepthBinding = accumImageBinding;
+	normalDepthBinding.binding = 11;
+	VkDescriptorSetLayoutBinding albedoBinding = accumImageBinding;
+	albedoBinding.binding = 12;
+
+
 	VkDescriptorSetLayoutBinding bindings[] = {tlasBinding, outImageBinding, 
 		cameraBinding, persBinding, verticesBit, indicesBit, materialBinding, 
-		textureBinding, lightTransformBinding,lightBinding };
+		textureBinding, lightTransformBinding,lightBinding, accumImageBinding,
+		normalDepthBinding, albedoBinding };
 
 	VkDescriptorSetLayoutCreateInfo layoutInfo{};
 	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-	layoutInfo.bindingCount = 10;
+	layoutInfo.bindingCount = 13;
 	layoutInfo.pBindings = bindings;
 	if (vkCreateDescriptorSetLayout(
 		device, &layoutInfo, nullptr, &descriptorSetLayouts[0]) != VK_SUCCESS) {
@@ -1243,6 +1410,25 @@ void RTSystem::createDescriptorSetLayout() {
 		throw std::runtime_error("ERROR: Failed to create a descriptor set layout in Vulkan System.");
 	}
 
+	//Denoise: color in, color out, normal and depth, albedo
+	VkDescriptorSetLayoutBinding denoiseBindings[4];
+	for (int binding = 0; binding < 4; binding++) {
+		denoiseBindings[binding] = {};
+		denoiseBindings[binding].binding = binding;
+		denoiseBindings[binding].descriptorCount = 1;
+		denoiseBindings[binding].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+		denoiseBindings[binding].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+		denoiseBindings[binding].pImmutableSamplers = nullptr;
+	}
+	VkDescriptorSetLayoutCreateInfo layoutInfoDenoise{};
+	layoutInfoDenoise.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfoDenoise.bindingCount = 4;
+	layoutInfoDenoise.pBindings = denoiseBindings;
+	if (vkCreateDescriptorSetLayout(
+		device, &layoutInfoDenoise, nullptr, &descriptorSetLayouts[2]) != VK_SUCCESS) {
+		throw std::runtime_error("ERROR: Failed to create a descriptor set layout in RTSystem.");
+	}
+
 
 }
 
@@ -1462,6 +1648,45 @@ void RTSystem::createGraphicsPipelines() {
 
 }
 
+void RTSystem::createDenoisePipeline() {
+	VkPushConstantRange pushConstant{ VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstantDenoise) };
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{ VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &descriptorSetLayouts[2];
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &pushConstant;
+	if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayoutDenoise) != VK_SUCCESS) {
+		throw std::runtime_error("ERROR: Unable to create denoise pipeline layout in RTSystem.");
+	}
+
+	//Timestamps before the first pass and after every pass, including the odd count copy
+	VkQueryPoolCreateInfo queryInfo{ VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+	queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	queryInfo.queryCount = (MAX_DENOISE_ITERATIONS + 2) * MAX_FRAMES_IN_FLIGHT;
+	if (vkCreateQueryPool(device, &queryInfo, nullptr, &denoiseQueryPool) != VK_SUCCESS) {
+		throw std::runtime_error("ERROR: Unable to create a query pool in RTSystem.");
+	}
+	denoiseQueryState = std::vector<int>(MAX_FRAMES_IN_FLIGHT, 0);
+	denoiseIterations = std::clamp(denoiseIterations, 0, (int)MAX_DENOISE_ITERATIONS);
+	debugDenoiseTimes = std::vector<float>(MAX_DENOISE_ITERATIONS + 1, 0);
+	if (denoiseIterations == 0) return;
+
+	auto computeCode = readFile(shaderDir + "/denoise.spv");
+	VkShaderModule computeShaderModule = createShaderModule(computeCode);
+	VkPipelineShaderStageCreateInfo stage{ VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO };
+	stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	stage.module = computeShaderModule;
+	stage.pName = "main";
+
+	VkComputePipelineCreateInfo pipelineInfo{ VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+	pipelineInfo.stage = stage;
+	pipelineInfo.layout = pipelineLayoutDenoise;
+	if (vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &computePipelineDenoise) != VK_SUCCESS) {
+		throw std::runtime_error("ERROR: Unable to create denoise pipeline in RTSystem.");
+	}
+	vkDestroyShaderModule(device, computeShaderModule, nullptr);
+}
+
 
 
 VkShaderModule RTSystem::createShaderModule(const std::vector<char>& code) {
@@ -1696,40 +1921,6 @@ void RTSystem::createVertexBuffer(bool realloc) {
 	}
 }
 
-void RTSystem::createTransformBuffers(bool realloc) {
-
-	int stagingBits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-	int usageBits = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
-		VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR;
-	int propertyBits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-	meshTransformBuffers.resize(transformPoolsMesh.size());
-	meshTransformMemorys.resize(transformPoolsMesh.size());
-	for (int mesh = 0; mesh < transformPoolsMesh.size(); mesh++) {
-		//Convert transform to vulkan format
-		VkTransformMatrixKHR transform = transformPoolsMesh[mesh].toVulkan();
-
-		//Create temp staging buffer
-		VkDeviceSize bufferSize = sizeof(VkTransformMatrixKHR);
-		VkBuffer stagingBuffer{};
-		VkDeviceMemory stagingBufferMemory{};
-		createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, stagingBits,
-			stagingBuffer, stagingBufferMemory, true);
-
-		//Move vertex data to GPU
-		void* data;
-		vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-		memcpy(data, &transform, (size_t)bufferSize);
-		vkUnmapMemory(device, stagingBufferMemory);
-
-		//Create proper vertex buffer
-		createBuffer(bufferSize, usageBits, propertyBits,
-			meshTransformBuffers[mesh], meshTransformMemorys[mesh], realloc);
-		copyBuffer(stagingBuffer, meshTransformBuffers[mesh], bufferSize);
-		vkDestroyBuffer(device, stagingBuffer, nullptr);
-		vkFreeMemory(device, stagingBufferMemory, nullptr);
-	}
-}
-
 mat44<float> RTSystem::getCameraSpace(DrawCamera camera, float_3 useMoveVec, float_3 useDirVec) {
 	useDirVec = useDirVec.normalize() * -1;
 	float_3 up = float_3(0, 0, 1);
@@ -1843,11 +2034,11 @@ void RTSystem::transitionImageLayout(VkImage image, VkFormat format,
 }
 
 
-void RTSystem::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height, int level, int face) {
+void RTSystem::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height, int level, int face, VkDeviceSize offset) {
 	VkCommandBuffer commandBuffer = beginSingleTimeCommands();
 
 	VkBufferImageCopy region{};
-	region.bufferOffset = 0;
+	region.bufferOffset = offset;
 	region.bufferImageHeight = 0;
 	region.bufferRowLength = 0;
 	region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -1942,44 +2133,47 @@ void RTSystem::generateMipmaps(VkImage image, int32_t x, int32_t y, uint32_t mip
 
 void RTSystem::createEnvironmentImage(Texture env, VkImage& image,
 	VkDeviceMemory& memory, VkImageView& imageView, VkSampler& sampler) {
-
-	VkDeviceSize imageSize = 4 * env.x * env.realY;
-	VkDeviceSize layerSize = 4 * env.x * env.y;
+	VkFormat format = chooseEnvironmentFormat(physicalDevice);
 	std::array<VkBuffer, 6> stageBuffer;
 	std::array<VkDeviceMemory, 6> stageBufferMemory;
+	std::array<std::vector<VkDeviceSize>, 6> levelOffsets;
 	for (int face = 0; face < 6; face++) {
-		createBuffer(imageSize,
+		std::vector<unsigned char> encoded = encodeEnvironmentFace(env, face, format, levelOffsets[face]);
+		VkDeviceSize faceSize = encoded.size();
+		createBuffer(faceSize,
 			VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
 			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stageBuffer[face], stageBufferMemory[face], true);
 		void* data;
-		vkMapMemory(device, stageBufferMemory[face], 0, layerSize, 0, &data);
-		memcpy(data, (void*)(&env.data[face * static_cast<size_t>(layerSize)]), static_cast<size_t>(layerSize));
+		vkMapMemory(device, stageBufferMemory[face], 0, faceSize, 0, &data);
+		memcpy(data, encoded.data(), static_cast<size_t>(faceSize));
 		vkUnmapMemory(device, stageBufferMemory[face]);
 	}
 	if (env.doFree) {
 		stbi_image_free((void*)env.data);
 	}
 
-	int usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT |
-		VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	//Mips come from the CPU since shared exponent formats are not blit destinations
+	int usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
 	int flags = VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT;
-	createImage(env.x, env.y, VK_FORMAT_R8G8B8A8_SRGB,
+	createImage(env.x, env.y, format,
 		VK_IMAGE_TILING_OPTIMAL, usage, flags,
 		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, memory, 6, env.mipLevels);
-	transitionImageLayout(image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 6, env.mipLevels);
+	transitionImageLayout(image, format, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 6, env.mipLevels);
 	for (int face = 0; face < 6; face++) {
-		copyBufferToImage(stageBuffer[face], image, static_cast<uint32_t>(env.x), static_cast<uint32_t>(env.y), 0, face);
-		generateMipmaps(image, env.x, env.y, env.mipLevels, face);
+		for (int mipLevel = 0; mipLevel < env.mipLevels; mipLevel++) {
+			copyBufferToImage(stageBuffer[face], image, static_cast<uint32_t>(std::max(env.x >> mipLevel, 1)),
+				static_cast<uint32_t>(std::max(env.y >> mipLevel, 1)), mipLevel, face, levelOffsets[face][mipLevel]);
+		}
 		vkDestroyBuffer(device, stageBuffer[face], nullptr);
 		vkFreeMemory(device, stageBufferMemory[face], nullptr);
 	}
-
+	transitionImageLayout(image, format, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 6, env.mipLevels);
 
 	VkImageViewCreateInfo viewInfo{};
 	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
 	viewInfo.image = image;
 	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_CUBE;
-	viewInfo.format = VK_FORMAT_R8G8B8A8_SRGB;
+	viewInfo.format = format;
 	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
 	viewInfo.subresourceRange.baseArrayLayer = 0;
 	viewInfo.subresourceRange.baseMipLevel = 0;
@@ -2018,7 +2212,16 @@ void RTSystem::createEnvironmentImage(Texture env, VkImage& image,
 
 void RTSystem::createTextureImage(Texture tex, VkImage& image,
 	VkDeviceMemory& memory, VkImageView& imageView, VkSampler& sampler) {
-	VkDeviceSize imageSize = 4 * tex.x * tex.realY;
+	//Devices without BC support load the png the ktx2 was encoded from instead
+	if (tex.compressedFormat != VK_FORMAT_UNDEFINED && (!compressedTextures || !formatFilterable(physicalDevice, tex.compressedFormat))) {
+		if (tex.doFree) {
+			stbi_image_free((void*)tex.data);
+		}
+		tex = Texture::parseTexture(tex.path.substr(0, tex.path.size() - 5) + ".png", false, tex.semantic);
+	}
+	bool compressed = tex.compressedFormat != VK_FORMAT_UNDEFINED;
+	VkFormat format = textureFormat(tex);
+	VkDeviceSize imageSize = compressed ? tex.dataSize : (VkDeviceSize)tex.channels * tex.x * tex.realY;
 	VkBuffer stageBuffer;
 	VkDeviceMemory stageBufferMemory;
 	createBuffer(imageSize,
@@ -2034,12 +2237,22 @@ void RTSystem::createTextureImage(Texture tex, VkImage& image,
 
 	int usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT |
 		VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
-	createImage(tex.x, tex.realY, VK_FORMAT_R8G8B8A8_SRGB,
+	createImage(tex.x, tex.realY, format,
 		VK_IMAGE_TILING_OPTIMAL, usage, 0,
 		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, memory, 1, tex.mipLevels);
-	transitionImageLayout(image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, tex.mipLevels);
-	copyBufferToImage(stageBuffer, image, static_cast<uint32_t>(tex.x), static_cast<uint32_t>(tex.realY));
-	generateMipmaps(image, tex.x, tex.realY, tex.mipLevels);
+	transitionImageLayout(image, format, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, tex.mipLevels);
+	if (compressed) {
+		//Mips were encoded offline, block formats cannot be blitted anyway
+		for (int mipLevel = 0; mipLevel < tex.mipLevels; mipLevel++) {
+			copyBufferToImage(stageBuffer, image, static_cast<uint32_t>(std::max(tex.x >> mipLevel, 1)),
+				static_cast<uint32_t>(std::max(tex.realY >> mipLevel, 1)), mipLevel, 0, tex.levelOffsets[mipLevel]);
+		}
+		transitionImageLayout(image, format, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 1, tex.mipLevels);
+	}
+	else {
+		copyBufferToImage(stageBuffer, image, static_cast<uint32_t>(tex.x), static_cast<uint32_t>(tex.realY));
+		generateMipmaps(image, tex.x, tex.realY, tex.mipLevels);
+	}
 
 	vkDestroyBuffer(device, stageBuffer, nullptr);
 	vkFreeMemory(device, stageBufferMemory, nullptr);
@@ -2048,7 +2261,7 @@ void RTSystem::createTextureImage(Texture tex, VkImage& image,
 	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
 	viewInfo.image = image;
 	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-	viewInfo.format = VK_FORMAT_R8G8B8A8_SRGB;
+	viewInfo.format = format;
 	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
 	viewInfo.subresourceRange.baseArrayLayer = 0;
 	viewInfo.subresourceRange.baseMipLevel = 0;
@@ -2266,6 +2479,18 @@ void RTSystem::createDescriptorPool() {
 		!= VK_SUCCESS) {
 		throw std::runtime_error("ERROR: Unable to create a descriptor pool in Vulkan System.");
 	}
+	VkDescriptorPoolSize poolSizeDenoise{};
+	poolSizeDenoise.type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+	poolSizeDenoise.descriptorCount = 8 * MAX_FRAMES_IN_FLIGHT;
+	VkDescriptorPoolCreateInfo poolInfoDenoise{};
+	poolInfoDenoise.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfoDenoise.poolSizeCount = 1;
+	poolInfoDenoise.pPoolSizes = &poolSizeDenoise;
+	poolInfoDenoise.maxSets = 2 * MAX_FRAMES_IN_FLIGHT;
+	if (vkCreateDescriptorPool(device, &poolInfoDenoise, nullptr, &descriptorPoolDenoise)
+		!= VK_SUCCESS) {
+		throw std::runtime_error("ERROR: Unable to create a descriptor pool in RTSystem.");
+	}
 }
 
 
@@ -2307,6 +2532,9 @@ void RTSystem::createDescriptorSets() {
 		tlasDescriptor.accelerationStructureCount = 1;
 		tlasDescriptor.pAccelerationStructures = &tlas.acc;
 		VkDescriptorImageInfo imageDescriptor{ {}, rtImageViews[frame], VK_IMAGE_LAYOUT_GENERAL};
+		VkDescriptorImageInfo accumDescriptor{ {}, accumImageView, VK_IMAGE_LAYOUT_GENERAL };
+		VkDescriptorImageInfo normalDepthDescriptor{ {}, normalDepthImageView, VK_IMAGE_LAYOUT_GENERAL };
+		VkDescriptorImageInfo albedoDescriptor{ {}, albedoImageView, VK_IMAGE_LAYOUT_GENERAL };
 
 		VkDescriptorBufferInfo bufferInfoCameras{};
 		bufferInfoCameras.buffer = uniformBuffersCamera[frame];
@@ -2343,7 +2571,7 @@ void RTSystem::createDescriptorSets() {
 		bufferInfoLights.offset = 0;
 		bufferInfoLights.range = sizeof(DrawLight) * lightPool.size();
 
-		std::vector<VkWriteDescriptorSet> writeDescriptorSets = std::vector<VkWriteDescriptorSet>(9 + rawTextures.size());
+		std::vector<VkWriteDescriptorSet> writeDescriptorSets = std::vector<VkWriteDescriptorSet>(12 + rawTextures.size());
 		writeDescriptorSets[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 		writeDescriptorSets[0].dstSet = descriptorSetsHDR[frame];
 		writeDescriptorSets[0].pNext = &tlasDescriptor;
@@ -2407,9 +2635,30 @@ void RTSystem::createDescriptorSets() {
 		writeDescriptorSets[8].dstBinding = 9;
 		writeDescriptorSets[8].pBufferInfo = &bufferInfoLights;
 		writeDescriptorSets[8].dstArrayElement = 0;
+		writeDescriptorSets[9].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writeDescriptorSets[9].dstSet = descriptorSetsHDR[frame];
+		writeDescriptorSets[9].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+		writeDescriptorSets[9].descriptorCount = 1;
+		writeDescriptorSets[9].dstBinding = 10;
+		writeDescriptorSets[9].pImageInfo = &accumDescriptor;
+		writeDescriptorSets[9].dstArrayElement = 0;
+		writeDescriptorSets[10].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writeDescriptorSets[10].dstSet = descriptorSetsHDR[frame];
+		writeDescriptorSets[10].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+		writeDescriptorSets[10].descriptorCount = 1;
+		writeDescriptorSets[10].dstBinding = 11;
+		writeDescriptorSets[10].pImageInfo = &normalDepthDescriptor;
+		writeDescriptorSets[10].dstArrayElement = 0;
+		writeDescriptorSets[11].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writeDescriptorSets[11].dstSet = descriptorSetsHDR[frame];
+		writeDescriptorSets[11].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+		writeDescriptorSets[11].descriptorCount = 1;
+		writeDescriptorSets[11].dstBinding = 12;
+		writeDescriptorSets[11].pImageInfo = &albedoDescriptor;
+		writeDescriptorSets[11].dstArrayElement = 0;
 		std::vector<VkDescriptorImageInfo> imageInfosTex = std::vector<VkDescriptorImageInfo>(rawTextures.size());
 		for (size_t tex = 0; tex < rawTextures.size(); tex++) {
-			size_t descSet = tex + 9;
+			size_t descSet = tex + 12;
 			imageInfosTex[tex].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 			imageInfosTex[tex].imageView = textureImageViews[tex];
 			imageInfosTex[tex].sampler = textureSamplers[tex];
@@ -2442,6 +2691,42 @@ void RTSystem::createDescriptorSets() {
 		writeDescriptorSet.dstArrayElement = 0;
 		vkUpdateDescriptorSets(device, 1, &writeDescriptorSet, 0, nullptr);
 	}
+
+	std::vector<VkDescriptorSetLayout> layoutsDenoise(2 * MAX_FRAMES_IN_FLIGHT, descriptorSetLayouts[2]);
+	VkDescriptorSetAllocateInfo allocateInfoDenoise{};
+	allocateInfoDenoise.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocateInfoDenoise.descriptorPool = descriptorPoolDenoise;
+	allocateInfoDenoise.descriptorSetCount = 2 * MAX_FRAMES_IN_FLIGHT;
+	allocateInfoDenoise.pSetLayouts = layoutsDenoise.data();
+	descriptorSetsDenoise.resize(2 * MAX_FRAMES_IN_FLIGHT);
+	if (vkAllocateDescriptorSets(device, &allocateInfoDenoise, descriptorSetsDenoise.data())
+		!= VK_SUCCESS) {
+		throw std::runtime_error("ERROR: Unable to create descriptor sets in RTSystem. Denoise.");
+	}
+	for (size_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+		VkDescriptorImageInfo frameDescriptor{ {}, rtImageViews[frame], VK_IMAGE_LAYOUT_GENERAL };
+		VkDescriptorImageInfo pingDescriptor{ {}, denoiseImageView, VK_IMAGE_LAYOUT_GENERAL };
+		VkDescriptorImageInfo normalDepthDescriptor{ {}, normalDepthImageView, VK_IMAGE_LAYOUT_GENERAL };
+		VkDescriptorImageInfo albedoDescriptor{ {}, albedoImageView, VK_IMAGE_LAYOUT_GENERAL };
+		VkDescriptorImageInfo* imageInfos[2][4] = {
+			{ &frameDescriptor, &pingDescriptor, &normalDepthDescriptor, &albedoDescriptor },
+			{ &pingDescriptor, &frameDescriptor, &normalDepthDescriptor, &albedoDescriptor } };
+
+		VkWriteDescriptorSet writeDescriptorSets[8]{};
+		for (int set = 0; set < 2; set++) {
+			for (int binding = 0; binding < 4; binding++) {
+				VkWriteDescriptorSet& write = writeDescriptorSets[4 * set + binding];
+				write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+				write.dstSet = descriptorSetsDenoise[2 * frame + set];
+				write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+				write.descriptorCount = 1;
+				write.dstBinding = binding;
+				write.pImageInfo = imageInfos[set][binding];
+				write.dstArrayElement = 0;
+			}
+		}
+		vkUpdateDescriptorSets(device, 8, writeDescriptorSets, 0, nullptr);
+	}
 }
 
 void RTSystem::createCommands() {
@@ -2503,40 +2788,184 @@ void RTSystem::createImage(uint32_t width, uint32_t height, VkFormat format,
 }
 
 void RTSystem::raytrace(VkCommandBuffer commandBuffer) {
-	VkCommandBufferBeginInfo beginInfo{};
-	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
-		throw std::runtime_error("ERROR: Unable to begin recording a command buffer in RTSystem.");
-	}
-
-	
+	updateTLAccelereationStructure(commandBuffer);
+
+	//Take this frame's image back from the composite
+	VkImageMemoryBarrier imageBarrier{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+	imageBarrier.oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	imageBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+	imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	imageBarrier.image = rtImages[currentFrame];
+	imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	imageBarrier.subresourceRange.baseMipLevel = 0;
+	imageBarrier.subresourceRange.levelCount = 1;
+	imageBarrier.subresourceRange.baseArrayLayer = 0;
+	imageBarrier.subresourceRange.layerCount = 1;
+	imageBarrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	imageBarrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(commandBuffer,
+		VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+		VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+		0, 0, nullptr, 0, nullptr, 1, &imageBarrier);
+
+	//Converged images are left as is, so the GPU idles
+	if (!accumulationConverged) {
+		if (accumulate || denoiseIterations > 0) {
+			//Previous trace and denoise must finish with the shared images
+			VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+			barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+			barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+			vkCmdPipelineBarrier(commandBuffer,
+				VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+				VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+				0, 1, &barrier, 0, nullptr, 0, nullptr);
+		}
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, graphicsPipelineRT);
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipelineLayoutRT, 0,
+			1, &descriptorSetsHDR[currentFrame], 0, nullptr);
+		vkCmdPushConstants(commandBuffer, pipelineLayoutRT,
+			VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_MISS_BIT_KHR,
+			0, sizeof(PushConstantRay), &pushConstantRT);
+		vkCmdTraceRaysKHR(commandBuffer, &rgenRegion, &missRegion, &hitRegion, &callRegion, swapChainExtent.width, swapChainExtent.height, 1);
+		if (denoiseIterations > 0) denoise(commandBuffer);
+	}
+
+	//Hand the image to the composite
+	imageBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+	imageBarrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	imageBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	imageBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer,
+		VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+		0, 0, nullptr, 0, nullptr, 1, &imageBarrier);
+}
 
-	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, graphicsPipelineRT);
-	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipelineLayoutRT, 0,
-		1, &descriptorSetsHDR[currentFrame], 0, nullptr);
-	vkCmdPushConstants(commandBuffer, pipelineLayoutRT,
-		VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_MISS_BIT_KHR,
-		0, sizeof(PushConstantRay), &pushConstantRT);
-	vkCmdTraceRaysKHR(commandBuffer, &rgenRegion, &missRegion, &hitRegion, &callRegion, swapChainExtent.width, swapChainExtent.height, 1);
+void RTSystem::denoise(VkCommandBuffer commandBuffer) {
+	//Filter reads the traced color and features
+	VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(commandBuffer,
+		VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		0, 1, &barrier, 0, nullptr, 0, nullptr);
 
-	if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
-		throw std::runtime_error("ERROR: Unable to record command buffer in RTSystem.");
+	//Keep the filter's inputs for the CPU reference
+	bool check = denoiseCheck && denoiseCheckState == 0;
+	if (check) {
+		VkDeviceSize sliceSize = (VkDeviceSize)swapChainExtent.width * swapChainExtent.height * 4 * sizeof(float);
+		createBuffer(4 * sliceSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			denoiseCheckBuffer, denoiseCheckMemory, true);
+		copyForDenoiseCheck(commandBuffer, rtImages[currentFrame], 0);
+		copyForDenoiseCheck(commandBuffer, normalDepthImage, 1);
+		copyForDenoiseCheck(commandBuffer, albedoImage, 2);
+	}
+
+	//Ping-pong between the frame image and the denoise image, ending on the frame image
+	int passes = denoiseIterations + denoiseIterations % 2;
+	uint32_t queryBase = (MAX_DENOISE_ITERATIONS + 2) * currentFrame;
+	vkCmdResetQueryPool(commandBuffer, denoiseQueryPool, queryBase, MAX_DENOISE_ITERATIONS + 2);
+	vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, denoiseQueryPool, queryBase);
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computePipelineDenoise);
+	for (int pass = 0; pass < passes; pass++) {
+		PushConstantDenoise pushConstant;
+		pushConstant.stepSize = pass < denoiseIterations ? 1 << pass : 0;
+		//Wider steps see smoother input, so tighten the color edge stop
+		pushConstant.colorPhi = colorPhi / (float)(1 << pass);
+		pushConstant.normalPhi = normalPhi;
+		pushConstant.depthPhi = depthPhi;
+		pushConstant.albedoPhi = albedoPhi;
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayoutDenoise, 0,
+			1, &descriptorSetsDenoise[2 * currentFrame + pass % 2], 0, nullptr);
+		vkCmdPushConstants(commandBuffer, pipelineLayoutDenoise, VK_SHADER_STAGE_COMPUTE_BIT,
+			0, sizeof(PushConstantDenoise), &pushConstant);
+		vkCmdDispatch(commandBuffer, (swapChainExtent.width + 7) / 8, (swapChainExtent.height + 7) / 8, 1);
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, denoiseQueryPool, queryBase + pass + 1);
+
+		barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+		vkCmdPipelineBarrier(commandBuffer,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			0, 1, &barrier, 0, nullptr, 0, nullptr);
+	}
+	denoiseQueryState[currentFrame] = passes;
+	if (check) {
+		copyForDenoiseCheck(commandBuffer, rtImages[currentFrame], 3);
+		denoiseCheckState = 1;
 	}
+}
 
+//Copies a frame sized image in the general layout into one slice of the check buffer
+void RTSystem::copyForDenoiseCheck(VkCommandBuffer commandBuffer, VkImage image, int slice) {
+	VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer,
+		VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		0, 1, &barrier, 0, nullptr, 0, nullptr);
 
+	VkBufferImageCopy region{};
+	region.bufferOffset = (VkDeviceSize)slice * swapChainExtent.width * swapChainExtent.height * 4 * sizeof(float);
+	region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	region.imageSubresource.mipLevel = 0;
+	region.imageSubresource.baseArrayLayer = 0;
+	region.imageSubresource.layerCount = 1;
+	region.imageExtent = { swapChainExtent.width, swapChainExtent.height, 1 };
+	vkCmdCopyImageToBuffer(commandBuffer, image, VK_IMAGE_LAYOUT_GENERAL, denoiseCheckBuffer, 1, &region);
 
-	VkSubmitInfo submitInfo{};
-	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submitInfo.waitSemaphoreCount = 0;
-	submitInfo.signalSemaphoreCount = 0;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = commandBuffers.data() + currentFrame;
+	//Passes and the composite transition wait on the copy, the host reads it after the frame
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_HOST_BIT,
+		0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
 
-	if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
-		throw std::runtime_error("failed to submit draw command buffer!");
-	}
+//Runs atrousDenoise on the same input the shader saw and reports how far apart the two results are
+void RTSystem::compareDenoise() {
 	vkQueueWaitIdle(graphicsQueue);
-
+	int width = swapChainExtent.width;
+	int height = swapChainExtent.height;
+	size_t floats = (size_t)width * height * 4;
+	float* data;
+	vkMapMemory(device, denoiseCheckMemory, 0, 4 * floats * sizeof(float), 0, (void**)&data);
+	std::vector<float> color(data, data + floats);
+	std::vector<float> normalDepth(data + floats, data + 2 * floats);
+	std::vector<float> albedo(data + 2 * floats, data + 3 * floats);
+	std::vector<float> gpuColor(data + 3 * floats, data + 4 * floats);
+	vkUnmapMemory(device, denoiseCheckMemory);
+	vkDestroyBuffer(device, denoiseCheckBuffer, nullptr);
+	vkFreeMemory(device, denoiseCheckMemory, nullptr);
+	denoiseCheckBuffer = VK_NULL_HANDLE;
+	denoiseCheckMemory = VK_NULL_HANDLE;
+	denoiseCheckState = 2;
+
+	DenoisePhis phis;
+	phis.color = colorPhi;
+	phis.normal = normalPhi;
+	phis.depth = depthPhi;
+	phis.albedo = albedoPhi;
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	std::vector<float> cpuColor = atrousDenoise(color, normalDepth, albedo, width, height, denoiseIterations, phis);
+	std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+
+	double maxDifference = 0;
+	double sumDifference = 0;
+	for (size_t pixel = 0; pixel < floats; pixel += 4) {
+		for (int c = 0; c < 3; c++) {
+			double difference = std::abs(cpuColor[pixel + c] - gpuColor[pixel + c]);
+			maxDifference = std::max(maxDifference, difference);
+			sumDifference += difference;
+		}
+	}
+	std::cout << "MEASURE denoise check (" << width << "x" << height << ", " << denoiseIterations << " iterations): " <<
+		"max difference " << maxDifference << ", mean difference " << sumDifference / (3.0 * width * height) <<
+		", CPU reference " << std::chrono::duration<float, std::milli>(end - start).count() << "ms" << std::endl;
 }
 
 void RTSystem::recordCommandBufferMain(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
@@ -2545,6 +2974,11 @@ void RTSystem::recordCommandBufferMain(VkCommandBuffer commandBuffer, uint32_t i
 	if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
 		throw std::runtime_error("ERROR: Unable to begin recording a command buffer in RTSystem.");
 	}
+	vkCmdResetQueryPool(commandBuffer, timestampQueryPool, 4 * currentFrame, 4);
+	vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampQueryPool, 4 * currentFrame);
+
+	//Trace into this frame's storage image
+	raytrace(commandBuffer);
 
 	//Begin preparing command buffer render pass
 	VkRenderPassBeginInfo renderPassInfo{};
@@ -2590,6 +3024,8 @@ void RTSystem::recordCommandBufferMain(VkCommandBuffer commandBuffer, uint32_t i
 
 	//END render pass
 	vkCmdEndRenderPass(commandBuffer);
+	vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPool, 4 * currentFrame + 1);
+	frameQueryState[currentFrame] = true;
 
 	if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
 		throw std::runtime_error("ERROR: Unable to record command buffer in RTSystem.");
@@ -2605,40 +3041,44 @@ void RTSystem::updateUniformBuffers(uint32_t frame) {
 	//Guided by glm implementation of lookAt
 	float_3 useMoveVec = movementMode == MOVE_DEBUG ? debugMoveVec : moveVec;
 	float_3 useDirVec = movementMode == MOVE_DEBUG ? debugDirVec : dirVec;
-	mat44<float> normLocal = getCameraSpace(cameras[currentCamera], useMoveVec, useDirVec);
-	glm::mat4x4 glmLocal;
-	for (int i = 0; i < 4; i++) {
-		for (int j = 0; j < 4; j++) {
-			glmLocal[i][j] = normLocal.data[i][j];
-		}
-	}
-	glmLocal = glm::inverse(glmLocal);
-	mat44<float> local;
-	for (int i = 0; i < 4; i++) {
-		for (int j = 0; j < 4; j++) {
-			local.data[i][j] = glmLocal[i][j];
-		}
-	}
+	mat44<float> local = mat44<float>::affineInverse(
+		getCameraSpace(cameras[currentCamera], useMoveVec, useDirVec));
 
 
 	float_3 cameraPos = useMoveVec + cameras[currentCamera].forAnimate.translate;
+	if (memcmp(&local, &lastCameraSpace, sizeof(mat44<float>)) != 0 ||
+		pushConstantRT.numLights != (int)lightPool.size()) {
+		accumulationReset = true;
+	}
+	lastCameraSpace = local;
 	pushConstantRT.numLights = (int)lightPool.size();
 	pushConstantRT.camPosX = cameraPos.x;
 	pushConstantRT.camPosY = cameraPos.y;
 	pushConstantRT.camPosZ = cameraPos.z;
-	pushConstantRT.frame = frame;
+	pushConstantRT.frame = this->frame; //Seeds the sampler, must keep changing for accumulation
 	pushConstantRT.doReflect = doReflect;
 	pushConstantRT.numSamples = numSamples;
 	pushConstantRT.numBounces = numBounces;
-	frame++;
+	this->frame++;
+
+	//Accumulation restarts on any change, after the target the shader only copies 
+	//the result into each frame's image and then tracing stops
+	if (accumulationReset) {
+		accumulatedFrames = 0;
+		accumulationReset = false;
+	}
+	int targetFrames = targetSamples > 0 ? (targetSamples + numSamples - 1) / numSamples : 0;
+	pushConstantRT.accumFrame = accumulate ? accumulatedFrames : -1;
+	pushConstantRT.accumTarget = targetFrames;
+	accumulationConverged = accumulate && targetFrames > 0 &&
+		accumulatedFrames >= targetFrames + MAX_FRAMES_IN_FLIGHT;
+	if (accumulate && !accumulationConverged) accumulatedFrames++;
 	
-	for (size_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
-		mat44<float> test = local*normLocal;
-		memcpy(uniformBuffersMappedCamera[frame], &(local),
-			sizeof(mat44<float>));
-		memcpy(uniformBuffersMappedProj[frame], &(cameras[currentCamera].invPerspective),
-			sizeof(mat44<float>));
-	}
+	//Only this frame's buffers, the other frame may still be in flight
+	memcpy(uniformBuffersMappedCamera[frame], &(local),
+		sizeof(mat44<float>));
+	memcpy(uniformBuffersMappedProj[frame], &(cameras[currentCamera].invPerspective),
+		sizeof(mat44<float>));
 	
 }
 
@@ -2649,6 +3089,7 @@ void RTSystem::drawFrame() {
 	uint32_t imageIndex;
 	if (renderToWindow) {
 		vkWaitForFences(device, 1, inFlightFences.data() + currentFrame, VK_TRUE, UINT64_MAX);
+		if (verbose) readTimestamps(currentFrame);
 
 		if (!*activeP) { return; }
 		result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
@@ -2671,25 +3112,12 @@ void RTSystem::drawFrame() {
 
 
 
-	updateUniformBuffers(currentFrame);
-
-
-	vkResetCommandBuffer(commandBuffers[currentFrame], 0);
-
-
+	//CPU time excludes waiting on the GPU
 	std::chrono::high_resolution_clock::time_point start =
 		std::chrono::high_resolution_clock::now();
-	raytrace(commandBuffers[currentFrame]);
-	if (verbose) {
-		std::chrono::high_resolution_clock::time_point end =
-			std::chrono::high_resolution_clock::now();
-		debugRayTime += std::chrono::duration_cast<std::chrono::milliseconds>(
-			end - start).count();
-	}
-
 
+	updateUniformBuffers(currentFrame);
 	vkResetCommandBuffer(commandBuffers[currentFrame], 0);
-	transitionImageLayout(rtImages[currentFrame], VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 1, 1);
 	recordCommandBufferMain(commandBuffers[currentFrame], imageIndex);
 
 	if (renderToWindow) {
@@ -2745,13 +3173,20 @@ void RTSystem::drawFrame() {
 		}
 	}
 
+	if (verbose) {
+		std::chrono::high_resolution_clock::time_point end =
+			std::chrono::high_resolution_clock::now();
+		debugCpuTime += std::chrono::duration<float, std::milli>(end - start).count();
+	}
+
+	if (denoiseCheckState == 1) compareDenoise();
+
 	currentFrame++; currentFrame %= MAX_FRAMES_IN_FLIGHT;
 	//Headless benchmarking
 	if (!renderToWindow) {
 		headlessFrames++;
 		std::cout << "Frames rendered: " << headlessFrames << std::endl;
 	}
-	transitionImageLayout(rtImages[currentFrame], VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL, 1, 1);
 }
 
 
@@ -49,6 +49,7 @@ public:
 	bool renderToWindow = true; //false = headless
 	float playbackSpeed = 1;
 	void setDriverRuntime(float time);
+	void runDrivers(float frameTime, SceneGraph* sceneGraphP, bool loop);
 
 	//Vertex shader
 	std::vector<Vertex> vertices;
@@ -76,8 +77,29 @@ public:
 	int numSamples = 1;
 	int numBounces = 1;
 	int doReflect = 0;
-	float debugRayTime = 0;
+	float debugCpuTime = 0;
+	float debugGpuTime = 0;
+	int debugGpuCount = 0;
 	bool verbose = false;
+	//TLAS refits allowed before a full rebuild, 0 rebuilds every change
+	int tlasRebuildInterval = 60;
+	//Progressive accumulation, target of 0 keeps accumulating
+	bool accumulate = false;
+	int targetSamples = 0;
+	float debugRefitTime = 0;
+	float debugRebuildTime = 0;
+	int debugRefitCount = 0;
+	int debugRebuildCount = 0;
+	//A-trous denoise iterations after the trace, 0 disables
+	int denoiseIterations = 0;
+	float colorPhi = 1.f;
+	float normalPhi = 128.f;
+	float depthPhi = 1.f;
+	float albedoPhi = 0.1f;
+	//Reads back the first denoised frame and compares it with atrousDenoise in Denoise.h
+	bool denoiseCheck = false;
+	std::vector<float> debugDenoiseTimes;
+	int debugDenoiseCount = 0;
 private:
 	//init
 	void createInstance(bool verbose = true);
@@ -97,6 +119,10 @@ private:
 		VkImageAspectFlags aspectFlags = VK_IMAGE_ASPECT_COLOR_BIT,
 		VkImageViewType viewType = VK_IMAGE_VIEW_TYPE_2D, int levels = 1);
 	void createImageViews();
+	void createDenoisePipeline();
+	void denoise(VkCommandBuffer commandBuffer);
+	void copyForDenoiseCheck(VkCommandBuffer commandBuffer, VkImage image, int slice);
+	void compareDenoise();
 
 
 	struct BuildData {
@@ -126,7 +152,11 @@ private:
 		VkQueryPool queryPool,
 		std::vector<AS>& cleanupAS);
 	void createBLAccelereationStructures(uint32_t flags);
-	void createTLAccelereationStructures(VkBuildAccelerationStructureFlagsKHR flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
+	void createTLAccelereationStructures(VkBuildAccelerationStructureFlagsKHR flags = 
+		VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR);
+	void recordTLAccelereationStructureBuild(VkCommandBuffer commandBuffer, bool update);
+	void updateTLAccelereationStructure(VkCommandBuffer commandBuffer);
+	void readTimestamps(uint32_t frame);
 	void createAccelereationStructures();
 	void createDescriptorSetLayout();
 	void createGraphicsPipeline(std::string vertShader,
@@ -145,12 +175,11 @@ private:
 		VkMemoryPropertyFlags properties, VkBuffer& buffer,
 		VkDeviceMemory& bufferMemory, bool realloc);
 	void createVertexBuffer(bool realloc = true);
-	void createTransformBuffers(bool realloc = true);
 	mat44<float> getCameraSpace(DrawCamera camera, float_3 useMoveVec, float_3 useDirVec);
 	mat44<float> getInvCameraSpace(DrawCamera camera, float_3 useMoveVec, float_3 useDirVec);
 	void transitionImageLayout(VkImage image, VkFormat format,
 		VkImageLayout oldLayout, VkImageLayout newLayout, int layers = 1, int levels = 1);
-	void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height, int level = 0, int face = 0);
+	void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height, int level = 0, int face = 0, VkDeviceSize offset = 0);
 	void createIndexBuffers(bool realloc = true, bool andFree = false);
 	void generateMipmaps(VkImage image, int32_t x, int32_t y, uint32_t mipLevels, int face = 0);
 	void createEnvironmentImage(Texture env, VkImage& image,
@@ -186,6 +215,7 @@ private:
 	VkSurfaceKHR surface;
 	VkPhysicalDevice physicalDevice;
 	VkDevice device;
+	bool compressedTextures = false; //textureCompressionBC enabled on the device
 	QueueFamilyIndices familyIndices;
 	//Pipeline
 	std::vector<VkDeviceMemory> attachmentMemorys;
@@ -193,6 +223,8 @@ private:
 	VkPipelineLayout pipelineLayoutFinal;
 	VkPipeline graphicsPipelineRT;
 	VkPipeline graphicsPipelineFinal;
+	VkPipelineLayout pipelineLayoutDenoise;
+	VkPipeline computePipelineDenoise;
 	//Rendering
 	uint32_t imageCount = 0;
 	VkQueue graphicsQueue;
@@ -206,6 +238,18 @@ private:
 	std::vector<VkImageView> rtImageViews;
 	std::vector<VkDeviceMemory> rtImageMemorys;
 	std::vector<VkSampler> rtSamplers;
+	VkImage accumImage;
+	VkDeviceMemory accumImageMemory;
+	VkImageView accumImageView;
+	VkImage normalDepthImage;
+	VkDeviceMemory normalDepthImageMemory;
+	VkImageView normalDepthImageView;
+	VkImage albedoImage;
+	VkDeviceMemory albedoImageMemory;
+	VkImageView albedoImageView;
+	VkImage denoiseImage;
+	VkDeviceMemory denoiseImageMemory;
+	VkImageView denoiseImageView;
 	VkRenderPass renderPass;
 	VkRenderPass offscreenPass;
 	std::vector<VkFramebuffer> swapChainFramebuffers;
@@ -217,8 +261,6 @@ private:
 	VkDeviceMemory vertexBufferMemory;
 	std::vector<VkBuffer> meshIndexBuffers;
 	std::vector<VkDeviceMemory> meshIndexBufferMemorys;
-	std::vector<VkBuffer> meshTransformBuffers;
-	std::vector<VkDeviceMemory> meshTransformMemorys;
 	std::vector<uint64_t> meshIndexBufferAddresses;
 	VkBuffer indexAddressBuffer;
 	VkDeviceMemory IndexAddressBufferMemorys;
@@ -236,6 +278,23 @@ private:
 	std::vector<AS> blas;
 	AS tlas;
 	std::vector<VkAccelerationStructureInstanceKHR> tlasInstances;
+	VkBuildAccelerationStructureFlagsKHR tlasFlags;
+	std::vector<VkBuffer> tlasInstanceBuffers;
+	std::vector<VkDeviceMemory> tlasInstanceMemorys;
+	std::vector<void*> tlasInstanceMapped;
+	VkBuffer tlasScratchBuffer;
+	VkDeviceMemory tlasScratchMemory;
+	VkDeviceAddress tlasScratchAddress;
+	bool tlasDirty = false;
+	int tlasRefitsSinceBuild = 0;
+	//Timestamps per frame in flight, frame begin/end then TLAS build begin/end
+	VkQueryPool timestampQueryPool = VK_NULL_HANDLE;
+	float timestampPeriod = 1;
+	std::vector<bool> frameQueryState;
+	std::vector<int> tlasQueryState; //0 none, 1 refit, 2 rebuild
+	//Denoise start then one per pass, per frame in flight
+	VkQueryPool denoiseQueryPool = VK_NULL_HANDLE;
+	std::vector<int> denoiseQueryState; //passes recorded
 	//Images
 	bool initialFrame = true;
 	std::vector<Texture> rawTextures;
@@ -276,6 +335,12 @@ private:
 	std::vector<VkDescriptorSet> descriptorSetsHDR;
 	VkDescriptorPool descriptorPoolFinal;
 	std::vector<VkDescriptorSet> descriptorSetsFinal;
+	VkDescriptorPool descriptorPoolDenoise;
+	std::vector<VkDescriptorSet> descriptorSetsDenoise; //frame image to ping, ping to frame image
+	//Noisy color, normal and depth, albedo, then denoised color, one frame sized slice each
+	VkBuffer denoiseCheckBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory denoiseCheckMemory = VK_NULL_HANDLE;
+	int denoiseCheckState = 0; //0 waiting for a denoised frame, 1 recorded, 2 compared
 	std::vector < VkDescriptorSetLayout> descriptorSetLayouts;
 
 	//Camera
@@ -306,10 +371,25 @@ private:
 		float camPosX;
 		float camPosY;
 		float camPosZ;
+		int accumFrame; //-1 when not accumulating
+		int accumTarget;
 	};
 	int frame = 0;
+	int accumulatedFrames = 0;
+	bool accumulationReset = true;
+	bool accumulationConverged = false;
+	mat44<float> lastCameraSpace;
 	PushConstantRay pushConstantRT;
 
+	struct PushConstantDenoise
+	{
+		int stepSize; //0 only copies
+		float colorPhi;
+		float normalPhi;
+		float depthPhi;
+		float albedoPhi;
+	};
+
 	const std::vector<const char*> validationLayers = {
 		"VK_LAYER_KHRONOS_validation"
 	};
@@ -9,13 +9,24 @@
 #include <algorithm>
 #include <chrono>
 #include <cassert>
+#include <fstream>
+#include <iterator>
+#include <cstring>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
 
 
-Texture Texture::parseTexture(std::string path, bool cube) {
+Texture Texture::parseTexture(std::string path, bool cube, Semantic semantic) {
+	std::chrono::high_resolution_clock::time_point loadStart = std::chrono::high_resolution_clock::now();
+	if (!cube && path.size() > 5 && path.substr(path.size() - 5).compare(".ktx2") == 0) {
+		Texture tex = parseKTX2(path, semantic);
+		tex.loadTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - loadStart).count();
+		return tex;
+	}
 	Texture tex;
+	tex.semantic = semantic;
+	tex.path = path;
 	tex.format = cube ? Texture::FORM_RGBE : Texture::FORM_LIN;
 	tex.type = cube ? Texture::TYPE_CUBE : Texture::TYPE_2D;
 	int x, y, n;
@@ -31,10 +42,96 @@ Texture Texture::parseTexture(std::string path, bool cube) {
 	tex.x = x;
 	tex.y = cube ? y / 6 : y;
 	tex.realY = y;
+	//Scalars are read from .r and pairs from .rg, so the leading channels are packed down in place
+	//Normals stay four channel since three channel formats are rarely sampleable, but are not sRGB decoded
+	if (!cube) {
+		tex.srgb = semantic == SEM_COLOR;
+		tex.channels = semantic == SEM_SCALAR ? 1 : semantic == SEM_PAIR ? 2 : 4;
+		if (tex.channels < 4) {
+			size_t texels = (size_t)x * y;
+			for (size_t texel = 0; texel < texels; texel++) {
+				for (int channel = 0; channel < tex.channels; channel++) {
+					rawData[tex.channels * texel + channel] = rawData[4 * texel + channel];
+				}
+			}
+		}
+	}
 	//Every surface of the cube has the same image resolution
 	tex.data = rawData;
 	//https://vulkan-tutorial.com/Generating_Mipmaps
 	tex.mipLevels = std::floor(std::log2(std::max(x, tex.y))) + 1;
+	tex.loadTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - loadStart).count();
+	return tex;
+}
+
+//Pre-mipped BC1/BC4/BC5/BC7 2D textures as written by texcomp, anything else should stay a png
+//https://registry.khronos.org/KTX/specs/2.0/ktxspec.v2.html
+Texture Texture::parseKTX2(std::string path, Semantic semantic) {
+	std::ifstream inStream(path, std::ios::binary);
+	if (!inStream.is_open()) {
+		throw std::runtime_error("ERROR: Unable to open texture at path " + path);
+	}
+	std::vector<char> file((std::istreambuf_iterator<char>(inStream)), std::istreambuf_iterator<char>());
+	const unsigned char identifier[12] = { 0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A };
+	const size_t headerSize = 12 + 9 * 4 + 4 * 4 + 2 * 8;
+	if (file.size() < headerSize || memcmp(file.data(), identifier, sizeof(identifier)) != 0) {
+		throw std::runtime_error("ERROR: Texture at path " + path + " is not a KTX2 file");
+	}
+	uint32_t header[9]; //vkFormat, typeSize, width, height, depth, layers, faces, levels, supercompression
+	memcpy(header, &file[12], sizeof(header));
+	VkFormat format = (VkFormat)header[0];
+	size_t blockBytes = 0;
+	switch (format) {
+	case VK_FORMAT_BC1_RGB_UNORM_BLOCK: case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+	case VK_FORMAT_BC1_RGBA_UNORM_BLOCK: case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+	case VK_FORMAT_BC4_UNORM_BLOCK:
+		blockBytes = 8;
+		break;
+	case VK_FORMAT_BC5_UNORM_BLOCK: case VK_FORMAT_BC7_UNORM_BLOCK: case VK_FORMAT_BC7_SRGB_BLOCK:
+		blockBytes = 16;
+		break;
+	default:
+		break;
+	}
+	uint32_t levels = header[7];
+	if (!blockBytes || header[4] > 0 || header[5] > 1 || header[6] != 1 || levels == 0 || header[8] != 0 ||
+		file.size() < headerSize + 3 * sizeof(uint64_t) * levels) {
+		throw std::runtime_error("ERROR: Texture at path " + path + " is not a pre-mipped BC1, BC4, BC5 or BC7 2D KTX2");
+	}
+	std::vector<uint64_t> levelIndex(3 * levels); //offset, length, uncompressed length
+	memcpy(levelIndex.data(), &file[headerSize], levelIndex.size() * sizeof(uint64_t));
+
+	Texture tex;
+	tex.semantic = semantic;
+	tex.path = path;
+	tex.format = Texture::FORM_LIN;
+	tex.type = Texture::TYPE_2D;
+	tex.x = header[2];
+	tex.y = header[3];
+	tex.realY = tex.y;
+	tex.mipLevels = levels;
+	tex.compressedFormat = format;
+	tex.srgb = format == VK_FORMAT_BC1_RGB_SRGB_BLOCK || format == VK_FORMAT_BC1_RGBA_SRGB_BLOCK || format == VK_FORMAT_BC7_SRGB_BLOCK;
+	tex.levelOffsets.resize(levels);
+	for (uint32_t level = 0; level < levels; level++) {
+		size_t blocksX = (std::max(tex.x >> level, 1) + 3) / 4;
+		size_t blocksY = (std::max(tex.y >> level, 1) + 3) / 4;
+		if (levelIndex[3 * level + 1] != blocksX * blocksY * blockBytes ||
+			levelIndex[3 * level] + levelIndex[3 * level + 1] > file.size()) {
+			throw std::runtime_error("ERROR: Texture at path " + path + " has a truncated mip level");
+		}
+		tex.levelOffsets[level] = tex.dataSize;
+		tex.dataSize += levelIndex[3 * level + 1];
+	}
+	//malloc so the data is released through stbi_image_free like decoded images
+	unsigned char* data = (unsigned char*)malloc(tex.dataSize);
+	if (!data) {
+		throw std::runtime_error("ERROR: Unable to allocate texture at path " + path);
+	}
+	for (uint32_t level = 0; level < levels; level++) {
+		memcpy(&data[tex.levelOffsets[level]], &file[levelIndex[3 * level]], levelIndex[3 * level + 1]);
+	}
+	tex.data = data;
 	return tex;
 }
 
@@ -322,6 +419,7 @@ DrawListIntermediate SceneGraph::navigateSceneGraphInt(int instanceSize) {
 	drawList.textureMaps = textureMaps;
 	drawList.cubeMaps = cubeMaps;
 	drawList.environmentMap = environmentMap;
+	drawList.environmentSH = environmentSH;
 	int drawNode = 0;
 	for (int root : roots) {
 		std::vector<DrawNode> rootList;
@@ -556,6 +654,7 @@ DrawList SceneGraph::navigateSceneGraph(bool verbose, int poolSize) {
 	list.textureMaps = intermediate.textureMaps;
 	list.cubeMaps = intermediate.cubeMaps;
 	list.environmentMap = intermediate.environmentMap;
+	list.environmentSH = intermediate.environmentSH;
 	list.worldToLights = std::vector<mat44<float>>();
 	list.lights = toDrawLights(intermediate.lights, list.worldToLights);
 	std::optional<mat44<float>> worldToEnvironment = intermediate.worldToEnvironment;
@@ -5,6 +5,7 @@
 #include <optional>
 #include "Vertex.h"
 #include <map>
+#include <cmath>
 #include <vulkan/vulkan_core.h>
 
 
@@ -78,9 +79,24 @@ struct Texture {
 	int realY;
 	int mipLevels;
 	bool doFree = true;
+	//What the shaders read from the texture, picks how many channels are kept and whether they are sRGB encoded
+	enum Semantic {
+		SEM_COLOR, SEM_NORMAL, SEM_SCALAR, SEM_PAIR
+	};
+	Semantic semantic = SEM_COLOR;
+	int channels = 4;
+	bool srgb = true;
+	//Block compressed data read from a .ktx2, every level packed largest first at levelOffsets
+	//VK_FORMAT_UNDEFINED when data is uncompressed
+	VkFormat compressedFormat = VK_FORMAT_UNDEFINED;
+	std::vector<size_t> levelOffsets;
+	size_t dataSize = 0;
+	std::string path;
+	float loadTime = 0; //ms spent reading and decoding the file
 	Texture() {};
 	~Texture() {};
-	static Texture parseTexture(std::string path, bool cube);
+	static Texture parseTexture(std::string path, bool cube, Semantic semantic = SEM_COLOR);
+	static Texture parseKTX2(std::string path, Semantic semantic);
 };
 
 
@@ -121,6 +137,57 @@ struct DrawLight {
 	int shadowRes;
 };
 
+//What the fragment shaders read per light, every term that does not depend on the fragment is folded in here
+//Matches Light in lighting.glsl under std430
+struct GPULight {
+	float position[3]; //World space
+	int type;
+	float direction[3]; //The light's -z in world space, the spot cone is measured from it
+	float radius;
+	float tint[3];
+	float limit;
+	float invLimit; //0 when unlimited, so the windowed falloff reduces to inverse square
+	float diffuseScale; //power / 4pi
+	float pbrScale; //(power + 2) / 2pi / 4pi
+	float strength;
+	float halfAngle; //Sun
+	float sunScale; //Sun solid angle / 4pi * strength
+	float cosBlend; //Spot, cos of the edge of the full strength cone
+	float cosFov; //Spot, cos of the outer edge
+	float blendLimit;
+	float invBlendWidth;
+	float pad[2];
+
+	static GPULight fromLight(const DrawLight& light, mat44<float> worldToLight) {
+		const float pi = 3.14159f;
+		mat44<float> lightToWorld = mat44<float>::affineInverse(worldToLight);
+		GPULight packed{};
+		float_3 axis = float_3(-lightToWorld.data[2][0], -lightToWorld.data[2][1], -lightToWorld.data[2][2]).normalize();
+		for (int c = 0; c < 3; c++) {
+			packed.position[c] = lightToWorld.data[3][c];
+			packed.direction[c] = axis[c];
+		}
+		packed.type = light.type;
+		packed.radius = light.radius;
+		packed.tint[0] = light.tintR;
+		packed.tint[1] = light.tintG;
+		packed.tint[2] = light.tintB;
+		packed.limit = light.limit;
+		packed.invLimit = light.limit > 0 ? 1 / light.limit : 0;
+		packed.diffuseScale = light.power / (4 * pi);
+		packed.pbrScale = (light.power + 2) / (2 * pi) / (4 * pi);
+		packed.strength = light.strength;
+		packed.halfAngle = light.angle / 2;
+		packed.sunScale = pi * packed.halfAngle * packed.halfAngle / (4 * pi) * light.strength;
+		packed.blendLimit = light.fov * (1 - light.blend) / 2;
+		float fovLimit = light.fov / 2;
+		packed.cosBlend = std::cos(packed.blendLimit);
+		packed.cosFov = std::cos(fovLimit);
+		packed.invBlendWidth = fovLimit > packed.blendLimit ? 1 / (fovLimit - packed.blendLimit) : 0;
+		return packed;
+	}
+};
+
 enum MaterialType {
 	MAT_NONE, MAT_PBR, MAT_LAM, MAT_MIR, MAT_ENV, MAT_SIM
 };
@@ -314,6 +381,7 @@ public:
 	std::vector<Texture> textureMaps;
 	std::vector<Texture> cubeMaps;
 	std::optional<Texture> environmentMap;
+	std::vector<float> environmentSH; //9 rgb L2 coefficients, empty if unused
 	std::vector<Light> lights;
 };
 
@@ -365,6 +433,7 @@ public:
 	std::vector<Texture> textureMaps;
 	std::vector<Texture> cubeMaps;
 	std::optional<Texture> environmentMap;
+	std::vector<float> environmentSH;
 	std::vector<DrawLight> lights;
 	std::vector<mat44<float>> worldToLights;
 	std::vector<mat44<float>> worldToLightsPersp;
@@ -452,6 +521,7 @@ public:
 	std::vector<Texture> textureMaps;
 	std::vector<Texture> cubeMaps;
 	std::optional<Texture> environmentMap;
+	std::vector<float> environmentSH; //9 rgb L2 coefficients, empty if unused
 	std::optional<mat44<float>> worldToEnvironment;
 	std::optional<mat44<float>> environmentToWorld;
 	std::vector<Light> lights;
@@ -0,0 +1,44 @@
+//Clustered forward lighting, the grid is built on the CPU by LightClusters.h each frame
+//A fragment only loops over the unbounded lights and the lights binned into its cluster
+
+const int CLUSTER_TILES_X = 16;
+const int CLUSTER_TILES_Y = 9;
+const int CLUSTER_SLICES = 24;
+
+layout(binding = 13) uniform ClusterInfo {
+    mat4 view;
+    float leftSlope;
+    float bottomSlope;
+    float tilesPerSlopeX;
+    float tilesPerSlopeY;
+    float nearZ;
+    float slicesPerLog;
+    int globalCount;
+    int pad;
+    mat4 inverseCamera;
+    vec2 inverseViewport;
+} clusterInfo;
+layout(binding = 14) readonly buffer ClusterRanges {
+    uvec2 arr[];
+} clusterRanges;
+layout(binding = 15) readonly buffer ClusterLights {
+    uint arr[];
+} clusterLights;
+
+//Offset and count of the cluster holding a world space position
+uvec2 findCluster(vec4 worldPos){
+    vec3 viewPos = (clusterInfo.view * worldPos).xyz;
+    float depth = max(-viewPos.z, clusterInfo.nearZ);
+    int x = clamp(int(floor((viewPos.x / depth - clusterInfo.leftSlope) * clusterInfo.tilesPerSlopeX)), 0, CLUSTER_TILES_X - 1);
+    int y = clamp(int(floor((viewPos.y / depth - clusterInfo.bottomSlope) * clusterInfo.tilesPerSlopeY)), 0, CLUSTER_TILES_Y - 1);
+    int slice = clamp(int(floor(log(depth / clusterInfo.nearZ) * clusterInfo.slicesPerLog)), 0, CLUSTER_SLICES - 1);
+    return clusterRanges.arr[(slice * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x];
+}
+
+//Unbounded lights come first, then the cluster's own
+int clusterLightCount(uvec2 cluster){
+    return clusterInfo.globalCount + int(cluster.y);
+}
+int clusterLight(uvec2 cluster, int entry){
+    return int(entry < clusterInfo.globalCount ? clusterLights.arr[entry] : clusterLights.arr[cluster.x + uint(entry - clusterInfo.globalCount)]);
+}
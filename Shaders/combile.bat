@@ -4,13 +4,17 @@ C:/VulkanSDK/1.3.268.0/Bin/glslc.exe shader.vert -o vert.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe shaderInst.vert -o vertInst.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe shaderEnv.vert -o vertEnv.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe shaderInstEnv.vert -o vertInstEnv.spv
+C:/VulkanSDK/1.3.268.0/Bin/glslc.exe shaderDepth.vert -o vertDepth.spv
+C:/VulkanSDK/1.3.268.0/Bin/glslc.exe shaderDepthInst.vert -o vertDepthInst.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe vertQuad.vert -o vertQuad.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe shaderShadow.frag -o fragShadow.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe shader.frag -o frag.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe shaderEnv.frag -o fragEnv.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe fragFinal.frag -o fragFinal.spv
+C:/VulkanSDK/1.3.268.0/Bin/glslc.exe deferredLight.frag -o fragDeferred.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe rtFinal.frag -o rtFinal.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe --target-spv=spv1.6 raytrace.rgen -o rayGen.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe --target-spv=spv1.6 raytrace.rmiss -o miss.spv
 C:/VulkanSDK/1.3.268.0/Bin/glslc.exe --target-spv=spv1.6 raytrace.rchit -o closestHit.spv
+C:/VulkanSDK/1.3.268.0/Bin/glslc.exe denoise.comp -o denoise.spv
 pause
\ No newline at end of file
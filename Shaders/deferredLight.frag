@@ -0,0 +1,51 @@
+#version 450
+#extension GL_EXT_nonuniform_qualifier : require
+#include "lighting.glsl"
+
+//Deferred lighting, adds the clustered lights to the G-buffer written by shader.frag or shaderEnv.frag
+layout(input_attachment_index = 0, set = 1, binding = 0) uniform subpassInput gAmbient;
+layout(input_attachment_index = 1, set = 1, binding = 1) uniform subpassInput gScale;
+layout(input_attachment_index = 2, set = 1, binding = 2) uniform subpassInput gNormal;
+layout(input_attachment_index = 3, set = 1, binding = 3) uniform subpassInput gDepth;
+
+struct PushConstants
+{
+    int lightNum;
+	float cameraPosX;
+	float cameraPosY;
+	float cameraPosZ;
+	float pbrP;
+	int baseIndex;
+};
+layout( push_constant ) uniform PushConsts
+{
+	PushConstants inConsts;
+};
+
+layout(location = 0) out vec4 outColor;
+
+void main() {
+	vec3 ambient = subpassLoad(gAmbient).rgb;
+	vec4 packedNormal = subpassLoad(gNormal);
+	int model = int(round(packedNormal.a * 3));
+	if(model == 0){
+		outColor = vec4(ambient, 1);
+		return;
+	}
+	//Position from depth, the same way findCluster would have seen it in the G-buffer pass
+	vec2 ndc = gl_FragCoord.xy * clusterInfo.inverseViewport * 2 - 1;
+	vec4 position = clusterInfo.inverseCamera * vec4(ndc, subpassLoad(gDepth).r, 1);
+	position /= position.w;
+	vec3 useNormal = octDecode(packedNormal.rg);
+	uvec2 cluster = findCluster(position);
+
+	vec3 directLight;
+	if(model == 1){
+		directLight = diffuseLight(position, useNormal, cluster);
+	}
+	else{
+		vec3 cameraPos = vec3(inConsts.cameraPosX,inConsts.cameraPosY,inConsts.cameraPosZ);
+		directLight = pbrLight(position, useNormal, packedNormal.b, cameraPos, inConsts.pbrP, cluster);
+	}
+	outColor = vec4(ambient + directLight * subpassLoad(gScale).rgb, 1);
+}
@@ -0,0 +1,21 @@
+//Outputs of the forward shaders, which also fill the deferred G-buffer when constant 28 is set
+//A shaded fragment is ambient + directLight * scale, so the G-buffer stores the resolved material terms
+//and deferredLight.frag adds the lights later
+
+layout(constant_id = 28) const bool deferredGBuffer = false;
+
+layout(location = 0) out vec4 outColor;
+layout(location = 1) out vec4 outScale;
+layout(location = 2) out vec4 outNormal;
+
+//model 0 is unlit, 1 diffuse, 2 PBR, roughness only matters to PBR
+void writeShading(vec3 ambient, vec3 scale, vec3 directLight, vec3 useNormal, float roughness, int model){
+	if(deferredGBuffer){
+		outColor = vec4(ambient, 1);
+		outScale = vec4(scale, 1);
+		outNormal = vec4(octEncode(useNormal), roughness, model / 3.0);
+	}
+	else{
+		outColor = vec4(ambient + directLight * scale, 1);
+	}
+}
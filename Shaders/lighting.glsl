@@ -0,0 +1,164 @@
+//Direct lighting shared by the forward shaders and the deferred lighting pass
+//Lights come from the fragment's cluster, see cluster.glsl
+#include "cluster.glsl"
+
+layout(binding = 8) uniform sampler2D shadows[];
+//Per light terms are folded on the CPU, see GPULight in SceneGraph.h
+struct Light {
+	vec3 position;
+	int type;
+	// 0 none, 1 sphere, 2 sun, 3 spot
+	vec3 direction;
+	float radius;
+	vec3 tint;
+	float limit;
+	float invLimit;
+	float diffuseScale;
+	float pbrScale;
+	float strength;
+	float halfAngle;
+	float sunScale;
+	float cosBlend;
+	float cosFov;
+	float blendLimit;
+	float invBlendWidth;
+	vec2 pad;
+};
+
+layout(binding = 7) readonly buffer LightArray {
+	Light arr[];
+} lights;
+//Only spot lights cast shadows, so only they read this
+layout(binding = 9) readonly buffer LightPerspective {
+    mat4 arr[];
+} lightPerspective;
+
+//Octahedral normal packed into [0,1]^2 for the G-buffer
+//https://knarkowicz.wordpress.com/2014/04/16/octahedron-normal-vector-encoding/
+vec2 octEncode(vec3 n){
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	vec2 folded = n.z >= 0 ? n.xy : (1 - abs(n.yx)) * vec2(n.x >= 0 ? 1 : -1, n.y >= 0 ? 1 : -1);
+	return folded * 0.5 + 0.5;
+}
+vec3 octDecode(vec2 f){
+	f = f * 2 - 1;
+	vec3 n = vec3(f, 1 - abs(f.x) - abs(f.y));
+	float t = clamp(-n.z, 0, 1);
+	n.x += n.x >= 0 ? -t : t;
+	n.y += n.y >= 0 ? -t : t;
+	return normalize(n);
+}
+
+//https://learnopengl.com/Advanced-Lighting/Shadows/Shadow-Mapping
+float getShadowContribution(vec4 lightSpacePos){
+	vec3 projectedPos = lightSpacePos.xyz / lightSpacePos.w;
+	float realDepth = projectedPos.z;
+	projectedPos = projectedPos * 0.5 + 0.5;
+	float sampledDepth = texture(shadows[0],projectedPos.xy).r;
+	float shadow = realDepth - 0.0005 > sampledDepth ? 0.1 : 1.0;
+	return shadow;
+}
+
+//Windowed inverse square without the 1/4pi, which the light's scales carry
+float lightFallOff(Light light, float dist){
+	float x = dist * light.invLimit;
+	float x2 = x * x;
+	return max(0, 1 - x2 * x2) / (dist * dist);
+}
+
+//Full strength inside the blend cone, then fading linearly in angle to the edge of the fov
+float spotCone(Light light, float cosAngle){
+	if(cosAngle > light.cosBlend) return 1;
+	if(cosAngle > light.cosFov) return 1 - (acos(cosAngle) - light.blendLimit) * light.invBlendWidth;
+	return 0;
+}
+
+//Lambertian surfaces, the caller scales the result by albedo
+vec3 diffuseLight(vec4 position, vec3 useNormal, uvec2 cluster){
+	int numLights = clusterLightCount(cluster);
+	vec3 directLight = vec3(0,0,0);
+	for(int entry = 0; entry < numLights; entry++){
+		int lightInd = clusterLight(cluster, entry);
+		Light light = lights.arr[lightInd];
+
+		if(light.type == 1){
+			vec3 toLight = light.position - position.xyz;
+			float dist = length(toLight);
+			float normDot = max(0, dot(useNormal, toLight / dist));
+			directLight += normDot * light.diffuseScale * lightFallOff(light, dist) * light.tint;
+		}
+		else if(light.type == 2){
+			float normDot = dot(useNormal,vec3(0,0,-1));
+			if (normDot < 0) normDot = 1 + normDot;
+			else normDot = 1;
+			directLight += normDot*light.strength*light.tint;
+		}
+		else if(light.type == 3){
+			vec3 toLight = light.position - position.xyz;
+			float dist = length(toLight);
+			if(light.limit > dist){
+				float cone = spotCone(light, dot(toLight / dist, light.direction));
+				if(cone > 0){
+					float normDot = max(0, dot(useNormal,vec3(0,0,-1)));
+					float shadowContribution = getShadowContribution(lightPerspective.arr[lightInd] * position);
+					directLight += shadowContribution * normDot * cone * light.diffuseScale * lightFallOff(light, dist) * light.tint;
+				}
+			}
+		}
+	}
+	return directLight;
+}
+
+//Sphere, sun and spot lights through the representative point approximation for PBR surfaces
+vec3 pbrLight(vec4 position, vec3 useNormal, float roughness, vec3 cameraPos, float pbrP, uvec2 cluster){
+	int numLights = clusterLightCount(cluster);
+	vec3 directLight = vec3(0,0,0);
+	vec3 r = reflect(cameraPos - position.xyz, useNormal);
+	vec3 rDir = normalize(r);
+	float alpha = roughness*roughness;
+	float p = pbrP;
+	for(int entry = 0; entry < numLights; entry++){
+		int lightInd = clusterLight(cluster, entry);
+		Light light = lights.arr[lightInd];
+
+		if(light.type == 1){
+			vec3 toLight = light.position - position.xyz;
+			vec3 centerToRay = dot(r,toLight)*r - toLight;
+			vec3 closestPoint = toLight + centerToRay*light.radius/length(centerToRay);
+			float normDot = max(0, dot(useNormal,normalize(closestPoint)));
+			float phi = acos(dot(rDir,normalize(toLight)));
+			float dist = length(closestPoint);
+			float alphaP = alpha + light.radius/2/dist;
+			float sphereNormalization = pow((alpha/alphaP),2);
+			directLight += normDot*sphereNormalization*light.pbrScale*pow(phi,p)*lightFallOff(light, dist)*light.tint;
+		}
+		else if(light.type == 2){
+			float phi = acos(dot(rDir,vec3(0,0,-1)));
+			if(dot(useNormal,vec3(0,0,-1)) < 0){
+				phi = 0;
+			}
+			else if(phi > light.halfAngle){
+				phi = light.halfAngle;
+			}
+			directLight += light.sunScale*pow(phi,p)*light.tint;
+		}
+		else if(light.type == 3){
+			vec3 toLight = light.position - position.xyz;
+			vec3 centerToRay = dot(r,toLight)*r - toLight;
+			vec3 closestPoint = toLight + centerToRay*light.radius/length(centerToRay);
+			float dist = length(closestPoint);
+			if(light.limit > dist){
+				float cone = spotCone(light, dot(normalize(closestPoint), light.direction));
+				if(cone > 0){
+					float normDot = max(0, dot(useNormal,vec3(0,0,-1)));
+					float phi = acos(dot(rDir,normalize(toLight)));
+					float alphaP = alpha + light.radius/2/dist;
+					float sphereNormalization = pow((alpha/alphaP),2);
+					float shadowContribution = getShadowContribution(lightPerspective.arr[lightInd] * position);
+					directLight += shadowContribution*normDot*cone*sphereNormalization*light.pbrScale*pow(phi,p)*lightFallOff(light, dist)*light.tint;
+				}
+			}
+		}
+	}
+	return directLight;
+}
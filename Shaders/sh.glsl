@@ -0,0 +1,54 @@
+//Irradiance from the 9 L2 spherical harmonic coefficients written by cube --sh
+//Set as specialization constants in VulkanSystem, so no texture or buffer is read
+//https://cseweb.ucsd.edu/~ravir/papers/envmap/envmap.pdf
+
+layout(constant_id = 0) const bool useSH = false;
+layout(constant_id = 1) const float sh0r = 0;
+layout(constant_id = 2) const float sh0g = 0;
+layout(constant_id = 3) const float sh0b = 0;
+layout(constant_id = 4) const float sh1r = 0;
+layout(constant_id = 5) const float sh1g = 0;
+layout(constant_id = 6) const float sh1b = 0;
+layout(constant_id = 7) const float sh2r = 0;
+layout(constant_id = 8) const float sh2g = 0;
+layout(constant_id = 9) const float sh2b = 0;
+layout(constant_id = 10) const float sh3r = 0;
+layout(constant_id = 11) const float sh3g = 0;
+layout(constant_id = 12) const float sh3b = 0;
+layout(constant_id = 13) const float sh4r = 0;
+layout(constant_id = 14) const float sh4g = 0;
+layout(constant_id = 15) const float sh4b = 0;
+layout(constant_id = 16) const float sh5r = 0;
+layout(constant_id = 17) const float sh5g = 0;
+layout(constant_id = 18) const float sh5b = 0;
+layout(constant_id = 19) const float sh6r = 0;
+layout(constant_id = 20) const float sh6g = 0;
+layout(constant_id = 21) const float sh6b = 0;
+layout(constant_id = 22) const float sh7r = 0;
+layout(constant_id = 23) const float sh7g = 0;
+layout(constant_id = 24) const float sh7b = 0;
+layout(constant_id = 25) const float sh8r = 0;
+layout(constant_id = 26) const float sh8g = 0;
+layout(constant_id = 27) const float sh8b = 0;
+
+//Coefficients ordered L00, L1-1, L10, L11, L2-2, L2-1, L20, L21, L22
+vec3 shIrradiance(vec3 n){
+	const float c1 = 0.429043;
+	const float c2 = 0.511664;
+	const float c3 = 0.743125;
+	const float c4 = 0.886227;
+	const float c5 = 0.247708;
+	vec3 L00 = vec3(sh0r, sh0g, sh0b);
+	vec3 L1m1 = vec3(sh1r, sh1g, sh1b);
+	vec3 L10 = vec3(sh2r, sh2g, sh2b);
+	vec3 L11 = vec3(sh3r, sh3g, sh3b);
+	vec3 L2m2 = vec3(sh4r, sh4g, sh4b);
+	vec3 L2m1 = vec3(sh5r, sh5g, sh5b);
+	vec3 L20 = vec3(sh6r, sh6g, sh6b);
+	vec3 L21 = vec3(sh7r, sh7g, sh7b);
+	vec3 L22 = vec3(sh8r, sh8g, sh8b);
+	return max(vec3(0),
+		c1*L22*(n.x*n.x - n.y*n.y) + c3*L20*n.z*n.z + c4*L00 - c5*L20
+		+ 2*c1*(L2m2*n.x*n.y + L21*n.x*n.z + L2m1*n.y*n.z)
+		+ 2*c2*(L11*n.x + L1m1*n.y + L10*n.z));
+}
@@ -0,0 +1,31 @@
+#version 450
+
+//Depth prepass, only the position stream is fetched
+layout(binding = 0) readonly buffer Transforms {
+    mat4 arr[];
+} transforms;
+layout(binding = 1) uniform Camera {
+    mat4 camera;
+} camera;
+struct PushConstants
+{
+    int lightNum;
+	float cameraPosX;
+	float cameraPosY;
+	float cameraPosZ;
+	float pbrP;
+	int baseIndex;
+};
+layout( push_constant ) uniform PushConsts
+{
+	PushConstants inConsts;
+};
+
+layout(location = 0) in vec3 inPosition;
+
+invariant gl_Position;
+
+void main() {
+    vec4 worldPos = transforms.arr[inConsts.baseIndex + gl_InstanceIndex] * vec4(inPosition, 1.0);
+    gl_Position = camera.camera * worldPos;
+}
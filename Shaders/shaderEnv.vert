@@ -1,17 +1,31 @@
 #version 450
+#include "vertex.glsl"
 
 
-layout(binding = 0) uniform Transforms {
-    mat4 arr[1000];
+layout(binding = 0) readonly buffer Transforms {
+    mat4 arr[];
 } transforms;
 layout(binding = 1) uniform Camera {
     mat4 camera;
 } camera;
-layout(binding = 11) uniform NormalTransforms {
-    mat4 arr[1000];
+struct PushConstants
+{
+    int lightNum;
+	float cameraPosX;
+	float cameraPosY;
+	float cameraPosZ;
+	float pbrP;
+	int baseIndex;
+};
+layout( push_constant ) uniform PushConsts
+{
+	PushConstants inConsts;
+};
+layout(binding = 11) readonly buffer NormalTransforms {
+    mat4 arr[];
 } normTransforms;
-layout(binding = 12) uniform EnvironmentTransforms {
-    mat4 arr[1000];
+layout(binding = 12) readonly buffer EnvironmentTransforms {
+    mat4 arr[];
 } envTransforms;
 
 layout(location = 0) in vec3 inPosition;
@@ -31,15 +45,21 @@ layout(location = 5) out vec3 bitangent;
 layout(location = 6) out vec3 toEnvLight;
 layout(location = 7) out vec4 position;
 
+//Bit for bit with shaderDepth.vert so the main pass can test depth for EQUAL
+invariant gl_Position;
+
 void main() {
-    vec4 worldPos = transforms.arr[inNode] * vec4(inPosition, 1.0);
-    normal = (normTransforms.arr[inNode] * vec4(inNormal, 1.0)).xyz;
+    int node = inConsts.baseIndex + inNode;
+    vec3 vertNormal = decodeDirection(inNormal);
+    vec3 vertTangent = decodeDirection(inTangent);
+    vec4 worldPos = transforms.arr[node] * vec4(inPosition, 1.0);
+    normal = (normTransforms.arr[node] * vec4(vertNormal, 1.0)).xyz;
     gl_Position = camera.camera * worldPos;
     position = worldPos;
     fragColor = inColor;
-    nodeInd = inNode;
-    tangent = inTangent;
-    bitangent = cross(inNormal,inTangent);
+    nodeInd = node;
+    tangent = vertTangent;
+    bitangent = cross(vertNormal,vertTangent);
     texcoord = inTexcoord;
-    toEnvLight = -(envTransforms.arr[inNode] * worldPos).xyz;
+    toEnvLight = -(envTransforms.arr[node] * worldPos).xyz;
 }
\ No newline at end of file
@@ -1,12 +1,26 @@
 #version 450
+#include "vertex.glsl"
 
 
-layout(binding = 0) uniform Transforms {
-    mat4 arr[1000];
+layout(binding = 0) readonly buffer Transforms {
+    mat4 arr[];
 } transforms;
 layout(binding = 1) uniform Camera {
     mat4 camera;
 } camera;
+struct PushConstants
+{
+    int lightNum;
+	float cameraPosX;
+	float cameraPosY;
+	float cameraPosZ;
+	float pbrP;
+	int baseIndex;
+};
+layout( push_constant ) uniform PushConsts
+{
+	PushConstants inConsts;
+};
 
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inNormal;
@@ -25,14 +39,21 @@ layout(location = 5) out vec3 bitangent;
 layout(location = 6) out vec3 toEnvLight;
 layout(location = 7) out vec4 position;
 
+//Bit for bit with shaderDepth.vert so the main pass can test depth for EQUAL
+invariant gl_Position;
+
 void main() {
-    vec4 worldPos = transforms.arr[gl_InstanceIndex] * vec4(inPosition, 1.0);
+    int instance = inConsts.baseIndex + gl_InstanceIndex;
+    vec3 vertNormal = decodeDirection(inNormal);
+    vec3 vertTangent = decodeDirection(inTangent);
+    vec4 worldPos = transforms.arr[instance] * vec4(inPosition, 1.0);
     gl_Position = camera.camera * worldPos;
     position = worldPos;
     fragColor = inColor;
-    normal = inNormal;
+    normal = vertNormal;
     texcoord = inTexcoord;
-    tangent = inTangent;
-    bitangent = cross(inNormal,inTangent);
+    nodeInd = inConsts.baseIndex;
+    tangent = vertTangent;
+    bitangent = cross(vertNormal,vertTangent);
     toEnvLight = vec3(0,0,0);
 }
\ No newline at end of file
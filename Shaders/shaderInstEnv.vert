@@ -1,17 +1,31 @@
 #version 450
+#include "vertex.glsl"
 
 
-layout(binding = 0) uniform Transforms {
-    mat4 arr[1000];
+layout(binding = 0) readonly buffer Transforms {
+    mat4 arr[];
 } transforms;
 layout(binding = 1) uniform Camera {
     mat4 camera;
 } camera;
-layout(binding = 11) uniform NormalTransforms {
-    mat4 arr[1000];
+struct PushConstants
+{
+    int lightNum;
+	float cameraPosX;
+	float cameraPosY;
+	float cameraPosZ;
+	float pbrP;
+	int baseIndex;
+};
+layout( push_constant ) uniform PushConsts
+{
+	PushConstants inConsts;
+};
+layout(binding = 11) readonly buffer NormalTransforms {
+    mat4 arr[];
 } normTransforms;
-layout(binding = 12) uniform EnvironmentTransforms {
-    mat4 arr[1000];
+layout(binding = 12) readonly buffer EnvironmentTransforms {
+    mat4 arr[];
 } envTransforms;
 
 layout(location = 0) in vec3 inPosition;
@@ -31,14 +45,21 @@ layout(location = 5) out vec3 bitangent;
 layout(location = 6) out vec3 toEnvLight;
 layout(location = 7) out vec4 position;
 
+//Bit for bit with shaderDepth.vert so the main pass can test depth for EQUAL
+invariant gl_Position;
+
 void main() {
-    vec4 worldPos = transforms.arr[gl_InstanceIndex] * vec4(inPosition, 1.0);
-    normal = (normTransforms.arr[gl_InstanceIndex] * vec4(inNormal, 1.0)).xyz;
-    tangent = (normTransforms.arr[gl_InstanceIndex] * vec4(inTangent, 1.0)).xyz;
-    bitangent = (normTransforms.arr[gl_InstanceIndex] * vec4(cross(inNormal,inTangent), 1.0)).xyz;
+    int instance = inConsts.baseIndex + gl_InstanceIndex;
+    vec3 vertNormal = decodeDirection(inNormal);
+    vec3 vertTangent = decodeDirection(inTangent);
+    vec4 worldPos = transforms.arr[instance] * vec4(inPosition, 1.0);
+    normal = (normTransforms.arr[instance] * vec4(vertNormal, 1.0)).xyz;
+    tangent = (normTransforms.arr[instance] * vec4(vertTangent, 1.0)).xyz;
+    bitangent = (normTransforms.arr[instance] * vec4(cross(vertNormal,vertTangent), 1.0)).xyz;
     gl_Position = camera.camera * worldPos;
     position = worldPos;
     fragColor = inColor;
     texcoord = inTexcoord;
-    toEnvLight = -(envTransforms.arr[gl_InstanceIndex] * worldPos).xyz;
+    nodeInd = inConsts.baseIndex;
+    toEnvLight = -(envTransforms.arr[instance] * worldPos).xyz;
 }
\ No newline at end of file
@@ -1,12 +1,13 @@
 #version 450
 
 
-layout(binding = 0) uniform Models {
-    mat4 arr[1000];
+layout(binding = 0) readonly buffer Models {
+    mat4 arr[];
 } models;
 struct PushConstants
 {
     mat4 light;
+    int baseIndex;
 };
 layout( push_constant ) uniform PushConsts
 {
@@ -14,16 +15,13 @@ layout( push_constant ) uniform PushConsts
 };
 
 
+//Shadow pipelines only bind the position stream
 layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inNormal;
-layout(location = 2) in vec3 inTangent;
-layout(location = 3) in vec2 inTexcoord;
-layout(location = 4) in vec3 inColor;
 layout(location = 5) in int inNode;
 
 
 
 void main() {
-    vec4 worldPos = models.arr[inNode] * vec4(inPosition, 1.0);
+    vec4 worldPos = models.arr[inConsts.baseIndex + gl_InstanceIndex] * vec4(inPosition, 1.0);
     gl_Position = inConsts.light * worldPos;
 }
\ No newline at end of file
@@ -0,0 +1,18 @@
+//Decode for VertexCompact, the attribute formats already expand it to floats
+//Set as a specialization constant of the vertex stage in VulkanSystem
+
+layout(constant_id = 0) const bool compactVertex = false;
+
+//https://jcgt.org/published/0003/02/01/
+vec3 octDecode(vec2 e){
+	vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if(v.z < 0){
+		vec2 signs = vec2(v.x >= 0 ? 1.0 : -1.0, v.y >= 0 ? 1.0 : -1.0);
+		v.xy = (1.0 - abs(v.yx)) * signs;
+	}
+	return normalize(v);
+}
+
+vec3 decodeDirection(vec3 raw){
+	return compactVertex ? octDecode(raw.xy) : raw;
+}
@@ -7,7 +7,11 @@
 #include <optional>
 #include "MathHelpers.h"
 #include "SceneGraph.h"
+#include "SystemCommonTypes.h"
 #include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
 
 
 
@@ -229,31 +233,6 @@ static bool updateTransform(Driver* driver, float frameTime, SceneGraph* sceneGr
 
 
 //Pre-calculate info needed for all points
-struct frustumInfo {
-	float_3 topNormal;
-	float_3 bottomNormal;
-	float_3 nearNormal;
-	float_3 farNormal;
-	float_3 leftNormal;
-	float_3 rightNormal;
-	float_3 topOrigin;
-	float_3 bottomOrigin;
-	float_3 nearOrigin;
-	float_3 farOrigin;
-	float_3 leftOrigin;
-	float_3 rightOrigin;
-	float nearBottom;
-	float nearTop;
-	float nearLeft;
-	float nearRight;
-	float farTop;
-	float farLeft;
-	float farRight;
-	float farBottom;
-	float farZ;
-	float nearZ;
-};
-
 static frustumInfo findFrustumInfo(DrawCamera camera) {
 	frustumInfo info;
 	//Constraints
@@ -471,6 +450,115 @@ static bool sphereInFrustum(std::pair<float_3, float> boundingSphere, frustumInf
 
 
 
+//Image format for a parsed 2D texture, channel count and encoding come from the texture's semantic
+static VkFormat textureFormat(const Texture& tex) {
+	if (tex.compressedFormat != VK_FORMAT_UNDEFINED) return tex.compressedFormat;
+	if (tex.channels == 1) return VK_FORMAT_R8_UNORM;
+	if (tex.channels == 2) return VK_FORMAT_R8G8_UNORM;
+	return tex.srgb ? VK_FORMAT_R8G8B8A8_SRGB : VK_FORMAT_R8G8B8A8_UNORM;
+}
+
+//Bytes a texture and its mip chain take
+static VkDeviceSize textureMemory(int x, int y, int mipLevels, int texelBytes) {
+	VkDeviceSize bytes = 0;
+	for (int mipLevel = 0; mipLevel < mipLevels; mipLevel++) {
+		bytes += (VkDeviceSize)std::max(x >> mipLevel, 1) * std::max(y >> mipLevel, 1) * texelBytes;
+	}
+	return bytes;
+}
+
+static bool formatFilterable(VkPhysicalDevice physicalDevice, VkFormat format) {
+	VkFormatProperties properties;
+	vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &properties);
+	VkFormatFeatureFlags needed = VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+	return (properties.optimalTilingFeatures & needed) == needed;
+}
+
+//Environment cubes are stored as RGBE, shared exponent floats keep them at four bytes per texel
+//Linear filtering of E5B9G9R9 is optional so half floats are the fallback
+static VkFormat chooseEnvironmentFormat(VkPhysicalDevice physicalDevice) {
+	if (formatFilterable(physicalDevice, VK_FORMAT_E5B9G9R9_UFLOAT_PACK32)) return VK_FORMAT_E5B9G9R9_UFLOAT_PACK32;
+	return VK_FORMAT_R16G16B16A16_SFLOAT;
+}
+
+//https://www.graphics.cornell.edu/~bjw/rgbe.html
+static void decodeRGBE(const unsigned char* rgbe, float* rgb) {
+	if (rgbe[3] == 0) {
+		rgb[0] = rgb[1] = rgb[2] = 0;
+		return;
+	}
+	float scale = std::ldexp(1.f, rgbe[3] - (128 + 8));
+	for (int channel = 0; channel < 3; channel++) rgb[channel] = (rgbe[channel] + 0.5f) * scale;
+}
+
+//https://registry.khronos.org/OpenGL/extensions/EXT/EXT_texture_shared_exponent.txt
+static uint32_t packE5B9G9R9(const float* rgb) {
+	const int mantissaBits = 9, bias = 15;
+	const float sharedMax = 511.f / 512.f * 65536.f;
+	float clamped[3];
+	for (int channel = 0; channel < 3; channel++) clamped[channel] = std::clamp(rgb[channel], 0.f, sharedMax);
+	float maxChannel = std::max({ clamped[0], clamped[1], clamped[2] });
+	int exponent = maxChannel > 0 ? std::max(-bias - 1, (int)std::floor(std::log2(maxChannel))) + 1 + bias : 0;
+	if ((int)std::floor(maxChannel / std::ldexp(1.f, exponent - bias - mantissaBits) + 0.5f) == 1 << mantissaBits) exponent++;
+	float scale = std::ldexp(1.f, exponent - bias - mantissaBits);
+	uint32_t packed = (uint32_t)exponent << 27;
+	for (int channel = 0; channel < 3; channel++) {
+		packed |= (uint32_t)std::floor(clamped[channel] / scale + 0.5f) << (mantissaBits * channel);
+	}
+	return packed;
+}
+
+//Decodes one cube face and rebuilds its mips in linear space, filtering the RGBE bytes would blend exponents
+//Levels are packed back to back in format, offsets gets where each starts
+static std::vector<unsigned char> encodeEnvironmentFace(const Texture& env, int face, VkFormat format, std::vector<VkDeviceSize>& offsets) {
+	int texelBytes = format == VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 ? 4 : 8;
+	std::vector<unsigned char> encoded(textureMemory(env.x, env.y, env.mipLevels, texelBytes));
+	offsets.assign(env.mipLevels, 0);
+
+	int mipX = env.x, mipY = env.y;
+	const unsigned char* faceData = &env.data[4 * (size_t)env.x * env.y * face];
+	std::vector<float> level(3 * (size_t)mipX * mipY);
+	for (size_t texel = 0; texel < (size_t)mipX * mipY; texel++) decodeRGBE(&faceData[4 * texel], &level[3 * texel]);
+
+	VkDeviceSize offset = 0;
+	for (int mipLevel = 0; mipLevel < env.mipLevels; mipLevel++) {
+		if (mipLevel > 0) {
+			//2x2 box filter, odd edges repeat their last texel
+			int nextX = std::max(mipX / 2, 1), nextY = std::max(mipY / 2, 1);
+			std::vector<float> next(3 * (size_t)nextX * nextY);
+			for (int y = 0; y < nextY; y++) {
+				for (int x = 0; x < nextX; x++) {
+					int x0 = std::min(2 * x, mipX - 1), x1 = std::min(2 * x + 1, mipX - 1);
+					int y0 = std::min(2 * y, mipY - 1), y1 = std::min(2 * y + 1, mipY - 1);
+					for (int channel = 0; channel < 3; channel++) {
+						next[3 * ((size_t)y * nextX + x) + channel] = 0.25f * (
+							level[3 * ((size_t)y0 * mipX + x0) + channel] + level[3 * ((size_t)y0 * mipX + x1) + channel] +
+							level[3 * ((size_t)y1 * mipX + x0) + channel] + level[3 * ((size_t)y1 * mipX + x1) + channel]);
+					}
+				}
+			}
+			level.swap(next);
+			mipX = nextX; mipY = nextY;
+		}
+
+		offsets[mipLevel] = offset;
+		for (size_t texel = 0; texel < (size_t)mipX * mipY; texel++) {
+			unsigned char* out = &encoded[offset + texelBytes * texel];
+			if (texelBytes == 4) {
+				uint32_t packed = packE5B9G9R9(&level[3 * texel]);
+				memcpy(out, &packed, sizeof(packed));
+			}
+			else {
+				uint16_t half[4] = { VertexCompact::toHalf(level[3 * texel]), VertexCompact::toHalf(level[3 * texel + 1]),
+					VertexCompact::toHalf(level[3 * texel + 2]), VertexCompact::toHalf(1.f) };
+				memcpy(out, half, sizeof(half));
+			}
+		}
+		offset += (VkDeviceSize)texelBytes * mipX * mipY;
+	}
+	return encoded;
+}
+
 static VkSurfaceFormatKHR chooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR>& availableFormats) {
 	for (const VkSurfaceFormatKHR& availableFormat : availableFormats) {
 
@@ -7,8 +7,11 @@
 
 enum Platform { PLAT_WIN, PLAT_LIN };
 enum  MovementMode { MOVE_STATIC, MOVE_USER, MOVE_DEBUG };
+//Depth state of a pipeline, the prepass lays depth that the main pass then tests for EQUAL
+enum DepthMode { DEPTH_WRITE, DEPTH_ONLY, DEPTH_EQUAL };
 
 const uint32_t MAX_FRAMES_IN_FLIGHT = 2;
+const uint32_t MAX_DENOISE_ITERATIONS = 5;
 
 
 
@@ -21,6 +24,31 @@ struct QueueFamilyIndices {
 	}
 };
 
+struct frustumInfo {
+	float_3 topNormal;
+	float_3 bottomNormal;
+	float_3 nearNormal;
+	float_3 farNormal;
+	float_3 leftNormal;
+	float_3 rightNormal;
+	float_3 topOrigin;
+	float_3 bottomOrigin;
+	float_3 nearOrigin;
+	float_3 farOrigin;
+	float_3 leftOrigin;
+	float_3 rightOrigin;
+	float nearBottom;
+	float nearTop;
+	float nearLeft;
+	float nearRight;
+	float farTop;
+	float farLeft;
+	float farRight;
+	float farBottom;
+	float farZ;
+	float nearZ;
+};
+
 struct SwapChainSupportDetails {
 	VkSurfaceCapabilitiesKHR capabilities;
 	std::vector<VkSurfaceFormatKHR> formats;
@@ -1,11 +1,16 @@
 #pragma once
 #include "MathHelpers.h"
 #include <array>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
 #include<vulkan/vulkan.h>
 
 
 
-//TODO: Split into simple (pos,normal,color,node) and standard (pos, normal,tangent,texcoord,color,node) in the future
+//Interleaved layout kept on the CPU and by RTSystem, VulkanSystem uploads it as the streams below
 struct Vertex {
 	float posX;
 	float posY;
@@ -60,4 +65,209 @@ struct Vertex {
 		attributeDescriptions[5].offset = offsetof(Vertex, node);
 		return attributeDescriptions;
 	};
-};
\ No newline at end of file
+};
+
+//Position stream, the only one depth only passes such as the shadow maps bind
+struct VertexPosition {
+	float posX;
+	float posY;
+	float posZ;
+	int node;
+
+	static std::vector<VertexPosition> fromVertices(const std::vector<Vertex>& vertices) {
+		std::vector<VertexPosition> positions(vertices.size());
+		for (size_t vert = 0; vert < vertices.size(); vert++) {
+			positions[vert].posX = vertices[vert].posX;
+			positions[vert].posY = vertices[vert].posY;
+			positions[vert].posZ = vertices[vert].posZ;
+			positions[vert].node = vertices[vert].node;
+		}
+		return positions;
+	}
+
+	static VkVertexInputBindingDescription getBindingDescription() {
+		VkVertexInputBindingDescription bindingDescription{};
+		bindingDescription.binding = 0;
+		bindingDescription.stride = sizeof(VertexPosition);
+		bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+		return bindingDescription;
+	}
+
+	static std::array<VkVertexInputAttributeDescription, 2> getAttributeDescriptions() {
+		std::array<VkVertexInputAttributeDescription, 2> attributeDescriptions{};
+		attributeDescriptions[0].binding = 0;
+		attributeDescriptions[0].location = 0;
+		attributeDescriptions[0].format = VK_FORMAT_R32G32B32_SFLOAT;
+		attributeDescriptions[0].offset = offsetof(VertexPosition, posX);
+		attributeDescriptions[1].binding = 0;
+		attributeDescriptions[1].location = 5;
+		attributeDescriptions[1].format = VK_FORMAT_R32_SINT;
+		attributeDescriptions[1].offset = offsetof(VertexPosition, node);
+		return attributeDescriptions;
+	};
+};
+
+//Attribute stream, bound next to VertexPosition by the shaded passes
+struct VertexAttributes {
+	float normalX;
+	float normalY;
+	float normalZ;
+	float tangentX;
+	float tangentY;
+	float tangentZ;
+	float texcoordU;
+	float texcoordV;
+	float colorR;
+	float colorG;
+	float colorB;
+
+	static std::vector<VertexAttributes> fromVertices(const std::vector<Vertex>& vertices) {
+		std::vector<VertexAttributes> attributes(vertices.size());
+		for (size_t vert = 0; vert < vertices.size(); vert++) {
+			attributes[vert].normalX = vertices[vert].normalX;
+			attributes[vert].normalY = vertices[vert].normalY;
+			attributes[vert].normalZ = vertices[vert].normalZ;
+			attributes[vert].tangentX = vertices[vert].tangentX;
+			attributes[vert].tangentY = vertices[vert].tangentY;
+			attributes[vert].tangentZ = vertices[vert].tangentZ;
+			attributes[vert].texcoordU = vertices[vert].texcoordU;
+			attributes[vert].texcoordV = vertices[vert].texcoordV;
+			attributes[vert].colorR = vertices[vert].colorR;
+			attributes[vert].colorG = vertices[vert].colorG;
+			attributes[vert].colorB = vertices[vert].colorB;
+		}
+		return attributes;
+	}
+
+	static VkVertexInputBindingDescription getBindingDescription() {
+		VkVertexInputBindingDescription bindingDescription{};
+		bindingDescription.binding = 1;
+		bindingDescription.stride = sizeof(VertexAttributes);
+		bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+		return bindingDescription;
+	}
+
+	static std::array<VkVertexInputAttributeDescription, 4> getAttributeDescriptions() {
+		std::array<VkVertexInputAttributeDescription, 4> attributeDescriptions{};
+		attributeDescriptions[0].binding = 1;
+		attributeDescriptions[0].location = 1;
+		attributeDescriptions[0].format = VK_FORMAT_R32G32B32_SFLOAT;
+		attributeDescriptions[0].offset = offsetof(VertexAttributes, normalX);
+		attributeDescriptions[1].binding = 1;
+		attributeDescriptions[1].location = 2;
+		attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT;
+		attributeDescriptions[1].offset = offsetof(VertexAttributes, tangentX);
+		attributeDescriptions[2].binding = 1;
+		attributeDescriptions[2].location = 3;
+		attributeDescriptions[2].format = VK_FORMAT_R32G32_SFLOAT;
+		attributeDescriptions[2].offset = offsetof(VertexAttributes, texcoordU);
+		attributeDescriptions[3].binding = 1;
+		attributeDescriptions[3].location = 4;
+		attributeDescriptions[3].format = VK_FORMAT_R32G32B32_SFLOAT;
+		attributeDescriptions[3].offset = offsetof(VertexAttributes, colorR);
+		return attributeDescriptions;
+	};
+};
+
+//16 byte encoding of VertexAttributes, selected at load time with --compact-vertices
+//Decoded by the vertex shaders when their compactVertex specialization constant is set
+struct VertexCompact {
+	int16_t normalOct[2];
+	int16_t tangentOct[2];
+	uint16_t texcoordHalf[2];
+	uint8_t color[4];
+
+	//Octahedral mapping, reversed by octDecode in vertex.glsl
+	//https://jcgt.org/published/0003/02/01/
+	static void octEncode(float x, float y, float z, int16_t out[2]) {
+		float l1 = std::abs(x) + std::abs(y) + std::abs(z);
+		if (l1 == 0) {
+			out[0] = 0; out[1] = 0;
+			return;
+		}
+		float u = x / l1;
+		float v = y / l1;
+		if (z < 0) {
+			float foldU = (1 - std::abs(v)) * (u >= 0 ? 1.f : -1.f);
+			float foldV = (1 - std::abs(u)) * (v >= 0 ? 1.f : -1.f);
+			u = foldU;
+			v = foldV;
+		}
+		out[0] = (int16_t)std::round(std::clamp(u, -1.f, 1.f) * 32767.f);
+		out[1] = (int16_t)std::round(std::clamp(v, -1.f, 1.f) * 32767.f);
+	}
+
+	static uint16_t toHalf(float f) {
+		uint32_t bits;
+		memcpy(&bits, &f, sizeof(float));
+		uint16_t sign = (uint16_t)((bits >> 16) & 0x8000u);
+		int exponent = (int)((bits >> 23) & 0xffu) - 127 + 15;
+		uint32_t mantissa = bits & 0x7fffffu;
+		if (exponent >= 31) return sign | 0x7bffu;
+		if (exponent <= 0) {
+			if (exponent < -10) return sign;
+			mantissa |= 0x800000u;
+			int shift = 14 - exponent;
+			uint16_t half = (uint16_t)(mantissa >> shift);
+			if ((mantissa >> (shift - 1)) & 1u) half++;
+			return sign | half;
+		}
+		uint16_t half = (uint16_t)((exponent << 10) | (mantissa >> 13));
+		if (mantissa & 0x1000u) half++;
+		if ((half & 0x7c00u) == 0x7c00u) half = 0x7bffu;
+		return sign | half;
+	}
+
+	static VertexCompact fromVertex(const Vertex& vertex) {
+		VertexCompact compact{};
+		octEncode(vertex.normalX, vertex.normalY, vertex.normalZ, compact.normalOct);
+		octEncode(vertex.tangentX, vertex.tangentY, vertex.tangentZ, compact.tangentOct);
+		compact.texcoordHalf[0] = toHalf(vertex.texcoordU);
+		compact.texcoordHalf[1] = toHalf(vertex.texcoordV);
+		compact.color[0] = (uint8_t)std::round(std::clamp(vertex.colorR, 0.f, 1.f) * 255.f);
+		compact.color[1] = (uint8_t)std::round(std::clamp(vertex.colorG, 0.f, 1.f) * 255.f);
+		compact.color[2] = (uint8_t)std::round(std::clamp(vertex.colorB, 0.f, 1.f) * 255.f);
+		compact.color[3] = 255;
+		return compact;
+	}
+
+	static std::vector<VertexCompact> fromVertices(const std::vector<Vertex>& vertices) {
+		std::vector<VertexCompact> compacts(vertices.size());
+		for (size_t vert = 0; vert < vertices.size(); vert++) {
+			compacts[vert] = fromVertex(vertices[vert]);
+		}
+		return compacts;
+	}
+
+	static VkVertexInputBindingDescription getBindingDescription() {
+		VkVertexInputBindingDescription bindingDescription{};
+		bindingDescription.binding = 1;
+		bindingDescription.stride = sizeof(VertexCompact);
+		bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+		return bindingDescription;
+	}
+
+	//Same locations as VertexAttributes, components the formats lack read as 0
+	static std::array<VkVertexInputAttributeDescription, 4> getAttributeDescriptions() {
+		std::array<VkVertexInputAttributeDescription, 4> attributeDescriptions{};
+		attributeDescriptions[0].binding = 1;
+		attributeDescriptions[0].location = 1;
+		attributeDescriptions[0].format = VK_FORMAT_R16G16_SNORM;
+		attributeDescriptions[0].offset = offsetof(VertexCompact, normalOct);
+		attributeDescriptions[1].binding = 1;
+		attributeDescriptions[1].location = 2;
+		attributeDescriptions[1].format = VK_FORMAT_R16G16_SNORM;
+		attributeDescriptions[1].offset = offsetof(VertexCompact, tangentOct);
+		attributeDescriptions[2].binding = 1;
+		attributeDescriptions[2].location = 3;
+		attributeDescriptions[2].format = VK_FORMAT_R16G16_SFLOAT;
+		attributeDescriptions[2].offset = offsetof(VertexCompact, texcoordHalf);
+		attributeDescriptions[3].binding = 1;
+		attributeDescriptions[3].location = 4;
+		attributeDescriptions[3].format = VK_FORMAT_R8G8B8A8_UNORM;
+		attributeDescriptions[3].offset = offsetof(VertexCompact, color);
+		return attributeDescriptions;
+	};
+};
+static_assert(sizeof(VertexPosition) == 16, "VertexPosition should stay 16 bytes");
+static_assert(sizeof(VertexCompact) == 16, "VertexCompact should stay 16 bytes");
@@ -15,6 +15,9 @@
 #endif //PLATFORM_LIN
 #include <set>
 #include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <numeric>
 #include "MathHelpers.h"
 #include <chrono>
 #include "SceneGraph.h"
@@ -25,6 +28,11 @@
 #include "SystemCommonTypes.h"
 //https://vulkan-tutorial.com
 
+//Deferred G-buffer: ambient and unlit color, light scale, octahedral normal with roughness and the 2 bit lighting model
+static const int G_BUFFER_COUNT = 3;
+static const VkFormat G_BUFFER_FORMATS[G_BUFFER_COUNT] = {
+	VK_FORMAT_R16G16B16A16_SFLOAT, VK_FORMAT_R8G8B8A8_UNORM, VK_FORMAT_A2B10G10R10_UNORM_PACK32 };
+
 void VulkanSystem::initVulkan(DrawList drawList, std::string cameraName) {
 	//Vertex shader
 	vertices = drawList.vertexPool;
@@ -47,9 +55,13 @@ void VulkanSystem::initVulkan(DrawList drawList, std::string cameraName) {
 	
 	//Lights
 	rawEnvironment = drawList.environmentMap;
+	environmentSH = drawList.environmentSH;
 	lightPool = drawList.lights;
 	worldTolightPool = drawList.worldToLights;
 	worldTolightPerspPool = drawList.worldToLightsPersp;
+	for (size_t light = 0; light < lightPool.size(); light++) {
+		gpuLights.push_back(GPULight::fromLight(lightPool[light], worldTolightPool[light]));
+	}
 
 	//Animate and bounding box
 	drawPools = drawList.drawPools;
@@ -132,6 +144,9 @@ void VulkanSystem::listPhysicalDevices() {
 void VulkanSystem::runDrivers(float frameTime, SceneGraph* sceneGraphP, bool loop) {
 	frameTime *= playbackSpeed; //1 when not in headless mode
 	frameTime *= (playingAnimation ? (forwardAnimation ? 1 : -1) : 0);
+	//A paused animation keeps evaluating to the same pose, so the scene is not navigated again
+	if (frameTime == 0 && driversEvaluated) return;
+	driversEvaluated = true;
 	bool renavigate = false;
 	for (size_t ind = 0; ind < nodeDrivers.size(); ind++) {
 		Driver* driver = nodeDrivers.data() + ind;
@@ -143,6 +158,24 @@ void VulkanSystem::runDrivers(float frameTime, SceneGraph* sceneGraphP, bool loo
 	}
 	if (renavigate) {
 		DrawList drawList = sceneGraphP->navigateSceneGraph(false, poolSize);
+		//Environment transforms also carry worldToEnvironment, so moving the environment dirties slots whose transform is unchanged
+		//Normal transforms change only with one of the two, so they need no comparison of their own
+		if (drawList.transformPools.size() != transformPools.size()) resetDirty();
+		else {
+			bool environment = rawEnvironment.has_value();
+			for (size_t pool = 0; pool < transformPools.size(); pool++) {
+				markDirty(pool, transformPools[pool], drawList.transformPools[pool]);
+				if (environment) markDirty(pool, transformEnvironmentPools[pool], drawList.environmentTransformPools[pool]);
+			}
+			//Instanced slots hold the culled instances, so a moved environment dirties the whole pool
+			size_t instPools = std::min(transformEnvironmentInstPoolsStore.size(), drawList.instancedEnvironmentTransformPools.size());
+			for (size_t pool = 0; pool < instPools && environment; pool++) {
+				const std::vector<mat44<float>>& before = transformEnvironmentInstPoolsStore[pool];
+				const std::vector<mat44<float>>& after = drawList.instancedEnvironmentTransformPools[pool];
+				if (before.size() == after.size() && memcmp(before.data(), after.data(), sizeof(mat44<float>) * after.size()) == 0) continue;
+				markDirty(transformPools.size() + pool, std::vector<mat44<float>>(), after);
+			}
+		}
 		transformPools = drawList.transformPools;
 		transformInstPoolsStore = drawList.instancedTransformPools;
 		transformNormalPools = drawList.normalTransformPools;
@@ -150,6 +183,8 @@ void VulkanSystem::runDrivers(float frameTime, SceneGraph* sceneGraphP, bool loo
 		transformEnvironmentPools = drawList.environmentTransformPools;
 		transformEnvironmentInstPoolsStore = drawList.instancedEnvironmentTransformPools;
 		cameras = drawList.cameras;
+		cullTreesDirty = true;
+		stateVersion++;
 	}
 }
 
@@ -161,6 +196,7 @@ void VulkanSystem::setDriverRuntime(float time) {
 	for (size_t ind = 0; ind < nodeDrivers.size(); ind++) {
 		nodeDrivers[ind].currentRuntime = time;
 	}
+	driversEvaluated = false;
 }
 
 void VulkanSystem::cleanup() {
@@ -198,29 +234,24 @@ void VulkanSystem::cleanup() {
 	vkDestroyImageView(device, defaultShadowImageView, nullptr);
 	vkDestroyImage(device, defaultShadowImage, nullptr);
 	vkFreeMemory(device, defaultShadowImageMemory, nullptr);
-	for (int pool = 0; pool < transformPools.size(); pool++) {
-		for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
-			vkDestroyBuffer(device, uniformBuffersTransformsPools[pool][frame], nullptr);
-			vkFreeMemory(device, uniformBuffersMemoryTransformsPools[pool][frame], nullptr);
-			vkDestroyBuffer(device, uniformBuffersEnvironmentTransformsPools[pool][frame], nullptr);
-			vkFreeMemory(device, uniformBuffersMemoryEnvironmentTransformsPools[pool][frame], nullptr);
-			vkDestroyBuffer(device, uniformBuffersNormalTransformsPools[pool][frame], nullptr);
-			vkFreeMemory(device, uniformBuffersMemoryNormalTransformsPools[pool][frame], nullptr);
-			vkDestroyBuffer(device, uniformBuffersMaterialsPools[pool][frame], nullptr);
-			vkFreeMemory(device, uniformBuffersMemoryMaterialsPools[pool][frame], nullptr);
-			vkDestroyBuffer(device, uniformBuffersCamerasPools[pool][frame], nullptr);
-			vkFreeMemory(device, uniformBuffersMemoryCamerasPools[pool][frame], nullptr);
-			vkDestroyBuffer(device, uniformBuffersLightsPools[pool][frame], nullptr);
-			vkFreeMemory(device, uniformBuffersMemoryLightsPools[pool][frame], nullptr);
-			vkDestroyBuffer(device, uniformBuffersLightTransformsPools[pool][frame], nullptr);
-			vkFreeMemory(device, uniformBuffersMemoryLightTransformsPools[pool][frame], nullptr);
+	auto destroyFrameBuffers = [&](std::vector<VkBuffer>& buffers, std::vector<VkDeviceMemory>& memorys) {
+		for (size_t frame = 0; frame < buffers.size(); frame++) {
+			vkDestroyBuffer(device, buffers[frame], nullptr);
+			vkFreeMemory(device, memorys[frame], nullptr);
 		}
-	}
+	};
+	destroyFrameBuffers(storageBuffersTransforms, storageBuffersMemoryTransforms);
+	destroyFrameBuffers(storageBuffersNormalTransforms, storageBuffersMemoryNormalTransforms);
+	destroyFrameBuffers(storageBuffersEnvironmentTransforms, storageBuffersMemoryEnvironmentTransforms);
+	destroyFrameBuffers(storageBuffersMaterials, storageBuffersMemoryMaterials);
+	destroyFrameBuffers(storageBuffersLights, storageBuffersMemoryLights);
+	destroyFrameBuffers(storageBuffersLightPerspective, storageBuffersMemoryLightPerspective);
+	destroyFrameBuffers(uniformBuffersCameras, uniformBuffersMemoryCameras);
+	destroyFrameBuffers(uniformBuffersClusters, uniformBuffersMemoryClusters);
+	destroyFrameBuffers(storageBuffersClusterRanges, storageBuffersMemoryClusterRanges);
+	destroyFrameBuffers(storageBuffersClusterLights, storageBuffersMemoryClusterLights);
 	vkDestroyDescriptorPool(device, descriptorPoolHDR, nullptr);
-	for (int i = 0; i < lightPool.size(); i++) {
-		vkDestroyDescriptorPool(device, descriptorPoolShadows[i], nullptr);
-	}
-	for (int i = 0; i < lightPool.size() + 2; i++) {
+	for (int i = 0; i < descriptorSetLayouts.size(); i++) {
 		vkDestroyDescriptorSetLayout(device, descriptorSetLayouts[i], nullptr);
 	}
 	for (int pool = 0; pool < indexBufferMemorys.size(); pool++) {
@@ -235,13 +266,30 @@ void VulkanSystem::cleanup() {
 	vkFreeMemory(device, vertexBufferMemory, nullptr);
 	vkDestroyBuffer(device, vertexInstBuffer, nullptr);
 	vkFreeMemory(device, vertexInstBufferMemory, nullptr);
+	vkDestroyBuffer(device, vertexAttributeBuffer, nullptr);
+	vkFreeMemory(device, vertexAttributeBufferMemory, nullptr);
+	vkDestroyBuffer(device, vertexInstAttributeBuffer, nullptr);
+	vkFreeMemory(device, vertexInstAttributeBufferMemory, nullptr);
 	vkDestroyPipeline(device, graphicsPipeline, nullptr);
 	vkDestroyPipeline(device, graphicsInstPipeline, nullptr);
-	for (int i = 0; i < lightPool.size(); i++) {
-		vkDestroyPipelineLayout(device, pipelineLayoutShadows[i], nullptr);
+	if (depthPrepass) {
+		vkDestroyPipeline(device, depthPipeline, nullptr);
+		vkDestroyPipeline(device, depthInstPipeline, nullptr);
 	}
+	if (countFragments) vkDestroyQueryPool(device, fragmentQueryPool, nullptr);
+	vkDestroyPipelineLayout(device, pipelineLayoutShadow, nullptr);
 	vkDestroyPipelineLayout(device, pipelineLayoutHDR, nullptr);
 	vkDestroyPipelineLayout(device, pipelineLayoutFinal, nullptr);
+	if (deferred) {
+		vkDestroyPipeline(device, graphicsPipelineDeferred, nullptr);
+		vkDestroyPipelineLayout(device, pipelineLayoutDeferred, nullptr);
+		vkDestroyDescriptorPool(device, descriptorPoolDeferred, nullptr);
+	}
+	for (size_t target = 0; target < gBufferImages.size(); target++) {
+		vkDestroyImageView(device, gBufferImageViews[target], nullptr);
+		vkDestroyImage(device, gBufferImages[target], nullptr);
+		vkFreeMemory(device, gBufferMemorys[target], nullptr);
+	}
 	vkDestroyRenderPass(device, renderPass, nullptr);
 	for(int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
 	{
@@ -250,6 +298,10 @@ void VulkanSystem::cleanup() {
 		vkDestroyFence(device, inFlightFences[i], nullptr);
 	}
 	vkDestroyCommandPool(device, commandPool, nullptr);
+	recordWorkers.stop();
+	for (size_t pool = 0; pool < recordCommandPools.size(); pool++) {
+		vkDestroyCommandPool(device, recordCommandPools[pool], nullptr);
+	}
 	vkDestroyDevice(device, nullptr);
 	vkDestroySurfaceKHR(instance, surface, nullptr);
 
@@ -445,6 +497,14 @@ int VulkanSystem::isDeviceSuitable(VkPhysicalDevice device) {
 	VkPhysicalDeviceFeatures deviceFeatures;
 	vkGetPhysicalDeviceFeatures(device, &deviceFeatures);
 	if (!deviceFeatures.samplerAnisotropy) return -1;
+	VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures{};
+	indexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+	VkPhysicalDeviceFeatures2 deviceFeatures2{};
+	deviceFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+	deviceFeatures2.pNext = &indexingFeatures;
+	vkGetPhysicalDeviceFeatures2(device, &deviceFeatures2);
+	if (!indexingFeatures.runtimeDescriptorArray || !indexingFeatures.descriptorBindingPartiallyBound ||
+		!indexingFeatures.shaderSampledImageArrayNonUniformIndexing) return -1;
 
 	QueueFamilyIndices indices = findQueueFamilies(device);
 	if (!indices.isComplete() || !CheckDeviceExtensionSupport(device)) {
@@ -517,7 +577,27 @@ void VulkanSystem::createLogicalDevice() {
 		static_cast<uint32_t>(deviceQueueCreateInfos.size());
 	createInfo.pQueueCreateInfos = deviceQueueCreateInfos.data();
 	physicalDeviceFeatures.samplerAnisotropy = VK_TRUE;
-	createInfo.pEnabledFeatures = &physicalDeviceFeatures;
+	//Fragment invocation counts, secondaries recorded inside the query need it inherited
+	VkPhysicalDeviceFeatures supportedFeatures;
+	vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+	physicalDeviceFeatures.pipelineStatisticsQuery = supportedFeatures.pipelineStatisticsQuery;
+	physicalDeviceFeatures.inheritedQueries = supportedFeatures.inheritedQueries;
+	countFragments = supportedFeatures.pipelineStatisticsQuery && (recordThreads <= 1 || supportedFeatures.inheritedQueries);
+	//BC formats from .ktx2 textures, without it they fall back to their png
+	physicalDeviceFeatures.textureCompressionBC = supportedFeatures.textureCompressionBC;
+	compressedTextures = supportedFeatures.textureCompressionBC;
+	//Bindless scene set, texture arrays are unsized in the shaders and indexed per fragment
+	VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures{};
+	indexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+	indexingFeatures.runtimeDescriptorArray = VK_TRUE;
+	indexingFeatures.descriptorBindingPartiallyBound = VK_TRUE;
+	indexingFeatures.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+	VkPhysicalDeviceFeatures2 deviceFeatures2{};
+	deviceFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+	deviceFeatures2.features = physicalDeviceFeatures;
+	deviceFeatures2.pNext = &indexingFeatures;
+	createInfo.pNext = &deviceFeatures2;
+	createInfo.pEnabledFeatures = nullptr;
 	createInfo.enabledExtensionCount =
 		static_cast<uint32_t>(deviceExtensions.size());
 	createInfo.ppEnabledExtensionNames = deviceExtensions.data();
@@ -645,12 +725,22 @@ void VulkanSystem::createAttachments() {
 		shadowImages[i].resize(swapChainImages.size());
 		shadowMemorys[i].resize(swapChainImages.size());
 	}
+	gBufferImages.resize(deferred ? swapChainImages.size() * G_BUFFER_COUNT : 0);
+	gBufferMemorys.resize(gBufferImages.size());
 	for (size_t image = 0; image < swapChainImages.size(); image++) {
 		createImage(extent.width, extent.height, VK_FORMAT_R32G32B32A32_SFLOAT,
 			VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
 			| VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT, 0,
 			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, attachmentImages[image],
 			attachmentMemorys[image]);
+		for (int target = 0; target < G_BUFFER_COUNT && deferred; target++) {
+			//Transient, the G-buffer never leaves the render pass
+			createImage(extent.width, extent.height, G_BUFFER_FORMATS[target],
+				VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+				| VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT, 0,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, gBufferImages[image * G_BUFFER_COUNT + target],
+				gBufferMemorys[image * G_BUFFER_COUNT + target]);
+		}
 		for (int i = 0; i < lightPool.size(); i++) {
 			uint32_t shadowRes = lightPool[i].shadowRes;
 			if (shadowRes == 0) shadowRes = 1;
@@ -676,6 +766,11 @@ void VulkanSystem::createImageViews() {
 		attachmentImageViews[imageIndex] = createImageView(
 			attachmentImages[imageIndex], VK_FORMAT_R32G32B32A32_SFLOAT);
 	}
+	gBufferImageViews.resize(gBufferImages.size());
+	for (size_t imageIndex = 0; imageIndex < gBufferImages.size(); imageIndex++) {
+		gBufferImageViews[imageIndex] = createImageView(
+			gBufferImages[imageIndex], G_BUFFER_FORMATS[imageIndex % G_BUFFER_COUNT]);
+	}
 	shadowImageViews.resize(shadowImages.size());
 	shadowSamplers.resize(shadowImages.size());
 	for (int i = 0; i < shadowImages.size(); i++) {
@@ -785,8 +880,10 @@ void VulkanSystem::createRenderPasses() {
 		}
 	}
 
-	std::vector<VkSubpassDescription> finalSubpasses = std::vector<VkSubpassDescription>(2);
-	for (int i = 0; i < 2; i++) finalSubpasses[i] = {};
+	//Deferred inserts a lighting subpass between the G-buffer and the present subpass
+	int mainSubpassCount = deferred ? 3 : 2;
+	std::vector<VkSubpassDescription> finalSubpasses = std::vector<VkSubpassDescription>(mainSubpassCount);
+	for (int i = 0; i < mainSubpassCount; i++) finalSubpasses[i] = {};
 
 	VkAttachmentDescription colorAttachmentHDR{};
 	colorAttachmentHDR.format = VK_FORMAT_R32G32B32A32_SFLOAT;
@@ -837,20 +934,45 @@ void VulkanSystem::createRenderPasses() {
 	finalSubpasses[0].inputAttachmentCount = 0;
 	finalSubpasses[0].pInputAttachments = nullptr;
 
+	//G-buffer targets follow the HDR attachment, the lighting subpass reads them and depth back
+	std::vector<VkAttachmentDescription> gBufferAttachments(G_BUFFER_COUNT);
+	std::vector<VkAttachmentReference> gBufferRefs(G_BUFFER_COUNT);
+	std::vector<VkAttachmentReference> gBufferInputRefs(G_BUFFER_COUNT + 1);
+	for (int target = 0; target < G_BUFFER_COUNT; target++) {
+		gBufferAttachments[target] = colorAttachmentHDR;
+		gBufferAttachments[target].format = G_BUFFER_FORMATS[target];
+		gBufferRefs[target].attachment = 3 + target;
+		gBufferRefs[target].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+		gBufferInputRefs[target].attachment = 3 + target;
+		gBufferInputRefs[target].layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	}
+	gBufferInputRefs[G_BUFFER_COUNT].attachment = 1;
+	gBufferInputRefs[G_BUFFER_COUNT].layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+	if (deferred) {
+		finalSubpasses[0].colorAttachmentCount = G_BUFFER_COUNT;
+		finalSubpasses[0].pColorAttachments = gBufferRefs.data();
+
+		finalSubpasses[1].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+		finalSubpasses[1].colorAttachmentCount = 1;
+		finalSubpasses[1].pColorAttachments = &colorAttachmentRefHDR;
+		finalSubpasses[1].inputAttachmentCount = gBufferInputRefs.size();
+		finalSubpasses[1].pInputAttachments = gBufferInputRefs.data();
+	}
+
 	//https://www.saschawillems.de/blog/2018/07/19/vulkan-input-attachments-and-sub-passes/
 	VkAttachmentReference inputRef;
 	inputRef.attachment = 2;
 	inputRef.layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
 	
-	finalSubpasses[1].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-	finalSubpasses[1].colorAttachmentCount = 1;
-	finalSubpasses[1].pColorAttachments = &colorAttachmentRefFinal;
-	finalSubpasses[1].inputAttachmentCount = 1;
-	finalSubpasses[1].pInputAttachments = &inputRef;
+	finalSubpasses.back().pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	finalSubpasses.back().colorAttachmentCount = 1;
+	finalSubpasses.back().pColorAttachments = &colorAttachmentRefFinal;
+	finalSubpasses.back().inputAttachmentCount = 1;
+	finalSubpasses.back().pInputAttachments = &inputRef;
 
 	//Dependency for subpass before render pass
-	std::vector<VkSubpassDependency> dependencies = std::vector<VkSubpassDependency>(2);
+	std::vector<VkSubpassDependency> dependencies = std::vector<VkSubpassDependency>(mainSubpassCount);
 
 	//Stencil buffer pass to render pass
 	dependencies[0] = {};
@@ -864,20 +986,35 @@ void VulkanSystem::createRenderPasses() {
 	dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
 		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 
+	//G-buffer pass to lighting pass
+	if (deferred) {
+		dependencies[1] = {};
+		dependencies[1].srcSubpass = 0;
+		dependencies[1].dstSubpass = 1;
+		dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+			VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+		dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+		dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+			VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+		dependencies[1].dstAccessMask = VK_ACCESS_INPUT_ATTACHMENT_READ_BIT;
+		dependencies[1].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+	}
+
 	//Render pass to present pass
-	dependencies[1] = {};
-	dependencies[1].srcSubpass = 0;
-	dependencies[1].dstSubpass = 1;
-	dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-	dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-	dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-	dependencies[1].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+	dependencies.back() = {};
+	dependencies.back().srcSubpass = mainSubpassCount - 2;
+	dependencies.back().dstSubpass = mainSubpassCount - 1;
+	dependencies.back().srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	dependencies.back().dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	dependencies.back().srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	dependencies.back().dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	dependencies.back().dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
 
 	std::vector<VkAttachmentDescription> attachments;
 	attachments.push_back(colorAttachmentFinal);
 	attachments.push_back(depthAttachment);
 	attachments.push_back(colorAttachmentHDR);
+	if (deferred) attachments.insert(attachments.end(), gBufferAttachments.begin(), gBufferAttachments.end());
 	VkRenderPassCreateInfo renderPassInfo{};
 	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
 	renderPassInfo.attachmentCount = attachments.size();
@@ -894,31 +1031,13 @@ void VulkanSystem::createRenderPasses() {
 
 void VulkanSystem::createDescriptorSetLayout() {
 
-	descriptorSetLayouts.resize(2 + lightPool.size());
-
-	for (int i = 0; i < lightPool.size(); i++) {
-		VkDescriptorSetLayoutBinding meshBinding{};
-		meshBinding.binding = 0;
-		meshBinding.descriptorCount = 1;
-		meshBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-		meshBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-
-		VkDescriptorSetLayoutCreateInfo layoutInfoShadow{};
-		layoutInfoShadow.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-		layoutInfoShadow.bindingCount = 1;
-		layoutInfoShadow.pBindings = &meshBinding;
-		if (vkCreateDescriptorSetLayout(
-			device, &layoutInfoShadow, nullptr, &descriptorSetLayouts[i]) != VK_SUCCESS) {
-			throw std::runtime_error("ERROR: Failed to create a descriptor set layout in Vulkan System.");
-		}
-	}
-
+	//[0] is the bindless scene set shared by the main and shadow pipelines, [1] the present input, [2] the deferred G-buffer
+	descriptorSetLayouts.resize(deferred ? 3 : 2);
 
-	
 	VkDescriptorSetLayoutBinding transformBinding{};
 	transformBinding.binding = 0;
 	transformBinding.descriptorCount = 1;
-	transformBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	transformBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
 	transformBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 
 	VkDescriptorSetLayoutBinding cameraBinding{};
@@ -930,19 +1049,20 @@ void VulkanSystem::createDescriptorSetLayout() {
 	VkDescriptorSetLayoutBinding materialBinding{};
 	materialBinding.binding = 2;
 	materialBinding.descriptorCount = 1;
-	materialBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	materialBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
 	materialBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 
+	//Sampler arrays are sized by the scene and may be left partially bound
 	VkDescriptorSetLayoutBinding textureBinding{};
 	textureBinding.binding = 3;
-	textureBinding.descriptorCount = rawTextures.size(); 
+	textureBinding.descriptorCount = std::max<uint32_t>(rawTextures.size(), 1);
 	textureBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
 	textureBinding.pImmutableSamplers = nullptr;
 	textureBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 
 	VkDescriptorSetLayoutBinding cubeBinding{};
 	cubeBinding.binding = 4;
-	cubeBinding.descriptorCount = rawCubes.size();
+	cubeBinding.descriptorCount = std::max<uint32_t>(rawCubes.size(), 1);
 	cubeBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
 	cubeBinding.pImmutableSamplers = nullptr;
 	cubeBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
@@ -954,34 +1074,23 @@ void VulkanSystem::createDescriptorSetLayout() {
 	LUTBinding.pImmutableSamplers = nullptr;
 	LUTBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 
-
-
-	VkDescriptorSetLayoutBinding lightTransformBinding{};
-	lightTransformBinding.binding = 6;
-	lightTransformBinding.descriptorCount = 1;
-	lightTransformBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	lightTransformBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
-
 	VkDescriptorSetLayoutBinding lightBinding{};
 	lightBinding.binding = 7;
 	lightBinding.descriptorCount = 1;
-	lightBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	lightBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
 	lightBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 
-
-
 	VkDescriptorSetLayoutBinding shadowMapBinding{};
 	shadowMapBinding.binding = 8;
-	shadowMapBinding.descriptorCount = lightPool.size();
+	shadowMapBinding.descriptorCount = std::max<uint32_t>(lightPool.size(), 1);
 	shadowMapBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
 	shadowMapBinding.pImmutableSamplers = nullptr;
 	shadowMapBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 
-
 	VkDescriptorSetLayoutBinding lightPerspectiveBinding{};
 	lightPerspectiveBinding.binding = 9;
 	lightPerspectiveBinding.descriptorCount = 1;
-	lightPerspectiveBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	lightPerspectiveBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
 	lightPerspectiveBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 
 	VkDescriptorSetLayoutBinding environmentBinding{};
@@ -994,27 +1103,57 @@ void VulkanSystem::createDescriptorSetLayout() {
 	VkDescriptorSetLayoutBinding normTransformBinding{};
 	normTransformBinding.binding = 11;
 	normTransformBinding.descriptorCount = 1;
-	normTransformBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	normTransformBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
 	normTransformBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 
 	VkDescriptorSetLayoutBinding envTransformBinding{};
 	envTransformBinding.binding = 12;
 	envTransformBinding.descriptorCount = 1;
-	envTransformBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	envTransformBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
 	envTransformBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 
 
+	//Light clusters, see LightClusters.h
+	VkDescriptorSetLayoutBinding clusterInfoBinding{};
+	clusterInfoBinding.binding = 13;
+	clusterInfoBinding.descriptorCount = 1;
+	clusterInfoBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	clusterInfoBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+	VkDescriptorSetLayoutBinding clusterRangeBinding{};
+	clusterRangeBinding.binding = 14;
+	clusterRangeBinding.descriptorCount = 1;
+	clusterRangeBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	clusterRangeBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+	VkDescriptorSetLayoutBinding clusterLightBinding{};
+	clusterLightBinding.binding = 15;
+	clusterLightBinding.descriptorCount = 1;
+	clusterLightBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	clusterLightBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
 	VkDescriptorSetLayoutBinding bindings[] = { 
 		transformBinding, cameraBinding, materialBinding,textureBinding, 
-		cubeBinding, LUTBinding, lightTransformBinding, lightBinding, shadowMapBinding, lightPerspectiveBinding,
+		cubeBinding, LUTBinding, lightBinding, shadowMapBinding, lightPerspectiveBinding,
+		clusterInfoBinding, clusterRangeBinding, clusterLightBinding,
 		environmentBinding, normTransformBinding, envTransformBinding};
+	uint32_t bindingCount = rawEnvironment.has_value() ? 15 : 12;
+	std::vector<VkDescriptorBindingFlagsEXT> bindingFlags(bindingCount, 0);
+	bindingFlags[3] = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT;
+	bindingFlags[4] = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT;
+	bindingFlags[7] = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT;
+	VkDescriptorSetLayoutBindingFlagsCreateInfoEXT bindingFlagsInfo{};
+	bindingFlagsInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+	bindingFlagsInfo.bindingCount = bindingCount;
+	bindingFlagsInfo.pBindingFlags = bindingFlags.data();
 
 	VkDescriptorSetLayoutCreateInfo layoutInfo{};
 	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-	layoutInfo.bindingCount = rawEnvironment.has_value() ? 13 : 10;
+	layoutInfo.pNext = &bindingFlagsInfo;
+	layoutInfo.bindingCount = bindingCount;
 	layoutInfo.pBindings = bindings;
 	if (vkCreateDescriptorSetLayout(
-		device, &layoutInfo, nullptr, &descriptorSetLayouts[lightPool.size()]) != VK_SUCCESS) {
+		device, &layoutInfo, nullptr, &descriptorSetLayouts[0]) != VK_SUCCESS) {
 		throw std::runtime_error("ERROR: Failed to create a descriptor set layout in Vulkan System.");
 	}
 
@@ -1030,32 +1169,58 @@ void VulkanSystem::createDescriptorSetLayout() {
 	layoutInfoFinal.bindingCount = 1;
 	layoutInfoFinal.pBindings = &hdrBinding;
 	if (vkCreateDescriptorSetLayout(
-		device, &layoutInfoFinal, nullptr, &descriptorSetLayouts[lightPool.size() + 1]) != VK_SUCCESS) {
+		device, &layoutInfoFinal, nullptr, &descriptorSetLayouts[1]) != VK_SUCCESS) {
 		throw std::runtime_error("ERROR: Failed to create a descriptor set layout in Vulkan System.");
 	}
 
+	if (deferred) {
+		//G-buffer targets then depth
+		std::vector<VkDescriptorSetLayoutBinding> gBufferBindings(G_BUFFER_COUNT + 1, hdrBinding);
+		for (uint32_t binding = 0; binding < gBufferBindings.size(); binding++) gBufferBindings[binding].binding = binding;
+		VkDescriptorSetLayoutCreateInfo layoutInfoDeferred{};
+		layoutInfoDeferred.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+		layoutInfoDeferred.bindingCount = gBufferBindings.size();
+		layoutInfoDeferred.pBindings = gBufferBindings.data();
+		if (vkCreateDescriptorSetLayout(
+			device, &layoutInfoDeferred, nullptr, &descriptorSetLayouts[2]) != VK_SUCCESS) {
+			throw std::runtime_error("ERROR: Failed to create a descriptor set layout in Vulkan System.");
+		}
+	}
+
 
 }
 
 void VulkanSystem::createGraphicsPipeline(std::string vertShader, 
 	std::string fragShader, VkPipeline& pipeline, VkPipelineLayout& layout, 
-	int subpass, VkRenderPass inRenderPass) {
+	int subpass, VkRenderPass inRenderPass, const VkSpecializationInfo* fragmentSpecialization, bool positionOnly, uint32_t colorAttachments,
+	DepthMode depthMode) {
 	std::vector<char> vertexShaderRawData = readFile((shaderDir + vertShader).c_str());
 	std::vector<char> fragmentShaderRawData = readFile((shaderDir + fragShader).c_str());
 
 	VkShaderModule vertexShaderModule = createShaderModule(vertexShaderRawData);
 	VkShaderModule fragmentShaderModule = createShaderModule(fragmentShaderRawData);
 
+	//constant 0 of the vertex stage selects the VertexCompact decode in vertex.glsl
+	VkSpecializationMapEntry compactEntry = { 0, 0, sizeof(VkBool32) };
+	VkBool32 compactData = compactVertices;
+	VkSpecializationInfo vertexSpecialization{};
+	vertexSpecialization.mapEntryCount = 1;
+	vertexSpecialization.pMapEntries = &compactEntry;
+	vertexSpecialization.dataSize = sizeof(VkBool32);
+	vertexSpecialization.pData = &compactData;
+
 	VkPipelineShaderStageCreateInfo vertexShaderStageInfo{};
 	vertexShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 	vertexShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
 	vertexShaderStageInfo.module = vertexShaderModule;
 	vertexShaderStageInfo.pName = "main";
+	vertexShaderStageInfo.pSpecializationInfo = &vertexSpecialization;
 	VkPipelineShaderStageCreateInfo fragmentShaderStageInfo{};
 	fragmentShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 	fragmentShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
 	fragmentShaderStageInfo.module = fragmentShaderModule;
 	fragmentShaderStageInfo.pName = "main";
+	fragmentShaderStageInfo.pSpecializationInfo = fragmentSpecialization;
 	VkPipelineShaderStageCreateInfo shaderStages[] = { vertexShaderStageInfo, fragmentShaderStageInfo };
 
 	std::vector<VkDynamicState> dynamicStates = {
@@ -1070,12 +1235,20 @@ void VulkanSystem::createGraphicsPipeline(std::string vertShader,
 
 	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
 	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	VkVertexInputBindingDescription bindingDescription = Vertex::getBindingDescription();
-	std::array<VkVertexInputAttributeDescription, 6>
-		attributeDescriptions = Vertex::getAttributeDescriptions();
-	vertexInputInfo.vertexBindingDescriptionCount = 1;
+	//Depth only passes fetch just the position stream
+	std::vector<VkVertexInputBindingDescription> bindingDescriptions = { VertexPosition::getBindingDescription() };
+	std::array<VkVertexInputAttributeDescription, 2> positionAttributes = VertexPosition::getAttributeDescriptions();
+	std::vector<VkVertexInputAttributeDescription> attributeDescriptions(positionAttributes.begin(), positionAttributes.end());
+	if (!positionOnly) {
+		bindingDescriptions.push_back(compactVertices ?
+			VertexCompact::getBindingDescription() : VertexAttributes::getBindingDescription());
+		std::array<VkVertexInputAttributeDescription, 4> streamAttributes = compactVertices ?
+			VertexCompact::getAttributeDescriptions() : VertexAttributes::getAttributeDescriptions();
+		attributeDescriptions.insert(attributeDescriptions.end(), streamAttributes.begin(), streamAttributes.end());
+	}
+	vertexInputInfo.vertexBindingDescriptionCount = static_cast<uint32_t>(bindingDescriptions.size());
 	vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
-	vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+	vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions.data();
 	vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
 
 
@@ -1112,17 +1285,19 @@ void VulkanSystem::createGraphicsPipeline(std::string vertShader,
 	VkPipelineColorBlendAttachmentState colorBlendAttachment{};
 	colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
 	colorBlendAttachment.blendEnable = VK_FALSE;
+	if (depthMode == DEPTH_ONLY) colorBlendAttachment.colorWriteMask = 0;
+	std::vector<VkPipelineColorBlendAttachmentState> colorBlendAttachments(colorAttachments, colorBlendAttachment);
 	VkPipelineColorBlendStateCreateInfo colorBlending{};
 	colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
 	colorBlending.logicOpEnable = VK_FALSE;
-	colorBlending.attachmentCount = 1;
-	colorBlending.pAttachments = &colorBlendAttachment;
+	colorBlending.attachmentCount = colorAttachments;
+	colorBlending.pAttachments = colorBlendAttachments.data();
 
 	VkPipelineDepthStencilStateCreateInfo depthStencil{};
 	depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
 	depthStencil.depthTestEnable = true;
-	depthStencil.depthWriteEnable = true;
-	depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+	depthStencil.depthWriteEnable = depthMode != DEPTH_EQUAL;
+	depthStencil.depthCompareOp = depthMode == DEPTH_EQUAL ? VK_COMPARE_OP_EQUAL : VK_COMPARE_OP_LESS;
 	depthStencil.depthBoundsTestEnable = VK_FALSE;
 	depthStencil.stencilTestEnable = VK_FALSE;
 
@@ -1152,42 +1327,40 @@ void VulkanSystem::createGraphicsPipeline(std::string vertShader,
 }
 
 void VulkanSystem::createGraphicsPipelines() {
-	size_t subpassCount = 2 + lightPool.size();
-	pipelineLayoutShadows.resize(lightPool.size());
 	graphicsPipelineShadows.resize(lightPool.size());
 	graphicsInstPipelineShadows.resize(lightPool.size());
 
+	//Shadow passes read the scene set too, the light matrix and base index are pushed
+	VkPushConstantRange shadowConstant;
+	shadowConstant.offset = 0;
+	shadowConstant.size = sizeof(PushConstShadow);
+	shadowConstant.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	VkPipelineLayoutCreateInfo pipelineLayoutInfoShadow{};
+	pipelineLayoutInfoShadow.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfoShadow.setLayoutCount = 1;
+	pipelineLayoutInfoShadow.pSetLayouts = &descriptorSetLayouts[0];
+	pipelineLayoutInfoShadow.pushConstantRangeCount = 1;
+	pipelineLayoutInfoShadow.pPushConstantRanges = &shadowConstant;
+	if (vkCreatePipelineLayout(device, &pipelineLayoutInfoShadow, nullptr, &pipelineLayoutShadow) != VK_SUCCESS) {
+		throw std::runtime_error("ERROR: Unable to create pipeline layout in VulkanSystems.");
+	}
 	for (int i = 0; i < lightPool.size(); i++) {
+		createGraphicsPipeline("/vertShadow.spv", "/fragShadow.spv", graphicsPipelineShadows[i], pipelineLayoutShadow, 0, shadowPasses[i], nullptr, true);
 
-		VkPushConstantRange lightTransformConstant;
-		lightTransformConstant.offset = 0;
-		lightTransformConstant.size = sizeof(mat44<float>);
-		lightTransformConstant.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-		VkPipelineLayoutCreateInfo pipelineLayoutInfoShadow{};
-		pipelineLayoutInfoShadow.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-		pipelineLayoutInfoShadow.setLayoutCount = 1;
-		pipelineLayoutInfoShadow.pSetLayouts = &descriptorSetLayouts[i];
-		pipelineLayoutInfoShadow.pushConstantRangeCount = 1;
-		pipelineLayoutInfoShadow.pPushConstantRanges = &lightTransformConstant;
-		if (vkCreatePipelineLayout(device, &pipelineLayoutInfoShadow, nullptr, &pipelineLayoutShadows[i]) != VK_SUCCESS) {
-			throw std::runtime_error("ERROR: Unable to create pipeline layout in VulkanSystems.");
-		}
-		createGraphicsPipeline("/vertShadow.spv", "/fragShadow.spv", graphicsPipelineShadows[i], pipelineLayoutShadows[i], 0, shadowPasses[i]);
-
-		createGraphicsPipeline("/vertShadowInst.spv", "/fragShadow.spv", graphicsInstPipelineShadows[i], pipelineLayoutShadows[i],0, shadowPasses[i]);
+		createGraphicsPipeline("/vertShadowInst.spv", "/fragShadow.spv", graphicsInstPipelineShadows[i], pipelineLayoutShadow,0, shadowPasses[i], nullptr, true);
 
 	}
 
 	VkPushConstantRange numLightsConstant;
 	numLightsConstant.offset = 0;
-	numLightsConstant.size = sizeof(int) + sizeof(float)*3 + sizeof(float);
-	numLightsConstant.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+	numLightsConstant.size = sizeof(PushConst);
+	numLightsConstant.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
 
 
 	VkPipelineLayoutCreateInfo pipelineLayoutInfoHDR{};
 	pipelineLayoutInfoHDR.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
 	pipelineLayoutInfoHDR.setLayoutCount = 1;
-	pipelineLayoutInfoHDR.pSetLayouts = &descriptorSetLayouts[lightPool.size()];
+	pipelineLayoutInfoHDR.pSetLayouts = &descriptorSetLayouts[0];
 	pipelineLayoutInfoHDR.pushConstantRangeCount = 1;
 	pipelineLayoutInfoHDR.pPushConstantRanges = &numLightsConstant;
 
@@ -1197,20 +1370,69 @@ void VulkanSystem::createGraphicsPipelines() {
 	}
 
 
+	//Irradiance spherical harmonics are constant per scene, so bake them into the pipeline
+	//constant 0 is useSH, constants 1-27 the rgb coefficients, constant 28 writes the G-buffer instead of lighting
+	std::array<VkSpecializationMapEntry, 29> shEntries;
+	shEntries[0] = { 0, 0, sizeof(VkBool32) };
+	for (uint32_t i = 1; i < 28; i++) {
+		shEntries[i] = { i, (uint32_t)(sizeof(VkBool32) + sizeof(float) * (i - 1)), sizeof(float) };
+	}
+	shEntries[28] = { 28, (uint32_t)(sizeof(VkBool32) + sizeof(float) * 27), sizeof(VkBool32) };
+	struct {
+		VkBool32 useSH;
+		float coefficients[27];
+		VkBool32 deferred;
+	} shData{};
+	shData.useSH = environmentSH.size() == 27;
+	shData.deferred = deferred;
+	if (shData.useSH) std::copy(environmentSH.begin(), environmentSH.end(), shData.coefficients);
+	VkSpecializationInfo shSpecialization{};
+	shSpecialization.mapEntryCount = shEntries.size();
+	shSpecialization.pMapEntries = shEntries.data();
+	shSpecialization.dataSize = sizeof(shData);
+	shSpecialization.pData = &shData;
+
+	uint32_t mainColorAttachments = deferred ? G_BUFFER_COUNT : 1;
+	DepthMode mainDepth = depthPrepass ? DEPTH_EQUAL : DEPTH_WRITE;
 	if (rawEnvironment.has_value()) {
-		createGraphicsPipeline("/vertEnv.spv", "/fragEnv.spv", graphicsPipeline, pipelineLayoutHDR, subpassCount-2,renderPass);
+		createGraphicsPipeline("/vertEnv.spv", "/fragEnv.spv", graphicsPipeline, pipelineLayoutHDR, 0, renderPass, &shSpecialization,
+			false, mainColorAttachments, mainDepth);
 
-		createGraphicsPipeline("/vertInstEnv.spv", "/fragEnv.spv", graphicsInstPipeline, pipelineLayoutHDR, 0, renderPass);
+		createGraphicsPipeline("/vertInstEnv.spv", "/fragEnv.spv", graphicsInstPipeline, pipelineLayoutHDR, 0, renderPass, &shSpecialization,
+			false, mainColorAttachments, mainDepth);
 	}
 	else {
-		createGraphicsPipeline("/vert.spv", "/frag.spv", graphicsPipeline, pipelineLayoutHDR, 0, renderPass);
-		createGraphicsPipeline("/vertInst.spv", "/frag.spv", graphicsInstPipeline, pipelineLayoutHDR, 0, renderPass);
+		createGraphicsPipeline("/vert.spv", "/frag.spv", graphicsPipeline, pipelineLayoutHDR, 0, renderPass, &shSpecialization,
+			false, mainColorAttachments, mainDepth);
+		createGraphicsPipeline("/vertInst.spv", "/frag.spv", graphicsInstPipeline, pipelineLayoutHDR, 0, renderPass, &shSpecialization,
+			false, mainColorAttachments, mainDepth);
+	}
+	if (depthPrepass) {
+		createGraphicsPipeline("/vertDepth.spv", "/fragShadow.spv", depthPipeline, pipelineLayoutHDR, 0, renderPass, nullptr,
+			true, mainColorAttachments, DEPTH_ONLY);
+		createGraphicsPipeline("/vertDepthInst.spv", "/fragShadow.spv", depthInstPipeline, pipelineLayoutHDR, 0, renderPass, nullptr,
+			true, mainColorAttachments, DEPTH_ONLY);
+	}
+
+	//Lighting subpass reads the scene set for lights and clusters, and the G-buffer set
+	if (deferred) {
+		VkDescriptorSetLayout layoutsDeferred[] = { descriptorSetLayouts[0], descriptorSetLayouts[2] };
+		VkPipelineLayoutCreateInfo pipelineLayoutInfoDeferred{};
+		pipelineLayoutInfoDeferred.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+		pipelineLayoutInfoDeferred.setLayoutCount = 2;
+		pipelineLayoutInfoDeferred.pSetLayouts = layoutsDeferred;
+		pipelineLayoutInfoDeferred.pushConstantRangeCount = 1;
+		pipelineLayoutInfoDeferred.pPushConstantRanges = &numLightsConstant;
+		if (vkCreatePipelineLayout(device, &pipelineLayoutInfoDeferred, nullptr, &pipelineLayoutDeferred) != VK_SUCCESS) {
+			throw std::runtime_error("ERROR: Unable to create pipeline layout in VulkanSystems.");
+		}
+		createGraphicsPipeline("/vertQuad.spv", "/fragDeferred.spv", graphicsPipelineDeferred, pipelineLayoutDeferred, 1, renderPass);
 	}
 
 	VkPipelineLayoutCreateInfo pipelineLayoutInfoFinal{};
 	pipelineLayoutInfoFinal.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
 	pipelineLayoutInfoFinal.setLayoutCount = 1;
-	pipelineLayoutInfoFinal.pSetLayouts = &descriptorSetLayouts[lightPool.size() + 1];
+	pipelineLayoutInfoFinal.pSetLayouts = &descriptorSetLayouts[1];
 	pipelineLayoutInfoFinal.pushConstantRangeCount = 0;
 	pipelineLayoutInfoFinal.pPushConstantRanges = nullptr;
 
@@ -1219,7 +1441,7 @@ void VulkanSystem::createGraphicsPipelines() {
 	if (vkCreatePipelineLayout(device, &pipelineLayoutInfoFinal, nullptr, &pipelineLayoutFinal) != VK_SUCCESS) {
 		throw std::runtime_error("ERROR: Unable to create pipeline layout in VulkanSystems.");
 	}
-	createGraphicsPipeline("/vertQuad.spv", "/fragFinal.spv", graphicsPipelineFinal, pipelineLayoutFinal, 1, renderPass);
+	createGraphicsPipeline("/vertQuad.spv", "/fragFinal.spv", graphicsPipelineFinal, pipelineLayoutFinal, deferred ? 2 : 1, renderPass);
 
 }
 
@@ -1268,6 +1490,9 @@ void VulkanSystem::createFramebuffers() {
 		attachments.push_back(swapChainImageViews[image]);
 		attachments.push_back(depthImageView);
 		attachments.push_back(attachmentImageViews[image]);
+		for (int target = 0; target < G_BUFFER_COUNT && deferred; target++) {
+			attachments.push_back(gBufferImageViews[image * G_BUFFER_COUNT + target]);
+		}
 
 		VkFramebufferCreateInfo framebufferInfo{};
 		framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
@@ -1360,56 +1585,74 @@ void VulkanSystem::copyBuffer(VkBuffer source, VkBuffer dest,
 }
 
 void VulkanSystem::createVertexBuffer(bool realloc) {
+	//Split the interleaved vertices into position and attribute streams once
+	if (realloc) {
+		vertexPositions = VertexPosition::fromVertices(vertices);
+		vertexInstPositions = VertexPosition::fromVertices(verticesInst);
+		if (compactVertices) {
+			vertexCompacts = VertexCompact::fromVertices(vertices);
+			vertexInstCompacts = VertexCompact::fromVertices(verticesInst);
+		}
+		else {
+			vertexAttributes = VertexAttributes::fromVertices(vertices);
+			vertexInstAttributes = VertexAttributes::fromVertices(verticesInst);
+		}
+	}
+
 	useVertexBuffer = false;
-	int stagingBits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-	int vertexUsageBits = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-	int vertexPropertyBits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
 	if (vertices.size() != 0) {
 		useVertexBuffer = true;
-
-		//Create temp staging buffer
-		VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
-		VkBuffer stagingBuffer{};
-		VkDeviceMemory stagingBufferMemory{};
-		createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, stagingBits,
-			stagingBuffer, stagingBufferMemory, true);
-
-		//Move vertex data to GPU
-		void* data;
-		vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-		memcpy(data, vertices.data(), (size_t)bufferSize);
-		vkUnmapMemory(device, stagingBufferMemory);
-
-		//Create proper vertex buffer
-		createBuffer(bufferSize, vertexUsageBits, vertexPropertyBits,
+		uploadVertexStream(vertexPositions.data(), sizeof(VertexPosition) * vertexPositions.size(),
 			vertexBuffer, vertexBufferMemory, realloc);
-		copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
-		vkDestroyBuffer(device, stagingBuffer, nullptr);
-		vkFreeMemory(device, stagingBufferMemory, nullptr);
+		if (compactVertices) {
+			uploadVertexStream(vertexCompacts.data(), sizeof(VertexCompact) * vertexCompacts.size(),
+				vertexAttributeBuffer, vertexAttributeBufferMemory, realloc);
+		}
+		else {
+			uploadVertexStream(vertexAttributes.data(), sizeof(VertexAttributes) * vertexAttributes.size(),
+				vertexAttributeBuffer, vertexAttributeBufferMemory, realloc);
+		}
 	}
 
 	if (useInstancing) {
-		//Create temp staging buffer
-		VkDeviceSize bufferInstSize = sizeof(verticesInst[0]) * verticesInst.size();
-		VkBuffer stagingInstBuffer{};
-		VkDeviceMemory stagingInstBufferMemory{};
+		uploadVertexStream(vertexInstPositions.data(), sizeof(VertexPosition) * vertexInstPositions.size(),
+			vertexInstBuffer, vertexInstBufferMemory, realloc);
+		if (compactVertices) {
+			uploadVertexStream(vertexInstCompacts.data(), sizeof(VertexCompact) * vertexInstCompacts.size(),
+				vertexInstAttributeBuffer, vertexInstAttributeBufferMemory, realloc);
+		}
+		else {
+			uploadVertexStream(vertexInstAttributes.data(), sizeof(VertexAttributes) * vertexInstAttributes.size(),
+				vertexInstAttributeBuffer, vertexInstAttributeBufferMemory, realloc);
+		}
+	}
+}
 
-		createBuffer(bufferInstSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, stagingBits,
-			stagingInstBuffer, stagingInstBufferMemory, true);
+void VulkanSystem::uploadVertexStream(const void* streamData, VkDeviceSize bufferSize,
+	VkBuffer& buffer, VkDeviceMemory& bufferMemory, bool realloc, VkBufferUsageFlags usage) {
+	if (bufferSize == 0) return;
+	int stagingBits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	int vertexUsageBits = VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage;
+	int vertexPropertyBits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
 
-		//Move vertex data to GPU
-		void* data;
-		vkMapMemory(device, stagingInstBufferMemory, 0, bufferInstSize, 0, &data);
-		memcpy(data, verticesInst.data(), (size_t)bufferInstSize);
-		vkUnmapMemory(device, stagingInstBufferMemory);
+	//Create temp staging buffer
+	VkBuffer stagingBuffer{};
+	VkDeviceMemory stagingBufferMemory{};
+	createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, stagingBits,
+		stagingBuffer, stagingBufferMemory, true);
 
-		//Create proper vertex buffer
-		createBuffer(bufferInstSize, vertexUsageBits, vertexPropertyBits,
-			vertexInstBuffer, vertexInstBufferMemory, realloc);
-		copyBuffer(stagingInstBuffer, vertexInstBuffer, bufferInstSize);
-		vkDestroyBuffer(device, stagingInstBuffer, nullptr);
-		vkFreeMemory(device, stagingInstBufferMemory, nullptr);
-	}
+	//Move vertex data to GPU
+	void* data;
+	vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
+	memcpy(data, streamData, (size_t)bufferSize);
+	vkUnmapMemory(device, stagingBufferMemory);
+
+	//Create proper vertex buffer
+	createBuffer(bufferSize, vertexUsageBits, vertexPropertyBits,
+		buffer, bufferMemory, realloc);
+	copyBuffer(stagingBuffer, buffer, bufferSize);
+	vkDestroyBuffer(device, stagingBuffer, nullptr);
+	vkFreeMemory(device, stagingBufferMemory, nullptr);
 }
 
 mat44<float> VulkanSystem::getCameraSpace(DrawCamera camera, float_3 useMoveVec, float_3 useDirVec) {
@@ -1432,7 +1675,11 @@ mat44<float> VulkanSystem::getCameraSpace(DrawCamera camera, float_3 useMoveVec,
 }
 
 void VulkanSystem::cullInstances() {
+	std::chrono::high_resolution_clock::time_point start =
+		std::chrono::high_resolution_clock::now();
 
+	//The previous result is kept to find which instance slots changed
+	transformInstPoolsLast.swap(transformInstPools);
 	if (transformInstPools.size() < transformInstPoolsStore.size()) {
 		transformInstPools = std::vector<std::vector<mat44<float>>>(transformInstPoolsStore.size());
 		transformEnvironmentInstPools = std::vector<std::vector<mat44<float>>>(transformEnvironmentInstPoolsStore.size());
@@ -1450,19 +1697,59 @@ void VulkanSystem::cullInstances() {
 		}
 		transformNormalInstPools[pool].clear();
 		transformNormalInstPools[pool].reserve(transformInstPoolsStore[pool].size());
-		for (size_t transform = 0; transform < transformInstPoolsStore[pool].size(); transform++) {
-			if (!useCulling || sphereInFrustum(boundingSpheresInst[transformInstIndexPools[pool]], info, cameraSpace, transformInstPoolsStore[pool][transform])) {
-				transformInstPools[pool].push_back(transformInstPoolsStore[pool][transform]);
-				if (rawEnvironment.has_value()) {
-					transformEnvironmentInstPools[pool].push_back(transformEnvironmentInstPoolsStore[pool][transform]);
-				}
-				transformNormalInstPools[pool].push_back(transformNormalInstPoolsStore[pool][transform]);
+	}
+	auto keepInstance = [&](size_t pool, size_t transform) {
+		transformInstPools[pool].push_back(transformInstPoolsStore[pool][transform]);
+		if (rawEnvironment.has_value()) {
+			transformEnvironmentInstPools[pool].push_back(transformEnvironmentInstPoolsStore[pool][transform]);
+		}
+		transformNormalInstPools[pool].push_back(transformNormalInstPoolsStore[pool][transform]);
+	};
+	if (!useCulling) {
+		//Nothing is dropped, but the prepass still wants each pool's instances nearest first
+		if (depthPrepass) {
+			updateCullTrees();
+			std::vector<int> all(cullInstItems.size());
+			std::iota(all.begin(), all.end(), 0);
+			sortByDepth(all, cullInstTree.spheres, cameraSpace);
+			for (int item : all) {
+				keepInstance(cullInstItems[item].first, cullInstItems[item].second);
 			}
+			return;
 		}
-	}
+		for (size_t pool = 0; pool < transformInstPools.size(); pool++) {
+			for (size_t transform = 0; transform < transformInstPoolsStore[pool].size(); transform++) {
+				keepInstance(pool, transform);
+			}
+		}
+		return;
+	}
+
+	//Walk the hierarchy, then draw each pool's instances nearest first
+	updateCullTrees();
+	std::vector<int> visible;
+	cullInstTree.cull(info, cameraSpace, [&](int item) {
+		int pool = cullInstItems[item].first;
+		int transform = cullInstItems[item].second;
+		return sphereInFrustum(boundingSpheresInst[transformInstIndexPools[pool]], info, cameraSpace, transformInstPoolsStore[pool][transform]);
+	}, visible);
+	sortByDepth(visible, cullInstTree.spheres, cameraSpace);
+	for (int item : visible) {
+		keepInstance(cullInstItems[item].first, cullInstItems[item].second);
+	}
+
+	std::chrono::high_resolution_clock::time_point end =
+		std::chrono::high_resolution_clock::now();
+	debugCullTime += std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.f;
+	debugCullTested += cullInstTree.tested;
+	debugCullVisible += visible.size();
+	debugCullTotal += cullInstItems.size();
 }
 
 void VulkanSystem::cullIndexPools() {
+	std::chrono::high_resolution_clock::time_point start =
+		std::chrono::high_resolution_clock::now();
+
 	if (indexPools.size() < indexPoolsStore.size()) {
 		indexPools = std::vector<std::vector<uint32_t>>(indexPoolsStore.size());
 		indexBuffersValid = std::vector<bool>(indexPoolsStore.size());
@@ -1473,17 +1760,108 @@ void VulkanSystem::cullIndexPools() {
 	for (size_t pool = 0; pool < drawPools.size(); pool++) {
 		indexPools[pool].clear();
 		indexPools[pool].reserve(indexPoolsStore[pool].size());
-		for (size_t node = 0; node < drawPools[pool].size(); node++) {
-			if (!useCulling || sphereInFrustum(drawPools[pool][node].boundingSphere, info, cameraSpace, transformPools[pool][node])) {
-				int indexBegin = drawPools[pool][node].indexStart;
-				int indexEnd = drawPools[pool][node].indexCount + indexBegin;
-				indexPools[pool].insert(
-					indexPools[pool].end(),
-					indexPoolsStore[pool].begin() + indexBegin,
-					indexPoolsStore[pool].begin() + indexEnd);
+	}
+	auto keepNode = [&](size_t pool, size_t node) {
+		int indexBegin = drawPools[pool][node].indexStart;
+		int indexEnd = drawPools[pool][node].indexCount + indexBegin;
+		indexPools[pool].insert(
+			indexPools[pool].end(),
+			indexPoolsStore[pool].begin() + indexBegin,
+			indexPoolsStore[pool].begin() + indexEnd);
+	};
+	if (!useCulling) {
+		if (depthPrepass) {
+			updateCullTrees();
+			std::vector<int> all(cullItems.size());
+			std::iota(all.begin(), all.end(), 0);
+			sortByDepth(all, cullTree.spheres, cameraSpace);
+			for (int item : all) {
+				keepNode(cullItems[item].first, cullItems[item].second);
 			}
+			return;
+		}
+		for (size_t pool = 0; pool < drawPools.size(); pool++) {
+			for (size_t node = 0; node < drawPools[pool].size(); node++) {
+				keepNode(pool, node);
+			}
+		}
+		return;
+	}
+
+	updateCullTrees();
+	std::vector<int> visible;
+	cullTree.cull(info, cameraSpace, [&](int item) {
+		int pool = cullItems[item].first;
+		int node = cullItems[item].second;
+		return sphereInFrustum(drawPools[pool][node].boundingSphere, info, cameraSpace, transformPools[pool][node]);
+	}, visible);
+	sortByDepth(visible, cullTree.spheres, cameraSpace);
+	for (int item : visible) {
+		keepNode(cullItems[item].first, cullItems[item].second);
+	}
+
+	std::chrono::high_resolution_clock::time_point end =
+		std::chrono::high_resolution_clock::now();
+	debugCullTime += std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.f;
+	debugCullTested += cullTree.tested;
+	debugCullVisible += visible.size();
+	debugCullTotal += cullItems.size();
+	debugCullCount++;
+}
+
+//Orders visible items by the view space depth of the nearest point of their world sphere, so early depth tests reject more
+//Items of one pool stay together since each pool is appended to its own buffer, ties keep item order
+void VulkanSystem::sortByDepth(std::vector<int>& visible, const std::vector<std::pair<float_3, float>>& spheres, mat44<float> cameraSpace) {
+	std::vector<std::pair<float, int>> keyed(visible.size());
+	for (size_t index = 0; index < visible.size(); index++) {
+		const std::pair<float_3, float>& sphere = spheres[visible[index]];
+		float_3 viewCenter = cameraSpace * sphere.first;
+		keyed[index] = std::make_pair(-viewCenter.z - sphere.second, visible[index]);
+	}
+	std::sort(keyed.begin(), keyed.end());
+	for (size_t index = 0; index < visible.size(); index++) visible[index] = keyed[index].second;
+}
+
+//Rebuilds the culling hierarchies when the item count changes and refits them after transforms move
+void VulkanSystem::updateCullTrees() {
+	if (!cullTreesDirty) return;
+	cullTreesDirty = false;
+
+	size_t nodeCount = 0;
+	for (size_t pool = 0; pool < drawPools.size(); pool++) nodeCount += drawPools[pool].size();
+	bool rebuild = nodeCount != cullItems.size();
+	if (rebuild) {
+		cullItems.clear();
+		for (size_t pool = 0; pool < drawPools.size(); pool++) {
+			for (size_t node = 0; node < drawPools[pool].size(); node++) cullItems.push_back(std::make_pair((int)pool, (int)node));
 		}
 	}
+	cullTree.spheres.resize(cullItems.size());
+	for (size_t item = 0; item < cullItems.size(); item++) {
+		int pool = cullItems[item].first;
+		int node = cullItems[item].second;
+		cullTree.spheres[item] = worldSphere(drawPools[pool][node].boundingSphere, transformPools[pool][node]);
+	}
+	if (rebuild) cullTree.build();
+	else cullTree.refit();
+
+	size_t instanceCount = 0;
+	for (size_t pool = 0; pool < transformInstPoolsStore.size(); pool++) instanceCount += transformInstPoolsStore[pool].size();
+	rebuild = instanceCount != cullInstItems.size();
+	if (rebuild) {
+		cullInstItems.clear();
+		for (size_t pool = 0; pool < transformInstPoolsStore.size(); pool++) {
+			for (size_t transform = 0; transform < transformInstPoolsStore[pool].size(); transform++) cullInstItems.push_back(std::make_pair((int)pool, (int)transform));
+		}
+	}
+	cullInstTree.spheres.resize(cullInstItems.size());
+	for (size_t item = 0; item < cullInstItems.size(); item++) {
+		int pool = cullInstItems[item].first;
+		int transform = cullInstItems[item].second;
+		cullInstTree.spheres[item] = worldSphere(boundingSpheresInst[transformInstIndexPools[pool]], transformInstPoolsStore[pool][transform]);
+	}
+	if (rebuild) cullInstTree.build();
+	else cullInstTree.refit();
 }
 
 void VulkanSystem::transitionImageLayout(VkImage image, VkFormat format,
@@ -1531,11 +1909,11 @@ void VulkanSystem::transitionImageLayout(VkImage image, VkFormat format,
 }
 
 
-void VulkanSystem::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height, int level , int face) {
+void VulkanSystem::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height, int level, int face, VkDeviceSize offset) {
 	VkCommandBuffer commandBuffer = beginSingleTimeCommands();
 
 	VkBufferImageCopy region{};
-	region.bufferOffset = 0;
+	region.bufferOffset = offset;
 	region.bufferImageHeight = 0;
 	region.bufferRowLength = 0;
 	region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -1630,44 +2008,49 @@ void VulkanSystem::generateMipmaps(VkImage image, int32_t x, int32_t y, uint32_t
 
 void VulkanSystem::createEnvironmentImage(Texture env, VkImage& image,
 	VkDeviceMemory& memory, VkImageView& imageView, VkSampler& sampler) {
-
-	VkDeviceSize imageSize = 4 * env.x * env.realY;
-	VkDeviceSize layerSize = 4 * env.x * env.y;
-	std::array<VkBuffer,6> stageBuffer;
-	std::array<VkDeviceMemory,6> stageBufferMemory;
+	VkFormat format = chooseEnvironmentFormat(physicalDevice);
+	std::array<VkBuffer, 6> stageBuffer;
+	std::array<VkDeviceMemory, 6> stageBufferMemory;
+	std::array<std::vector<VkDeviceSize>, 6> levelOffsets;
 	for (int face = 0; face < 6; face++) {
-		createBuffer(imageSize,
+		std::vector<unsigned char> encoded = encodeEnvironmentFace(env, face, format, levelOffsets[face]);
+		VkDeviceSize faceSize = encoded.size();
+		createBuffer(faceSize,
 			VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
 			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stageBuffer[face], stageBufferMemory[face], true);
 		void* data;
-		vkMapMemory(device, stageBufferMemory[face], 0, layerSize, 0, &data);
-		memcpy(data, (void*)(&env.data[face*static_cast<size_t>(layerSize)]), static_cast<size_t>(layerSize));
+		vkMapMemory(device, stageBufferMemory[face], 0, faceSize, 0, &data);
+		memcpy(data, encoded.data(), static_cast<size_t>(faceSize));
 		vkUnmapMemory(device, stageBufferMemory[face]);
 	}
 	if (env.doFree) {
 		stbi_image_free((void*)env.data);
 	}
 
-	int usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT |
-		VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	//Mips come from the CPU since shared exponent formats are not blit destinations
+	int usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
 	int flags = VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT;
-	createImage(env.x, env.y, VK_FORMAT_R8G8B8A8_SRGB,
+	createImage(env.x, env.y, format,
 		VK_IMAGE_TILING_OPTIMAL, usage, flags,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, memory,6,env.mipLevels);
-	transitionImageLayout(image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,6,env.mipLevels);
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, memory, 6, env.mipLevels);
+	transitionImageLayout(image, format, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 6, env.mipLevels);
 	for (int face = 0; face < 6; face++) {
-		copyBufferToImage(stageBuffer[face], image, static_cast<uint32_t>(env.x), static_cast<uint32_t>(env.y), 0, face);
-		generateMipmaps(image, env.x, env.y, env.mipLevels, face);
+		for (int mipLevel = 0; mipLevel < env.mipLevels; mipLevel++) {
+			copyBufferToImage(stageBuffer[face], image, static_cast<uint32_t>(std::max(env.x >> mipLevel, 1)),
+				static_cast<uint32_t>(std::max(env.y >> mipLevel, 1)), mipLevel, face, levelOffsets[face][mipLevel]);
+		}
 		vkDestroyBuffer(device, stageBuffer[face], nullptr);
 		vkFreeMemory(device, stageBufferMemory[face], nullptr);
 	}
-
+	transitionImageLayout(image, format, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 6, env.mipLevels);
+	debugTextureBytes += 6 * textureMemory(env.x, env.y, env.mipLevels, format == VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 ? 4 : 8);
+	debugTextureBytesRGBA += 6 * textureMemory(env.x, env.y, env.mipLevels, 4);
 
 	VkImageViewCreateInfo viewInfo{};
 	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
 	viewInfo.image = image;
 	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_CUBE;
-	viewInfo.format = VK_FORMAT_R8G8B8A8_SRGB;
+	viewInfo.format = format;
 	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
 	viewInfo.subresourceRange.baseArrayLayer = 0;
 	viewInfo.subresourceRange.baseMipLevel = 0;
@@ -1706,7 +2089,17 @@ void VulkanSystem::createEnvironmentImage(Texture env, VkImage& image,
 
 void VulkanSystem::createTextureImage(Texture tex, VkImage& image, 
 	VkDeviceMemory& memory, VkImageView& imageView, VkSampler& sampler) {
-	VkDeviceSize imageSize = 4 * tex.x * tex.realY;
+	//Devices without BC support load the png the ktx2 was encoded from instead
+	if (tex.compressedFormat != VK_FORMAT_UNDEFINED && (!compressedTextures || !formatFilterable(physicalDevice, tex.compressedFormat))) {
+		if (tex.doFree) {
+			stbi_image_free((void*)tex.data);
+		}
+		tex = Texture::parseTexture(tex.path.substr(0, tex.path.size() - 5) + ".png", false, tex.semantic);
+	}
+	std::chrono::high_resolution_clock::time_point uploadStart = std::chrono::high_resolution_clock::now();
+	bool compressed = tex.compressedFormat != VK_FORMAT_UNDEFINED;
+	VkFormat format = textureFormat(tex);
+	VkDeviceSize imageSize = compressed ? tex.dataSize : (VkDeviceSize)tex.channels * tex.x * tex.realY;
 	VkBuffer stageBuffer;
 	VkDeviceMemory stageBufferMemory;
 	createBuffer(imageSize,
@@ -1722,21 +2115,37 @@ void VulkanSystem::createTextureImage(Texture tex, VkImage& image,
 
 	int usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT |
 		VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
-	createImage(tex.x, tex.realY, VK_FORMAT_R8G8B8A8_SRGB,
-		VK_IMAGE_TILING_OPTIMAL,usage ,0, 
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, memory, 1,tex.mipLevels);
-	transitionImageLayout(image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,1,tex.mipLevels);
-	copyBufferToImage(stageBuffer, image, static_cast<uint32_t>(tex.x), static_cast<uint32_t>(tex.realY));
-	generateMipmaps(image, tex.x, tex.realY, tex.mipLevels);
+	createImage(tex.x, tex.realY, format,
+		VK_IMAGE_TILING_OPTIMAL, usage, 0,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, memory, 1, tex.mipLevels);
+	transitionImageLayout(image, format, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, tex.mipLevels);
+	if (compressed) {
+		//Mips were encoded offline, block formats cannot be blitted anyway
+		for (int mipLevel = 0; mipLevel < tex.mipLevels; mipLevel++) {
+			copyBufferToImage(stageBuffer, image, static_cast<uint32_t>(std::max(tex.x >> mipLevel, 1)),
+				static_cast<uint32_t>(std::max(tex.realY >> mipLevel, 1)), mipLevel, 0, tex.levelOffsets[mipLevel]);
+		}
+		transitionImageLayout(image, format, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 1, tex.mipLevels);
+	}
+	else {
+		copyBufferToImage(stageBuffer, image, static_cast<uint32_t>(tex.x), static_cast<uint32_t>(tex.realY));
+		generateMipmaps(image, tex.x, tex.realY, tex.mipLevels);
+	}
+	debugTextureBytes += compressed ? tex.dataSize : textureMemory(tex.x, tex.realY, tex.mipLevels, tex.channels);
+	debugTextureBytesRGBA += textureMemory(tex.x, tex.realY, tex.mipLevels, 4);
+	debugTextureCount++;
+	if (compressed) debugCompressedTextureCount++;
 
 	vkDestroyBuffer(device, stageBuffer, nullptr);
 	vkFreeMemory(device, stageBufferMemory, nullptr);
+	debugTextureDecodeTime += tex.loadTime;
+	debugTextureUploadTime += std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - uploadStart).count();
 
 	VkImageViewCreateInfo viewInfo{};
 	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
 	viewInfo.image = image;
 	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-	viewInfo.format = VK_FORMAT_R8G8B8A8_SRGB;
+	viewInfo.format = format;
 	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
 	viewInfo.subresourceRange.baseArrayLayer = 0;
 	viewInfo.subresourceRange.baseMipLevel = 0;
@@ -1841,304 +2250,133 @@ void VulkanSystem::createIndexBuffers(bool realloc, bool andFree) {
 
 		indexBufferMemorys.resize(indexPools.size());
 		indexBuffers.resize(indexPools.size());
+		indexTypes.resize(indexPools.size());
+		indexBaseVertices.resize(indexPools.size());
 		for (size_t pool = 0; pool < indexPools.size(); pool++) {
 			if (!indexBuffersValid[pool]) continue;
-			VkDeviceSize bufferSize = sizeof(indexPools[pool][0]) * indexPools[pool].size();
-			if (bufferSize > 0) {
-
-				//Create temp staging buffer
-				VkBuffer stagingBuffer{};
-				VkDeviceMemory stagingBufferMemory{};
-				int stagingBits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-				createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, stagingBits,
-					stagingBuffer, stagingBufferMemory, true);
-
-				//Move index data to GPU
-				void* data;
-				vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-				memcpy(data, indexPools[pool].data(), (size_t)bufferSize);
-				vkUnmapMemory(device, stagingBufferMemory);
-
-				//Create proper index buffer
-				int indexUsageBits = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
-				int indexPropertyBits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-				createBuffer(bufferSize, indexUsageBits, indexPropertyBits,
-					indexBuffers[pool], indexBufferMemorys[pool], realloc);
-				copyBuffer(stagingBuffer, indexBuffers[pool], bufferSize);
-
-				vkDestroyBuffer(device, stagingBuffer, nullptr);
-				vkFreeMemory(device, stagingBufferMemory, nullptr);
-			}
+			uploadIndexPool(indexPools[pool], indexBuffers[pool], indexBufferMemorys[pool],
+				realloc, indexTypes[pool], indexBaseVertices[pool]);
 		}
 	}
 	if (useInstancing) {
 		indexInstBufferMemorys.resize(indexInstPools.size());
 		indexInstBuffers.resize(indexInstPools.size());
+		indexInstTypes.resize(indexInstPools.size());
+		indexInstBaseVertices.resize(indexInstPools.size());
 		for (size_t pool = 0; pool < indexInstPools.size(); pool++) {
-			VkDeviceSize bufferSize = sizeof(indexInstPools[pool][0]) * indexInstPools[pool].size();
-			if (bufferSize > 0) {
-
-				//Create temp staging buffer
-				VkBuffer stagingBuffer{};
-				VkDeviceMemory stagingBufferMemory{};
-				int stagingBits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-				createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, stagingBits,
-					stagingBuffer, stagingBufferMemory, true);
-
-				//Move index data to GPU
-				void* data;
-				vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-				memcpy(data, indexInstPools[pool].data(), (size_t)bufferSize);
-				vkUnmapMemory(device, stagingBufferMemory);
-
-				//Create proper index buffer
-				int indexUsageBits = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
-				int indexPropertyBits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-				createBuffer(bufferSize, indexUsageBits, indexPropertyBits,
-					indexInstBuffers[pool], indexInstBufferMemorys[pool], realloc);
-				copyBuffer(stagingBuffer, indexInstBuffers[pool], bufferSize);
-
-				vkDestroyBuffer(device, stagingBuffer, nullptr);
-				vkFreeMemory(device, stagingBufferMemory, nullptr);
-			}
+			uploadIndexPool(indexInstPools[pool], indexInstBuffers[pool], indexInstBufferMemorys[pool],
+				realloc, indexInstTypes[pool], indexInstBaseVertices[pool]);
 		}
 	}
 }
 
+//Pools spanning at most 65536 vertices are stored as 16 bit offsets from their lowest vertex, which is passed back as the draw's vertexOffset
+void VulkanSystem::uploadIndexPool(const std::vector<uint32_t>& pool, VkBuffer& buffer, VkDeviceMemory& bufferMemory,
+	bool realloc, VkIndexType& indexType, int32_t& baseVertex) {
+	indexType = VK_INDEX_TYPE_UINT32;
+	baseVertex = 0;
+	if (pool.size() == 0) return;
+	auto [minIndex, maxIndex] = std::minmax_element(pool.begin(), pool.end());
+	if (*maxIndex - *minIndex > UINT16_MAX) {
+		uploadVertexStream(pool.data(), sizeof(pool[0]) * pool.size(),
+			buffer, bufferMemory, realloc, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+		return;
+	}
+	std::vector<uint16_t> packed(pool.size());
+	for (size_t index = 0; index < pool.size(); index++) {
+		packed[index] = (uint16_t)(pool[index] - *minIndex);
+	}
+	indexType = VK_INDEX_TYPE_UINT16;
+	baseVertex = (int32_t)*minIndex;
+	uploadVertexStream(packed.data(), sizeof(packed[0]) * packed.size(),
+		buffer, bufferMemory, realloc, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+}
+
 void VulkanSystem::createUniformBuffers(bool realloc) {
 	cullInstances();
 
-	size_t transformsSize = useVertexBuffer ?
-		transformPools.size() : 0;
-	transformsSize = useInstancing ?
-		transformsSize + transformInstPools.size() :
-		transformsSize;
-	uniformBuffersTransformsPools.resize(transformsSize);
-	uniformBuffersMemoryTransformsPools.resize(transformsSize);
-	uniformBuffersMappedTransformsPools.resize(transformsSize);
-	uniformBuffersLightPerspectivePools.resize(transformsSize);
-	uniformBuffersMemoryLightPerspectivePools.resize(transformsSize);
-	uniformBuffersMappedLightPerspectivePools.resize(transformsSize);
-	uniformBuffersModelsPools.resize(lightPool.size());
-	uniformBuffersMemoryModelsPools.resize(lightPool.size());
-	uniformBuffersMappedModelsPools.resize(lightPool.size());
-	for (int i = 0; i < lightPool.size(); i++) {
-		uniformBuffersModelsPools[i].resize(transformsSize);
-		uniformBuffersMemoryModelsPools[i].resize(transformsSize);
-		uniformBuffersMappedModelsPools[i].resize(transformsSize);
+	//Transforms and materials of a pool share its base index, so a draw only pushes one offset
+	drawBaseIndices.assign(transformPools.size() + transformInstPoolsStore.size(), 0);
+	sceneSlots = 0;
+	for (size_t pool = 0; pool < transformPools.size() && useVertexBuffer; pool++) {
+		drawBaseIndices[pool] = sceneSlots;
+		sceneSlots += std::max<size_t>({ transformPools[pool].size(), materialPools[pool].size(), 1 });
 	}
-	if (rawEnvironment.has_value()) {
-		uniformBuffersEnvironmentTransformsPools.resize(transformsSize);
-		uniformBuffersMemoryEnvironmentTransformsPools.resize(transformsSize);
-		uniformBuffersMappedEnvironmentTransformsPools.resize(transformsSize);
-		uniformBuffersNormalTransformsPools.resize(transformsSize);
-		uniformBuffersMemoryNormalTransformsPools.resize(transformsSize);
-		uniformBuffersMappedNormalTransformsPools.resize(transformsSize);
-	}
-	uniformBuffersCamerasPools.resize(transformsSize);
-	uniformBuffersMemoryCamerasPools.resize(transformsSize);
-	uniformBuffersMappedCamerasPools.resize(transformsSize);
-	uniformBuffersLightsPools.resize(transformsSize);
-	uniformBuffersMemoryLightsPools.resize(transformsSize);
-	uniformBuffersMappedLightsPools.resize(transformsSize);
-	uniformBuffersLightTransformsPools.resize(transformsSize);
-	uniformBuffersMemoryLightTransformsPools.resize(transformsSize);
-	uniformBuffersMappedLightTransformsPools.resize(transformsSize);
-
-	uniformBuffersMaterialsPools.resize(transformsSize);
-	uniformBuffersMemoryMaterialsPools.resize(transformsSize);
-	uniformBuffersMappedMaterialsPools.resize(transformsSize);
-	for (size_t pool = 0; pool < transformsSize; pool++) {
-		uniformBuffersTransformsPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-		uniformBuffersMemoryTransformsPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-		uniformBuffersMappedTransformsPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-		uniformBuffersLightPerspectivePools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-		uniformBuffersMemoryLightPerspectivePools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-		uniformBuffersMappedLightPerspectivePools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-
-		for (int i = 0; i < lightPool.size(); i++) {
-			uniformBuffersModelsPools[i][pool].resize(MAX_FRAMES_IN_FLIGHT);
-			uniformBuffersMemoryModelsPools[i][pool].resize(MAX_FRAMES_IN_FLIGHT);
-			uniformBuffersMappedModelsPools[i][pool].resize(MAX_FRAMES_IN_FLIGHT);
-		}
-		if (rawEnvironment.has_value()) {
-			uniformBuffersEnvironmentTransformsPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-			uniformBuffersMemoryEnvironmentTransformsPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-			uniformBuffersMappedEnvironmentTransformsPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-			uniformBuffersNormalTransformsPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-			uniformBuffersMemoryNormalTransformsPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-			uniformBuffersMappedNormalTransformsPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-		}
-		uniformBuffersCamerasPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-		uniformBuffersMemoryCamerasPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-		uniformBuffersMappedCamerasPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-		uniformBuffersLightsPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-		uniformBuffersMemoryLightsPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-		uniformBuffersMappedLightsPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-		uniformBuffersLightTransformsPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-		uniformBuffersMemoryLightTransformsPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-		uniformBuffersMappedLightTransformsPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-		uniformBuffersMaterialsPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-		uniformBuffersMemoryMaterialsPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
-		uniformBuffersMappedMaterialsPools[pool].resize(MAX_FRAMES_IN_FLIGHT);
+	for (size_t pool = 0; pool < transformInstPoolsStore.size() && useInstancing; pool++) {
+		//Unfortunately, the results of culling cant be used here, every possible transform needs a slot
+		//Even if they end up unused!
+		drawBaseIndices[transformPools.size() + pool] = sceneSlots;
+		sceneSlots += std::max<size_t>(transformInstPoolsStore[pool].size(), 1);
 	}
+	resetDirty();
+	VkPhysicalDeviceProperties properties{};
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+	nonCoherentAtomSize = properties.limits.nonCoherentAtomSize;
+
+	VkDeviceSize bufferSizeTransforms = sizeof(mat44<float>) * std::max<uint32_t>(sceneSlots, 1);
+	VkDeviceSize bufferSizeMaterials = sizeof(DrawMaterial) * std::max<uint32_t>(sceneSlots, 1);
+	VkDeviceSize bufferSizeLights = sizeof(GPULight) * std::max<size_t>(lightPool.size(), 1);
+	VkDeviceSize bufferSizeLightTransforms = sizeof(mat44<float>) * std::max<size_t>(lightPool.size(), 1);
+	VkDeviceSize bufferSizeCameras = sizeof(mat44<float>);
+	//Worst case every bounded light reaches every cluster
+	VkDeviceSize bufferSizeClusterLights = sizeof(uint32_t) * (CLUSTER_COUNT * lightPool.size() + 1);
 
 	int props = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | 
 		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-	for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
-		size_t pool = 0;
-		for (; pool < transformPools.size() && useVertexBuffer; pool++)
-		{
-			VkDeviceSize bufferSizeTransforms = sizeof(mat44<float>) * transformPools[pool].size();
-			VkDeviceSize bufferSizeNormalTransforms = sizeof(mat44<float>) * transformPools[pool].size();
-			VkDeviceSize bufferSizeEnvironmentTransforms;
-			if (rawEnvironment.has_value()) bufferSizeEnvironmentTransforms= sizeof(mat44<float>) * transformEnvironmentPools[pool].size();
-			VkDeviceSize bufferSizeCameras = sizeof(mat44<float>);
-			VkDeviceSize bufferSizeLights = sizeof(Light) * lightPool.size();
-			VkDeviceSize bufferSizeLightTransforms = sizeof(mat44<float>) * lightPool.size();
-			VkDeviceSize bufferSizeMaterials = sizeof(DrawMaterial) * materialPools[pool].size();
-			
-			for (int i = 0; i < lightPool.size(); i++) {
-				createBuffer(bufferSizeTransforms, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
-					uniformBuffersModelsPools[i][pool][frame], uniformBuffersMemoryModelsPools[i][pool][frame], realloc);
-				vkMapMemory(device, uniformBuffersMemoryModelsPools[i][pool][frame], 0, bufferSizeTransforms, 0,
-					uniformBuffersMappedModelsPools[i][pool].data() + frame);
-			}
-			createBuffer(bufferSizeTransforms, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
-				uniformBuffersTransformsPools[pool][frame], uniformBuffersMemoryTransformsPools[pool][frame], realloc);
-			vkMapMemory(device, uniformBuffersMemoryTransformsPools[pool][frame], 0, bufferSizeTransforms, 0,
-				uniformBuffersMappedTransformsPools[pool].data() + frame);
-			createBuffer(bufferSizeLightTransforms, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
-				uniformBuffersLightPerspectivePools[pool][frame], uniformBuffersMemoryLightPerspectivePools[pool][frame], realloc);
-			vkMapMemory(device, uniformBuffersMemoryLightPerspectivePools[pool][frame], 0, bufferSizeLightTransforms, 0,
-				uniformBuffersMappedLightPerspectivePools[pool].data() + frame);
-			if (rawEnvironment.has_value()) {
-				createBuffer(bufferSizeNormalTransforms, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
-					uniformBuffersNormalTransformsPools[pool][frame], uniformBuffersMemoryNormalTransformsPools[pool][frame], realloc);
-				vkMapMemory(device, uniformBuffersMemoryNormalTransformsPools[pool][frame], 0, bufferSizeNormalTransforms, 0,
-					uniformBuffersMappedNormalTransformsPools[pool].data() + frame);
-				createBuffer(bufferSizeEnvironmentTransforms, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
-					uniformBuffersEnvironmentTransformsPools[pool][frame], uniformBuffersMemoryEnvironmentTransformsPools[pool][frame], realloc);
-				vkMapMemory(device, uniformBuffersMemoryEnvironmentTransformsPools[pool][frame], 0, bufferSizeEnvironmentTransforms, 0,
-					uniformBuffersMappedEnvironmentTransformsPools[pool].data() + frame);
-			}
-			createBuffer(bufferSizeCameras, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
-				uniformBuffersCamerasPools[pool][frame], uniformBuffersMemoryCamerasPools[pool][frame], realloc);
-			vkMapMemory(device, uniformBuffersMemoryCamerasPools[pool][frame], 0, bufferSizeCameras, 0,
-				uniformBuffersMappedCamerasPools[pool].data() + frame);
-			if (lightPool.size() > 0) {
-				createBuffer(bufferSizeLights, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
-					uniformBuffersLightsPools[pool][frame], uniformBuffersMemoryLightsPools[pool][frame], realloc);
-				vkMapMemory(device, uniformBuffersMemoryLightsPools[pool][frame], 0, bufferSizeLights, 0,
-					uniformBuffersMappedLightsPools[pool].data() + frame);
-				createBuffer(bufferSizeLightTransforms, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
-					uniformBuffersLightTransformsPools[pool][frame], uniformBuffersMemoryLightTransformsPools[pool][frame], realloc);
-				vkMapMemory(device, uniformBuffersMemoryLightTransformsPools[pool][frame], 0, bufferSizeLightTransforms, 0,
-					uniformBuffersMappedLightTransformsPools[pool].data() + frame);
-			}
-			createBuffer(bufferSizeMaterials, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
-				uniformBuffersMaterialsPools[pool][frame], uniformBuffersMemoryMaterialsPools[pool][frame], realloc);
-			vkMapMemory(device, uniformBuffersMemoryMaterialsPools[pool][frame], 0, bufferSizeMaterials, 0,
-				uniformBuffersMappedMaterialsPools[pool].data() + frame);
-		}
-		for (;pool < transformsSize && useInstancing; pool++)
-		{
-			//Unfortunately, the results of culling cant be used here, every possible transform needs to be accounted for in the buffer size
-			//Even if they end up unused!
-			VkDeviceSize bufferSizeTransforms = sizeof(mat44<float>) * transformInstPoolsStore[pool - transformPools.size()].size();
-			VkDeviceSize bufferSizeNormalTransforms = sizeof(mat44<float>) * transformInstPoolsStore[pool - transformPools.size()].size();
-			VkDeviceSize bufferSizeEnvironmentTransforms;
-			if (rawEnvironment.has_value())bufferSizeEnvironmentTransforms = sizeof(mat44<float>) * transformEnvironmentInstPoolsStore[pool - transformPools.size()].size();
-			VkDeviceSize bufferSizeCameras = sizeof(mat44<float>);
-			VkDeviceSize bufferSizeLights = sizeof(Light) * lightPool.size();
-			VkDeviceSize bufferSizeLightTransforms = sizeof(mat44<float>) * lightPool.size();
-			VkDeviceSize bufferSizeMaterials = sizeof(DrawMaterial);
-			createBuffer(bufferSizeTransforms, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
-				uniformBuffersTransformsPools[pool][frame], uniformBuffersMemoryTransformsPools[pool][frame], realloc);
-			vkMapMemory(device, uniformBuffersMemoryTransformsPools[pool][frame], 0, bufferSizeTransforms, 0,
-				uniformBuffersMappedTransformsPools[pool].data() + frame);
-			createBuffer(bufferSizeLightTransforms, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
-				uniformBuffersLightPerspectivePools[pool][frame], uniformBuffersMemoryLightPerspectivePools[pool][frame], realloc);
-			vkMapMemory(device, uniformBuffersMemoryLightPerspectivePools[pool][frame], 0, bufferSizeLightTransforms, 0,
-				uniformBuffersMappedLightPerspectivePools[pool].data() + frame);
-			for (int i = 0; i < lightPool.size(); i++) {
-				createBuffer(bufferSizeTransforms, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
-					uniformBuffersModelsPools[i][pool][frame], uniformBuffersMemoryModelsPools[i][pool][frame], realloc);
-				vkMapMemory(device, uniformBuffersMemoryModelsPools[i][pool][frame], 0, bufferSizeTransforms, 0,
-					uniformBuffersMappedModelsPools[i][pool].data() + frame);
-			}
-			if (rawEnvironment.has_value()) {
-				createBuffer(bufferSizeNormalTransforms, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
-					uniformBuffersNormalTransformsPools[pool][frame], uniformBuffersMemoryNormalTransformsPools[pool][frame], realloc);
-				vkMapMemory(device, uniformBuffersMemoryNormalTransformsPools[pool][frame], 0, bufferSizeNormalTransforms, 0,
-					uniformBuffersMappedNormalTransformsPools[pool].data() + frame);
-				createBuffer(bufferSizeEnvironmentTransforms, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
-					uniformBuffersEnvironmentTransformsPools[pool][frame], uniformBuffersMemoryEnvironmentTransformsPools[pool][frame], realloc);
-				vkMapMemory(device, uniformBuffersMemoryEnvironmentTransformsPools[pool][frame], 0, bufferSizeEnvironmentTransforms, 0,
-					uniformBuffersMappedEnvironmentTransformsPools[pool].data() + frame);
-			}
-			createBuffer(bufferSizeCameras, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
-				uniformBuffersCamerasPools[pool][frame], uniformBuffersMemoryCamerasPools[pool][frame], realloc);
-			vkMapMemory(device, uniformBuffersMemoryCamerasPools[pool][frame], 0, bufferSizeCameras, 0,
-				uniformBuffersMappedCamerasPools[pool].data() + frame);
-			
-
-			if (lightPool.size() > 0) {
-				createBuffer(bufferSizeLights, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
-					uniformBuffersLightsPools[pool][frame], uniformBuffersMemoryLightsPools[pool][frame], realloc);
-				vkMapMemory(device, uniformBuffersMemoryLightsPools[pool][frame], 0, bufferSizeLights, 0,
-					uniformBuffersMappedLightsPools[pool].data() + frame);
-				createBuffer(bufferSizeLightTransforms, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
-					uniformBuffersLightTransformsPools[pool][frame], uniformBuffersMemoryLightTransformsPools[pool][frame], realloc);
-				vkMapMemory(device, uniformBuffersMemoryLightTransformsPools[pool][frame], 0, bufferSizeLightTransforms, 0,
-					uniformBuffersMappedLightTransformsPools[pool].data() + frame);
-			}
-			createBuffer(bufferSizeMaterials, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
-				uniformBuffersMaterialsPools[pool][frame], uniformBuffersMemoryMaterialsPools[pool][frame], realloc);
-			vkMapMemory(device, uniformBuffersMemoryMaterialsPools[pool][frame], 0, bufferSizeMaterials, 0,
-				uniformBuffersMappedMaterialsPools[pool].data() + frame);
+	//Mapped whole so flushes can run to the end of the allocation
+	auto createMapped = [&](VkDeviceSize size, VkBufferUsageFlags usage, std::vector<VkBuffer>& buffers,
+		std::vector<VkDeviceMemory>& memorys, std::vector<void*>& mapped, int memoryProps) {
+		buffers.resize(MAX_FRAMES_IN_FLIGHT);
+		memorys.resize(MAX_FRAMES_IN_FLIGHT);
+		mapped.resize(MAX_FRAMES_IN_FLIGHT);
+		for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+			createBuffer(size, usage, memoryProps, buffers[frame], memorys[frame], realloc);
+			vkMapMemory(device, memorys[frame], 0, VK_WHOLE_SIZE, 0, mapped.data() + frame);
 		}
-	}
+	};
+	//Transforms are written in dirty ranges and flushed, so they take the first host visible type, coherent or not
+	createMapped(bufferSizeTransforms, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		storageBuffersTransforms, storageBuffersMemoryTransforms, storageBuffersMappedTransforms, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+	if (rawEnvironment.has_value()) {
+		createMapped(bufferSizeTransforms, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			storageBuffersNormalTransforms, storageBuffersMemoryNormalTransforms, storageBuffersMappedNormalTransforms,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+		createMapped(bufferSizeTransforms, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			storageBuffersEnvironmentTransforms, storageBuffersMemoryEnvironmentTransforms, storageBuffersMappedEnvironmentTransforms,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+	}
+	createMapped(bufferSizeMaterials, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		storageBuffersMaterials, storageBuffersMemoryMaterials, storageBuffersMappedMaterials, props);
+	createMapped(bufferSizeLights, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		storageBuffersLights, storageBuffersMemoryLights, storageBuffersMappedLights, props);
+	createMapped(bufferSizeLightTransforms, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		storageBuffersLightPerspective, storageBuffersMemoryLightPerspective, storageBuffersMappedLightPerspective, props);
+	createMapped(bufferSizeCameras, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+		uniformBuffersCameras, uniformBuffersMemoryCameras, uniformBuffersMappedCameras, props);
+	createMapped(sizeof(ClusterInfo), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+		uniformBuffersClusters, uniformBuffersMemoryClusters, uniformBuffersMappedClusters, props);
+	createMapped(sizeof(uint32_t) * 2 * CLUSTER_COUNT, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		storageBuffersClusterRanges, storageBuffersMemoryClusterRanges, storageBuffersMappedClusterRanges, props);
+	createMapped(bufferSizeClusterLights, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		storageBuffersClusterLights, storageBuffersMemoryClusterLights, storageBuffersMappedClusterLights, props);
 }
 
 
 void VulkanSystem::createDescriptorPool() {
-	size_t transformsSize = useVertexBuffer ?
-		transformPools.size() : 0;
-	transformsSize = useInstancing ?
-		transformsSize + transformInstPools.size() :
-		transformsSize;
-
-	descriptorPoolShadows.resize(lightPool.size());
-	for (int i = 0; i < lightPool.size(); i++) {
-		VkDescriptorPoolSize poolSizeShadow{};
-		poolSizeShadow.type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
-		poolSizeShadow.descriptorCount = MAX_FRAMES_IN_FLIGHT * (transformsSize);
-		VkDescriptorPoolCreateInfo poolInfoShadow{};
-		poolInfoShadow.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-		poolInfoShadow.poolSizeCount = 1;
-		poolInfoShadow.pPoolSizes = &poolSizeShadow;
-		poolInfoShadow.maxSets = (transformsSize)*MAX_FRAMES_IN_FLIGHT;
-		if (vkCreateDescriptorPool(device, &poolInfoShadow, nullptr, &descriptorPoolShadows[i])
-			!= VK_SUCCESS) {
-			throw std::runtime_error("ERROR: Unable to create a descriptor pool in Vulkan System.");
-		}
-	}
-
-	std::array<VkDescriptorPoolSize,2> poolSizesHDR{};
-	poolSizesHDR[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	poolSizesHDR[0].descriptorCount = rawEnvironment.has_value() ? 
-		8 * (transformsSize)*MAX_FRAMES_IN_FLIGHT :
-		6 * (transformsSize)*MAX_FRAMES_IN_FLIGHT;
-	poolSizesHDR[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-	poolSizesHDR[1].descriptorCount = rawEnvironment.has_value() ? 
-		(rawTextures.size() + rawCubes.size() + 1 + lightPool.size()) * transformsSize*MAX_FRAMES_IN_FLIGHT : 
-		(rawTextures.size() + rawCubes.size() + lightPool.size()) * transformsSize * MAX_FRAMES_IN_FLIGHT;
+	//One scene set per frame, however many pools the scene splits into
+	std::array<VkDescriptorPoolSize,3> poolSizesHDR{};
+	poolSizesHDR[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	poolSizesHDR[0].descriptorCount = 8 * MAX_FRAMES_IN_FLIGHT;
+	poolSizesHDR[1].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	poolSizesHDR[1].descriptorCount = 2 * MAX_FRAMES_IN_FLIGHT;
+	poolSizesHDR[2].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	poolSizesHDR[2].descriptorCount = (std::max<size_t>(rawTextures.size(), 1) + std::max<size_t>(rawCubes.size(), 1) +
+		std::max<size_t>(lightPool.size(), 1) + 2) * MAX_FRAMES_IN_FLIGHT;
 	VkDescriptorPoolCreateInfo poolInfoHDR{};
 	poolInfoHDR.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
 	poolInfoHDR.poolSizeCount = poolSizesHDR.size();
 	poolInfoHDR.pPoolSizes = poolSizesHDR.data();
-	poolInfoHDR.maxSets = (transformsSize) * MAX_FRAMES_IN_FLIGHT;
+	poolInfoHDR.maxSets = MAX_FRAMES_IN_FLIGHT;
 	if (vkCreateDescriptorPool(device, &poolInfoHDR, nullptr, &descriptorPoolHDR)
 		!= VK_SUCCESS) {
 		throw std::runtime_error("ERROR: Unable to create a descriptor pool in Vulkan System.");
@@ -2155,33 +2393,38 @@ void VulkanSystem::createDescriptorPool() {
 		!= VK_SUCCESS) {
 		throw std::runtime_error("ERROR: Unable to create a descriptor pool in Vulkan System.");
 	}
+	if (!deferred) return;
+	//G-buffer sets follow the swap chain image, like the framebuffer they read
+	VkDescriptorPoolSize poolSizeDeferred{};
+	poolSizeDeferred.type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+	poolSizeDeferred.descriptorCount = (G_BUFFER_COUNT + 1) * swapChainImages.size();
+	VkDescriptorPoolCreateInfo poolInfoDeferred{};
+	poolInfoDeferred.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfoDeferred.poolSizeCount = 1;
+	poolInfoDeferred.pPoolSizes = &poolSizeDeferred;
+	poolInfoDeferred.maxSets = swapChainImages.size();
+	if (vkCreateDescriptorPool(device, &poolInfoDeferred, nullptr, &descriptorPoolDeferred)
+		!= VK_SUCCESS) {
+		throw std::runtime_error("ERROR: Unable to create a descriptor pool in Vulkan System.");
+	}
 }
 
+//Written once here, only shadow maps are rewritten when the swap chain rebuilds them
 void VulkanSystem::createDescriptorSets() {
 
-	size_t transformsSize = useVertexBuffer ?
-		transformPools.size() : 0;
-	transformsSize = useInstancing ?
-		transformsSize + transformInstPools.size() :
-		transformsSize;
-
-
-
-
-	std::vector<VkDescriptorSetLayout> layoutsHDR(MAX_FRAMES_IN_FLIGHT *
-		transformsSize, descriptorSetLayouts[lightPool.size()]);
+	std::vector<VkDescriptorSetLayout> layoutsHDR(MAX_FRAMES_IN_FLIGHT, descriptorSetLayouts[0]);
 	VkDescriptorSetAllocateInfo allocateInfoHDR{};
 	allocateInfoHDR.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
 	allocateInfoHDR.descriptorPool = descriptorPoolHDR;
-	allocateInfoHDR.descriptorSetCount = MAX_FRAMES_IN_FLIGHT * (transformsSize);
+	allocateInfoHDR.descriptorSetCount = MAX_FRAMES_IN_FLIGHT;
 	allocateInfoHDR.pSetLayouts = layoutsHDR.data();
-	descriptorSetsHDR.resize(MAX_FRAMES_IN_FLIGHT * (transformsSize));
+	descriptorSetsHDR.resize(MAX_FRAMES_IN_FLIGHT);
 	if (vkAllocateDescriptorSets(device, &allocateInfoHDR, descriptorSetsHDR.data())
 		!= VK_SUCCESS) {
 		throw std::runtime_error("ERROR: Unable to create descriptor sets in Vulkan System. HDR.");
 	}
 
-	std::vector<VkDescriptorSetLayout> layoutsFinal(MAX_FRAMES_IN_FLIGHT, descriptorSetLayouts[lightPool.size() + 1]);
+	std::vector<VkDescriptorSetLayout> layoutsFinal(MAX_FRAMES_IN_FLIGHT, descriptorSetLayouts[1]);
 	VkDescriptorSetAllocateInfo allocateInfoFinal{};
 	allocateInfoFinal.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
 	allocateInfoFinal.descriptorPool = descriptorPoolFinal;
@@ -2193,394 +2436,128 @@ void VulkanSystem::createDescriptorSets() {
 		throw std::runtime_error("ERROR: Unable to create descriptor sets in Vulkan System. Final.");
 	}
 
-	descriptorSetsShadows.resize(lightPool.size());
-	for (int i = 0; i < lightPool.size(); i++) {
-		std::vector<VkDescriptorSetLayout> layoutsShadow(MAX_FRAMES_IN_FLIGHT * transformsSize, descriptorSetLayouts[i]);
-		VkDescriptorSetAllocateInfo allocateInfoShadow{};
-		allocateInfoShadow.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-		allocateInfoShadow.descriptorPool = descriptorPoolShadows[i];
-		allocateInfoShadow.descriptorSetCount = MAX_FRAMES_IN_FLIGHT * transformsSize;
-		allocateInfoShadow.pSetLayouts = layoutsShadow.data();
-		descriptorSetsShadows[i].resize(MAX_FRAMES_IN_FLIGHT * transformsSize);
-		if (vkAllocateDescriptorSets(device, &allocateInfoShadow, descriptorSetsShadows[i].data())
+	if (deferred) {
+		std::vector<VkDescriptorSetLayout> layoutsDeferred(swapChainImages.size(), descriptorSetLayouts[2]);
+		VkDescriptorSetAllocateInfo allocateInfoDeferred{};
+		allocateInfoDeferred.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+		allocateInfoDeferred.descriptorPool = descriptorPoolDeferred;
+		allocateInfoDeferred.descriptorSetCount = layoutsDeferred.size();
+		allocateInfoDeferred.pSetLayouts = layoutsDeferred.data();
+		descriptorSetsDeferred.resize(layoutsDeferred.size());
+		if (vkAllocateDescriptorSets(device, &allocateInfoDeferred, descriptorSetsDeferred.data())
 			!= VK_SUCCESS) {
-			throw std::runtime_error("ERROR: Unable to create descriptor sets in Vulkan System. Shadow.");
+			throw std::runtime_error("ERROR: Unable to create descriptor sets in Vulkan System. Deferred.");
 		}
 	}
 
-	size_t samplerSize = rawTextures.size() + rawCubes.size();
-
-	size_t pool = 0;
-	for (; pool < transformPools.size() && useVertexBuffer; pool++) {
-		for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
-			size_t poolInd = pool * MAX_FRAMES_IN_FLIGHT + frame;
-			std::vector<VkWriteDescriptorSet> shadowWriteDescriptorSets =
-				std::vector<VkWriteDescriptorSet>(lightPool.size());
-
-			for (int i = 0; i < lightPool.size(); i++) {
-				//Shadow
-				VkDescriptorBufferInfo bufferInfoModels{};
-				bufferInfoModels.buffer = uniformBuffersModelsPools[i][pool][frame];
-				bufferInfoModels.offset = 0;
-				bufferInfoModels.range = sizeof(mat44<float>) * transformPools[pool].size();
-
-				shadowWriteDescriptorSets[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-				shadowWriteDescriptorSets[i].dstSet = descriptorSetsShadows[i][poolInd];
-				shadowWriteDescriptorSets[i].dstBinding = 0;
-				shadowWriteDescriptorSets[i].dstArrayElement = 0;
-				shadowWriteDescriptorSets[i].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-				shadowWriteDescriptorSets[i].descriptorCount = 1;
-				shadowWriteDescriptorSets[i].pBufferInfo = &bufferInfoModels;
-				vkUpdateDescriptorSets(device, 1, &shadowWriteDescriptorSets[i], 0, nullptr);
-			}
-
-			//HDR
-			VkDescriptorBufferInfo bufferInfoTransforms{};
-			bufferInfoTransforms.buffer = uniformBuffersTransformsPools[pool][frame];
-			bufferInfoTransforms.offset = 0;
-			bufferInfoTransforms.range = sizeof(mat44<float>) * transformPools[pool].size();
-			VkDescriptorBufferInfo bufferInfoCameras{};
-			bufferInfoCameras.buffer = uniformBuffersCamerasPools[pool][frame];
-			bufferInfoCameras.offset = 0;
-			bufferInfoCameras.range = sizeof(mat44<float>);
-			VkDescriptorBufferInfo bufferInfoLights{};
-			bufferInfoLights.buffer = uniformBuffersLightsPools[pool][frame];
-			bufferInfoLights.offset = 0;
-			bufferInfoLights.range = sizeof(Light) * lightPool.size();
-			VkDescriptorBufferInfo bufferInfoLightTransforms{};
-			bufferInfoLightTransforms.buffer = uniformBuffersLightTransformsPools[pool][frame];
-			bufferInfoLightTransforms.offset = 0;
-			bufferInfoLightTransforms.range = sizeof(mat44<float>) * lightPool.size();
-			VkDescriptorBufferInfo bufferInfoLightPerspective{};
-			bufferInfoLightPerspective.buffer = uniformBuffersLightPerspectivePools[pool][frame];
-			bufferInfoLightPerspective.offset = 0;
-			bufferInfoLightPerspective.range = sizeof(mat44<float>) * lightPool.size();
-			VkDescriptorBufferInfo bufferInfoMaterials{};
-			bufferInfoMaterials.buffer = uniformBuffersMaterialsPools[pool][frame];
-			bufferInfoMaterials.offset = 0;
-			bufferInfoMaterials.range = sizeof(DrawMaterial) * materialPools[pool].size();
-			VkDescriptorBufferInfo bufferInfoNormTransforms{};
-			VkDescriptorBufferInfo bufferInfoEnvTransforms{};
-			if (rawEnvironment.has_value()) {
-				bufferInfoNormTransforms.buffer = uniformBuffersNormalTransformsPools[pool][frame];
-				bufferInfoNormTransforms.offset = 0;
-				bufferInfoNormTransforms.range = sizeof(mat44<float>) * transformNormalPools[pool].size();
-				bufferInfoEnvTransforms.buffer = uniformBuffersEnvironmentTransformsPools[pool][frame];
-				bufferInfoEnvTransforms.offset = 0;
-				bufferInfoEnvTransforms.range = sizeof(mat44<float>) * transformEnvironmentPools[pool].size();
-			}
-			std::vector<VkWriteDescriptorSet> writeDescriptorSets = rawEnvironment.has_value() ?
-				std::vector<VkWriteDescriptorSet>(10 + samplerSize) :
-				std::vector<VkWriteDescriptorSet>(7 + samplerSize);
-			writeDescriptorSets[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			writeDescriptorSets[0].dstSet = descriptorSetsHDR[poolInd];
-			writeDescriptorSets[0].dstBinding = 0;
-			writeDescriptorSets[0].dstArrayElement = 0;
-			writeDescriptorSets[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-			writeDescriptorSets[0].descriptorCount = 1;
-			writeDescriptorSets[0].pBufferInfo = &bufferInfoTransforms;
-			writeDescriptorSets[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			writeDescriptorSets[1].dstSet = descriptorSetsHDR[poolInd];
-			writeDescriptorSets[1].dstBinding = 1;
-			writeDescriptorSets[1].dstArrayElement = 0;
-			writeDescriptorSets[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-			writeDescriptorSets[1].descriptorCount = 1;
-			writeDescriptorSets[1].pBufferInfo = &bufferInfoCameras;
-			writeDescriptorSets[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			writeDescriptorSets[2].dstSet = descriptorSetsHDR[poolInd];
-			writeDescriptorSets[2].dstBinding = 2;
-			writeDescriptorSets[2].dstArrayElement = 0;
-			writeDescriptorSets[2].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-			writeDescriptorSets[2].descriptorCount = 1;
-			writeDescriptorSets[2].pBufferInfo = &bufferInfoMaterials;
-			writeDescriptorSets[3].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			writeDescriptorSets[3].dstSet = descriptorSetsHDR[poolInd];
-			writeDescriptorSets[3].dstBinding = 6;
-			writeDescriptorSets[3].dstArrayElement = 0;
-			writeDescriptorSets[3].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-			writeDescriptorSets[3].descriptorCount = 1;
-			writeDescriptorSets[3].pBufferInfo = &bufferInfoLightTransforms;
-			writeDescriptorSets[4].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			writeDescriptorSets[4].dstSet = descriptorSetsHDR[poolInd];
-			writeDescriptorSets[4].dstBinding = 7;
-			writeDescriptorSets[4].dstArrayElement = 0;
-			writeDescriptorSets[4].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-			writeDescriptorSets[4].descriptorCount = 1;
-			writeDescriptorSets[4].pBufferInfo = &bufferInfoLights;
-
-			VkDescriptorImageInfo imageInfoLUT{};
-			imageInfoLUT.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-			imageInfoLUT.imageView = LUTImageView;
-			imageInfoLUT.sampler = LUTSampler;
-			writeDescriptorSets[5].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			writeDescriptorSets[5].dstSet = descriptorSetsHDR[poolInd];
-			writeDescriptorSets[5].dstBinding = 5;
-			writeDescriptorSets[5].dstArrayElement = 0;
-			writeDescriptorSets[5].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-			writeDescriptorSets[5].descriptorCount = 1;
-			writeDescriptorSets[5].pImageInfo = &imageInfoLUT;
-
-
-			writeDescriptorSets[6].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			writeDescriptorSets[6].dstSet = descriptorSetsHDR[poolInd];
-			writeDescriptorSets[6].dstBinding = 9;
-			writeDescriptorSets[6].dstArrayElement = 0;
-			writeDescriptorSets[6].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-			writeDescriptorSets[6].descriptorCount = 1;
-			writeDescriptorSets[6].pBufferInfo = &bufferInfoLightPerspective;
-
-			if (rawEnvironment.has_value()) {
-				writeDescriptorSets[7].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-				writeDescriptorSets[7].dstSet = descriptorSetsHDR[poolInd];
-				writeDescriptorSets[7].dstBinding = 11;
-				writeDescriptorSets[7].dstArrayElement = 0;
-				writeDescriptorSets[7].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-				writeDescriptorSets[7].descriptorCount = 1;
-				writeDescriptorSets[7].pBufferInfo = &bufferInfoNormTransforms;
-				writeDescriptorSets[8].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-				writeDescriptorSets[8].dstSet = descriptorSetsHDR[poolInd];
-				writeDescriptorSets[8].dstBinding = 12;
-				writeDescriptorSets[8].dstArrayElement = 0;
-				writeDescriptorSets[8].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-				writeDescriptorSets[8].descriptorCount = 1;
-				writeDescriptorSets[8].pBufferInfo = &bufferInfoEnvTransforms;
-			}
-
-			std::vector<VkDescriptorImageInfo> imageInfosTex = std::vector<VkDescriptorImageInfo>(rawTextures.size());
-			for (size_t tex = 0; tex < rawTextures.size(); tex++) {
-				size_t descSet = rawEnvironment.has_value() ? tex + 9 : tex + 7;
-				imageInfosTex[tex].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-				imageInfosTex[tex].imageView = textureImageViews[tex];
-				imageInfosTex[tex].sampler = textureSamplers[tex];
-				writeDescriptorSets[descSet].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-				writeDescriptorSets[descSet].dstSet = descriptorSetsHDR[poolInd];
-				writeDescriptorSets[descSet].dstBinding = 3;
-				writeDescriptorSets[descSet].dstArrayElement = tex;
-				writeDescriptorSets[descSet].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-				writeDescriptorSets[descSet].descriptorCount = 1;
-				writeDescriptorSets[descSet].pImageInfo = &imageInfosTex[tex];
-			}
-			std::vector<VkDescriptorImageInfo> imageInfosCube = std::vector<VkDescriptorImageInfo>(rawCubes.size());
-			for (size_t cube = 0; cube < rawCubes.size(); cube++) {
-				size_t descSet = rawEnvironment.has_value() ? cube + 9 : cube + 7;
-				descSet += rawTextures.size();
-				imageInfosCube[cube].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-				imageInfosCube[cube].imageView = cubeImageViews[cube];
-				imageInfosCube[cube].sampler = cubeSamplers[cube];
-				writeDescriptorSets[descSet].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-				writeDescriptorSets[descSet].dstSet = descriptorSetsHDR[poolInd];
-				writeDescriptorSets[descSet].dstBinding = 4;
-				writeDescriptorSets[descSet].dstArrayElement = cube;
-				writeDescriptorSets[descSet].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-				writeDescriptorSets[descSet].descriptorCount = 1;
-				writeDescriptorSets[descSet].pImageInfo = &imageInfosCube[cube];
-			}
-
-			if (rawEnvironment.has_value()) {
-				VkDescriptorImageInfo imageInfoEnv;
-				size_t descSet =samplerSize + 9;
-				imageInfoEnv.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-				imageInfoEnv.imageView = environmentImageView;
-				imageInfoEnv.sampler = environmentSampler;
-				writeDescriptorSets[descSet].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-				writeDescriptorSets[descSet].dstSet = descriptorSetsHDR[poolInd];
-				writeDescriptorSets[descSet].dstBinding = 10;
-				writeDescriptorSets[descSet].dstArrayElement = 0;
-				writeDescriptorSets[descSet].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-				writeDescriptorSets[descSet].descriptorCount = 1;
-				writeDescriptorSets[descSet].pImageInfo = &imageInfoEnv;
-			}
-
-			vkUpdateDescriptorSets(device, writeDescriptorSets.size(), writeDescriptorSets.data(), 0, nullptr);
+	for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+		std::vector<VkDescriptorBufferInfo> bufferInfos;
+		std::vector<std::pair<uint32_t, VkDescriptorType>> bufferBindings;
+		bufferInfos.reserve(11);
+		auto addBuffer = [&](uint32_t binding, VkDescriptorType type, VkBuffer buffer) {
+			VkDescriptorBufferInfo bufferInfo{};
+			bufferInfo.buffer = buffer;
+			bufferInfo.offset = 0;
+			bufferInfo.range = VK_WHOLE_SIZE;
+			bufferInfos.push_back(bufferInfo);
+			bufferBindings.push_back(std::make_pair(binding, type));
+		};
+		addBuffer(0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, storageBuffersTransforms[frame]);
+		addBuffer(1, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, uniformBuffersCameras[frame]);
+		addBuffer(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, storageBuffersMaterials[frame]);
+		addBuffer(7, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, storageBuffersLights[frame]);
+		addBuffer(9, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, storageBuffersLightPerspective[frame]);
+		addBuffer(13, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, uniformBuffersClusters[frame]);
+		addBuffer(14, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, storageBuffersClusterRanges[frame]);
+		addBuffer(15, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, storageBuffersClusterLights[frame]);
+		if (rawEnvironment.has_value()) {
+			addBuffer(11, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, storageBuffersNormalTransforms[frame]);
+			addBuffer(12, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, storageBuffersEnvironmentTransforms[frame]);
 		}
-	}
-	for (; useInstancing && pool < transformPools.size() + transformInstPoolsStore.size(); pool++) {
-		for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
-			size_t poolInd = pool * MAX_FRAMES_IN_FLIGHT + frame;
-
-
-
-			for (int i = 0; i < lightPool.size(); i++) {
-
-				//Shadow
-				VkDescriptorBufferInfo bufferInfoModels{};
-				bufferInfoModels.buffer = uniformBuffersModelsPools[i][pool][frame];
-				bufferInfoModels.offset = 0;
-				bufferInfoModels.range = sizeof(mat44<float>) * transformInstPoolsStore[pool - transformPools.size()].size();
-
-				VkWriteDescriptorSet shadowWriteDescriptorSet{};
-				shadowWriteDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-				shadowWriteDescriptorSet.dstSet = descriptorSetsShadows[i][poolInd];
-				shadowWriteDescriptorSet.dstBinding = 0;
-				shadowWriteDescriptorSet.dstArrayElement = 0;
-				shadowWriteDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-				shadowWriteDescriptorSet.descriptorCount = 1;
-				shadowWriteDescriptorSet.pBufferInfo = &bufferInfoModels;
-				vkUpdateDescriptorSets(device, 1, &shadowWriteDescriptorSet, 0, nullptr);
-			}
-
-
-			VkDescriptorBufferInfo bufferInfoLightPerspective{};
-			bufferInfoLightPerspective.buffer = uniformBuffersLightPerspectivePools[pool][frame];
-			bufferInfoLightPerspective.offset = 0;
-			bufferInfoLightPerspective.range = sizeof(mat44<float>) * lightPool.size();
-			VkDescriptorBufferInfo bufferInfoTransforms{};
-			bufferInfoTransforms.buffer = uniformBuffersTransformsPools[pool][frame];
-			bufferInfoTransforms.offset = 0;
-			bufferInfoTransforms.range = sizeof(mat44<float>) * transformInstPoolsStore[pool - transformPools.size()].size();
-			VkDescriptorBufferInfo bufferInfoCameras{};
-			bufferInfoCameras.buffer = uniformBuffersCamerasPools[pool][frame];
-			bufferInfoCameras.offset = 0;
-			bufferInfoCameras.range = sizeof(mat44<float>);
-			VkDescriptorBufferInfo bufferInfoLights{};
-			bufferInfoLights.buffer = uniformBuffersLightsPools[pool][frame];
-			bufferInfoLights.offset = 0;
-			bufferInfoLights.range = sizeof(Light) * lightPool.size();
-			VkDescriptorBufferInfo bufferInfoLightTransforms{};
-			bufferInfoLightTransforms.buffer = uniformBuffersLightTransformsPools[pool][frame];
-			bufferInfoLightTransforms.offset = 0;
-			bufferInfoLightTransforms.range = sizeof(mat44<float>) * lightPool.size();
-			VkDescriptorBufferInfo bufferInfoMaterials{};
-			bufferInfoMaterials.buffer = uniformBuffersMaterialsPools[pool][frame];
-			bufferInfoMaterials.offset = 0;
-			bufferInfoMaterials.range = sizeof(DrawMaterial);
-			VkDescriptorBufferInfo bufferInfoNormTransforms{};
-			VkDescriptorBufferInfo bufferInfoEnvTransforms{};
-			if (rawEnvironment.has_value()) {
-				bufferInfoNormTransforms.buffer = uniformBuffersNormalTransformsPools[pool][frame];
-				bufferInfoNormTransforms.offset = 0;
-				bufferInfoNormTransforms.range = sizeof(mat44<float>) * transformNormalPools[pool].size();
-				bufferInfoEnvTransforms.buffer = uniformBuffersEnvironmentTransformsPools[pool][frame];
-				bufferInfoEnvTransforms.offset = 0;
-				bufferInfoEnvTransforms.range = sizeof(mat44<float>) * transformEnvironmentInstPoolsStore[pool - transformPools.size()].size();
-			}
-			std::vector<VkWriteDescriptorSet> writeDescriptorSets = rawEnvironment.has_value() ?
-				std::vector<VkWriteDescriptorSet>(10 + samplerSize) :
-				std::vector<VkWriteDescriptorSet>(7 + samplerSize);
-
-			writeDescriptorSets[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			writeDescriptorSets[0].dstSet = descriptorSetsHDR[poolInd];
-			writeDescriptorSets[0].dstBinding = 0;
-			writeDescriptorSets[0].dstArrayElement = 0;
-			writeDescriptorSets[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-			writeDescriptorSets[0].descriptorCount = 1;
-			writeDescriptorSets[0].pBufferInfo = &bufferInfoTransforms;
-			writeDescriptorSets[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			writeDescriptorSets[1].dstSet = descriptorSetsHDR[poolInd];
-			writeDescriptorSets[1].dstBinding = 1;
-			writeDescriptorSets[1].dstArrayElement = 0;
-			writeDescriptorSets[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-			writeDescriptorSets[1].descriptorCount = 1;
-			writeDescriptorSets[1].pBufferInfo = &bufferInfoCameras;
-			writeDescriptorSets[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			writeDescriptorSets[2].dstSet = descriptorSetsHDR[poolInd];
-			writeDescriptorSets[2].dstBinding = 2;
-			writeDescriptorSets[2].dstArrayElement = 0;
-			writeDescriptorSets[2].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-			writeDescriptorSets[2].descriptorCount = 1;
-			writeDescriptorSets[2].pBufferInfo = &bufferInfoMaterials;
-			writeDescriptorSets[3].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			writeDescriptorSets[3].dstSet = descriptorSetsHDR[poolInd];
-			writeDescriptorSets[3].dstBinding = 6;
-			writeDescriptorSets[3].dstArrayElement = 0;
-			writeDescriptorSets[3].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-			writeDescriptorSets[3].descriptorCount = 1;
-			writeDescriptorSets[3].pBufferInfo = &bufferInfoLightTransforms;
-			writeDescriptorSets[4].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			writeDescriptorSets[4].dstSet = descriptorSetsHDR[poolInd];
-			writeDescriptorSets[4].dstBinding = 7;
-			writeDescriptorSets[4].dstArrayElement = 0;
-			writeDescriptorSets[4].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-			writeDescriptorSets[4].descriptorCount = 1;
-			writeDescriptorSets[4].pBufferInfo = &bufferInfoLights;
-
-			VkDescriptorImageInfo imageInfoLUT{};
-			imageInfoLUT.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-			imageInfoLUT.imageView = LUTImageView;
-			imageInfoLUT.sampler = LUTSampler;
-			writeDescriptorSets[5].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			writeDescriptorSets[5].dstSet = descriptorSetsHDR[poolInd];
-			writeDescriptorSets[5].dstBinding = 5;
-			writeDescriptorSets[5].dstArrayElement = 0;
-			writeDescriptorSets[5].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-			writeDescriptorSets[5].descriptorCount = 1;
-			writeDescriptorSets[5].pImageInfo = &imageInfoLUT;
-
-			writeDescriptorSets[6].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			writeDescriptorSets[6].dstSet = descriptorSetsHDR[poolInd];
-			writeDescriptorSets[6].dstBinding = 9;
-			writeDescriptorSets[6].dstArrayElement = 0;
-			writeDescriptorSets[6].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-			writeDescriptorSets[6].descriptorCount = 1;
-			writeDescriptorSets[6].pBufferInfo = &bufferInfoLightPerspective;
-
-			if (rawEnvironment.has_value()) {
-				writeDescriptorSets[7].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-				writeDescriptorSets[7].dstSet = descriptorSetsHDR[poolInd];
-				writeDescriptorSets[7].dstBinding = 11;
-				writeDescriptorSets[7].dstArrayElement = 0;
-				writeDescriptorSets[7].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-				writeDescriptorSets[7].descriptorCount = 1;
-				writeDescriptorSets[7].pBufferInfo = &bufferInfoNormTransforms;
-				writeDescriptorSets[8].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-				writeDescriptorSets[8].dstSet = descriptorSetsHDR[poolInd];
-				writeDescriptorSets[8].dstBinding = 12;
-				writeDescriptorSets[8].dstArrayElement = 0;
-				writeDescriptorSets[8].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-				writeDescriptorSets[8].descriptorCount = 1;
-				writeDescriptorSets[8].pBufferInfo = &bufferInfoEnvTransforms;
-			}
-
-			std::vector<VkDescriptorImageInfo> imageInfosTex = std::vector<VkDescriptorImageInfo>(rawTextures.size());
-			for (size_t tex = 0; tex < rawTextures.size(); tex++) {
-				size_t descSet = rawEnvironment.has_value() ? tex + 9 : tex + 7;
-				imageInfosTex[tex].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-				imageInfosTex[tex].imageView = textureImageViews[tex];
-				imageInfosTex[tex].sampler = textureSamplers[tex];
-				writeDescriptorSets[descSet].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-				writeDescriptorSets[descSet].dstSet = descriptorSetsHDR[poolInd];
-				writeDescriptorSets[descSet].dstBinding = 3;
-				writeDescriptorSets[descSet].dstArrayElement = tex;
-				writeDescriptorSets[descSet].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-				writeDescriptorSets[descSet].descriptorCount = 1;
-				writeDescriptorSets[descSet].pImageInfo = &imageInfosTex[tex];
-			}
-
-			std::vector<VkDescriptorImageInfo> imageInfosCube = std::vector<VkDescriptorImageInfo>(rawCubes.size());
-			for (size_t cube = 0; cube < rawCubes.size(); cube++) {
-				size_t descSet = rawEnvironment.has_value() ? cube + 9 : cube + 7;
-				descSet += rawTextures.size();
-				imageInfosCube[cube].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-				imageInfosCube[cube].imageView = cubeImageViews[cube];
-				imageInfosCube[cube].sampler = cubeSamplers[cube];
-				writeDescriptorSets[descSet].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-				writeDescriptorSets[descSet].dstSet = descriptorSetsHDR[poolInd];
-				writeDescriptorSets[descSet].dstBinding = 4;
-				writeDescriptorSets[descSet].dstArrayElement = cube;
-				writeDescriptorSets[descSet].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-				writeDescriptorSets[descSet].descriptorCount = 1;
-				writeDescriptorSets[descSet].pImageInfo = &imageInfosCube[cube];
-			}
 
+		std::vector<VkWriteDescriptorSet> writeDescriptorSets;
+		for (size_t buffer = 0; buffer < bufferInfos.size(); buffer++) {
+			VkWriteDescriptorSet write{};
+			write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			write.dstSet = descriptorSetsHDR[frame];
+			write.dstBinding = bufferBindings[buffer].first;
+			write.dstArrayElement = 0;
+			write.descriptorType = bufferBindings[buffer].second;
+			write.descriptorCount = 1;
+			write.pBufferInfo = &bufferInfos[buffer];
+			writeDescriptorSets.push_back(write);
+		}
 
+		VkDescriptorImageInfo imageInfoLUT{};
+		imageInfoLUT.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		imageInfoLUT.imageView = LUTImageView;
+		imageInfoLUT.sampler = LUTSampler;
+		VkWriteDescriptorSet writeLUT{};
+		writeLUT.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writeLUT.dstSet = descriptorSetsHDR[frame];
+		writeLUT.dstBinding = 5;
+		writeLUT.dstArrayElement = 0;
+		writeLUT.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		writeLUT.descriptorCount = 1;
+		writeLUT.pImageInfo = &imageInfoLUT;
+		writeDescriptorSets.push_back(writeLUT);
+
+		//Whole texture arrays in one write each
+		std::vector<VkDescriptorImageInfo> imageInfosTex = std::vector<VkDescriptorImageInfo>(rawTextures.size());
+		for (size_t tex = 0; tex < rawTextures.size(); tex++) {
+			imageInfosTex[tex].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			imageInfosTex[tex].imageView = textureImageViews[tex];
+			imageInfosTex[tex].sampler = textureSamplers[tex];
+		}
+		if (!imageInfosTex.empty()) {
+			VkWriteDescriptorSet writeTex{};
+			writeTex.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			writeTex.dstSet = descriptorSetsHDR[frame];
+			writeTex.dstBinding = 3;
+			writeTex.dstArrayElement = 0;
+			writeTex.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+			writeTex.descriptorCount = imageInfosTex.size();
+			writeTex.pImageInfo = imageInfosTex.data();
+			writeDescriptorSets.push_back(writeTex);
+		}
+		std::vector<VkDescriptorImageInfo> imageInfosCube = std::vector<VkDescriptorImageInfo>(rawCubes.size());
+		for (size_t cube = 0; cube < rawCubes.size(); cube++) {
+			imageInfosCube[cube].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			imageInfosCube[cube].imageView = cubeImageViews[cube];
+			imageInfosCube[cube].sampler = cubeSamplers[cube];
+		}
+		if (!imageInfosCube.empty()) {
+			VkWriteDescriptorSet writeCube{};
+			writeCube.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			writeCube.dstSet = descriptorSetsHDR[frame];
+			writeCube.dstBinding = 4;
+			writeCube.dstArrayElement = 0;
+			writeCube.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+			writeCube.descriptorCount = imageInfosCube.size();
+			writeCube.pImageInfo = imageInfosCube.data();
+			writeDescriptorSets.push_back(writeCube);
+		}
 
-			if (rawEnvironment.has_value()) {
-				VkDescriptorImageInfo imageInfoEnv;
-				size_t descSet = samplerSize + 9;
-				imageInfoEnv.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-				imageInfoEnv.imageView = environmentImageView;
-				imageInfoEnv.sampler = environmentSampler;
-				writeDescriptorSets[descSet].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-				writeDescriptorSets[descSet].dstSet = descriptorSetsHDR[poolInd];
-				writeDescriptorSets[descSet].dstBinding = 10;
-				writeDescriptorSets[descSet].dstArrayElement = 0;
-				writeDescriptorSets[descSet].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-				writeDescriptorSets[descSet].descriptorCount = 1;
-				writeDescriptorSets[descSet].pImageInfo = &imageInfoEnv;
-			}
-			vkUpdateDescriptorSets(device, writeDescriptorSets.size(), writeDescriptorSets.data(), 0, nullptr);
+		VkDescriptorImageInfo imageInfoEnv{};
+		if (rawEnvironment.has_value()) {
+			imageInfoEnv.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			imageInfoEnv.imageView = environmentImageView;
+			imageInfoEnv.sampler = environmentSampler;
+			VkWriteDescriptorSet writeEnv{};
+			writeEnv.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			writeEnv.dstSet = descriptorSetsHDR[frame];
+			writeEnv.dstBinding = 10;
+			writeEnv.dstArrayElement = 0;
+			writeEnv.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+			writeEnv.descriptorCount = 1;
+			writeEnv.pImageInfo = &imageInfoEnv;
+			writeDescriptorSets.push_back(writeEnv);
 		}
+
+		vkUpdateDescriptorSets(device, writeDescriptorSets.size(), writeDescriptorSets.data(), 0, nullptr);
 	}
+	writeShadowDescriptors();
+	writeDeferredDescriptors();
 
 	for (size_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
 		VkDescriptorImageInfo finalDescriptor{};
@@ -2600,8 +2577,57 @@ void VulkanSystem::createDescriptorSets() {
 	}
 }
 
+//G-buffer views and depth change only with the swap chain
+void VulkanSystem::writeDeferredDescriptors() {
+	for (size_t image = 0; image < descriptorSetsDeferred.size(); image++) {
+		std::array<VkDescriptorImageInfo, G_BUFFER_COUNT + 1> inputInfos{};
+		for (int target = 0; target < G_BUFFER_COUNT; target++) {
+			inputInfos[target].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			inputInfos[target].imageView = gBufferImageViews[image * G_BUFFER_COUNT + target];
+		}
+		inputInfos[G_BUFFER_COUNT].imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+		inputInfos[G_BUFFER_COUNT].imageView = depthImageView;
+
+		VkWriteDescriptorSet writeDescriptorSet{};
+		writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writeDescriptorSet.dstSet = descriptorSetsDeferred[image];
+		writeDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+		writeDescriptorSet.descriptorCount = inputInfos.size();
+		writeDescriptorSet.dstBinding = 0;
+		writeDescriptorSet.pImageInfo = inputInfos.data();
+		writeDescriptorSet.dstArrayElement = 0;
+		vkUpdateDescriptorSets(device, 1, &writeDescriptorSet, 0, nullptr);
+	}
+}
+
+//Shadow maps change only with the depth resources, not per frame
+void VulkanSystem::writeShadowDescriptors() {
+	if (lightPool.empty()) return;
+	for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+		std::vector<VkDescriptorImageInfo> imageInfoShadows = std::vector<VkDescriptorImageInfo>(lightPool.size());
+		for (int light = 0; light < lightPool.size(); light++) {
+			bool useDefault = lightPool[light].shadowRes == 0;
+			imageInfoShadows[light] = {};
+			imageInfoShadows[light].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			imageInfoShadows[light].imageView = useDefault ? defaultShadowImageView : shadowDepthImageViews[light];
+			imageInfoShadows[light].sampler = useDefault ? defaultShadowSampler : shadowSamplers[light][frame];
+		}
+		VkWriteDescriptorSet writeDescriptorSet{};
+		writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writeDescriptorSet.dstSet = descriptorSetsHDR[frame];
+		writeDescriptorSet.dstBinding = 8;
+		writeDescriptorSet.dstArrayElement = 0;
+		writeDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		writeDescriptorSet.descriptorCount = imageInfoShadows.size();
+		writeDescriptorSet.pImageInfo = imageInfoShadows.data();
+		vkUpdateDescriptorSets(device, 1, &writeDescriptorSet, 0, nullptr);
+	}
+}
+
 void VulkanSystem::createCommands() {
-	commandBuffers.resize((1 + lightPool.size()) * MAX_FRAMES_IN_FLIGHT);
+	recordImages = std::max<size_t>(swapChainImages.size(), MAX_FRAMES_IN_FLIGHT);
+	recordedVersions.assign(MAX_FRAMES_IN_FLIGHT * recordImages, 0);
+	commandBuffers.resize((1 + lightPool.size()) * MAX_FRAMES_IN_FLIGHT * recordImages);
 
 	VkCommandPoolCreateInfo poolInfo{};
 	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
@@ -2620,8 +2646,42 @@ void VulkanSystem::createCommands() {
 		throw std::runtime_error("ERROR: Unable to create a command buffer in VulkanSystem.");
 	}
 
-
-
+	if (countFragments) {
+		VkQueryPoolCreateInfo queryInfo{};
+		queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+		queryInfo.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+		queryInfo.queryCount = MAX_FRAMES_IN_FLIGHT;
+		queryInfo.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+		if (vkCreateQueryPool(device, &queryInfo, nullptr, &fragmentQueryPool) != VK_SUCCESS) {
+			throw std::runtime_error("ERROR: Unable to create a query pool in VulkanSystem.");
+		}
+		fragmentQueryWritten = std::vector<bool>(MAX_FRAMES_IN_FLIGHT, false);
+	}
+
+	if (recordThreads <= 1) return;
+	//Transient pools are reset whole each frame instead of per buffer, the last pass is the depth prepass
+	size_t passes = lightPool.size() + 2;
+	recordCommandPools.resize(recordThreads * MAX_FRAMES_IN_FLIGHT * recordImages);
+	recordSecondaryBuffers.resize(recordCommandPools.size() * passes);
+	for (size_t pool = 0; pool < recordCommandPools.size(); pool++) {
+		VkCommandPoolCreateInfo recordPoolInfo{};
+		recordPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		recordPoolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+		recordPoolInfo.queueFamilyIndex = familyIndices.graphicsFamily.value();
+		if (vkCreateCommandPool(device, &recordPoolInfo, nullptr, &recordCommandPools[pool]) != VK_SUCCESS) {
+			throw std::runtime_error("ERROR: Unable to create a command pool in VulkanSystem.");
+		}
+		VkCommandBufferAllocateInfo secondaryInfo{};
+		secondaryInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		secondaryInfo.commandPool = recordCommandPools[pool];
+		secondaryInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+		secondaryInfo.commandBufferCount = passes;
+		if (vkAllocateCommandBuffers(device, &secondaryInfo, recordSecondaryBuffers.data() + pool * passes) != VK_SUCCESS) {
+			throw std::runtime_error("ERROR: Unable to create a command buffer in VulkanSystem.");
+		}
+	}
+	//The calling thread records a share too
+	recordWorkers.start(recordThreads - 1);
 }
 
 void VulkanSystem::createImage(uint32_t width, uint32_t height, VkFormat format, 
@@ -2660,8 +2720,9 @@ void VulkanSystem::createImage(uint32_t width, uint32_t height, VkFormat format,
 
 void VulkanSystem::createDepthResources() {
 	VkFormat depthFormat = VK_FORMAT_D32_SFLOAT;
+	//The deferred lighting subpass reads depth back to find positions
 	createImage(swapChainExtent.width, swapChainExtent.height, depthFormat,
-		VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, 0,
+		VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | (deferred ? VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT : 0), 0,
 		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depthImage, depthImageMemory);
 	depthImageView = createImageView(depthImage, depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT);
 	VkFormat shadowDepthFormat = VK_FORMAT_D16_UNORM;
@@ -2707,55 +2768,31 @@ void VulkanSystem::recordCommandBufferShadow(VkCommandBuffer commandBuffer, uint
 
 	renderPassInfo.clearValueCount = clearColors.size();
 	renderPassInfo.pClearValues = clearColors.data();
-	vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+	vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+		recordThreads > 1 ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE);
 
 	VkViewport viewport{};
 	VkRect2D scissor{};
-	//Viewport and Scissor are dyanmic, so set now
+	//Viewport and Scissor are dyanmic, set inline or by each secondary
 	viewport.x = 0.0f;
 	viewport.y = 0.0f;
 	viewport.width = static_cast<float>(shadowRes);
 	viewport.height = static_cast<float>(shadowRes);
 	viewport.minDepth = 0.0f;
 	viewport.maxDepth = 1.0f;
-	vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
-
 	scissor.offset = { 0, 0 };
 	scissor.extent = shadowExtent;
-	vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
-	//Shadow subpass;
-	{
-		vkCmdPushConstants(commandBuffer, pipelineLayoutShadows[lightIndex], VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(mat44<float>), &worldTolightPerspPool[lightIndex]);
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipelineShadows[lightIndex]);
-		const VkDeviceSize offsets[] = { 0 };
-		if (useVertexBuffer) vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertexBuffer, offsets);
-		for (size_t pool = 0; pool < transformPools.size() && pool < indexBuffersValid.size() && useVertexBuffer; pool++) {
-			if (indexBuffersValid[pool]) {
-				vkCmdBindIndexBuffer(commandBuffer, indexBuffers[pool], 0, VK_INDEX_TYPE_UINT32);
-				vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-					pipelineLayoutShadows[lightIndex], 0, 1, &descriptorSetsShadows[lightIndex][pool * MAX_FRAMES_IN_FLIGHT + currentFrame], 0, nullptr);
-				vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(indexPools[pool].size()), 1, 0, 0, 0);
-			}
-		}
-
+	//Shadow subpass
+	if (recordThreads > 1) {
+		executeSecondaries(commandBuffer, shadowPasses[lightIndex], shadowFramebuffers[lightIndex][imageIndex], lightIndex,
+			viewport, scissor, [&](VkCommandBuffer secondary, size_t first, size_t last) {
+				recordShadowDraws(secondary, lightIndex, first, last);
+			});
 	}
-	//Instanced version
-	if (useInstancing) {
-		vkCmdPushConstants(commandBuffer, pipelineLayoutShadows[lightIndex], VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(mat44<float>), &worldTolightPerspPool[lightIndex]);
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsInstPipelineShadows[lightIndex]);
-		const VkDeviceSize offsets[] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertexInstBuffer, offsets);
-		for (size_t pool = 0; pool < transformInstPools.size(); pool++) {
-			if (transformInstPools[pool].size() == 0) continue;
-			vkCmdBindIndexBuffer(commandBuffer, indexInstBuffers[transformInstIndexPools[pool]], 0, VK_INDEX_TYPE_UINT32);
-			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-				pipelineLayoutShadows[lightIndex], 0, 1, &descriptorSetsShadows[lightIndex][(pool + transformPools.size()) *
-				MAX_FRAMES_IN_FLIGHT + currentFrame], 0, nullptr);
-			vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(
-				indexInstPools[transformInstIndexPools[pool]].size()),
-				transformInstPools[pool].size(), 0, 0, 0);
-		}
-
+	else {
+		vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+		vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+		recordShadowDraws(commandBuffer, lightIndex, 0, drawItemCount());
 	}
 	//END render pass
 	vkCmdEndRenderPass(commandBuffer);
@@ -2805,6 +2842,8 @@ void VulkanSystem::recordCommandBufferMain(VkCommandBuffer commandBuffer, uint32
 	clearColors.push_back({ {0.0f, 0.0f, 0.0f, 1.0f} });
 	clearColors.push_back({ {1.0f,0} });
 	clearColors.push_back({ {0.0f, 0.0f, 0.0f, 1.0f} });
+	//Cleared G-buffer texels have lighting model 0, so the background stays black
+	for (int target = 0; target < G_BUFFER_COUNT && deferred; target++) clearColors.push_back({ {0.0f, 0.0f, 0.0f, 0.0f} });
 
 	renderPassInfo.clearValueCount = clearColors.size();
 	renderPassInfo.pClearValues = clearColors.data();
@@ -2812,58 +2851,55 @@ void VulkanSystem::recordCommandBufferMain(VkCommandBuffer commandBuffer, uint32
 
 	VkViewport viewport{};
 	VkRect2D scissor{};
-	vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+	//Counts the whole render pass, the fullscreen subpasses add the same pixels with or without the prepass
+	if (countFragments) {
+		vkCmdResetQueryPool(commandBuffer, fragmentQueryPool, currentFrame, 1);
+		vkCmdBeginQuery(commandBuffer, fragmentQueryPool, currentFrame, 0);
+	}
+	vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+		recordThreads > 1 ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE);
 
-	//Viewport and Scissor are dyanmic, so set now
+	//Viewport and Scissor are dyanmic, set inline or by each secondary
 	viewport.x = 0.0f;
 	viewport.y = 0.0f;
 	viewport.width = static_cast<float>(swapChainExtent.width);
 	viewport.height = static_cast<float>(swapChainExtent.height);
 	viewport.minDepth = 0.0f;
 	viewport.maxDepth = 1.0f;
-	vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
-
 	scissor.offset = { 0, 0 };
 	scissor.extent = swapChainExtent;
-	vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
 
-	//Main subpass
-	{
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
-		//Begin recording commands
-		vkCmdPushConstants(commandBuffer, pipelineLayoutHDR, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(PushConst), &pushConstHDR);
-		const VkDeviceSize offsets[] = { 0 };
-		if (useVertexBuffer) vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertexBuffer, offsets);
-		for (size_t pool = 0; pool < transformPools.size() && pool < indexBuffersValid.size() && useVertexBuffer; pool++) {
-			if (indexBuffersValid[pool]) {
-				vkCmdBindIndexBuffer(commandBuffer, indexBuffers[pool], 0, VK_INDEX_TYPE_UINT32);
-				vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-					pipelineLayoutHDR, 0, 1, &descriptorSetsHDR[pool * MAX_FRAMES_IN_FLIGHT + currentFrame], 0, nullptr);
-				vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(indexPools[pool].size()), 1, 0, 0, 0);
-			}
+	//Main subpass, the prepass lays depth for every draw before any is shaded
+	if (recordThreads > 1) {
+		if (depthPrepass) {
+			executeSecondaries(commandBuffer, renderPass, swapChainFramebuffers[imageIndex], lightPool.size() + 1,
+				viewport, scissor, [&](VkCommandBuffer secondary, size_t first, size_t last) {
+					recordMainDraws(secondary, first, last, true);
+				});
 		}
+		executeSecondaries(commandBuffer, renderPass, swapChainFramebuffers[imageIndex], lightPool.size(),
+			viewport, scissor, [&](VkCommandBuffer secondary, size_t first, size_t last) {
+				recordMainDraws(secondary, first, last);
+			});
+	}
+	else {
+		vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+		vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+		if (depthPrepass) recordMainDraws(commandBuffer, 0, drawItemCount(), true);
+		recordMainDraws(commandBuffer, 0, drawItemCount());
 	}
 
-	//Instanced version
-	if (useInstancing) {
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsInstPipeline);
-
-
-		vkCmdPushConstants(commandBuffer, pipelineLayoutHDR, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(PushConst), &pushConstHDR);
-
-		const VkDeviceSize offsets[] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertexInstBuffer, offsets);
-		for (size_t pool = 0; pool < transformInstPools.size(); pool++) {
-			if (transformInstPools[pool].size() == 0) continue;
-			vkCmdBindIndexBuffer(commandBuffer, indexInstBuffers[transformInstIndexPools[pool]], 0, VK_INDEX_TYPE_UINT32);
-			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-				pipelineLayoutHDR, 0, 1, &descriptorSetsHDR[(pool + transformPools.size()) *
-				MAX_FRAMES_IN_FLIGHT + currentFrame], 0, nullptr);
-			vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(
-				indexInstPools[transformInstIndexPools[pool]].size()),
-				transformInstPools[pool].size(), 0, 0, 0);
-		}
-
+	//Deferred lighting subpass
+	if (deferred) {
+		vkCmdNextSubpass(commandBuffer, VK_SUBPASS_CONTENTS_INLINE);
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipelineDeferred);
+		vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+		vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+		VkDescriptorSet setsDeferred[] = { descriptorSetsHDR[currentFrame], descriptorSetsDeferred[imageIndex] };
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayoutDeferred, 0, 2, setsDeferred, 0, NULL);
+		vkCmdPushConstants(commandBuffer, pipelineLayoutDeferred, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+			0, sizeof(PushConst), &pushConstHDR);
+		vkCmdDraw(commandBuffer, 6, 1, 0, 0);
 	}
 
 	//Present subpass
@@ -2876,6 +2912,7 @@ void VulkanSystem::recordCommandBufferMain(VkCommandBuffer commandBuffer, uint32
 
 	//END render pass
 	vkCmdEndRenderPass(commandBuffer);
+	if (countFragments) vkCmdEndQuery(commandBuffer, fragmentQueryPool, currentFrame);
 
 	if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
 		throw std::runtime_error("ERROR: Unable to record command buffer in VulkanSystem.");
@@ -2886,6 +2923,228 @@ void VulkanSystem::recordCommandBufferMain(VkCommandBuffer commandBuffer, uint32
 
 
 
+//Draw items are the non instanced pools followed by the instanced pools
+size_t VulkanSystem::drawItemCount() {
+	size_t mainPools = useVertexBuffer ? std::min(transformPools.size(), indexBuffersValid.size()) : 0;
+	size_t instPools = useInstancing ? transformInstPools.size() : 0;
+	return mainPools + instPools;
+}
+
+//The scene set is bound once, each draw pushes the base slot of its pool
+//Sorted draws can alternate between instanced and not, so the pipeline is rebound on every switch
+void VulkanSystem::recordMainDraws(VkCommandBuffer commandBuffer, size_t first, size_t last, bool prepass) {
+	size_t mainPools = useVertexBuffer ? std::min(transformPools.size(), indexBuffersValid.size()) : 0;
+	bool sorted = drawOrder.size() == drawItemCount();
+	bool boundMain = false;
+	bool boundInst = false;
+	bool boundScene = false;
+	for (size_t index = first; index < last; index++) {
+		size_t item = sorted ? drawOrder[index] : index;
+		size_t pool = item < mainPools ? item : item - mainPools;
+		if (item < mainPools) {
+			if (!indexBuffersValid[pool]) continue;
+			if (!boundMain) {
+				vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, prepass ? depthPipeline : graphicsPipeline);
+				const VkDeviceSize offsets[] = { 0, 0 };
+				const VkBuffer streams[] = { vertexBuffer, vertexAttributeBuffer };
+				vkCmdBindVertexBuffers(commandBuffer, 0, 2, streams, offsets);
+				boundMain = true;
+				boundInst = false;
+			}
+		}
+		else {
+			//Instanced version
+			if (transformInstPools[pool].size() == 0) continue;
+			if (!boundInst) {
+				vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, prepass ? depthInstPipeline : graphicsInstPipeline);
+				const VkDeviceSize offsets[] = { 0, 0 };
+				const VkBuffer streams[] = { vertexInstBuffer, vertexInstAttributeBuffer };
+				vkCmdBindVertexBuffers(commandBuffer, 0, 2, streams, offsets);
+				boundInst = true;
+				boundMain = false;
+			}
+		}
+		if (!boundScene) {
+			//Both pipelines share the layout, so the set and constants stay bound across the switch
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+				pipelineLayoutHDR, 0, 1, &descriptorSetsHDR[currentFrame], 0, nullptr);
+			vkCmdPushConstants(commandBuffer, pipelineLayoutHDR, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+				0, sizeof(PushConst), &pushConstHDR);
+			boundScene = true;
+		}
+		if (item < mainPools) {
+			vkCmdPushConstants(commandBuffer, pipelineLayoutHDR, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+				offsetof(PushConst, baseIndex), sizeof(int), &drawBaseIndices[pool]);
+			vkCmdBindIndexBuffer(commandBuffer, indexBuffers[pool], 0, indexTypes[pool]);
+			vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(indexPools[pool].size()), 1, 0, indexBaseVertices[pool], 0);
+		}
+		else {
+			vkCmdPushConstants(commandBuffer, pipelineLayoutHDR, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+				offsetof(PushConst, baseIndex), sizeof(int), &drawBaseIndices[transformPools.size() + pool]);
+			vkCmdBindIndexBuffer(commandBuffer, indexInstBuffers[transformInstIndexPools[pool]], 0, indexInstTypes[transformInstIndexPools[pool]]);
+			vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(
+				indexInstPools[transformInstIndexPools[pool]].size()),
+				transformInstPools[pool].size(), 0, indexInstBaseVertices[transformInstIndexPools[pool]], 0);
+		}
+	}
+}
+
+void VulkanSystem::recordShadowDraws(VkCommandBuffer commandBuffer, int lightIndex, size_t first, size_t last) {
+	size_t mainPools = useVertexBuffer ? std::min(transformPools.size(), indexBuffersValid.size()) : 0;
+	bool boundMain = false;
+	bool boundInst = false;
+	bool boundScene = false;
+	for (size_t item = first; item < last; item++) {
+		size_t pool = item < mainPools ? item : item - mainPools;
+		if (item < mainPools) {
+			if (!indexBuffersValid[pool]) continue;
+			if (!boundMain) {
+				vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipelineShadows[lightIndex]);
+				//Shadows only read the position stream
+				const VkDeviceSize offsets[] = { 0 };
+				vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertexBuffer, offsets);
+				boundMain = true;
+			}
+		}
+		else {
+			//Instanced version
+			if (transformInstPools[pool].size() == 0) continue;
+			if (!boundInst) {
+				vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsInstPipelineShadows[lightIndex]);
+				const VkDeviceSize offsets[] = { 0 };
+				vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertexInstBuffer, offsets);
+				boundInst = true;
+			}
+		}
+		if (!boundScene) {
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+				pipelineLayoutShadow, 0, 1, &descriptorSetsHDR[currentFrame], 0, nullptr);
+			vkCmdPushConstants(commandBuffer, pipelineLayoutShadow, VK_SHADER_STAGE_VERTEX_BIT, 0,
+				sizeof(mat44<float>), &worldTolightPerspPool[lightIndex]);
+			boundScene = true;
+		}
+		if (item < mainPools) {
+			vkCmdPushConstants(commandBuffer, pipelineLayoutShadow, VK_SHADER_STAGE_VERTEX_BIT,
+				offsetof(PushConstShadow, baseIndex), sizeof(int), &drawBaseIndices[pool]);
+			vkCmdBindIndexBuffer(commandBuffer, indexBuffers[pool], 0, indexTypes[pool]);
+			vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(indexPools[pool].size()), 1, 0, indexBaseVertices[pool], 0);
+		}
+		else {
+			vkCmdPushConstants(commandBuffer, pipelineLayoutShadow, VK_SHADER_STAGE_VERTEX_BIT,
+				offsetof(PushConstShadow, baseIndex), sizeof(int), &drawBaseIndices[transformPools.size() + pool]);
+			vkCmdBindIndexBuffer(commandBuffer, indexInstBuffers[transformInstIndexPools[pool]], 0, indexInstTypes[transformInstIndexPools[pool]]);
+			vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(
+				indexInstPools[transformInstIndexPools[pool]].size()),
+				transformInstPools[pool].size(), 0, indexInstBaseVertices[transformInstIndexPools[pool]], 0);
+		}
+	}
+}
+
+//Splits the draw items over the record threads, each filling its own secondary buffer for subpass 0 of pass
+void VulkanSystem::executeSecondaries(VkCommandBuffer commandBuffer, VkRenderPass pass, VkFramebuffer framebuffer, size_t passIndex,
+	VkViewport viewport, VkRect2D scissor, std::function<void(VkCommandBuffer, size_t, size_t)> record) {
+	size_t items = drawItemCount();
+	size_t passes = lightPool.size() + 2;
+	size_t chunk = (items + recordThreads - 1) / recordThreads;
+	std::vector<VkCommandBuffer> recorded(recordThreads, VK_NULL_HANDLE);
+	recordWorkers.run(recordThreads, [&](int thread) {
+		size_t first = thread * chunk;
+		size_t last = std::min(items, first + chunk);
+		if (first >= last) return;
+		VkCommandBuffer secondary = recordSecondaryBuffers[(thread * MAX_FRAMES_IN_FLIGHT * recordImages + recordSlot) * passes + passIndex];
+		VkCommandBufferInheritanceInfo inheritanceInfo{};
+		inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+		inheritanceInfo.renderPass = pass;
+		inheritanceInfo.subpass = 0;
+		inheritanceInfo.framebuffer = framebuffer;
+		//Main pass secondaries run inside the fragment query
+		if (countFragments && pass == renderPass) {
+			inheritanceInfo.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+		}
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		//Not one time submit, the primary executing it may be submitted again
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+		beginInfo.pInheritanceInfo = &inheritanceInfo;
+		if (vkBeginCommandBuffer(secondary, &beginInfo) != VK_SUCCESS) {
+			throw std::runtime_error("ERROR: Unable to begin recording a command buffer in VulkanSystem.");
+		}
+		vkCmdSetViewport(secondary, 0, 1, &viewport);
+		vkCmdSetScissor(secondary, 0, 1, &scissor);
+		record(secondary, first, last);
+		if (vkEndCommandBuffer(secondary) != VK_SUCCESS) {
+			throw std::runtime_error("ERROR: Unable to record command buffer in VulkanSystem.");
+		}
+		recorded[thread] = secondary;
+	});
+	std::vector<VkCommandBuffer> secondaries;
+	for (VkCommandBuffer secondary : recorded) {
+		if (secondary != VK_NULL_HANDLE) secondaries.push_back(secondary);
+	}
+	if (!secondaries.empty()) vkCmdExecuteCommands(commandBuffer, (uint32_t)secondaries.size(), secondaries.data());
+}
+
+//World spheres the lights can reach, suns and lights without a limit reach everywhere
+std::vector<std::pair<float_3, float>> VulkanSystem::lightSpheres(size_t count) {
+	std::vector<std::pair<float_3, float>> spheres(count);
+	for (size_t light = 0; light < count; light++) {
+		const DrawLight& drawLight = lightPool[light];
+		if (drawLight.type == 2 || drawLight.limit <= 0) {
+			spheres[light] = std::make_pair(float_3(0, 0, 0), -1.f);
+			continue;
+		}
+		//Specular terms measure from the closest point on the light, up to radius nearer than its center
+		spheres[light] = worldSphere(std::make_pair(float_3(0, 0, 0), drawLight.limit + drawLight.radius),
+			mat44<float>::affineInverse(worldTolightPool[light]));
+	}
+	return spheres;
+}
+
+//Bins the lights into the camera's froxel grid and uploads it for this frame
+void VulkanSystem::updateLightClusters(uint32_t frame, mat44<float> cameraSpace) {
+	std::chrono::high_resolution_clock::time_point start =
+		std::chrono::high_resolution_clock::now();
+
+	lightClusters.build(findFrustumInfo(cameras[currentCamera]), cameraSpace, lightSpheres(lightPool.size()));
+	Perspective persp = cameras[currentCamera].perspectiveInfo;
+	lightClusters.info.inverseCamera = mat44<float>::affineInverse(cameraSpace) *
+		mat44<float>::invPerspective(persp.vfov, persp.aspect, persp.nearP, persp.farP);
+	lightClusters.info.inverseViewport[0] = 1.f / swapChainExtent.width;
+	lightClusters.info.inverseViewport[1] = 1.f / swapChainExtent.height;
+	memcpy(uniformBuffersMappedClusters[frame], &lightClusters.info, sizeof(ClusterInfo));
+	memcpy(storageBuffersMappedClusterRanges[frame], lightClusters.ranges.data(), sizeof(uint32_t) * lightClusters.ranges.size());
+	memcpy(storageBuffersMappedClusterLights[frame], lightClusters.indices.data(), sizeof(uint32_t) * lightClusters.indices.size());
+
+	std::chrono::high_resolution_clock::time_point end =
+		std::chrono::high_resolution_clock::now();
+	debugClusterTime += std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.f;
+	debugClusterLights += lightClusters.averageLights();
+	debugClusterCount++;
+}
+
+//Rebins growing prefixes of the scene's lights from the current camera, one row per step
+std::vector<std::array<float, 3>> VulkanSystem::measureLightScaling(int steps) {
+	float_3 useMoveVec = movementMode == MOVE_DEBUG ? debugMoveVec : moveVec;
+	float_3 useDirVec = movementMode == MOVE_DEBUG ? debugDirVec : dirVec;
+	mat44<float> cameraSpace = getCameraSpace(cameras[currentCamera], useMoveVec, useDirVec);
+	frustumInfo info = findFrustumInfo(cameras[currentCamera]);
+	LightClusters clusters;
+	std::vector<std::array<float, 3>> rows;
+	for (int step = 1; step <= steps; step++) {
+		size_t count = lightPool.size() * step / steps;
+		if (count == 0) continue;
+		std::vector<std::pair<float_3, float>> spheres = lightSpheres(count);
+		std::chrono::high_resolution_clock::time_point start =
+			std::chrono::high_resolution_clock::now();
+		clusters.build(info, cameraSpace, spheres);
+		std::chrono::high_resolution_clock::time_point end =
+			std::chrono::high_resolution_clock::now();
+		rows.push_back({ (float)count, clusters.averageLights(),
+			std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.f });
+	}
+	return rows;
+}
+
 void VulkanSystem::updateUniformBuffers(uint32_t frame) {
 
 
@@ -2893,75 +3152,160 @@ void VulkanSystem::updateUniformBuffers(uint32_t frame) {
 	//Guided by glm implementation of lookAt
 	float_3 useMoveVec = movementMode == MOVE_DEBUG ? debugMoveVec : moveVec;
 	float_3 useDirVec = movementMode == MOVE_DEBUG ? debugDirVec : dirVec;
-	mat44<float> local = getCameraSpace(cameras[currentCamera], useMoveVec, useDirVec);
+	mat44<float> cameraSpace = getCameraSpace(cameras[currentCamera], useMoveVec, useDirVec);
 	float_3 cameraPos = useMoveVec + cameras[currentCamera].forAnimate.translate;
-	local = cameras[currentCamera].perspective * local;
+	mat44<float> local = cameras[currentCamera].perspective * cameraSpace;
 	pushConstHDR.numLights = (int)lightPool.size();
 	pushConstHDR.camPosX = cameraPos.x;
 	pushConstHDR.camPosY = cameraPos.y;
 	pushConstHDR.camPosZ = cameraPos.z;
 	pushConstHDR.pbrP = 3;
-	size_t pool = 0;
-	size_t matsize = sizeof(DrawMaterial);
-	for (; pool < transformPools.size() && useVertexBuffer; pool++) {
-		memcpy(uniformBuffersMappedTransformsPools[pool][frame],
-			transformPools[pool].data(), sizeof(mat44<float>) *
-			transformPools[pool].size());
-		for (int i = 0; i < lightPool.size(); i++) {
-			memcpy(uniformBuffersMappedModelsPools[i][pool][frame],
-				transformPools[pool].data(), sizeof(mat44<float>) *
-				transformPools[pool].size());
+	pushConstHDR.baseIndex = 0;
+	for (size_t pool = 0; pool < transformInstPools.size() && pool < transformInstPoolsLast.size(); pool++) {
+		markDirty(transformPools.size() + pool, transformInstPoolsLast[pool], transformInstPools[pool]);
+	}
+	//Every pool writes into its own slots of the frame's scene arrays, and only the slots that changed since this frame wrote them
+	uint64_t bytes = 0;
+	VkDeviceSize transformBytes = sizeof(mat44<float>) * std::max<uint32_t>(sceneSlots, 1);
+	std::vector<VkMappedMemoryRange> flushRanges;
+	//Normal and environment transforms are only kept with an environment, so they are passed as null without one
+	auto writeTransforms = [&](size_t draw, const std::vector<mat44<float>>& source, const mat44<float>* normals,
+		const mat44<float>* environments) {
+		std::pair<size_t, size_t>& range = dirtyRanges[frame][draw];
+		size_t last = std::min(range.second, source.size());
+		if (range.first < last) {
+			size_t slot = drawBaseIndices[draw] + range.first;
+			size_t size = sizeof(mat44<float>) * (last - range.first);
+			memcpy((mat44<float>*)storageBuffersMappedTransforms[frame] + slot, source.data() + range.first, size);
+			flushMapped(flushRanges, storageBuffersMemoryTransforms[frame], sizeof(mat44<float>) * slot, size, transformBytes);
+			bytes += size;
+			if (rawEnvironment.has_value()) {
+				memcpy((mat44<float>*)storageBuffersMappedNormalTransforms[frame] + slot, normals + range.first, size);
+				memcpy((mat44<float>*)storageBuffersMappedEnvironmentTransforms[frame] + slot, environments + range.first, size);
+				flushMapped(flushRanges, storageBuffersMemoryNormalTransforms[frame], sizeof(mat44<float>) * slot, size, transformBytes);
+				flushMapped(flushRanges, storageBuffersMemoryEnvironmentTransforms[frame], sizeof(mat44<float>) * slot, size, transformBytes);
+				bytes += 2 * size;
+			}
 		}
-		if (rawEnvironment.has_value()) {
-			memcpy(uniformBuffersMappedNormalTransformsPools[pool][frame],
-				transformNormalPools[pool].data(), sizeof(mat44<float>) *
-				transformNormalPools[pool].size());
-			memcpy(uniformBuffersMappedEnvironmentTransformsPools[pool][frame],
-				transformEnvironmentPools[pool].data(), sizeof(mat44<float>) *
-				transformEnvironmentPools[pool].size());
-		}
-		memcpy(uniformBuffersMappedCamerasPools[pool][frame], &(local),
-			sizeof(mat44<float>));
-		memcpy(uniformBuffersMappedLightsPools[pool][frame], lightPool.data(),
-			sizeof(DrawLight) * lightPool.size());
-		memcpy(uniformBuffersMappedLightTransformsPools[pool][frame], worldTolightPool.data(),
-			sizeof(mat44<float>) * worldTolightPool.size());
-		memcpy(uniformBuffersMappedLightPerspectivePools[pool][frame], worldTolightPerspPool.data(),
-			sizeof(mat44<float>) * worldTolightPool.size());
-		memcpy(uniformBuffersMappedMaterialsPools[pool][frame], 
-			materialPools[pool].data(), matsize * materialPools[pool].size());
-	}
-	if (!useInstancing) return;
-	for (; pool < transformPools.size() + transformInstPools.size(); pool++) {
-		size_t poolAdjusted = pool - transformPools.size();
-		if (transformInstPools[poolAdjusted].size() == 0) continue;
-		memcpy(uniformBuffersMappedTransformsPools[pool][frame],
-			transformInstPools[poolAdjusted].data(), sizeof(mat44<float>) *
-			transformInstPools[poolAdjusted].size());
-		for (int i = 0; i < lightPool.size(); i++) {
-			memcpy(uniformBuffersMappedModelsPools[i][pool][frame],
-				transformInstPools[poolAdjusted].data(), sizeof(mat44<float>) *
-				transformInstPools[poolAdjusted].size());
+		range = std::make_pair(0, 0);
+	};
+	DrawMaterial* materials = (DrawMaterial*)storageBuffersMappedMaterials[frame];
+	for (size_t pool = 0; pool < transformPools.size() && useVertexBuffer; pool++) {
+		bool environment = rawEnvironment.has_value();
+		writeTransforms(pool, transformPools[pool], environment ? transformNormalPools[pool].data() : nullptr,
+			environment ? transformEnvironmentPools[pool].data() : nullptr);
+		if (sceneWritten[frame]) continue;
+		memcpy(materials + drawBaseIndices[pool], materialPools[pool].data(), sizeof(DrawMaterial) * materialPools[pool].size());
+		bytes += sizeof(DrawMaterial) * materialPools[pool].size();
+	}
+	for (size_t pool = 0; pool < transformInstPools.size() && useInstancing; pool++) {
+		bool environment = rawEnvironment.has_value();
+		writeTransforms(transformPools.size() + pool, transformInstPools[pool], environment ? transformNormalInstPools[pool].data() : nullptr,
+			environment ? transformEnvironmentInstPools[pool].data() : nullptr);
+		if (sceneWritten[frame]) continue;
+		memcpy(materials + drawBaseIndices[transformPools.size() + pool], &instancedMaterials[pool], sizeof(DrawMaterial));
+		bytes += sizeof(DrawMaterial);
+	}
+	if (flushRanges.size() > 0) vkFlushMappedMemoryRanges(device, (uint32_t)flushRanges.size(), flushRanges.data());
+	//Camera and lights are stored once per frame instead of once per pool, lights only on the first write
+	memcpy(uniformBuffersMappedCameras[frame], &(local), sizeof(mat44<float>));
+	bytes += sizeof(mat44<float>);
+	if (!sceneWritten[frame]) {
+		memcpy(storageBuffersMappedLights[frame], gpuLights.data(), sizeof(GPULight) * gpuLights.size());
+		memcpy(storageBuffersMappedLightPerspective[frame], worldTolightPerspPool.data(), sizeof(mat44<float>) * worldTolightPerspPool.size());
+		bytes += sizeof(GPULight) * gpuLights.size() + sizeof(mat44<float>) * worldTolightPerspPool.size();
+		sceneWritten[frame] = true;
+	}
+	updateLightClusters(frame, cameraSpace);
+	bytes += sizeof(ClusterInfo) + sizeof(uint32_t) * (lightClusters.ranges.size() + lightClusters.indices.size());
+	debugUploadBytes += bytes;
+	debugUploadCount++;
+	if (depthPrepass) sortDraws(cameraPos);
+}
+
+//Orders draw items by the nearest bounding sphere they hold, the nodes and instances inside an item are ordered while culling
+void VulkanSystem::sortDraws(float_3 cameraPos) {
+	size_t mainPools = useVertexBuffer ? std::min(transformPools.size(), indexBuffersValid.size()) : 0;
+	size_t items = drawItemCount();
+	std::vector<float> nearest(items, std::numeric_limits<float>::max());
+	auto distance = [&](std::pair<float_3, float> localSphere, mat44<float> toWorld) {
+		std::pair<float_3, float> sphere = worldSphere(localSphere, toWorld);
+		return (sphere.first - cameraPos).norm() - sphere.second;
+	};
+	for (size_t pool = 0; pool < mainPools; pool++) {
+		for (size_t node = 0; node < drawPools[pool].size(); node++) {
+			nearest[pool] = std::min(nearest[pool], distance(drawPools[pool][node].boundingSphere, transformPools[pool][node]));
 		}
-		if (rawEnvironment.has_value()) {
-			memcpy(uniformBuffersMappedNormalTransformsPools[pool][frame],
-				transformNormalInstPools[poolAdjusted].data(), sizeof(mat44<float>) *
-				transformNormalInstPools[poolAdjusted].size());
-			memcpy(uniformBuffersMappedEnvironmentTransformsPools[pool][frame],
-				transformEnvironmentInstPools[poolAdjusted].data(), sizeof(mat44<float>) *
-				transformEnvironmentInstPools[poolAdjusted].size());
+	}
+	for (size_t pool = 0; mainPools + pool < items; pool++) {
+		for (const mat44<float>& transform : transformInstPools[pool]) {
+			nearest[mainPools + pool] = std::min(nearest[mainPools + pool],
+				distance(boundingSpheresInst[transformInstIndexPools[pool]], transform));
 		}
-		memcpy(uniformBuffersMappedCamerasPools[pool][frame], &(local),
-			sizeof(mat44<float>));
-		memcpy(uniformBuffersMappedLightsPools[pool][frame], lightPool.data(),
-			sizeof(DrawLight)* lightPool.size());
-		memcpy(uniformBuffersMappedLightTransformsPools[pool][frame], worldTolightPool.data(),
-			sizeof(mat44<float>) * worldTolightPool.size());
-		memcpy(uniformBuffersMappedLightPerspectivePools[pool][frame], worldTolightPerspPool.data(),
-			sizeof(mat44<float>) * worldTolightPool.size());
-		memcpy(uniformBuffersMappedMaterialsPools[pool][frame],
-			&instancedMaterials[poolAdjusted], matsize);
 	}
+	drawOrder.resize(items);
+	for (size_t item = 0; item < items; item++) drawOrder[item] = item;
+	std::stable_sort(drawOrder.begin(), drawOrder.end(), [&](size_t a, size_t b) { return nearest[a] < nearest[b]; });
+}
+
+//Every slot of every frame is written again, used when the pools are laid out anew
+void VulkanSystem::resetDirty() {
+	for (uint32_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+		dirtyRanges[frame].assign(drawBaseIndices.size(), std::make_pair((size_t)0, std::numeric_limits<size_t>::max()));
+		sceneWritten[frame] = false;
+	}
+}
+
+//Widens every frame's pending range of a draw over the slots where before and after differ
+void VulkanSystem::markDirty(size_t draw, const std::vector<mat44<float>>& before, const std::vector<mat44<float>>& after) {
+	size_t shared = std::min(before.size(), after.size());
+	size_t first = 0;
+	while (first < shared && memcmp(&before[first], &after[first], sizeof(mat44<float>)) == 0) first++;
+	size_t last = after.size();
+	if (before.size() == after.size()) {
+		while (last > first && memcmp(&before[last - 1], &after[last - 1], sizeof(mat44<float>)) == 0) last--;
+	}
+	if (first >= last) return;
+	for (uint32_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+		std::pair<size_t, size_t>& range = dirtyRanges[frame][draw];
+		if (range.first >= range.second) range = std::make_pair(first, last);
+		else range = std::make_pair(std::min(range.first, first), std::max(range.second, last));
+	}
+}
+
+//Flush ranges are widened to the atom size, a range reaching the end of the buffer runs to the end of the mapping
+void VulkanSystem::flushMapped(std::vector<VkMappedMemoryRange>& ranges, VkDeviceMemory memory, VkDeviceSize offset,
+	VkDeviceSize size, VkDeviceSize bufferSize) {
+	VkMappedMemoryRange range{};
+	range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+	range.memory = memory;
+	range.offset = offset / nonCoherentAtomSize * nonCoherentAtomSize;
+	VkDeviceSize end = (offset + size + nonCoherentAtomSize - 1) / nonCoherentAtomSize * nonCoherentAtomSize;
+	range.size = end >= bufferSize ? VK_WHOLE_SIZE : end - range.offset;
+	ranges.push_back(range);
+}
+
+//The camera is compared by value, everything else that changes the recorded frames bumps the version where it happens
+void VulkanSystem::updateFrameState() {
+	std::array<float, 14> view = { (float)movementMode, (float)currentCamera,
+		moveVec.x, moveVec.y, moveVec.z, dirVec.x, dirVec.y, dirVec.z,
+		debugMoveVec.x, debugMoveVec.y, debugMoveVec.z, debugDirVec.x, debugDirVec.y, debugDirVec.z };
+	if (view != lastView) {
+		lastView = view;
+		stateVersion++;
+	}
+}
+
+//The frame's fence has passed, so its query is read without waiting
+void VulkanSystem::readFragmentQuery(uint32_t frame) {
+	if (!countFragments || !fragmentQueryWritten[frame]) return;
+	uint64_t invocations = 0;
+	if (vkGetQueryPoolResults(device, fragmentQueryPool, frame, 1, sizeof(uint64_t), &invocations, sizeof(uint64_t),
+		VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+		debugFragmentInvocations += invocations;
+		debugFragmentCount++;
+	}
+	fragmentQueryWritten[frame] = false;
 }
 
 
@@ -2996,17 +3340,43 @@ void VulkanSystem::drawFrame() {
 
 
 
-	createVertexBuffer(false);
-	createIndexBuffers(true, true);
-	updateUniformBuffers(currentFrame);
+	readFragmentQuery(currentFrame);
+	//Buffers recorded for this slot and image against the same state are still valid
+	updateFrameState();
+	recordSlot = currentFrame * recordImages + imageIndex;
+	bool reuse = reuseCommands && recordedVersions[recordSlot] == stateVersion;
+	if (!reuse) {
+		//Index and vertex buffers are shared by both slots, so they are only rebuilt once per change
+		if (!reuseCommands || uploadedVersion != stateVersion) {
+			createVertexBuffer(false);
+			createIndexBuffers(true, true);
+			uploadedVersion = stateVersion;
+		}
+		//Uniforms belong to the slot, another image may already have written them for this state
+		if (!reuseCommands || uniformVersions[currentFrame] != stateVersion) {
+			updateUniformBuffers(currentFrame);
+			uniformVersions[currentFrame] = stateVersion;
+		}
+	}
 
+	std::chrono::high_resolution_clock::time_point recordStart =
+		std::chrono::high_resolution_clock::now();
+	float recordTime = 0;
+	for (int thread = 0; thread < recordThreads && recordThreads > 1 && !reuse; thread++) {
+		vkResetCommandPool(device, recordCommandPools[thread * MAX_FRAMES_IN_FLIGHT * recordImages + recordSlot], 0);
+	}
 
 	for (int i = 0; i < lightPool.size(); i++) {
 
-		size_t commandBufferIndex = (lightPool.size() + 1) * currentFrame + i;
+		size_t commandBufferIndex = (lightPool.size() + 1) * recordSlot + i;
 
-		vkResetCommandBuffer(commandBuffers[commandBufferIndex], 0);
-		recordCommandBufferShadow(commandBuffers[commandBufferIndex], imageIndex,i);
+		if (!reuse) {
+			vkResetCommandBuffer(commandBuffers[commandBufferIndex], 0);
+			recordCommandBufferShadow(commandBuffers[commandBufferIndex], imageIndex, i);
+			std::chrono::high_resolution_clock::time_point recordEnd =
+				std::chrono::high_resolution_clock::now();
+			recordTime += std::chrono::duration_cast<std::chrono::microseconds>(recordEnd - recordStart).count() / 1000.f;
+		}
 
 
 
@@ -3020,42 +3390,28 @@ void VulkanSystem::drawFrame() {
 		if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
 			throw std::runtime_error("failed to submit draw command buffer!");
 		}
-
+		recordStart = std::chrono::high_resolution_clock::now();
 
 	}
 
 
 
-	for (size_t pool = 0; pool < transformPools.size() + transformInstPoolsStore.size(); pool++) {
-		std::vector<VkWriteDescriptorSet> writeDescriptorSets = std::vector<VkWriteDescriptorSet>(lightPool.size());
-		std::vector<VkDescriptorImageInfo> imageInfoShadows = std::vector<VkDescriptorImageInfo>(lightPool.size());
-		size_t poolInd = pool * MAX_FRAMES_IN_FLIGHT + currentFrame;
-
-		for (int light = 0; light < lightPool.size(); light++) {
-			bool useDefault = lightPool[light].shadowRes == 0;
-			writeDescriptorSets[light] = {};
-			imageInfoShadows[light] = {};
-			imageInfoShadows[light].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-			imageInfoShadows[light].imageView = useDefault ? defaultShadowImageView : shadowDepthImageViews[light];
-			imageInfoShadows[light].sampler = useDefault ? defaultShadowSampler : shadowSamplers[light][currentFrame];
-			writeDescriptorSets[light].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			writeDescriptorSets[light].dstSet = descriptorSetsHDR[poolInd];
-			writeDescriptorSets[light].dstBinding = 8;
-			writeDescriptorSets[light].dstArrayElement = light;
-			writeDescriptorSets[light].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-			writeDescriptorSets[light].descriptorCount = 1;
-			writeDescriptorSets[light].pImageInfo = &imageInfoShadows[light];
-		}
-		vkUpdateDescriptorSets(device, writeDescriptorSets.size(), writeDescriptorSets.data(), 0, nullptr);
-
-	}
-
-
 	initialFrame = false;
-	size_t commandBufferIndex = (lightPool.size() + 1) * currentFrame + lightPool.size();
+	size_t commandBufferIndex = (lightPool.size() + 1) * recordSlot + lightPool.size();
 
-	vkResetCommandBuffer(commandBuffers[commandBufferIndex], 0);
-	recordCommandBufferMain(commandBuffers[commandBufferIndex], imageIndex);
+	if (!reuse) {
+		recordStart = std::chrono::high_resolution_clock::now();
+		vkResetCommandBuffer(commandBuffers[commandBufferIndex], 0);
+		recordCommandBufferMain(commandBuffers[commandBufferIndex], imageIndex);
+		std::chrono::high_resolution_clock::time_point recordEnd =
+			std::chrono::high_resolution_clock::now();
+		recordTime += std::chrono::duration_cast<std::chrono::microseconds>(recordEnd - recordStart).count() / 1000.f;
+		debugRecordTime += recordTime;
+		debugRecordCount++;
+		recordedVersions[recordSlot] = stateVersion;
+	}
+	else debugReusedFrames++;
+	if (countFragments) fragmentQueryWritten[currentFrame] = true;
 
 	VkSubmitInfo submitInfo{};
 	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
@@ -3125,9 +3481,15 @@ void VulkanSystem::recreateSwapChain() {
 	{
 		cleanupSwapChain();
 		createSwapChain();
+		if (swapChainImages.size() > recordImages) {
+			throw std::runtime_error("ERROR: Swap chain grew past the images command buffers were allocated for in VulkanSystem.");
+		}
 		createImageViews();
 		createDepthResources();
 		createFramebuffers();
+		writeShadowDescriptors();
+		writeDeferredDescriptors();
+		stateVersion++;
 	}
 }
 
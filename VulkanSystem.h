@@ -8,6 +8,11 @@
 #include "SceneGraph.h"
 #include "platform.h"
 #include "SystemCommonTypes.h"
+#include "CullBVH.h"
+#include "WorkerPool.h"
+#include "LightClusters.h"
+#include <array>
+#include <functional>
 
 
 
@@ -40,6 +45,15 @@ public:
 	bool forwardAnimation = true;
 	bool useInstancing = false;
 	bool useCulling = false;
+	bool compactVertices = false;
+	//Threads recording secondary command buffers, 1 records every pass inline
+	int recordThreads = 1;
+	//Writes a G-buffer in the main subpass and lights it in a fullscreen subpass instead of lighting every fragment drawn
+	bool deferred = false;
+	//Lays depth with position only pipelines first, then shades only the visible fragments, draws sorted front to back
+	bool depthPrepass = false;
+	//Re-submits the last recorded command buffers of a frame while nothing they were built from has changed
+	bool reuseCommands = true;
 	int poolSize;
 
 	//Directories
@@ -59,6 +73,7 @@ public:
 	std::vector<std::vector<uint32_t>> indexInstPools;
 	std::vector<std::vector<mat44<float>>> transformPools;
 	std::vector<std::vector<mat44<float>>> transformInstPools;
+	std::vector<std::vector<mat44<float>>> transformInstPoolsLast;
 	std::vector<std::vector<mat44<float>>> transformInstPoolsStore;
 	std::vector<std::vector<mat44<float>>> transformNormalPools;
 	std::vector<std::vector<mat44<float>>> transformNormalInstPools;
@@ -70,8 +85,11 @@ public:
 	//Materials and Lights
 	std::vector<DrawLight> lightPool;
 	std::vector<mat44<float>> worldTolightPool;
+	//Lights do not move after load, so their shader records are packed once
+	std::vector<GPULight> gpuLights;
 	std::vector<mat44<float>> worldTolightPerspPool;
 	std::optional<Texture> rawEnvironment;
+	std::vector<float> environmentSH;
 	Texture LUT;
 	std::vector<std::vector<DrawMaterial>> materialPools;
 	std::vector<DrawMaterial> instancedMaterials;
@@ -81,8 +99,47 @@ public:
 	std::vector<std::pair<float_3, float>> boundingSpheresInst;
 	std::vector<Driver> nodeDrivers;
 	std::vector<Driver> cameraDrivers;
+	//Culling hierarchies, items map back to (pool, node) and (pool, transform)
+	CullBVH cullTree;
+	CullBVH cullInstTree;
+	std::vector<std::pair<int, int>> cullItems;
+	std::vector<std::pair<int, int>> cullInstItems;
+	bool cullTreesDirty = true;
+	//Draw items nearest first, empty draws in pool order
+	std::vector<size_t> drawOrder;
 	//Cameras
 	std::vector<DrawCamera> cameras;
+	//Culling stats, summed until read
+	float debugCullTime = 0;
+	int debugCullCount = 0;
+	size_t debugCullTested = 0;
+	size_t debugCullVisible = 0;
+	size_t debugCullTotal = 0;
+	//Command recording stats, summed until read
+	float debugRecordTime = 0;
+	int debugRecordCount = 0;
+	//Fragment shader invocations of the main render pass, summed until read, only counted when the device supports it
+	uint64_t debugFragmentInvocations = 0;
+	int debugFragmentCount = 0;
+	//Bytes copied into mapped scene memory, summed until read
+	uint64_t debugUploadBytes = 0;
+	int debugUploadCount = 0;
+	//Frames submitted without culling, uploads or recording, summed until read
+	int debugReusedFrames = 0;
+	//Sampled texture memory with mips, and what it would be if every texture were RGBA8
+	VkDeviceSize debugTextureBytes = 0;
+	VkDeviceSize debugTextureBytesRGBA = 0;
+	//Textures uploaded and how many were block compressed, with the ms spent decoding files and uploading
+	int debugTextureCount = 0;
+	int debugCompressedTextureCount = 0;
+	float debugTextureDecodeTime = 0;
+	float debugTextureUploadTime = 0;
+	//Light cluster stats, summed until read
+	float debugClusterTime = 0;
+	float debugClusterLights = 0;
+	int debugClusterCount = 0;
+	//Lights binned, average lights per cluster and build ms for growing prefixes of the scene's lights
+	std::vector<std::array<float, 3>> measureLightScaling(int steps);
 private:
 	//init
 	void createInstance(bool verbose = true);
@@ -103,7 +160,9 @@ private:
 		VkImageViewType viewType = VK_IMAGE_VIEW_TYPE_2D, int levels = 1);
 	void createImageViews();
 	void createDescriptorSetLayout();
-	void createGraphicsPipeline(std::string vertShader, std::string fragShader, VkPipeline& pipeline, VkPipelineLayout& layout, int subpass, VkRenderPass inRenderPass);
+	void createGraphicsPipeline(std::string vertShader, std::string fragShader, VkPipeline& pipeline, VkPipelineLayout& layout, int subpass, VkRenderPass inRenderPass,
+		const VkSpecializationInfo* fragmentSpecialization = nullptr, bool positionOnly = false, uint32_t colorAttachments = 1,
+		DepthMode depthMode = DEPTH_WRITE);
 	void createGraphicsPipelines();
 	void createRenderPasses();
 	VkShaderModule createShaderModule(const std::vector<char>& shader);
@@ -115,12 +174,26 @@ private:
 		VkMemoryPropertyFlags properties, VkBuffer& buffer, 
 		VkDeviceMemory& bufferMemory, bool realloc);
 	void createVertexBuffer(bool realloc = true);
+	void uploadVertexStream(const void* streamData, VkDeviceSize bufferSize, VkBuffer& buffer, VkDeviceMemory& bufferMemory, bool realloc,
+		VkBufferUsageFlags usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+	void uploadIndexPool(const std::vector<uint32_t>& pool, VkBuffer& buffer, VkDeviceMemory& bufferMemory,
+		bool realloc, VkIndexType& indexType, int32_t& baseVertex);
 	mat44<float> getCameraSpace(DrawCamera camera, float_3 useMoveVec, float_3 useDirVec);
 	void cullInstances();
 	void cullIndexPools();
+	void updateCullTrees();
+	void sortByDepth(std::vector<int>& visible, const std::vector<std::pair<float_3, float>>& spheres, mat44<float> cameraSpace);
+	void sortDraws(float_3 cameraPos);
+	void readFragmentQuery(uint32_t frame);
+	void updateFrameState();
+	void resetDirty();
+	void markDirty(size_t draw, const std::vector<mat44<float>>& before, const std::vector<mat44<float>>& after);
+	void flushMapped(std::vector<VkMappedMemoryRange>& ranges, VkDeviceMemory memory, VkDeviceSize offset, VkDeviceSize size, VkDeviceSize bufferSize);
+	std::vector<std::pair<float_3, float>> lightSpheres(size_t count);
+	void updateLightClusters(uint32_t frame, mat44<float> cameraSpace);
 	void transitionImageLayout(VkImage image, VkFormat format,
 		VkImageLayout oldLayout, VkImageLayout newLayout, int layers = 1, int levels = 1);
-	void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height, int level = 0, int face = 0);
+	void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height, int level = 0, int face = 0, VkDeviceSize offset = 0);
 	void createIndexBuffers(bool realloc = true, bool andFree = false);
 	void generateMipmaps(VkImage image, int32_t x, int32_t y, uint32_t mipLevels, int face = 0);
 	void createEnvironmentImage(Texture env, VkImage& image,
@@ -132,9 +205,16 @@ private:
 	void createDescriptorPool();
 	void createDepthResources();
 	void createDescriptorSets();
+	void writeShadowDescriptors();
+	void writeDeferredDescriptors();
 	void createCommands();
 	void recordCommandBufferShadow(VkCommandBuffer commandBuffer, uint32_t imageIndex, int lightIndex);
 	void recordCommandBufferMain(VkCommandBuffer commandBuffer, uint32_t imageIndex);
+	size_t drawItemCount();
+	void recordMainDraws(VkCommandBuffer commandBuffer, size_t first, size_t last, bool prepass = false);
+	void recordShadowDraws(VkCommandBuffer commandBuffer, int lightIndex, size_t first, size_t last);
+	void executeSecondaries(VkCommandBuffer commandBuffer, VkRenderPass pass, VkFramebuffer framebuffer, size_t passIndex,
+		VkViewport viewport, VkRect2D scissor, std::function<void(VkCommandBuffer, size_t, size_t)> record);
 	void submitFrame(size_t frameIndex, uint32_t imageIndex, bool draw);
 	void updateUniformBuffers(uint32_t frame);
 	void createImage(uint32_t width, uint32_t height, VkFormat format, 
@@ -157,6 +237,11 @@ private:
 		float camPosY;
 		float camPosZ;
 		float pbrP;
+		int baseIndex; //First slot of the drawn pool, pushed per draw
+	};
+	struct PushConstShadow {
+		mat44<float> light;
+		int baseIndex;
 	};
 	PushConst pushConstHDR;
 
@@ -166,6 +251,7 @@ private:
 	VkSurfaceKHR surface;
 	VkPhysicalDevice physicalDevice;
 	VkDevice device;
+	bool compressedTextures = false; //textureCompressionBC enabled on the device
 	VkPhysicalDeviceFeatures physicalDeviceFeatures{};
 	QueueFamilyIndices familyIndices;
 	//Pipeline
@@ -175,10 +261,14 @@ private:
 	std::vector< std::vector<VkImageView>> shadowImageViews;
 	VkPipelineLayout pipelineLayoutHDR;
 	VkPipelineLayout pipelineLayoutFinal;
-	std::vector<VkPipelineLayout> pipelineLayoutShadows;
+	VkPipelineLayout pipelineLayoutShadow;
 	VkPipeline graphicsPipeline;
 	VkPipeline graphicsInstPipeline;
+	VkPipeline depthPipeline;
+	VkPipeline depthInstPipeline;
 	VkPipeline graphicsPipelineFinal;
+	VkPipelineLayout pipelineLayoutDeferred;
+	VkPipeline graphicsPipelineDeferred;
 	std::vector<VkPipeline> graphicsPipelineShadows;
 	std::vector<VkPipeline> graphicsInstPipelineShadows;
 	//Rendering
@@ -187,6 +277,10 @@ private:
 	VkSwapchainKHR swapChain;
 	std::vector<VkImage> swapChainImages;
 	std::vector<VkImage> attachmentImages;
+	//G_BUFFER_COUNT targets per swap chain image when deferred
+	std::vector<VkImage> gBufferImages;
+	std::vector<VkDeviceMemory> gBufferMemorys;
+	std::vector<VkImageView> gBufferImageViews;
 	std::vector<std::vector<VkImage>> shadowImages;
 	VkFormat swapChainImageFormat;
 	VkExtent2D swapChainExtent;
@@ -197,23 +291,56 @@ private:
 	std::vector<std::vector<VkFramebuffer>> shadowFramebuffers;
 	VkCommandPool commandPool;
 	std::vector<VkCommandBuffer> commandBuffers;
+	//Secondary recording, one pool per thread and record slot holding a buffer per pass
+	WorkerPool recordWorkers;
+	std::vector<VkCommandPool> recordCommandPools;
+	std::vector<VkCommandBuffer> recordSecondaryBuffers;
+	//Bumped whenever the view, the scene or the swap chain changes
+	//Lights are fixed after initVulkan, so they never bump it
+	uint64_t stateVersion = 1;
+	uint64_t uploadedVersion = 0;
+	//Images are acquired in rotation, so buffers and the version they recorded are kept per frame slot and swap chain image
+	size_t recordImages = 0;
+	size_t recordSlot = 0; //currentFrame * recordImages + imageIndex of the frame being recorded
+	std::vector<uint64_t> recordedVersions;
+	std::array<uint64_t, MAX_FRAMES_IN_FLIGHT> uniformVersions{};
+	std::array<float, 14> lastView{};
+	bool driversEvaluated = false;
+	//One pipeline statistics query per frame in flight
+	bool countFragments = false;
+	VkQueryPool fragmentQueryPool = VK_NULL_HANDLE;
+	std::vector<bool> fragmentQueryWritten;
 	VkImage depthImage;
 	VkDeviceMemory depthImageMemory;
 	VkImageView depthImageView;
 	std::vector<VkImage> shadowDepthImages;
 	std::vector<VkDeviceMemory> shadowDepthImageMemorys;
 	std::vector<VkImageView> shadowDepthImageViews;
-	//Vertices
+	//Vertices, the position streams are vertexBuffer and vertexInstBuffer
+	std::vector<VertexPosition> vertexPositions;
+	std::vector<VertexPosition> vertexInstPositions;
+	std::vector<VertexAttributes> vertexAttributes;
+	std::vector<VertexAttributes> vertexInstAttributes;
+	std::vector<VertexCompact> vertexCompacts;
+	std::vector<VertexCompact> vertexInstCompacts;
 	VkBuffer vertexBuffer;
 	bool useVertexBuffer;
 	VkDeviceMemory vertexBufferMemory;
+	VkBuffer vertexAttributeBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory vertexAttributeBufferMemory = VK_NULL_HANDLE;
+	VkBuffer vertexInstAttributeBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory vertexInstAttributeBufferMemory = VK_NULL_HANDLE;
 	std::vector<VkBuffer> indexBuffers;
 	std::vector<bool> indexBuffersValid;
 	std::vector<VkDeviceMemory> indexBufferMemorys;
+	std::vector<VkIndexType> indexTypes;
+	std::vector<int32_t> indexBaseVertices;
 	VkBuffer vertexInstBuffer;
 	VkDeviceMemory vertexInstBufferMemory;
 	std::vector<VkBuffer> indexInstBuffers;
 	std::vector<VkDeviceMemory> indexInstBufferMemorys;
+	std::vector<VkIndexType> indexInstTypes;
+	std::vector<int32_t> indexInstBaseVertices;
 	//Images
 	bool initialFrame = true;
 	std::vector<Texture> rawTextures;
@@ -239,55 +366,62 @@ private:
 	VkDeviceMemory defaultShadowImageMemory;
 	VkImageView defaultShadowImageView;
 	VkSampler defaultShadowSampler;
-	//Uniforms
-	std::vector<std::vector<VkBuffer>> uniformBuffersTransformsPools;
-	std::vector<std::vector<VkDeviceMemory>> uniformBuffersMemoryTransformsPools;
-	std::vector<std::vector<void*>> uniformBuffersMappedTransformsPools;
-
-
-	std::vector<std::vector<std::vector<VkBuffer>>> uniformBuffersModelsPools;
-	std::vector < std::vector<std::vector<VkDeviceMemory>>> uniformBuffersMemoryModelsPools;
-	std::vector < std::vector<std::vector<void*>>> uniformBuffersMappedModelsPools;
-
-	std::vector<std::vector<VkBuffer>> uniformBuffersEnvironmentTransformsPools;
-	std::vector<std::vector<VkDeviceMemory>> uniformBuffersMemoryEnvironmentTransformsPools;
-	std::vector<std::vector<void*>> uniformBuffersMappedEnvironmentTransformsPools;
-
-	std::vector<std::vector<VkBuffer>> uniformBuffersNormalTransformsPools;
-	std::vector<std::vector<VkDeviceMemory>> uniformBuffersMemoryNormalTransformsPools;
-	std::vector<std::vector<void*>> uniformBuffersMappedNormalTransformsPools;
-
-	std::vector< std::vector<VkBuffer>> uniformBuffersCamerasPools;
-	std::vector< std::vector<VkDeviceMemory >> uniformBuffersMemoryCamerasPools;
-	std::vector< std::vector<void*>> uniformBuffersMappedCamerasPools;
-
-	std::vector< std::vector<VkBuffer>> uniformBuffersLightsPools;
-	std::vector< std::vector<VkDeviceMemory >> uniformBuffersMemoryLightsPools;
-	std::vector< std::vector<void*>> uniformBuffersMappedLightsPools;
-
-	std::vector< std::vector<VkBuffer>> uniformBuffersLightTransformsPools;
-	std::vector< std::vector<VkDeviceMemory >> uniformBuffersMemoryLightTransformsPools;
-	std::vector< std::vector<void*>> uniformBuffersMappedLightTransformsPools;
-
-	std::vector< std::vector<VkBuffer>> uniformBuffersLightPerspectivePools;
-	std::vector< std::vector<VkDeviceMemory >> uniformBuffersMemoryLightPerspectivePools;
-	std::vector< std::vector<void*>> uniformBuffersMappedLightPerspectivePools;
-
-	/*
-	std::vector< std::vector<VkBuffer>> uniformBuffersLightPerspectivePools;
-	std::vector< std::vector<VkDeviceMemory >> uniformBuffersMemoryLightPerspectivePools;
-	std::vector< std::vector<void*>> uniformBuffersMappedLightPerspectivePools;
-	*/
-
-	std::vector< std::vector<VkBuffer>> uniformBuffersMaterialsPools;
-	std::vector< std::vector<VkDeviceMemory >> uniformBuffersMemoryMaterialsPools;
-	std::vector< std::vector<void*>> uniformBuffersMappedMaterialsPools;
+	//Scene data, one copy per frame in flight shared by every draw through the bindless set
+	//Each pool owns slots [drawBaseIndices[pool], ...) of the transform and material arrays, instanced pools after transformPools
+	std::vector<uint32_t> drawBaseIndices;
+	uint32_t sceneSlots = 0;
+	//Per frame slot and draw, the slots [first, last) changed since that frame last wrote them
+	//Transforms live in memory that may not be coherent, so written ranges are flushed
+	std::array<std::vector<std::pair<size_t, size_t>>, MAX_FRAMES_IN_FLIGHT> dirtyRanges;
+	//Materials and lights never change after the first write of each frame slot
+	std::array<bool, MAX_FRAMES_IN_FLIGHT> sceneWritten{};
+	VkDeviceSize nonCoherentAtomSize = 1;
+	std::vector<VkBuffer> storageBuffersTransforms;
+	std::vector<VkDeviceMemory> storageBuffersMemoryTransforms;
+	std::vector<void*> storageBuffersMappedTransforms;
+
+	std::vector<VkBuffer> storageBuffersEnvironmentTransforms;
+	std::vector<VkDeviceMemory> storageBuffersMemoryEnvironmentTransforms;
+	std::vector<void*> storageBuffersMappedEnvironmentTransforms;
+
+	std::vector<VkBuffer> storageBuffersNormalTransforms;
+	std::vector<VkDeviceMemory> storageBuffersMemoryNormalTransforms;
+	std::vector<void*> storageBuffersMappedNormalTransforms;
+
+	std::vector<VkBuffer> storageBuffersMaterials;
+	std::vector<VkDeviceMemory> storageBuffersMemoryMaterials;
+	std::vector<void*> storageBuffersMappedMaterials;
+
+	std::vector<VkBuffer> storageBuffersLights;
+	std::vector<VkDeviceMemory> storageBuffersMemoryLights;
+	std::vector<void*> storageBuffersMappedLights;
+
+	std::vector<VkBuffer> storageBuffersLightPerspective;
+	std::vector<VkDeviceMemory> storageBuffersMemoryLightPerspective;
+	std::vector<void*> storageBuffersMappedLightPerspective;
+
+	std::vector<VkBuffer> uniformBuffersCameras;
+	std::vector<VkDeviceMemory> uniformBuffersMemoryCameras;
+	std::vector<void*> uniformBuffersMappedCameras;
+
+	LightClusters lightClusters;
+	std::vector<VkBuffer> uniformBuffersClusters;
+	std::vector<VkDeviceMemory> uniformBuffersMemoryClusters;
+	std::vector<void*> uniformBuffersMappedClusters;
+
+	std::vector<VkBuffer> storageBuffersClusterRanges;
+	std::vector<VkDeviceMemory> storageBuffersMemoryClusterRanges;
+	std::vector<void*> storageBuffersMappedClusterRanges;
+
+	std::vector<VkBuffer> storageBuffersClusterLights;
+	std::vector<VkDeviceMemory> storageBuffersMemoryClusterLights;
+	std::vector<void*> storageBuffersMappedClusterLights;
 	VkDescriptorPool descriptorPoolHDR;
 	std::vector<VkDescriptorSet> descriptorSetsHDR;
 	VkDescriptorPool descriptorPoolFinal;
 	std::vector<VkDescriptorSet> descriptorSetsFinal;
-	std::vector<VkDescriptorPool> descriptorPoolShadows;
-	std::vector<std::vector<VkDescriptorSet>> descriptorSetsShadows;
+	VkDescriptorPool descriptorPoolDeferred;
+	std::vector<VkDescriptorSet> descriptorSetsDeferred;
 	std::vector < VkDescriptorSetLayout> descriptorSetLayouts;
 	
 	//Camera
@@ -303,7 +437,9 @@ private:
 	};
 
 	const std::vector<const char*> deviceExtensions = {
-		VK_KHR_SWAPCHAIN_EXTENSION_NAME
+		VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+		VK_KHR_MAINTENANCE3_EXTENSION_NAME,
+		VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME
 	};
 
 
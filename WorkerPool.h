@@ -0,0 +1,99 @@
+#pragma once
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <vector>
+#include <cstdint>
+
+//Persistent threads that split a batch of jobs with the calling thread
+//run blocks until every job has finished and rethrows the first exception a job threw
+class WorkerPool {
+public:
+	~WorkerPool() { stop(); }
+
+	void start(int threadCount) {
+		stop();
+		stopping = false;
+		for (int thread = 0; thread < threadCount; thread++) {
+			threads.emplace_back(&WorkerPool::workerLoop, this);
+		}
+	}
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (std::thread& thread : threads) thread.join();
+		threads.clear();
+	}
+
+	//Runs job(0) ... job(jobCount - 1), the caller takes jobs too
+	void run(int jobCount, std::function<void(int)> job) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			currentJob = job;
+			totalJobs = jobCount;
+			nextJob = 0;
+			remaining = jobCount;
+			error = nullptr;
+			generation++;
+		}
+		wake.notify_all();
+		runJobs();
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&] { return remaining == 0; });
+		if (error) std::rethrow_exception(error);
+	}
+
+	int threadCount() { return (int)threads.size(); }
+
+private:
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	std::function<void(int)> currentJob;
+	int totalJobs = 0;
+	int nextJob = 0;
+	int remaining = 0;
+	uint64_t generation = 0;
+	bool stopping = false;
+	std::exception_ptr error;
+
+	void runJobs() {
+		while (true) {
+			int index;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (nextJob >= totalJobs) return;
+				index = nextJob++;
+			}
+			try {
+				currentJob(index);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error) error = std::current_exception();
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--remaining == 0) done.notify_all();
+		}
+	}
+
+	void workerLoop() {
+		uint64_t seen = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&] { return stopping || generation != seen; });
+				if (stopping) return;
+				seen = generation;
+			}
+			runJobs();
+		}
+	}
+};
@@ -9,7 +9,16 @@
 #include <vector>
 #include <algorithm>
 #include <string>
-#define float_rand ((float)(rand()) / (float)(RAND_MAX))
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <optional>
+#include <filesystem>
+#include <cstring>
 #define PI 3.1415926535897
 #define EPS 0.00000001
 
@@ -17,10 +26,64 @@
 void cubeError() {
 	throw std::runtime_error("Invalid arguments. Application must at least be"
 		+ std::string(" run with cube in.png --lambertian out.png ")
-		+ std::string(" or with cube in.png --ggx out.png\n")
+		+ std::string(" or with cube in.png --ggx out.png")
+		+ std::string(" or with cube in.png --sh out.txt")
+		+ std::string(" or with cube --batch manifest.txt\n")
+		+ std::string("Lambertian and ggx outputs ending in .ktx2 are written as half float cubemaps.\n")
 		+ std::string("The optional arguments may also follow the original arguments:\n")
 		+ std::string("'--face x y' to indicate the resolution desired for each cubemap face\n")
-		+ std::string("'--samples size' to indicate number of monte carlo samples."));
+		+ std::string("'--samples size' to indicate number of monte carlo samples.\n")
+		+ std::string("'--threads count' to indicate number of bake threads, defaults to all cores.\n")
+		+ std::string("'--nearest' to sample ggx from the nearest source texel instead of a filtered mip.\n")
+		+ std::string("'--reference samples' to report ggx error against an unfiltered bake.\n")
+		+ std::string("'--format png|ktx2' to pick the batch output format."));
+}
+
+//Hammersley point i of n, deterministic so any thread split gives the same result
+//http://holger.dammertz.org/stuff/notes_HammersleyOnHemisphere.html
+float radicalInverse(uint32_t bits) {
+	bits = (bits << 16u) | (bits >> 16u);
+	bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+	bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+	bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+	bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+	return (float)bits * 2.3283064365386963e-10f;
+}
+
+void hammersley(int i, int n, float& xix, float& xiy) {
+	xix = (float)i / (float)n;
+	xiy = radicalInverse((uint32_t)i);
+}
+
+//Runs work(item) for items [0, count) on threads pulling from a shared counter
+//Each item owns its output, so results do not depend on the thread count
+void parallelFor(int count, int threads, std::string label, const std::function<void(int)>& work) {
+	std::atomic<int> nextItem = 0;
+	std::atomic<int> doneItems = 0;
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; t++) {
+		workers.emplace_back([&]() {
+			for (int item = nextItem++; item < count; item = nextItem++) {
+				work(item);
+				doneItems++;
+			}
+		});
+	}
+	//Report progress from here at most a few times a second
+	int lastPercent = -1;
+	std::chrono::steady_clock::time_point lastReport;
+	while (doneItems < count) {
+		int percent = (int)(100.f * (float)doneItems / (float)count);
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (percent != lastPercent && now - lastReport > std::chrono::milliseconds(250)) {
+			lastPercent = percent;
+			lastReport = now;
+			std::cout << label << " " << percent << "%\n";
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	for (std::thread& worker : workers) worker.join();
+	std::cout << label << " 100%" << std::endl;
 }
 
 
@@ -35,10 +98,10 @@ struct float_3 {
 		z = c;
 	}
 
-	float norm() {
+	float norm() const {
 		return sqrt(x * x + y * y + z * z);
 	}
-	float_3 normalize() {
+	float_3 normalize() const {
 		float_3 newVec;
 		float norm_f = norm();
 		newVec.x = x / norm_f;
@@ -46,25 +109,25 @@ struct float_3 {
 		newVec.z = z / norm_f;
 		return newVec;
 	}
-	float_3 cross(float_3 b) {
+	float_3 cross(float_3 b) const {
 		return float_3(y * b.z - z * b.y, z * b.x - x * b.z, x * b.y - y * b.x);
 	}
-	float_3 operator*(float_3 b) {
+	float_3 operator*(float_3 b) const {
 		return float_3(x * b.x, y * b.y, z * b.z);
 	}
-	float_3 operator+(float_3 b) {
+	float_3 operator+(float_3 b) const {
 		return float_3(x + b.x, y + b.y, z + b.z);
 	}
-	float_3 operator/(float_3 b) {
+	float_3 operator/(float_3 b) const {
 		return float_3(x / b.x, y / b.y, z / b.z);
 	}
-	float_3 operator-(float_3 b) {
+	float_3 operator-(float_3 b) const {
 		return float_3(x - b.x, y - b.y, z - b.z);
 	}
-	float_3 operator*(float b) {
+	float_3 operator*(float b) const {
 		return float_3(x * b, y * b, z * b);
 	}
-	float dot(float_3 b) {
+	float dot(float_3 b) const {
 		return x * b.x + y * b.y + z * b.z;
 	}
 };
@@ -78,6 +141,13 @@ struct Pixel {
 	float_3 toColor() {
 		return float_3((float)r, float(g), (float)b) * (1.f / 255.f);
 	};
+	//Same decode as the renderer's shaders
+	float_3 toLinear() {
+		if (e == 0) return float_3(0, 0, 0);
+		return float_3(ldexp(((float)r + 0.5f) / 256.f, (int)e - 128),
+			ldexp(((float)g + 0.5f) / 256.f, (int)e - 128),
+			ldexp(((float)b + 0.5f) / 256.f, (int)e - 128));
+	};
 };
 
 float_3 operator* (float a, float_3 b) {
@@ -125,7 +195,13 @@ struct mat33 {
 	}
 };
 
-float_3 sampleVec(float_3 in, float_3 up, int x, int y, int width, int height) {
+//Face directions in +x, -x, +y, -y, +z, -z order
+const float_3 faceIn[6] = { float_3(1, 0, 0), float_3(-1, 0, 0), float_3(0, 1, 0),
+	float_3(0, -1, 0), float_3(0, 0, 1), float_3(0, 0, -1) };
+const float_3 faceUp[6] = { float_3(0, 1, 0), float_3(0, 1, 0), float_3(0, 0, -1),
+	float_3(0, 0, 1), float_3(0, 1, 0), float_3(0, 1, 0) };
+
+float_3 sampleVec(float_3 in, float_3 up, int x, int y, int width, int height, float jitterX = 0.5f, float jitterY = 0.5f) {
 
 	//Transform final pixel into world space to get sample vec
 	float_3 right = up.cross(in);
@@ -134,8 +210,8 @@ float_3 sampleVec(float_3 in, float_3 up, int x, int y, int width, int height) {
 	//Get vec
 	float f_x = (float)x / (float)(width);
 	float f_y = (float)y / (float)(height);
-	float sample_x = (f_x + float_rand / (float)(width)) * 2.0 - 1.0;
-	float sample_y = (f_y + float_rand / (float)(height)) * 2.0 - 1.0;
+	float sample_x = (f_x + jitterX / (float)(width)) * 2.0 - 1.0;
+	float sample_y = (f_y + jitterY / (float)(height)) * 2.0 - 1.0;
 	float_3 localPos = float_3(sample_x, sample_y, 1);
 	float_3 worldVec = (toVec * localPos).normalize();
 	return worldVec;
@@ -157,37 +233,97 @@ Pixel sampleData(Pixel* rawData,int realWidth, int realHeight, float_3 worldVec)
 	return rawData[sampleInd];
 }
 
-void sampleFaceLam(std::vector<Pixel>& storeData, Pixel* rawData, int width, int height,
-	int realWidth, int realHeight, float_3 in, float_3 up, int offset, int samples, int face) {
-	int lastPercent = -1;
-	for (int x = 0; x < width; x++) {
-		for (int y = 0; y < height; y++) {
-			int storeInd = offset + y * width + x;
-			float_3 avgSample;
-			float e = 0;
-			for (int i = 0; i < samples; i++) {
-				float_3 worldVec = sampleVec(in, up, x, y, width, height);
-				Pixel sampledPixel = sampleData(rawData, realWidth, realHeight, worldVec);
-				avgSample.x += (float)sampledPixel.r;
-				avgSample.y += (float)sampledPixel.g;
-				avgSample.z += (float)sampledPixel.b;
-				e += (float)sampledPixel.e;
-			}
-			avgSample.x /= (float)samples;
-			avgSample.y /= (float)samples;
-			avgSample.z /= (float)samples;
-			e /= (float)samples;
-			storeData[storeInd].r = (stbi_uc)avgSample.x;
-			storeData[storeInd].g = (stbi_uc)avgSample.y;
-			storeData[storeInd].b = (stbi_uc)avgSample.z;
-			storeData[storeInd].e = e;
-			int percent = (int)((float)(x * height + y) / (float)(width * height) * 100.f / 6.f + 100.f * (face / 6.f));
-			if (percent != lastPercent) {
-				lastPercent = percent;
-				std::cout << percent << "%\n";
+//Float mip pyramid of the source for filtered importance sampling
+//https://developer.nvidia.com/gpugems/gpugems3/part-iii-rendering/chapter-20-gpu-based-importance-sampling
+struct EnvPyramid {
+	std::vector<std::vector<float_3>> levels;
+	std::vector<int> widths;
+	std::vector<int> heights;
+
+	EnvPyramid(Pixel* rawData, int realWidth, int realHeight) {
+		levels.push_back(std::vector<float_3>(realWidth * realHeight));
+		for (int ind = 0; ind < realWidth * realHeight; ind++) {
+			levels[0][ind] = rawData[ind].toColor();
+		}
+		widths.push_back(realWidth);
+		heights.push_back(realHeight);
+		//2x2 box down to a single texel in either direction
+		while (widths.back() > 1 && heights.back() > 1) {
+			int lastWidth = widths.back();
+			int lastHeight = heights.back();
+			int width = lastWidth / 2;
+			int height = lastHeight / 2;
+			const std::vector<float_3>& last = levels.back();
+			std::vector<float_3> level = std::vector<float_3>(width * height);
+			for (int y = 0; y < height; y++) {
+				for (int x = 0; x < width; x++) {
+					level[y * width + x] = (last[2 * y * lastWidth + 2 * x] + last[2 * y * lastWidth + 2 * x + 1]
+						+ last[(2 * y + 1) * lastWidth + 2 * x] + last[(2 * y + 1) * lastWidth + 2 * x + 1]) * 0.25f;
+				}
 			}
+			levels.push_back(level);
+			widths.push_back(width);
+			heights.push_back(height);
 		}
 	}
+
+	//Bilinear, wrapping around in phi and clamping in theta
+	float_3 sampleLevel(int level, float_3 worldVec) const {
+		int width = widths[level];
+		int height = heights[level];
+		float theta = acos(std::clamp(worldVec.z, -1.f, 1.f));
+		float phi = atan2(worldVec.y, worldVec.x);
+		float xF = (phi + PI) / 2 / PI * (float)width - 0.5f;
+		float yF = std::clamp(theta / (float)PI * (float)height - 0.5f, 0.f, (float)(height - 1));
+		int x0 = (int)floor(xF);
+		int y0 = (int)floor(yF);
+		float fx = xF - (float)x0;
+		float fy = yF - (float)y0;
+		int x1 = (x0 + 1) % width;
+		x0 = (x0 + width) % width;
+		int y1 = std::min(y0 + 1, height - 1);
+		const std::vector<float_3>& data = levels[level];
+		return (data[y0 * width + x0] * (1 - fx) + data[y0 * width + x1] * fx) * (1 - fy)
+			+ (data[y1 * width + x0] * (1 - fx) + data[y1 * width + x1] * fx) * fy;
+	}
+
+	float_3 sample(float_3 worldVec, float lod) const {
+		lod = std::clamp(lod, 0.f, (float)(levels.size() - 1));
+		int level = (int)lod;
+		float blend = lod - (float)level;
+		if (blend == 0 || level + 1 >= (int)levels.size()) return sampleLevel(level, worldVec);
+		return sampleLevel(level, worldVec) * (1 - blend) + sampleLevel(level + 1, worldVec) * blend;
+	}
+};
+
+void sampleRowLam(std::vector<Pixel>& storeData, std::vector<float_3>& linearData, Pixel* rawData, int width, int height,
+	int realWidth, int realHeight, float_3 in, float_3 up, int offset, int samples, int y) {
+	for (int x = 0; x < width; x++) {
+		int storeInd = offset + y * width + x;
+		float_3 avgSample;
+		float_3 avgLinear;
+		float e = 0;
+		for (int i = 0; i < samples; i++) {
+			float jitterX, jitterY;
+			hammersley(i, samples, jitterX, jitterY);
+			float_3 worldVec = sampleVec(in, up, x, y, width, height, jitterX, jitterY);
+			Pixel sampledPixel = sampleData(rawData, realWidth, realHeight, worldVec);
+			avgSample.x += (float)sampledPixel.r;
+			avgSample.y += (float)sampledPixel.g;
+			avgSample.z += (float)sampledPixel.b;
+			e += (float)sampledPixel.e;
+			avgLinear = avgLinear + sampledPixel.toLinear();
+		}
+		linearData[storeInd] = avgLinear * (1.f / (float)samples);
+		avgSample.x /= (float)samples;
+		avgSample.y /= (float)samples;
+		avgSample.z /= (float)samples;
+		e /= (float)samples;
+		storeData[storeInd].r = (stbi_uc)avgSample.x;
+		storeData[storeInd].g = (stbi_uc)avgSample.y;
+		storeData[storeInd].b = (stbi_uc)avgSample.z;
+		storeData[storeInd].e = e;
+	}
 }
 
 float_3 importanceSample(float xix, float xiy, float roughness, float_3 N) {
@@ -210,41 +346,90 @@ float_3 importanceSample(float xix, float xiy, float roughness, float_3 N) {
 	return tangentX * H.x + tangentY * H.y + N * H.z;
 }
 
-void sampleFaceGGX(std::vector<Pixel>& storeData, Pixel* rawData, int width, int height,
-	int realWidth, int realHeight, float roughness, float_3 in, float_3 up, int offset, int samples, int face, int level, int levels) {
-	int lastPercent = -1;
-	for (int x = 0; x < width; x++) {
-		for (int y = 0; y < height; y++) {
-			int storeInd = offset + y * width + x;
-			float_3 avgSample;
-			float totalWeight = 0;
-			float_3 v = sampleVec(in, up, x, y, width, height);
-			for (int i = 0; i < samples; i++) {
-				float xix = (float)i / (float)samples;
-				float xiy = 1/(float) i;
-				float_3 h = importanceSample(xix, xiy, roughness, v);
-				float_3 l = 2 * v.dot(h) * h - v;
-				float nl = std::clamp(v.dot(l), 0.f, 1.f);
-				if (nl > 0) {
-					Pixel samplePix = sampleData(rawData, realWidth, realHeight, l);
-					float_3 sampleColor = samplePix.toColor()*nl;
-					avgSample = avgSample + sampleColor;
-					totalWeight += nl;
-				}
+float ggxD(float roughness, float nh) {
+	float alpha = roughness * roughness;
+	float alpha2 = alpha * alpha;
+	float denom = nh * nh * (alpha2 - 1) + 1;
+	return alpha2 / (PI * denom * denom);
+}
+
+//Prefiltered radiance around v, nearest texel reads if no pyramid is given
+//With mipFilter each sample reads the mip whose texels cover the sample's solid angle, otherwise bilinear from the source
+float_3 prefilterGGX(const EnvPyramid* pyramid, Pixel* rawData, int realWidth, int realHeight,
+	float roughness, float_3 v, int samples, bool mipFilter) {
+	float_3 avgSample;
+	float totalWeight = 0;
+	//Equirect texels are tallest in theta, sizing mips on that keeps samples from blurring past their footprint
+	float texelSolidAngle = (PI / (float)realHeight) * (PI / (float)realHeight);
+	for (int i = 0; i < samples; i++) {
+		float xix, xiy;
+		hammersley(i, samples, xix, xiy);
+		float_3 h = importanceSample(xix, xiy, roughness, v);
+		float_3 l = 2 * v.dot(h) * h - v;
+		float nl = std::clamp(v.dot(l), 0.f, 1.f);
+		if (nl > 0) {
+			float_3 sampleColor;
+			if (pyramid) {
+				//With n = v the pdf of l reduces to D / 4
+				float nh = std::clamp(v.dot(h), 0.f, 1.f);
+				float pdf = ggxD(roughness, nh) / 4;
+				float sampleSolidAngle = 1 / ((float)samples * pdf + EPS);
+				float lod = roughness == 0 || !mipFilter ? 0 : 0.5f * log2(sampleSolidAngle / texelSolidAngle);
+				sampleColor = pyramid->sample(l, lod);
 			}
-			avgSample = avgSample * (1/totalWeight)* 256;
-			if (avgSample.x > 255.f) avgSample.x = 255.f;
-			if (avgSample.y > 255.f) avgSample.y = 255.f;
-			if (avgSample.z > 255.f) avgSample.z = 255.f;
-			storeData[storeInd].r = (stbi_uc)avgSample.x;
-			storeData[storeInd].g = (stbi_uc)avgSample.y;
-			storeData[storeInd].b = (stbi_uc)avgSample.z;
-			storeData[storeInd].e = 122;
-			float progress = (float)(level * 6 + face) / (levels * 6.f);
-			int percent = (int)((float)(x * height + y) / (float)(width * height) * 100.f / (float) levels/6.f + 100.f * progress);
-			if (percent != lastPercent) {
-				lastPercent = percent;
-				std::cout << percent << "%\n";
+			else {
+				sampleColor = sampleData(rawData, realWidth, realHeight, l).toColor();
+			}
+			avgSample = avgSample + sampleColor * nl;
+			totalWeight += nl;
+		}
+	}
+	return avgSample * (1 / totalWeight);
+}
+
+void sampleRowGGX(std::vector<float_3>& storeData, const EnvPyramid* pyramid, Pixel* rawData, int width, int height,
+	int realWidth, int realHeight, float roughness, float_3 in, float_3 up, int offset, int samples, bool mipFilter, int y) {
+	for (int x = 0; x < width; x++) {
+		float_3 v = sampleVec(in, up, x, y, width, height);
+		storeData[offset + y * width + x] = prefilterGGX(pyramid, rawData, realWidth, realHeight, roughness, v, samples, mipFilter);
+	}
+}
+
+std::vector<Pixel> packGGX(const std::vector<float_3>& floatData) {
+	std::vector<Pixel> storeData = std::vector<Pixel>(floatData.size());
+	for (size_t storeInd = 0; storeInd < floatData.size(); storeInd++) {
+		float_3 avgSample = floatData[storeInd] * 256;
+		if (avgSample.x > 255.f) avgSample.x = 255.f;
+		if (avgSample.y > 255.f) avgSample.y = 255.f;
+		if (avgSample.z > 255.f) avgSample.z = 255.f;
+		storeData[storeInd].r = (stbi_uc)avgSample.x;
+		storeData[storeInd].g = (stbi_uc)avgSample.y;
+		storeData[storeInd].b = (stbi_uc)avgSample.z;
+		storeData[storeInd].e = 122;
+	}
+	return storeData;
+}
+
+//Projects the environment onto the 9 L2 spherical harmonics in one pass over the source
+//https://cseweb.ucsd.edu/~ravir/papers/envmap/envmap.pdf
+void projectSH(Pixel* rawData, int realWidth, int realHeight, float_3 coefficients[9]) {
+	for (int i = 0; i < 9; i++) coefficients[i] = float_3(0, 0, 0);
+	for (int realY = 0; realY < realHeight; realY++) {
+		//Texel centers, inverting the mapping in sampleData
+		float theta = ((float)realY + 0.5f) / (float)realHeight * PI;
+		float solidAngle = (2 * PI / (float)realWidth) * (PI / (float)realHeight) * sin(theta);
+		for (int realX = 0; realX < realWidth; realX++) {
+			float phi = ((float)realX + 0.5f) / (float)realWidth * 2 * PI - PI;
+			float x = sin(theta) * cos(phi);
+			float y = sin(theta) * sin(phi);
+			float z = cos(theta);
+			float basis[9] = { 0.282095f,
+				0.488603f * y, 0.488603f * z, 0.488603f * x,
+				1.092548f * x * y, 1.092548f * y * z, 0.315392f * (3 * z * z - 1),
+				1.092548f * x * z, 0.546274f * (x * x - y * y) };
+			float_3 radiance = rawData[realY * realWidth + realX].toLinear() * solidAngle;
+			for (int i = 0; i < 9; i++) {
+				coefficients[i] = coefficients[i] + radiance * basis[i];
 			}
 		}
 	}
@@ -263,8 +448,8 @@ void brdf(float roughness, float nv, float& A, float& B, int samples) {
 	float_3 v; v.x = sqrt(1 - nv * nv); v.y = 0; v.z = nv;
 
 	for (int i = 0; i < samples; i++) {
-		float xix = (float)i / (float)(samples - 1);
-		float xiy = 1 / (float)i;
+		float xix, xiy;
+		hammersley(i, samples, xix, xiy);
 		float_3 h = importanceSample(xix, xiy, roughness, float_3(0,0,1));
 		float_3 l = 2 * v.dot(h) * h - v;
 		float nl = std::clamp(l.z,0.f,1.f);
@@ -285,59 +470,99 @@ void brdf(float roughness, float nv, float& A, float& B, int samples) {
 	if (B > 255) B = 255;
 }
 
-int main(int argc, char* argv[])
-{
-	srand(time(0));
-	if (argc < 4) {
-		cubeError();
-	}
-	std::string inFile = argv[1];
-	//Further assert correct input formatting
-	bool lambertian = true;
-	int samples = 4;
-	if (std::string(argv[2]).compare(std::string("--ggx")) == 0) {
-		samples = 1024;
-		lambertian = false;
-	}
-	else if (std::string(argv[2]).compare(std::string("--lambertian")) != 0) {
-		cubeError();
-	}
-	std::string outFile = argv[3];
-	int width = 16; int height = 16;
+struct BakeSettings {
+	int width = 16;
+	int height = 16;
 	int levels = 8;
-	if (argc > 4) {
-		if (argc == 7) {
-			if (std::string(argv[4]).compare(std::string("--face")) != 0) {
-				cubeError();
-			}
-			width = atoi(argv[5]);
-			height = atoi(argv[6]);
-		}
-		else if (argc == 6) {
+	int threads = 1;
+	int samples = 0;
+	int referenceSamples = 0;
+	bool nearest = false;
+	//Float outputs go to half float KTX2 instead of RGBE png
+	bool ktx2 = false;
+};
 
-			if (std::string(argv[4]).compare(std::string("--samples")) != 0) {
-				cubeError();
-			}
-			samples = atoi(argv[5]);
-		}
-		else if (argc == 9) {
+uint16_t floatToHalf(float f) {
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(float));
+	uint16_t sign = (uint16_t)((bits >> 16) & 0x8000u);
+	int exponent = (int)((bits >> 23) & 0xffu) - 127 + 15;
+	uint32_t mantissa = bits & 0x7fffffu;
+	//Clamp to the largest half rather than writing infinities
+	if (exponent >= 31) return sign | 0x7bffu;
+	if (exponent <= 0) {
+		if (exponent < -10) return sign;
+		mantissa |= 0x800000u;
+		int shift = 14 - exponent;
+		uint16_t half = (uint16_t)(mantissa >> shift);
+		if ((mantissa >> (shift - 1)) & 1u) half++;
+		return sign | half;
+	}
+	uint16_t half = (uint16_t)((exponent << 10) | (mantissa >> 13));
+	if (mantissa & 0x1000u) half++;
+	if ((half & 0x7c00u) == 0x7c00u) half = 0x7bffu;
+	return sign | half;
+}
 
-			if (std::string(argv[4]).compare(std::string("--face")) != 0) {
-				cubeError();
-			}
-			width = atoi(argv[5]);
-			height = atoi(argv[6]);
+//Writes faces stacked like the png outputs as a VK_FORMAT_R16G16B16A16_SFLOAT KTX2, a cubemap when faces are square
+//https://registry.khronos.org/KTX/specs/2.0/ktxspec.v2.html
+void writeKTX2(std::string outFile, int width, int height, const std::vector<float_3>& data, float scale) {
+	const uint8_t identifier[12] = { 0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A };
+	bool cube = width == height;
+	uint32_t faceCount = cube ? 6 : 1;
+	uint32_t pixelHeight = cube ? height : 6 * height;
+
+	//Basic data format descriptor with one float sample per channel
+	std::vector<uint32_t> dfd;
+	dfd.push_back(4 + 24 + 4 * 16);
+	dfd.push_back(0);
+	dfd.push_back(2 | ((24 + 4 * 16) << 16));
+	dfd.push_back(1 | (1 << 8) | (1 << 16)); //RGBSDA, BT709 primaries, linear
+	dfd.push_back(0);
+	dfd.push_back(8);
+	dfd.push_back(0);
+	const uint32_t channels[4] = { 0, 1, 2, 15 };
+	for (int c = 0; c < 4; c++) {
+		dfd.push_back((uint32_t)(16 * c) | (15u << 16) | ((channels[c] | 0xC0u) << 24));
+		dfd.push_back(0);
+		dfd.push_back(0xBF800000u);
+		dfd.push_back(0x3F800000u);
+	}
 
-			if (std::string(argv[7]).compare(std::string("--samples")) != 0) {
-				cubeError();
-			}
-			samples = atoi(argv[8]);
-		}
-		else {
-			cubeError();
-		}
+	std::vector<uint16_t> halfs = std::vector<uint16_t>(4 * data.size());
+	for (size_t i = 0; i < data.size(); i++) {
+		halfs[4 * i] = floatToHalf(data[i].x * scale);
+		halfs[4 * i + 1] = floatToHalf(data[i].y * scale);
+		halfs[4 * i + 2] = floatToHalf(data[i].z * scale);
+		halfs[4 * i + 3] = floatToHalf(1.f);
+	}
+
+	uint32_t headerSize = 12 + 9 * 4 + 4 * 4 + 2 * 8;
+	uint32_t dfdOffset = headerSize + 3 * 8;
+	uint32_t dfdSize = (uint32_t)(dfd.size() * sizeof(uint32_t));
+	uint64_t levelOffset = (dfdOffset + dfdSize + 7) / 8 * 8;
+	uint64_t levelSize = halfs.size() * sizeof(uint16_t);
+	uint32_t header[9] = { 97, 2, (uint32_t)width, pixelHeight, 0, 0, faceCount, 1, 0 };
+	uint32_t index[4] = { dfdOffset, dfdSize, 0, 0 };
+	uint64_t supercompression[2] = { 0, 0 };
+	uint64_t levelIndex[3] = { levelOffset, levelSize, levelSize };
+
+	std::ofstream outStream(outFile, std::ios::binary);
+	if (!outStream.is_open()) {
+		throw std::runtime_error("ERROR: Unable to open " + outFile + " for writing.");
 	}
-	int realHeight, realWidth, n;
+	outStream.write((const char*)identifier, sizeof(identifier));
+	outStream.write((const char*)header, sizeof(header));
+	outStream.write((const char*)index, sizeof(index));
+	outStream.write((const char*)supercompression, sizeof(supercompression));
+	outStream.write((const char*)levelIndex, sizeof(levelIndex));
+	outStream.write((const char*)dfd.data(), dfdSize);
+	for (uint64_t pad = dfdOffset + dfdSize; pad < levelOffset; pad++) outStream.put(0);
+	outStream.write((const char*)halfs.data(), levelSize);
+}
+
+Pixel* loadSource(std::string inFile, int& realWidth, int& realHeight) {
+	int n;
 	Pixel* rawData = (Pixel*)(void*)stbi_load(inFile.c_str(), &realHeight, &realWidth, &n, 4);
 	if (!rawData) {
 		if (stbi_failure_reason()) {
@@ -348,80 +573,259 @@ int main(int argc, char* argv[])
 			throw std::runtime_error("ERROR: Unable to load texture at path " + inFile + " with no stbi error");
 		}
 	}
+	return rawData;
+}
 
-	if (lambertian) {
-		std::vector<Pixel>  sampledData = std::vector<Pixel>(6 * width * height);
+void bakeSH(Pixel* rawData, int realWidth, int realHeight, std::string outFile) {
+	float_3 coefficients[9];
+	projectSH(rawData, realWidth, realHeight, coefficients);
 
-		int faceSize = width * height;
-		//Pos x
-		sampleFaceLam(sampledData, rawData, width, height, realWidth, realHeight, float_3(1, 0, 0), float_3(0, 1, 0), 0, samples, 0);
-		//Neg x
-		sampleFaceLam(sampledData, rawData, width, height, realWidth, realHeight, float_3(-1, 0, 0), float_3(0, 1, 0), faceSize, samples, 1);
-		//Pos y
-		sampleFaceLam(sampledData, rawData, width, height, realWidth, realHeight, float_3(0, 1, 0), float_3(0, 0, -1), 2 * faceSize, samples, 2);
-		//Neg y
-		sampleFaceLam(sampledData, rawData, width, height, realWidth, realHeight, float_3(0, -1, 0), float_3(0, 0, 1), 3 * faceSize, samples, 3);
-		//Pos z
-		sampleFaceLam(sampledData, rawData, width, height, realWidth, realHeight, float_3(0, 0, 1), float_3(0, 1, 0), 4 * faceSize, samples, 4);
-		//Neg z
-		sampleFaceLam(sampledData, rawData, width, height, realWidth, realHeight, float_3(0, 0, -1), float_3(0, 1, 0), 5 * faceSize, samples, 5);
+	//Written as the line the ENVIRONMENT object of a .s72 expects
+	std::ostringstream shStream;
+	shStream << "\"irradianceSH\":[";
+	for (int i = 0; i < 9; i++) {
+		shStream << coefficients[i].x << "," << coefficients[i].y << "," << coefficients[i].z << (i < 8 ? "," : "]");
+	}
+	std::string shLine = shStream.str();
+	std::ofstream outStream(outFile);
+	if (!outStream.is_open()) {
+		throw std::runtime_error("ERROR: Unable to open " + outFile + " for writing.");
+	}
+	outStream << shLine << std::endl;
+	std::cout << shLine << std::endl;
+}
 
-		//Write sampled data to outFile
+void bakeLambertian(Pixel* rawData, int realWidth, int realHeight, const BakeSettings& settings, int samples, std::string outFile) {
+	int width = settings.width;
+	int height = settings.height;
+	int faceSize = width * height;
+	std::vector<Pixel> sampledData = std::vector<Pixel>(6 * faceSize);
+	std::vector<float_3> linearData = std::vector<float_3>(6 * faceSize);
+
+	//One work item per face row
+	parallelFor(6 * height, settings.threads, "lambertian", [&](int item) {
+		int face = item / height;
+		sampleRowLam(sampledData, linearData, rawData, width, height, realWidth, realHeight, faceIn[face], faceUp[face], face * faceSize, samples, item % height);
+	});
+
+	//Write sampled data to outFile
+	if (settings.ktx2) {
+		writeKTX2(outFile, width, height, linearData, 1.f);
+	}
+	else {
 		stbi_write_png(outFile.c_str(), width, height * 6, 4, sampledData.data(), 4 * width);
 	}
-	else {//ggx
-		int faceSize = width * height;
-		if (outFile.substr(outFile.size() - 4, 4).compare(".png")) {
-			cubeError();
+}
+
+void bakeGGX(Pixel* rawData, int realWidth, int realHeight, const EnvPyramid* pyramid, const BakeSettings& settings, int samples, std::string outFile) {
+	int width = settings.width;
+	int height = settings.height;
+	int levels = settings.levels;
+	int faceSize = width * height;
+	std::string extension = settings.ktx2 ? "ktx2" : "png";
+	if (outFile.size() <= extension.size() || outFile.substr(outFile.size() - extension.size()).compare(extension)) {
+		cubeError();
+	}
+	std::string outRoot = outFile.substr(0, outFile.size() - extension.size());
+	//One work item per face row of every level, so rough and smooth levels share the threads
+	std::vector<std::vector<float_3>> levelData = std::vector<std::vector<float_3>>(levels, std::vector<float_3>(6 * faceSize));
+	parallelFor(levels * 6 * height, settings.threads, "ggx", [&](int item) {
+		int level = item / (6 * height);
+		int face = (item / height) % 6;
+		float roughness = (float)level / ((float)(levels - 1));
+		sampleRowGGX(levelData[level], pyramid, rawData, width, height, realWidth, realHeight, roughness, faceIn[face], faceUp[face], face * faceSize, samples, true, item % height);
+	});
+	for (int i = 0; i < levels; i++) {
+		std::string levelOutFile = outRoot + std::to_string(i) + "." + extension;
+		//Write sampled data to outFile
+		if (settings.ktx2) {
+			//Scaled to what the renderer decodes from the e = 122 png
+			writeKTX2(levelOutFile, width, height, levelData[i], 1.f / 64.f);
 		}
-		std::string outRoot = outFile.substr(0, outFile.size() - 3);
-		std::string pngStr = ".png";
-		for (int i = 0; i < levels; i++) {
-			std::string levelOutFile = outRoot + std::to_string(i) + pngStr;
-			float roughness = (float)i / ((float)(levels - 1));
-			std::vector<Pixel>  sampledData = std::vector<Pixel>(6 * width * height);
-			//Pos x
-			sampleFaceGGX(sampledData, rawData, width, height, realWidth, realHeight, roughness, float_3(1, 0, 0), float_3(0, 1, 0), 0, samples, 0, i,levels);
-			//Neg x
-			sampleFaceGGX(sampledData, rawData, width, height, realWidth, realHeight, roughness, float_3(-1, 0, 0), float_3(0, 1, 0), faceSize, samples, 1, i,levels);
-			//Pos y
-			sampleFaceGGX(sampledData, rawData, width, height, realWidth, realHeight, roughness, float_3(0, 1, 0), float_3(0, 0, -1), 2 * faceSize, samples, 2, i,levels);
-			//Neg y
-			sampleFaceGGX(sampledData, rawData, width, height, realWidth, realHeight, roughness, float_3(0, -1, 0), float_3(0, 0, 1), 3 * faceSize, samples, 3, i,levels);
-			//Pos z
-			sampleFaceGGX(sampledData, rawData, width, height, realWidth, realHeight, roughness, float_3(0, 0, 1), float_3(0, 1, 0), 4 * faceSize, samples, 4, i,levels);
-			//Neg z
-			sampleFaceGGX(sampledData, rawData, width, height, realWidth, realHeight, roughness, float_3(0, 0, -1), float_3(0, 1, 0), 5 * faceSize, samples, 5, i,levels);
-		
-			//Write sampled data to outFile
+		else {
+			std::vector<Pixel> sampledData = packGGX(levelData[i]);
 			stbi_write_png(levelOutFile.c_str(), width, height * 6, 4, sampledData.data(), 4 * width);
 		}
-		//Generate LUT for width x height	
-		{
-			std::string lutOutFile = "LUT" + std::to_string(width) + "x" + std::to_string(height) + pngStr;
-			std::vector<Pixel>  sampledData = std::vector<Pixel>(6 * width * height);
-
-			int lastPercent = -1;
-			for (int x = 0; x < width; x++) {
-				for (int y = 0; y < height; y++) {
-					float roughness = (float)x / (float)(width - 1);
-					float nv = (float)y / (float)(height - 1);
-					float A = 0; float B = 0;
-					brdf(roughness, nv, A, B, samples);
-					sampledData[y * width + x].r = A;
-					sampledData[y * width + x].g = B;
-					sampledData[y * width + x].b = 0;
-					sampledData[y * width + x].e = 255;
-					int percent = (int)((float)(x * height + y) / (float)(width * height) * 100.f);
-					if (percent != lastPercent) {
-						lastPercent = percent;
-						std::cout << percent << "%\n";
-					}
-				}
+	}
+
+	//Error against an unfiltered bake of the same source reconstruction with many samples
+	if (settings.referenceSamples > 0) {
+		std::vector<std::vector<float_3>> referenceData = std::vector<std::vector<float_3>>(levels, std::vector<float_3>(6 * faceSize));
+		parallelFor(levels * 6 * height, settings.threads, "reference", [&](int item) {
+			int level = item / (6 * height);
+			int face = (item / height) % 6;
+			float roughness = (float)level / ((float)(levels - 1));
+			sampleRowGGX(referenceData[level], pyramid, rawData, width, height, realWidth, realHeight, roughness, faceIn[face], faceUp[face], face * faceSize, settings.referenceSamples, false, item % height);
+		});
+		for (int i = 0; i < levels; i++) {
+			float squaredError = 0;
+			float maxError = 0;
+			for (int ind = 0; ind < 6 * faceSize; ind++) {
+				float_3 diff = levelData[i][ind] - referenceData[i][ind];
+				squaredError += diff.dot(diff) / 3;
+				maxError = std::max({ maxError, abs(diff.x), abs(diff.y), abs(diff.z) });
 			}
+			std::cout << "MEASURE ggx level " << i << " error vs " << settings.referenceSamples << " sample reference: rmse "
+				<< sqrt(squaredError / (float)(6 * faceSize)) << " max " << maxError << std::endl;
+		}
+	}
+}
 
-			stbi_write_png(lutOutFile.c_str(), width, height, 4, sampledData.data(), 4 * width);
+//The LUT does not depend on the environment, so it is kept on disk by size and sample count
+void bakeLUT(const BakeSettings& settings, int samples) {
+	int width = settings.width;
+	int height = settings.height;
+	std::string lutOutFile = "LUT" + std::to_string(width) + "x" + std::to_string(height) + "-" + std::to_string(samples) + ".png";
+	if (std::filesystem::exists(lutOutFile)) {
+		std::cout << "Reusing " << lutOutFile << std::endl;
+		return;
+	}
+	std::vector<Pixel> sampledData = std::vector<Pixel>(width * height);
+
+	parallelFor(height, settings.threads, "lut", [&](int y) {
+		for (int x = 0; x < width; x++) {
+			float roughness = (float)x / (float)(width - 1);
+			float nv = (float)y / (float)(height - 1);
+			float A = 0; float B = 0;
+			brdf(roughness, nv, A, B, samples);
+			sampledData[y * width + x].r = A;
+			sampledData[y * width + x].g = B;
+			sampledData[y * width + x].b = 0;
+			sampledData[y * width + x].e = 255;
 		}
+	});
+
+	stbi_write_png(lutOutFile.c_str(), width, height, 4, sampledData.data(), 4 * width);
+}
 
+//Each manifest line is an input image and an output root, '#' starts a comment
+//Every input is decoded once and baked to root-lambertian, root-ggx.0-7 and root-sh.txt
+void bakeBatch(std::string manifestFile, const BakeSettings& settings) {
+	std::ifstream manifest(manifestFile);
+	if (!manifest.is_open()) {
+		throw std::runtime_error("ERROR: Unable to open manifest " + manifestFile);
+	}
+	std::vector<std::pair<std::string, std::string>> entries;
+	std::string line;
+	while (std::getline(manifest, line)) {
+		std::istringstream lineStream(line);
+		std::string inFile, outRoot;
+		if (!(lineStream >> inFile) || inFile[0] == '#') continue;
+		if (!(lineStream >> outRoot)) {
+			throw std::runtime_error("ERROR: Manifest line '" + line + "' has no output root.");
+		}
+		entries.emplace_back(inFile, outRoot);
 	}
-}
\ No newline at end of file
+
+	std::string extension = settings.ktx2 ? ".ktx2" : ".png";
+	int lamSamples = settings.samples > 0 ? settings.samples : 4;
+	int ggxSamples = settings.samples > 0 ? settings.samples : settings.nearest ? 1024 : 64;
+	for (size_t entry = 0; entry < entries.size(); entry++) {
+		std::chrono::high_resolution_clock::time_point entryStart = std::chrono::high_resolution_clock::now();
+		int realWidth, realHeight;
+		Pixel* rawData = loadSource(entries[entry].first, realWidth, realHeight);
+		std::optional<EnvPyramid> pyramid;
+		if (!settings.nearest) pyramid = EnvPyramid(rawData, realWidth, realHeight);
+		const EnvPyramid* pyramidP = pyramid.has_value() ? &*pyramid : nullptr;
+
+		std::string outRoot = entries[entry].second;
+		bakeLambertian(rawData, realWidth, realHeight, settings, lamSamples, outRoot + "-lambertian" + extension);
+		bakeGGX(rawData, realWidth, realHeight, pyramidP, settings, ggxSamples, outRoot + "-ggx" + extension);
+		bakeSH(rawData, realWidth, realHeight, outRoot + "-sh.txt");
+		stbi_image_free(rawData);
+
+		std::chrono::high_resolution_clock::time_point entryEnd = std::chrono::high_resolution_clock::now();
+		std::cout << "MEASURE batch " << entry + 1 << "/" << entries.size() << " " << entries[entry].first << ": " <<
+			std::chrono::duration_cast<std::chrono::milliseconds>(entryEnd - entryStart).count() << "ms" << std::endl;
+	}
+	bakeLUT(settings, std::max(ggxSamples, 1024));
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3) {
+		cubeError();
+	}
+	BakeSettings settings;
+	settings.threads = std::max(1, (int)std::thread::hardware_concurrency());
+	bool batch = std::string(argv[1]).compare(std::string("--batch")) == 0;
+	std::string inFile = argv[batch ? 2 : 1];
+	//Further assert correct input formatting
+	bool lambertian = true;
+	bool sh = false;
+	std::string outFile;
+	if (!batch) {
+		if (argc < 4) {
+			cubeError();
+		}
+		if (std::string(argv[2]).compare(std::string("--ggx")) == 0) {
+			lambertian = false;
+		}
+		else if (std::string(argv[2]).compare(std::string("--sh")) == 0) {
+			sh = true;
+			lambertian = false;
+		}
+		else if (std::string(argv[2]).compare(std::string("--lambertian")) != 0) {
+			cubeError();
+		}
+		outFile = argv[3];
+		settings.ktx2 = outFile.size() > 5 && outFile.substr(outFile.size() - 5).compare(".ktx2") == 0;
+	}
+	for (int arg = batch ? 3 : 4; arg < argc; arg++) {
+		if (std::string(argv[arg]).compare(std::string("--face")) == 0 && arg + 2 < argc) {
+			settings.width = atoi(argv[arg + 1]);
+			settings.height = atoi(argv[arg + 2]);
+			arg += 2;
+		}
+		else if (std::string(argv[arg]).compare(std::string("--samples")) == 0 && arg + 1 < argc) {
+			settings.samples = atoi(argv[arg + 1]);
+			arg++;
+		}
+		else if (std::string(argv[arg]).compare(std::string("--threads")) == 0 && arg + 1 < argc) {
+			settings.threads = std::max(1, atoi(argv[arg + 1]));
+			arg++;
+		}
+		else if (std::string(argv[arg]).compare(std::string("--nearest")) == 0) {
+			settings.nearest = true;
+		}
+		else if (std::string(argv[arg]).compare(std::string("--reference")) == 0 && arg + 1 < argc) {
+			settings.referenceSamples = atoi(argv[arg + 1]);
+			arg++;
+		}
+		else if (batch && std::string(argv[arg]).compare(std::string("--format")) == 0 && arg + 1 < argc) {
+			if (std::string(argv[arg + 1]).compare(std::string("ktx2")) == 0) settings.ktx2 = true;
+			else if (std::string(argv[arg + 1]).compare(std::string("png")) != 0) cubeError();
+			arg++;
+		}
+		else {
+			cubeError();
+		}
+	}
+
+	std::chrono::high_resolution_clock::time_point bakeStart = std::chrono::high_resolution_clock::now();
+	if (batch) {
+		bakeBatch(inFile, settings);
+	}
+	else {
+		int realWidth, realHeight;
+		Pixel* rawData = loadSource(inFile, realWidth, realHeight);
+		if (sh) {
+			bakeSH(rawData, realWidth, realHeight, outFile);
+		}
+		else if (lambertian) {
+			bakeLambertian(rawData, realWidth, realHeight, settings, settings.samples > 0 ? settings.samples : 4, outFile);
+		}
+		else {//ggx
+			//Filtered ggx sampling converges with far fewer samples than nearest texel reads
+			int samples = settings.samples > 0 ? settings.samples : settings.nearest ? 1024 : 64;
+			std::optional<EnvPyramid> pyramid;
+			if (!settings.nearest) pyramid = EnvPyramid(rawData, realWidth, realHeight);
+			bakeGGX(rawData, realWidth, realHeight, pyramid.has_value() ? &*pyramid : nullptr, settings, samples, outFile);
+			bakeLUT(settings, std::max(samples, 1024));
+		}
+		stbi_image_free(rawData);
+	}
+	std::chrono::high_resolution_clock::time_point bakeEnd = std::chrono::high_resolution_clock::now();
+	std::cout << "MEASURE bake with " << settings.threads << " threads: " <<
+		std::chrono::duration_cast<std::chrono::milliseconds>(bakeEnd - bakeStart).count() << "ms" << std::endl;
+}
@@ -0,0 +1,125 @@
+// cullbench.cpp : Times frustum culling through CullBVH against the linear sphereInFrustum test on a random field of cubes.
+//
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "../SystemCommon.h"
+#include "../CullBVH.h"
+
+
+void cullbenchError() {
+	throw std::runtime_error("Invalid arguments. Application may be run with no arguments.\n"
+		+ std::string("The optional arguments are:\n")
+		+ std::string("'--items n' cubes in the scene, defaults to 10000.\n")
+		+ std::string("'--spread s' half width of the cube of space they are scattered in, defaults to 100.\n")
+		+ std::string("'--reps n' repetitions of each cull, defaults to 20.\n")
+		+ std::string("The camera sits near one face of the scene looking across it, so it sees a small part."));
+}
+
+int main(int argc, char* argv[])
+{
+	try {
+		int items = 10000;
+		float spread = 100.f;
+		int reps = 20;
+		for (int arg = 1; arg < argc; arg++) {
+			std::string option = argv[arg];
+			if (option.compare("--items") == 0 && arg + 1 < argc) {
+				items = std::max(1, atoi(argv[arg + 1]));
+				arg++;
+			}
+			else if (option.compare("--spread") == 0 && arg + 1 < argc) {
+				spread = std::max(1.f, (float)atof(argv[arg + 1]));
+				arg++;
+			}
+			else if (option.compare("--reps") == 0 && arg + 1 < argc) {
+				reps = std::max(1, atoi(argv[arg + 1]));
+				arg++;
+			}
+			else {
+				cullbenchError();
+			}
+		}
+
+		//Unit cubes like the ones in manycube and largecube, scaled and scattered
+		std::mt19937 rng(1);
+		std::uniform_real_distribution<float> position(-spread, spread);
+		std::uniform_real_distribution<float> scale(0.5f, 2.f);
+		std::pair<float_3, float> cubeSphere = std::make_pair(float_3(0, 0, 0), std::sqrt(3.f) / 2.f);
+		std::vector<mat44<float>> transforms(items);
+		for (mat44<float>& transform : transforms) {
+			float size = scale(rng);
+			transform = mat44<float>(
+				size, 0, 0, 0,
+				0, size, 0, 0,
+				0, 0, size, 0,
+				position(rng), position(rng), position(rng), 1);
+		}
+
+		//Same camera as the scenes use, turned away from the scene center
+		DrawCamera camera;
+		camera.perspectiveInfo.aspect = 1.77778f;
+		camera.perspectiveInfo.vfov = 0.471239f;
+		camera.perspectiveInfo.nearP = 0.1f;
+		camera.perspectiveInfo.farP = 1000.f;
+		frustumInfo info = findFrustumInfo(camera);
+		float angle = 0.7f;
+		mat44<float> cameraToWorld = mat44<float>(
+			std::cos(angle), 0, -std::sin(angle), 0,
+			0, 1, 0, 0,
+			std::sin(angle), 0, std::cos(angle), 0,
+			0, 0, spread * 0.9f, 1);
+		mat44<float> cameraSpace = mat44<float>::affineInverse(cameraToWorld);
+
+		auto milliseconds = [&](std::chrono::high_resolution_clock::time_point start, std::chrono::high_resolution_clock::time_point end) {
+			return std::chrono::duration<double, std::milli>(end - start).count() / reps;
+		};
+
+		CullBVH tree;
+		tree.spheres.resize(items);
+		for (int item = 0; item < items; item++) tree.spheres[item] = worldSphere(cubeSphere, transforms[item]);
+		std::chrono::high_resolution_clock::time_point buildStart = std::chrono::high_resolution_clock::now();
+		for (int rep = 0; rep < reps; rep++) tree.build();
+		std::chrono::high_resolution_clock::time_point buildEnd = std::chrono::high_resolution_clock::now();
+		for (int rep = 0; rep < reps; rep++) tree.refit();
+		std::chrono::high_resolution_clock::time_point refitEnd = std::chrono::high_resolution_clock::now();
+
+		std::vector<int> linearVisible;
+		for (int rep = 0; rep < reps; rep++) {
+			linearVisible.clear();
+			for (int item = 0; item < items; item++) {
+				if (sphereInFrustum(cubeSphere, info, cameraSpace, transforms[item])) linearVisible.push_back(item);
+			}
+		}
+		std::chrono::high_resolution_clock::time_point linearEnd = std::chrono::high_resolution_clock::now();
+
+		std::vector<int> treeVisible;
+		for (int rep = 0; rep < reps; rep++) {
+			treeVisible.clear();
+			tree.cull(info, cameraSpace, [&](int item) {
+				return sphereInFrustum(cubeSphere, info, cameraSpace, transforms[item]);
+			}, treeVisible);
+		}
+		std::chrono::high_resolution_clock::time_point treeEnd = std::chrono::high_resolution_clock::now();
+		std::sort(treeVisible.begin(), treeVisible.end());
+
+		std::cout << "MEASURE cull " << items << " items: " << linearVisible.size() << " visible, " <<
+			tree.tested << " spheres tested, sets " << (treeVisible == linearVisible ? "match" : "DIFFER") << std::endl;
+		std::cout << "MEASURE cull time: linear " << milliseconds(refitEnd, linearEnd) << "ms, hierarchy " <<
+			milliseconds(linearEnd, treeEnd) << "ms" << std::endl;
+		std::cout << "MEASURE hierarchy update: build " << milliseconds(buildStart, buildEnd) << "ms, refit " <<
+			milliseconds(buildEnd, refitEnd) << "ms" << std::endl;
+		if (treeVisible != linearVisible) return 1;
+	}
+	catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,159 @@
+// mathbench.cpp : Times the mat44 products and inverses in MathHelpers.h against the scalar code they replaced.
+//
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "../MathHelpers.h"
+
+
+void mathbenchError() {
+	throw std::runtime_error("Invalid arguments. Application may be run with no arguments.\n"
+		+ std::string("The optional arguments are:\n")
+		+ std::string("'--count n' matrices per repetition, defaults to 1024.\n")
+		+ std::string("'--reps n' repetitions of each operation, defaults to 2000.\n")
+		+ std::string("Build without auto-vectorization to compare against scalar MSVC codegen."));
+}
+
+//The product as it was before the SSE path, every term reads a column of b by value through operator[]
+mat44<float> scalarMultiply(const mat44<float>& a, const mat44<float>& b) {
+	mat44<float> prod = mat44<float>();
+	for (int row = 0; row < 4; row++) {
+		for (int col = 0; col < 4; col++) {
+			prod.data[col][row] =
+				a.data[0][row] * b[col][0] +
+				a.data[1][row] * b[col][1] +
+				a.data[2][row] * b[col][2] +
+				a.data[3][row] * b[col][3];
+		}
+	}
+	return prod;
+}
+
+float_4 scalarTransform(const mat44<float>& a, float_4 v) {
+	float_4 prod;
+	prod.x = a.data[0][0] * v.x + a.data[1][0] * v.y + a.data[2][0] * v.z + a.data[3][0] * v.w;
+	prod.y = a.data[0][1] * v.x + a.data[1][1] * v.y + a.data[2][1] * v.z + a.data[3][1] * v.w;
+	prod.z = a.data[0][2] * v.x + a.data[1][2] * v.y + a.data[2][2] * v.z + a.data[3][2] * v.w;
+	prod.w = a.data[0][3] * v.x + a.data[1][3] * v.y + a.data[2][3] * v.z + a.data[3][3] * v.w;
+	return prod;
+}
+
+//Weighted sum of every entry, equal sums mean the two paths produced the same matrices
+double checksum(const std::vector<mat44<float>>& matrices) {
+	double sum = 0;
+	for (const mat44<float>& m : matrices) {
+		for (int col = 0; col < 4; col++) {
+			for (int row = 0; row < 4; row++) sum += m.data[col][row] * (col * 4 + row + 1);
+		}
+	}
+	return sum;
+}
+
+int main(int argc, char* argv[])
+{
+	try {
+		int count = 1024;
+		int reps = 2000;
+		for (int arg = 1; arg < argc; arg++) {
+			std::string option = argv[arg];
+			if (option.compare("--count") == 0 && arg + 1 < argc) {
+				count = std::max(1, atoi(argv[arg + 1]));
+				arg++;
+			}
+			else if (option.compare("--reps") == 0 && arg + 1 < argc) {
+				reps = std::max(1, atoi(argv[arg + 1]));
+				arg++;
+			}
+			else {
+				mathbenchError();
+			}
+		}
+
+		//Random affine matrices, so the affine inverse and the cofactor inverse agree
+		std::mt19937 rng(3);
+		std::uniform_real_distribution<float> uniform(-1, 1);
+		std::vector<mat44<float>> a(count), b(count), out(count);
+		std::vector<float_4> v(count);
+		for (int i = 0; i < count; i++) {
+			for (int col = 0; col < 4; col++) {
+				for (int row = 0; row < 3; row++) {
+					a[i].data[col][row] = uniform(rng);
+					b[i].data[col][row] = uniform(rng);
+				}
+			}
+			a[i].data[3][3] = 1;
+			b[i].data[3][3] = 1;
+			v[i] = float_4(uniform(rng), uniform(rng), uniform(rng), 1);
+		}
+
+		volatile float sink = 0;
+		auto bench = [&](std::string name, const std::function<void()>& work) {
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			for (int rep = 0; rep < reps; rep++) work();
+			std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+			double seconds = std::chrono::duration<double>(end - start).count();
+			std::cout << "MEASURE " << name << ": " << (double)reps * count / seconds / 1e6 << " Mops/s" << std::endl;
+		};
+
+		bench("mat44*mat44 scalar", [&]() {
+			for (int i = 0; i < count; i++) out[i] = scalarMultiply(a[i], b[(i + 1) % count]);
+			sink = sink + out[7 % count].data[1][2];
+		});
+		double scalarSum = checksum(out);
+		bench("mat44*mat44", [&]() {
+			for (int i = 0; i < count; i++) out[i] = a[i] * b[(i + 1) % count];
+			sink = sink + out[7 % count].data[1][2];
+		});
+		double simdSum = checksum(out);
+		bench("mat44*=mat44", [&]() {
+			for (int i = 0; i < count; i++) {
+				out[i] = a[i];
+				out[i] *= b[(i + 1) % count];
+			}
+			sink = sink + out[7 % count].data[1][2];
+		});
+		bench("mat44*vec4 scalar", [&]() {
+			float sum = 0;
+			for (int i = 0; i < count; i++) sum += scalarTransform(a[i], v[i]).x;
+			sink = sink + sum;
+		});
+		bench("mat44*vec4", [&]() {
+			float sum = 0;
+			for (int i = 0; i < count; i++) sum += (a[i] * v[i]).x;
+			sink = sink + sum;
+		});
+		bench("cofactor inverse", [&]() {
+			for (int i = 0; i < count; i++) out[i] = mat44<float>::inverse(a[i]);
+			sink = sink + out[5 % count].data[0][0];
+		});
+		bench("affineInverse", [&]() {
+			for (int i = 0; i < count; i++) out[i] = mat44<float>::affineInverse(a[i]);
+			sink = sink + out[5 % count].data[0][0];
+		});
+
+		//Random matrices can be badly conditioned, so the error is only a sanity check
+		double inverseError = 0;
+		for (int i = 0; i < count; i++) {
+			mat44<float> identity = a[i] * mat44<float>::affineInverse(a[i]);
+			for (int col = 0; col < 4; col++) {
+				for (int row = 0; row < 4; row++) {
+					inverseError = std::max(inverseError, (double)std::abs(identity.data[col][row] - (col == row ? 1.f : 0.f)));
+				}
+			}
+		}
+		std::cout << "Product checksums: scalar " << scalarSum << ", current " << simdSum << std::endl;
+		std::cout << "Largest entry of M * affineInverse(M) - I: " << inverseError << std::endl;
+	}
+	catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,514 @@
+// texcomp.cpp : Encodes a texture to a block compressed KTX2 with its full mip chain.
+//
+
+#include <iostream>
+#define STB_IMAGE_IMPLEMENTATION
+#include "../stb_image.h"
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+#include <fstream>
+#include <cstring>
+#include <cmath>
+#include <stdexcept>
+
+//VkFormat values written into the KTX2 header
+#define FORMAT_BC1_RGB_UNORM 131
+#define FORMAT_BC1_RGB_SRGB 132
+#define FORMAT_BC4_UNORM 139
+#define FORMAT_BC5_UNORM 141
+#define FORMAT_BC7_UNORM 145
+#define FORMAT_BC7_SRGB 146
+
+
+void texcompError() {
+	throw std::runtime_error("Invalid arguments. Application must at least be"
+		+ std::string(" run with texcomp in.png out.ktx2\n")
+		+ std::string("The optional arguments may also follow the original arguments:\n")
+		+ std::string("'--color' for albedo and lambertian maps, BC7 sRGB (default).\n")
+		+ std::string("'--normal' for normal maps, BC7 linear.\n")
+		+ std::string("'--scalar' for roughness, specular and displacement maps, BC4 from the red channel.\n")
+		+ std::string("'--pair' for two channel data like the BRDF LUT, BC5 from the red and green channels.\n")
+		+ std::string("'--bc1' to encode color and normal maps as BC1 at half the size of BC7, alpha is dropped.\n")
+		+ std::string("'--threads count' to indicate number of encode threads, defaults to all cores.\n")
+		+ std::string("Keep the png beside the ktx2, devices without BC support load it instead."));
+}
+
+enum Semantic {
+	SEM_COLOR, SEM_NORMAL, SEM_SCALAR, SEM_PAIR
+};
+
+//Runs work(item) for items [0, count) on threads pulling from a shared counter
+void parallelFor(int count, int threads, const std::function<void(int)>& work) {
+	std::atomic<int> nextItem = 0;
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; t++) {
+		workers.emplace_back([&]() {
+			for (int item = nextItem++; item < count; item = nextItem++) work(item);
+		});
+	}
+	for (std::thread& worker : workers) worker.join();
+}
+
+float srgbToLinear(float c) {
+	return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+float linearToSrgb(float c) {
+	return c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.f / 2.4f) - 0.055f;
+}
+
+//One level of the mip chain as floats in the space it is filtered in
+struct Level {
+	int width;
+	int height;
+	std::vector<float> texels; //RGBA
+};
+
+//Color is filtered as linear light and normals are renormalized, everything else is a plain 2x2 box
+Level nextLevel(const Level& level, Semantic semantic) {
+	Level next;
+	next.width = std::max(level.width / 2, 1);
+	next.height = std::max(level.height / 2, 1);
+	next.texels.resize(4 * (size_t)next.width * next.height);
+	for (int y = 0; y < next.height; y++) {
+		for (int x = 0; x < next.width; x++) {
+			int x0 = std::min(2 * x, level.width - 1), x1 = std::min(2 * x + 1, level.width - 1);
+			int y0 = std::min(2 * y, level.height - 1), y1 = std::min(2 * y + 1, level.height - 1);
+			float* out = &next.texels[4 * ((size_t)y * next.width + x)];
+			for (int c = 0; c < 4; c++) {
+				out[c] = 0.25f * (
+					level.texels[4 * ((size_t)y0 * level.width + x0) + c] + level.texels[4 * ((size_t)y0 * level.width + x1) + c] +
+					level.texels[4 * ((size_t)y1 * level.width + x0) + c] + level.texels[4 * ((size_t)y1 * level.width + x1) + c]);
+			}
+			if (semantic == SEM_NORMAL) {
+				float n[3] = { 2 * out[0] - 1, 2 * out[1] - 1, 2 * out[2] - 1 };
+				float norm = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+				if (norm > 0) {
+					for (int c = 0; c < 3; c++) out[c] = 0.5f * n[c] / norm + 0.5f;
+				}
+			}
+		}
+	}
+	return next;
+}
+
+//Gathers a 4x4 block as 0-255 values in storage space, edges repeat for partial blocks
+void gatherBlock(const Level& level, Semantic semantic, int blockX, int blockY, float block[16][4]) {
+	for (int texel = 0; texel < 16; texel++) {
+		int x = std::min(4 * blockX + texel % 4, level.width - 1);
+		int y = std::min(4 * blockY + texel / 4, level.height - 1);
+		const float* in = &level.texels[4 * ((size_t)y * level.width + x)];
+		for (int c = 0; c < 4; c++) {
+			float value = (semantic == SEM_COLOR && c < 3) ? linearToSrgb(in[c]) : in[c];
+			block[texel][c] = std::clamp(value, 0.f, 1.f) * 255.f;
+		}
+	}
+}
+
+//Endpoints along the block's principal axis, found with a few power iterations on the covariance
+void principalEndpoints(float block[16][4], int channels, float e0[4], float e1[4]) {
+	float mean[4] = { 0, 0, 0, 0 };
+	for (int texel = 0; texel < 16; texel++) {
+		for (int c = 0; c < channels; c++) mean[c] += block[texel][c] / 16.f;
+	}
+	float cov[4][4] = {};
+	for (int texel = 0; texel < 16; texel++) {
+		for (int i = 0; i < channels; i++) {
+			for (int j = 0; j < channels; j++) cov[i][j] += (block[texel][i] - mean[i]) * (block[texel][j] - mean[j]);
+		}
+	}
+	float axis[4] = { 1, 1, 1, 1 };
+	for (int iteration = 0; iteration < 8; iteration++) {
+		float next[4] = { 0, 0, 0, 0 };
+		for (int i = 0; i < channels; i++) {
+			for (int j = 0; j < channels; j++) next[i] += cov[i][j] * axis[j];
+		}
+		float length = 0;
+		for (int c = 0; c < channels; c++) length = std::max(length, std::abs(next[c]));
+		if (length == 0) break;
+		for (int c = 0; c < channels; c++) axis[c] = next[c] / length;
+	}
+	float minProj = INFINITY, maxProj = -INFINITY;
+	for (int texel = 0; texel < 16; texel++) {
+		float proj = 0;
+		for (int c = 0; c < channels; c++) proj += (block[texel][c] - mean[c]) * axis[c];
+		minProj = std::min(minProj, proj);
+		maxProj = std::max(maxProj, proj);
+	}
+	float axisLength = 0;
+	for (int c = 0; c < channels; c++) axisLength += axis[c] * axis[c];
+	if (axisLength > 0) {
+		minProj /= axisLength;
+		maxProj /= axisLength;
+	}
+	for (int c = 0; c < channels; c++) {
+		e0[c] = std::clamp(mean[c] + minProj * axis[c], 0.f, 255.f);
+		e1[c] = std::clamp(mean[c] + maxProj * axis[c], 0.f, 255.f);
+	}
+}
+
+//Least squares endpoints for fixed interpolation weights
+void refitEndpoints(float block[16][4], int channels, const float weights[16], float e0[4], float e1[4]) {
+	float aa = 0, ab = 0, bb = 0;
+	float ax[4] = { 0, 0, 0, 0 }, bx[4] = { 0, 0, 0, 0 };
+	for (int texel = 0; texel < 16; texel++) {
+		float b = weights[texel], a = 1 - b;
+		aa += a * a; ab += a * b; bb += b * b;
+		for (int c = 0; c < channels; c++) {
+			ax[c] += a * block[texel][c];
+			bx[c] += b * block[texel][c];
+		}
+	}
+	float det = aa * bb - ab * ab;
+	if (std::abs(det) < 1e-6f) return;
+	for (int c = 0; c < channels; c++) {
+		e0[c] = std::clamp((ax[c] * bb - bx[c] * ab) / det, 0.f, 255.f);
+		e1[c] = std::clamp((bx[c] * aa - ax[c] * ab) / det, 0.f, 255.f);
+	}
+}
+
+//Writes count bits of value at bit offset, lowest bit first
+void putBits(uint8_t* out, int& offset, uint32_t value, int count) {
+	for (int bit = 0; bit < count; bit++, offset++) {
+		if ((value >> bit) & 1) out[offset / 8] |= (uint8_t)(1 << (offset % 8));
+	}
+}
+
+//https://learn.microsoft.com/en-us/windows/win32/direct3d10/d3d10-graphics-programming-guide-resources-block-compression#bc1
+uint16_t pack565(const float c[4]) {
+	int r = std::clamp((int)std::round(c[0] * 31.f / 255.f), 0, 31);
+	int g = std::clamp((int)std::round(c[1] * 63.f / 255.f), 0, 63);
+	int b = std::clamp((int)std::round(c[2] * 31.f / 255.f), 0, 31);
+	return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+void unpack565(uint16_t packed, float c[3]) {
+	int r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+	c[0] = (float)((r << 3) | (r >> 2));
+	c[1] = (float)((g << 2) | (g >> 4));
+	c[2] = (float)((b << 3) | (b >> 2));
+}
+
+//Four color mode only, the three color mode's transparent index is never wanted here
+void encodeBC1(float block[16][4], uint8_t* out) {
+	const float paletteWeights[4] = { 0, 1, 1.f / 3.f, 2.f / 3.f };
+	float e0[4], e1[4];
+	principalEndpoints(block, 3, e0, e1);
+	uint16_t bestC0 = 0, bestC1 = 0;
+	uint32_t bestIndices = 0;
+	float bestError = INFINITY;
+	for (int pass = 0; pass < 2; pass++) {
+		uint16_t c0 = pack565(e0), c1 = pack565(e1);
+		if (c0 < c1) std::swap(c0, c1);
+		float palette[4][3];
+		unpack565(c0, palette[0]);
+		unpack565(c1, palette[1]);
+		for (int c = 0; c < 3; c++) {
+			palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3.f;
+			palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3.f;
+		}
+		float weights[16];
+		uint32_t indices = 0;
+		float error = 0;
+		for (int texel = 0; texel < 16; texel++) {
+			int best = 0;
+			float texelError = INFINITY;
+			for (int index = 0; index < (c0 == c1 ? 1 : 4); index++) {
+				float indexError = 0;
+				for (int c = 0; c < 3; c++) indexError += (block[texel][c] - palette[index][c]) * (block[texel][c] - palette[index][c]);
+				if (indexError < texelError) {
+					texelError = indexError;
+					best = index;
+				}
+			}
+			indices |= (uint32_t)best << (2 * texel);
+			weights[texel] = paletteWeights[best];
+			error += texelError;
+		}
+		if (error < bestError) {
+			bestError = error;
+			bestC0 = c0;
+			bestC1 = c1;
+			bestIndices = indices;
+		}
+		if (pass == 0) {
+			unpack565(c0, e0);
+			unpack565(c1, e1);
+			refitEndpoints(block, 3, weights, e0, e1);
+		}
+	}
+	memcpy(out, &bestC0, 2);
+	memcpy(out + 2, &bestC1, 2);
+	memcpy(out + 4, &bestIndices, 4);
+}
+
+//Eight value mode with the endpoints at the block's extremes
+void encodeBC4(float block[16][4], int channel, uint8_t* out) {
+	float minValue = 255, maxValue = 0;
+	for (int texel = 0; texel < 16; texel++) {
+		minValue = std::min(minValue, block[texel][channel]);
+		maxValue = std::max(maxValue, block[texel][channel]);
+	}
+	int red0 = (int)std::round(maxValue), red1 = (int)std::round(minValue);
+	float palette[8] = { (float)red0, (float)red1 };
+	for (int index = 2; index < 8; index++) palette[index] = ((8 - index) * red0 + (index - 1) * red1) / 7.f;
+	memset(out, 0, 8);
+	out[0] = (uint8_t)red0;
+	out[1] = (uint8_t)red1;
+	int offset = 16;
+	for (int texel = 0; texel < 16; texel++) {
+		int best = 0;
+		float bestError = INFINITY;
+		for (int index = 0; index < (red0 == red1 ? 1 : 8); index++) {
+			float error = std::abs(block[texel][channel] - palette[index]);
+			if (error < bestError) {
+				bestError = error;
+				best = index;
+			}
+		}
+		putBits(out, offset, best, 3);
+	}
+}
+
+//Mode 6 only, one subset of RGBA with 7 bit endpoints, a p-bit each and 4 bit indices
+//https://learn.microsoft.com/en-us/windows/win32/direct3d11/bc7-format-mode-reference
+void encodeBC7(float block[16][4], uint8_t* out) {
+	const int bc7Weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+	float e0[4], e1[4];
+	principalEndpoints(block, 4, e0, e1);
+
+	int bestQ[2][4] = {}, bestP[2] = {}, bestIndices[16] = {};
+	float bestError = INFINITY;
+	for (int pass = 0; pass < 2; pass++) {
+		for (int pBits = 0; pBits < 4; pBits++) {
+			int p[2] = { pBits & 1, pBits >> 1 };
+			int q[2][4];
+			int endpoints[2][4];
+			for (int c = 0; c < 4; c++) {
+				q[0][c] = std::clamp((int)std::round((e0[c] - p[0]) / 2.f), 0, 127);
+				q[1][c] = std::clamp((int)std::round((e1[c] - p[1]) / 2.f), 0, 127);
+				endpoints[0][c] = (q[0][c] << 1) | p[0];
+				endpoints[1][c] = (q[1][c] << 1) | p[1];
+			}
+			int indices[16];
+			float error = 0;
+			for (int texel = 0; texel < 16; texel++) {
+				float texelError = INFINITY;
+				for (int index = 0; index < 16; index++) {
+					float indexError = 0;
+					for (int c = 0; c < 4; c++) {
+						int value = ((64 - bc7Weights[index]) * endpoints[0][c] + bc7Weights[index] * endpoints[1][c] + 32) >> 6;
+						indexError += (block[texel][c] - value) * (block[texel][c] - value);
+					}
+					if (indexError < texelError) {
+						texelError = indexError;
+						indices[texel] = index;
+					}
+				}
+				error += texelError;
+			}
+			if (error < bestError) {
+				bestError = error;
+				memcpy(bestQ, q, sizeof(q));
+				memcpy(bestP, p, sizeof(p));
+				memcpy(bestIndices, indices, sizeof(indices));
+			}
+		}
+		if (pass == 0) {
+			float weights[16];
+			for (int texel = 0; texel < 16; texel++) weights[texel] = bc7Weights[bestIndices[texel]] / 64.f;
+			refitEndpoints(block, 4, weights, e0, e1);
+		}
+	}
+
+	//The first index drops its top bit, so swap the endpoints when it is set
+	if (bestIndices[0] >= 8) {
+		for (int c = 0; c < 4; c++) std::swap(bestQ[0][c], bestQ[1][c]);
+		std::swap(bestP[0], bestP[1]);
+		for (int texel = 0; texel < 16; texel++) bestIndices[texel] = 15 - bestIndices[texel];
+	}
+	memset(out, 0, 16);
+	int offset = 0;
+	putBits(out, offset, 1 << 6, 7);
+	for (int c = 0; c < 4; c++) {
+		putBits(out, offset, bestQ[0][c], 7);
+		putBits(out, offset, bestQ[1][c], 7);
+	}
+	putBits(out, offset, bestP[0], 1);
+	putBits(out, offset, bestP[1], 1);
+	for (int texel = 0; texel < 16; texel++) putBits(out, offset, bestIndices[texel], texel == 0 ? 3 : 4);
+}
+
+struct EncodeSettings {
+	Semantic semantic = SEM_COLOR;
+	bool bc1 = false;
+	int threads = 1;
+};
+
+uint32_t chooseFormat(const EncodeSettings& settings) {
+	switch (settings.semantic) {
+	case SEM_SCALAR: return FORMAT_BC4_UNORM;
+	case SEM_PAIR: return FORMAT_BC5_UNORM;
+	case SEM_NORMAL: return settings.bc1 ? FORMAT_BC1_RGB_UNORM : FORMAT_BC7_UNORM;
+	default: return settings.bc1 ? FORMAT_BC1_RGB_SRGB : FORMAT_BC7_SRGB;
+	}
+}
+
+int blockBytes(uint32_t format) {
+	return format == FORMAT_BC1_RGB_UNORM || format == FORMAT_BC1_RGB_SRGB || format == FORMAT_BC4_UNORM ? 8 : 16;
+}
+
+std::vector<uint8_t> encodeLevel(const Level& level, uint32_t format, const EncodeSettings& settings) {
+	int blocksX = (level.width + 3) / 4, blocksY = (level.height + 3) / 4;
+	int bytes = blockBytes(format);
+	std::vector<uint8_t> encoded((size_t)blocksX * blocksY * bytes);
+	parallelFor(blocksY, settings.threads, [&](int blockY) {
+		float block[16][4];
+		for (int blockX = 0; blockX < blocksX; blockX++) {
+			uint8_t* out = &encoded[((size_t)blockY * blocksX + blockX) * bytes];
+			gatherBlock(level, settings.semantic, blockX, blockY, block);
+			if (format == FORMAT_BC4_UNORM) encodeBC4(block, 0, out);
+			else if (format == FORMAT_BC5_UNORM) {
+				encodeBC4(block, 0, out);
+				encodeBC4(block, 1, out + 8);
+			}
+			else if (bytes == 8) encodeBC1(block, out);
+			else encodeBC7(block, out);
+		}
+	});
+	return encoded;
+}
+
+//Levels are written smallest first as the spec requires, the level index still lists level 0 first
+//https://registry.khronos.org/KTX/specs/2.0/ktxspec.v2.html
+void writeKTX2(std::string outFile, uint32_t format, int width, int height, const std::vector<std::vector<uint8_t>>& levels) {
+	const uint8_t identifier[12] = { 0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A };
+	bool srgb = format == FORMAT_BC1_RGB_SRGB || format == FORMAT_BC7_SRGB;
+	int bytes = blockBytes(format);
+
+	//Basic data format descriptor, one sample per 64 bit half of the block
+	uint32_t colorModel = format == FORMAT_BC4_UNORM ? 131 : format == FORMAT_BC5_UNORM ? 132 : bytes == 8 ? 128 : 134;
+	int samples = format == FORMAT_BC5_UNORM ? 2 : 1;
+	std::vector<uint32_t> dfd;
+	dfd.push_back(4 + 24 + 16 * samples);
+	dfd.push_back(0);
+	dfd.push_back(2 | ((24 + 16 * samples) << 16));
+	dfd.push_back(colorModel | (1 << 8) | ((srgb ? 2u : 1u) << 16)); //BT709 primaries
+	dfd.push_back(3 | (3 << 8)); //4x4 texel blocks
+	dfd.push_back((uint32_t)bytes);
+	dfd.push_back(0);
+	for (int sample = 0; sample < samples; sample++) {
+		uint32_t bitLength = samples == 2 ? 64 : 8 * bytes;
+		dfd.push_back((uint32_t)(64 * sample) | ((bitLength - 1) << 16) | ((uint32_t)sample << 24));
+		dfd.push_back(0);
+		dfd.push_back(0);
+		dfd.push_back(0xFFFFFFFFu);
+	}
+
+	uint32_t levelCount = (uint32_t)levels.size();
+	uint32_t headerSize = 12 + 9 * 4 + 4 * 4 + 2 * 8;
+	uint32_t dfdOffset = headerSize + 3 * 8 * levelCount;
+	uint32_t dfdSize = (uint32_t)(dfd.size() * sizeof(uint32_t));
+	std::vector<uint64_t> levelIndex(3 * levelCount);
+	uint64_t offset = dfdOffset + dfdSize;
+	for (int level = (int)levelCount - 1; level >= 0; level--) {
+		offset = (offset + bytes - 1) / bytes * bytes;
+		levelIndex[3 * level] = offset;
+		levelIndex[3 * level + 1] = levels[level].size();
+		levelIndex[3 * level + 2] = levels[level].size();
+		offset += levels[level].size();
+	}
+	uint32_t header[9] = { format, 1, (uint32_t)width, (uint32_t)height, 0, 0, 1, levelCount, 0 };
+	uint32_t index[4] = { dfdOffset, dfdSize, 0, 0 };
+	uint64_t supercompression[2] = { 0, 0 };
+
+	std::ofstream outStream(outFile, std::ios::binary);
+	if (!outStream.is_open()) {
+		throw std::runtime_error("ERROR: Unable to open " + outFile + " for writing.");
+	}
+	outStream.write((const char*)identifier, sizeof(identifier));
+	outStream.write((const char*)header, sizeof(header));
+	outStream.write((const char*)index, sizeof(index));
+	outStream.write((const char*)supercompression, sizeof(supercompression));
+	outStream.write((const char*)levelIndex.data(), levelIndex.size() * sizeof(uint64_t));
+	outStream.write((const char*)dfd.data(), dfdSize);
+	uint64_t written = dfdOffset + dfdSize;
+	for (int level = (int)levelCount - 1; level >= 0; level--) {
+		for (; written < levelIndex[3 * level]; written++) outStream.put(0);
+		outStream.write((const char*)levels[level].data(), levels[level].size());
+		written += levels[level].size();
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	try {
+		if (argc < 3) {
+			texcompError();
+		}
+		std::string inFile = argv[1];
+		std::string outFile = argv[2];
+		EncodeSettings settings;
+		settings.threads = std::max(1, (int)std::thread::hardware_concurrency());
+		for (int arg = 3; arg < argc; arg++) {
+			std::string option = argv[arg];
+			if (option.compare("--color") == 0) settings.semantic = SEM_COLOR;
+			else if (option.compare("--normal") == 0) settings.semantic = SEM_NORMAL;
+			else if (option.compare("--scalar") == 0) settings.semantic = SEM_SCALAR;
+			else if (option.compare("--pair") == 0) settings.semantic = SEM_PAIR;
+			else if (option.compare("--bc1") == 0) settings.bc1 = true;
+			else if (option.compare("--threads") == 0 && arg + 1 < argc) {
+				settings.threads = std::max(1, atoi(argv[arg + 1]));
+				arg++;
+			}
+			else {
+				texcompError();
+			}
+		}
+
+		std::chrono::high_resolution_clock::time_point encodeStart = std::chrono::high_resolution_clock::now();
+		int width, height, n;
+		stbi_uc* rawData = stbi_load(inFile.c_str(), &width, &height, &n, 4);
+		if (!rawData) {
+			throw std::runtime_error("ERROR: Unable to load texture at path " + inFile + " with error: " +
+				(stbi_failure_reason() ? stbi_failure_reason() : "none"));
+		}
+		Level level;
+		level.width = width;
+		level.height = height;
+		level.texels.resize(4 * (size_t)width * height);
+		for (size_t i = 0; i < level.texels.size(); i++) {
+			float value = rawData[i] / 255.f;
+			level.texels[i] = (settings.semantic == SEM_COLOR && i % 4 < 3) ? srgbToLinear(value) : value;
+		}
+		stbi_image_free(rawData);
+
+		//Same level count the renderer gives uncompressed textures
+		uint32_t format = chooseFormat(settings);
+		int levelCount = (int)std::floor(std::log2(std::max(width, height))) + 1;
+		std::vector<std::vector<uint8_t>> levels;
+		size_t encodedBytes = 0;
+		for (int mipLevel = 0; mipLevel < levelCount; mipLevel++) {
+			if (mipLevel > 0) level = nextLevel(level, settings.semantic);
+			levels.push_back(encodeLevel(level, format, settings));
+			encodedBytes += levels.back().size();
+		}
+		writeKTX2(outFile, format, width, height, levels);
+
+		std::chrono::high_resolution_clock::time_point encodeEnd = std::chrono::high_resolution_clock::now();
+		std::cout << "MEASURE encode " << inFile << " with " << settings.threads << " threads: " <<
+			std::chrono::duration_cast<std::chrono::milliseconds>(encodeEnd - encodeStart).count() << "ms, " <<
+			encodedBytes << " bytes for " << levelCount << " levels" << std::endl;
+	}
+	catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}